@@ -0,0 +1,197 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "allocator.h"
+#include "include/log_utils.h"
+#include "include/libcuda_hook.h"
+#include "multiprocess/multiprocess_memory_limit.h"
+
+/*
+ * Allocation cache. With CUDA_DEVICE_MEMORY_CACHING_ENV set, cuMemAlloc_v2
+ * allocations up to ALLOCATED_CACHE_MAX are made in size classes, eight
+ * per power of two, and a freed one is kept on the free list of its
+ * device and class instead of going back to the driver. The next
+ * allocation of the class takes it without a driver call. Cached
+ * allocations stay charged to the process, so the limit holds; they are
+ * freed when an allocation of this process would not fit, and by the
+ * flusher thread when another process asks, see shrreg_request_cache_flush().
+ */
+
+#define ALLOCATED_CACHE_MAX (256 * 1024 * 1024)
+#define ALLOCATED_CACHE_STEPS 8
+#define ALLOCATED_CACHE_MIN_STEP 512
+// Classes of sizes up to ALLOCATED_CACHE_MAX, 2^28
+#define ALLOCATED_CACHE_CLASSES (ALLOCATED_CACHE_STEPS * 29)
+// Longest sleep of the flusher between checks of the request sequence
+#define ALLOCATED_CACHE_FLUSHER_WAIT_MS 1000
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t bytes;
+    allocated_device_memory *classes[ALLOCATED_CACHE_CLASSES];  // Linked through hash_next
+} allocated_cache_t;
+
+static allocated_cache_t *caches = NULL;  // One per device
+static pthread_once_t flusher_once = PTHREAD_ONCE_INIT;
+
+void allocated_cache_init() {
+    char *env = getenv(CUDA_DEVICE_MEMORY_CACHING_ENV);
+    if (env == NULL || env[0] == '\0' || strcmp(env, "0") == 0)
+        return;
+    caches = calloc(CUDA_DEVICE_MAX_COUNT, sizeof(allocated_cache_t));
+    if (caches == NULL) {
+        LOG_WARN("allocated_cache_init: malloc failed, freed allocations are not cached");
+        return;
+    }
+    int i;
+    for (i = 0; i < CUDA_DEVICE_MAX_COUNT; i++)
+        pthread_mutex_init(&caches[i].lock, NULL);
+    LOG_INFO("Freed allocations up to %d bytes are cached", ALLOCATED_CACHE_MAX);
+}
+
+static inline size_t floor_pow2(size_t size) {
+    return (size_t)1 << (63 - __builtin_clzll(size));
+}
+
+size_t allocated_cache_class(CUdevice dev, size_t size) {
+    if (caches == NULL || dev >= CUDA_DEVICE_MAX_COUNT || size == 0 || size > ALLOCATED_CACHE_MAX)
+        return 0;
+    size_t step = floor_pow2(size) / ALLOCATED_CACHE_STEPS;
+    if (step < ALLOCATED_CACHE_MIN_STEP)
+        step = ALLOCATED_CACHE_MIN_STEP;
+    return (size + step - 1) / step * step;
+}
+
+// Index of a size returned by allocated_cache_class()
+static inline int class_index(size_t csize) {
+    size_t p = floor_pow2(csize);
+    size_t k = csize / (p / ALLOCATED_CACHE_STEPS) - ALLOCATED_CACHE_STEPS;
+    return (63 - __builtin_clzll(p)) * ALLOCATED_CACHE_STEPS + k;
+}
+
+allocated_device_memory *allocated_cache_take(CUdevice dev, CUcontext ctx, size_t csize) {
+    allocated_cache_t *cache = &caches[dev];
+    allocated_device_memory **link = &cache->classes[class_index(csize)];
+    pthread_mutex_lock(&cache->lock);
+    while (*link != NULL && (*link)->ctx != ctx)
+        link = &(*link)->hash_next;
+    allocated_device_memory *e = *link;
+    if (e != NULL) {
+        *link = e->hash_next;
+        e->hash_next = NULL;
+        cache->bytes -= e->length;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return e;
+}
+
+// Free the cached allocations of a detached list outside the cache lock
+static size_t free_cached(allocated_device_memory *list) {
+    size_t bytes = 0;
+    CUcontext current = NULL;
+    CUDA_OVERRIDE_CALL(cuda_library_entry, cuCtxGetCurrent, &current);
+    while (list != NULL) {
+        allocated_device_memory *e = list;
+        list = e->hash_next;
+        if (e->ctx != current)
+            CUDA_OVERRIDE_CALL(cuda_library_entry, cuCtxPushCurrent_v2, e->ctx);
+        CUDA_OVERRIDE_CALL(cuda_library_entry, cuMemFree_v2, e->address);
+        if (e->ctx != current) {
+            CUcontext popped;
+            CUDA_OVERRIDE_CALL(cuda_library_entry, cuCtxPopCurrent_v2, &popped);
+        }
+        rm_gpu_device_memory_usage(getpid(), e->dev, e->length, 2);
+        bytes += e->length;
+        allocated_entry_free(e);
+    }
+    return bytes;
+}
+
+// Detach the cached allocations of dev, of the context ctx unless it is NULL
+static allocated_device_memory *detach_cached(int dev, CUcontext ctx) {
+    allocated_cache_t *cache = &caches[dev];
+    allocated_device_memory *list = NULL;
+    int i;
+    pthread_mutex_lock(&cache->lock);
+    for (i = 0; i < ALLOCATED_CACHE_CLASSES && cache->bytes > 0; i++) {
+        allocated_device_memory **link = &cache->classes[i];
+        while (*link != NULL) {
+            allocated_device_memory *e = *link;
+            if (ctx != NULL && e->ctx != ctx) {
+                link = &e->hash_next;
+                continue;
+            }
+            *link = e->hash_next;
+            cache->bytes -= e->length;
+            e->hash_next = list;
+            list = e;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return list;
+}
+
+size_t allocated_cache_flush(int dev) {
+    if (caches == NULL)
+        return 0;
+    size_t bytes = 0;
+    int d;
+    for (d = 0; d < CUDA_DEVICE_MAX_COUNT; d++)
+        if (dev < 0 || d == dev)
+            bytes += free_cached(detach_cached(d, NULL));
+    if (bytes > 0)
+        LOG_INFO("Allocation cache flushed, %lu bytes freed", bytes);
+    return bytes;
+}
+
+size_t allocated_cache_flush_ctx(CUcontext ctx) {
+    if (caches == NULL)
+        return 0;
+    size_t bytes = 0;
+    int d;
+    for (d = 0; d < CUDA_DEVICE_MAX_COUNT; d++)
+        bytes += free_cached(detach_cached(d, ctx));
+    return bytes;
+}
+
+// Flush the cache whenever another process is short of memory
+static void *cache_flusher(void *arg) {
+    int32_t seq = (int32_t)(intptr_t)arg;
+    while (1) {
+        shrreg_wait_cache_flush(seq, ALLOCATED_CACHE_FLUSHER_WAIT_MS);
+        int32_t now = shrreg_cache_flush_seq();
+        if (now == seq)
+            continue;
+        seq = now;
+        allocated_cache_flush(-1);
+        // Answers the requests up to now, later ones wake the thread again
+        shrreg_ack_cache_flush(seq);
+    }
+    return NULL;
+}
+
+// Registered before the first allocation is cached, so requests wait for it
+static void start_cache_flusher() {
+    pthread_t tid;
+    int32_t seq = shrreg_register_cache_flusher();
+    if (pthread_create(&tid, NULL, cache_flusher, (void *)(intptr_t)seq) != 0) {
+        LOG_WARN("Fail to start the allocation cache flusher, other processes cannot reclaim the cache");
+        shrreg_unregister_cache_flusher();
+        return;
+    }
+    pthread_detach(tid);
+}
+
+void allocated_cache_put(allocated_device_memory *e) {
+    pthread_once(&flusher_once, start_cache_flusher);
+    allocated_cache_t *cache = &caches[e->dev];
+    allocated_device_memory **head = &cache->classes[class_index(e->length)];
+    pthread_mutex_lock(&cache->lock);
+    e->hash_next = *head;
+    *head = e;
+    cache->bytes += e->length;
+    pthread_mutex_unlock(&cache->lock);
+}
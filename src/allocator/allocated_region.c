@@ -0,0 +1,256 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "allocator.h"
+#include "include/log_utils.h"
+#include "include/libcuda_hook.h"
+#include "multiprocess/multiprocess_memory_limit.h"
+
+/*
+ * Regions. With CUDA_DEVICE_MEMORY_SUBALLOC_ENV set, cuMemAlloc_v2
+ * allocations up to REGION_CARVE_MAX are carved out of IPCSIZE regions
+ * allocated from the driver, rather than each taking a driver call and a
+ * 2 MB page of its own. The quota is charged once per region when it is
+ * allocated; the region and its charge go back when its last allocation
+ * is freed. A region is a bitmap of BITSIZE units split in slots of one
+ * power of two units, its size class, so any free slot fits and finding
+ * one is a scan of a few words. Regions of a device and class with free
+ * slots are listed before the full ones, each list behind its own lock.
+ */
+
+// Largest allocation carved out of a region
+#define REGION_CARVE_MAX (IPCSIZE / 8)
+// Slots of 1 to 64 units, REGION_CARVE_MAX / CHUNK_SIZE
+#define REGION_CLASSES 7
+#define REGION_WORD_BITS 64
+
+static int suballoc_enabled = 0;
+
+void region_init() {
+    char *env = getenv(CUDA_DEVICE_MEMORY_SUBALLOC_ENV);
+    suballoc_enabled = env != NULL && env[0] != '\0' && strcmp(env, "0") != 0;
+    r_list = calloc(CUDA_DEVICE_MAX_COUNT * REGION_CLASSES, sizeof(region_list));
+    if (r_list == NULL) {
+        LOG_WARN("region_init: malloc failed, small allocations are not carved");
+        suballoc_enabled = 0;
+        return;
+    }
+    size_t i;
+    for (i = 0; i < CUDA_DEVICE_MAX_COUNT * REGION_CLASSES; i++)
+        pthread_mutex_init(&r_list[i].lock, NULL);
+    if (suballoc_enabled)
+        LOG_INFO("Allocations up to %lu bytes are carved from %lu byte regions",
+            REGION_CARVE_MAX, IPCSIZE);
+}
+
+int region_carves(CUdevice dev, size_t size) {
+    return suballoc_enabled && dev < CUDA_DEVICE_MAX_COUNT && size > 0 && size <= REGION_CARVE_MAX;
+}
+
+// Size class of an allocation, slots of 1 << class units
+static inline size_t region_class(size_t size) {
+    size_t units = (size + CHUNK_SIZE - 1) / CHUNK_SIZE, class = 0;
+    while (((size_t)1 << class) < units)
+        class++;
+    return class;
+}
+
+static inline region_list *class_list(CUdevice dev, size_t slot) {
+    return &r_list[dev * REGION_CLASSES + __builtin_ctzl(slot)];
+}
+
+// Bits of a word covering slot units from unit
+static inline uint64_t slot_mask(size_t slot, size_t unit) {
+    uint64_t mask = slot >= REGION_WORD_BITS ? UINT64_MAX : ((1ULL << slot) - 1);
+    return mask << (unit % REGION_WORD_BITS);
+}
+
+// First free slot at or after freemark, -1 if there is none
+static long find_slot(region *r) {
+    uint64_t starts = 0;
+    size_t b, i;
+    for (b = 0; b < REGION_WORD_BITS; b += r->slot)
+        starts |= 1ULL << b;
+    for (i = r->freemark / REGION_WORD_BITS; i < BITSIZE / REGION_WORD_BITS; i++) {
+        // A slot is free when its first unit is
+        uint64_t free_starts = ~r->bitmap[i] & starts;
+        if (free_starts != 0)
+            return i * REGION_WORD_BITS + __builtin_ctzll(free_starts);
+    }
+    return -1;
+}
+
+static void list_unlink(region_list *list, region *r) {
+    if (r->prev != NULL)
+        r->prev->next = r->next;
+    else
+        list->head = r->next;
+    if (r->next != NULL)
+        r->next->prev = r->prev;
+    else
+        list->tail = r->prev;
+    r->next = r->prev = NULL;
+    list->length--;
+}
+
+static void list_push(region_list *list, region *r, int tail) {
+    if (list->head == NULL) {
+        r->next = r->prev = NULL;
+        list->head = list->tail = r;
+    } else if (tail) {
+        r->next = NULL;
+        r->prev = list->tail;
+        list->tail->next = r;
+        list->tail = r;
+    } else {
+        r->prev = NULL;
+        r->next = list->head;
+        list->head->prev = r;
+        list->head = r;
+    }
+    list->length++;
+}
+
+static region *carve_nolock(region_list *list, allocated_device_memory *e, size_t size, size_t slot) {
+    region *r;
+    for (r = list->head; r != NULL && r->freed_map > 0; r = r->next) {
+        if (r->ctx != e->ctx)
+            continue;
+        long first = find_slot(r);
+        if (first < 0)
+            continue;
+        r->bitmap[first / REGION_WORD_BITS] |= slot_mask(slot, first);
+        if ((size_t)first == r->freemark)
+            r->freemark = first + slot;
+        r->freed_map -= slot;
+        r->length += size;
+        if (r->freed_map == 0) {
+            list_unlink(list, r);
+            list_push(list, r, 1);
+        }
+        e->address = r->start + first * CHUNK_SIZE;
+        e->region = r;
+        return r;
+    }
+    return NULL;
+}
+
+static region *region_create(CUdevice dev, CUcontext ctx, size_t slot) {
+    size_t words = BITSIZE / REGION_WORD_BITS;
+    region *r = malloc(sizeof(region) + words * sizeof(uint64_t));
+    if (r == NULL) {
+        LOG_ERROR("region_create: malloc failed");
+        return NULL;
+    }
+    if (reserve_memory(dev, IPCSIZE, SHRREG_API_MEM_ALLOC)) {
+        free(r);
+        return NULL;
+    }
+    CUresult res = CUDA_OVERRIDE_CALL(cuda_library_entry, cuMemAlloc_v2, &r->start, IPCSIZE);
+    if (res != CUDA_SUCCESS) {
+        LOG_ERROR("region_create: cuMemAlloc_v2 failed res=%d", res);
+        unreserve_memory(dev, IPCSIZE);
+        free(r);
+        return NULL;
+    }
+    r->bitmap = (uint64_t *)(r + 1);
+    memset(r->bitmap, 0, words * sizeof(uint64_t));
+    r->slot = slot;
+    r->freemark = 0;
+    r->freed_map = BITSIZE;
+    r->length = 0;
+    r->ctx = ctx;
+    r->dev = dev;
+    r->next = r->prev = NULL;
+    LOG_DEBUG("Region %llx of %lu unit slots created on device %d", r->start, r->slot, dev);
+    return r;
+}
+
+region *region_carve(allocated_device_memory *e, size_t size) {
+    size_t slot = (size_t)1 << region_class(size);
+    region_list *list = class_list(e->dev, slot);
+    pthread_mutex_lock(&list->lock);
+    region *r = carve_nolock(list, e, size, slot);
+    pthread_mutex_unlock(&list->lock);
+    if (r != NULL)
+        return r;
+    /* Quota and driver allocation outside lock */
+    r = region_create(e->dev, e->ctx, slot);
+    if (r == NULL)
+        return NULL;
+    pthread_mutex_lock(&list->lock);
+    list_push(list, r, 0);
+    r = carve_nolock(list, e, size, slot);
+    pthread_mutex_unlock(&list->lock);
+    return r;
+}
+
+static void region_destroy(region *r) {
+    LOG_DEBUG("Region %llx released on device %d", r->start, r->dev);
+    CUDA_OVERRIDE_CALL(cuda_library_entry, cuMemFree_v2, r->start);
+    unreserve_memory(r->dev, IPCSIZE);
+    free(r);
+}
+
+void region_release(allocated_device_memory *e) {
+    region *r = e->region;
+    region_list *list = class_list(r->dev, r->slot);
+    size_t first = (e->address - r->start) / CHUNK_SIZE;
+    pthread_mutex_lock(&list->lock);
+    int was_full = r->freed_map == 0;
+    r->bitmap[first / REGION_WORD_BITS] &= ~slot_mask(r->slot, first);
+    if (first < r->freemark)
+        r->freemark = first;
+    r->freed_map += r->slot;
+    r->length -= e->length;
+    e->region = NULL;
+    if (r->freed_map == BITSIZE) {
+        list_unlink(list, r);
+        pthread_mutex_unlock(&list->lock);
+        region_destroy(r);
+        return;
+    }
+    // Back among the regions with free slots
+    if (was_full) {
+        list_unlink(list, r);
+        list_push(list, r, 0);
+    }
+    pthread_mutex_unlock(&list->lock);
+}
+
+size_t region_flush(int dev, CUcontext ctx) {
+    if (r_list == NULL)
+        return 0;
+    size_t bytes = 0, i;
+    for (i = 0; i < CUDA_DEVICE_MAX_COUNT * REGION_CLASSES; i++) {
+        if (dev >= 0 && i / REGION_CLASSES != (size_t)dev)
+            continue;
+        region_list *list = &r_list[i];
+        region *dropped = NULL, *r, *next;
+        pthread_mutex_lock(&list->lock);
+        for (r = list->head; r != NULL; r = next) {
+            next = r->next;
+            if (r->ctx != ctx)
+                continue;
+            list_unlink(list, r);
+            r->next = dropped;
+            dropped = r;
+        }
+        pthread_mutex_unlock(&list->lock);
+        // The memory goes with the context, only the records and the charge are left
+        while (dropped != NULL) {
+            r = dropped;
+            dropped = r->next;
+            LOG_DEBUG("Region %llx dropped with its context on device %d", r->start, r->dev);
+            remove_chunk_range(r->start, IPCSIZE);
+            unreserve_memory(r->dev, IPCSIZE);
+            bytes += IPCSIZE;
+            free(r);
+        }
+    }
+    if (bytes > 0)
+        LOG_INFO("Regions of context %p dropped, %lu bytes released", ctx, bytes);
+    return bytes;
+}
@@ -0,0 +1,120 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "allocator.h"
+#include "include/log_utils.h"
+
+/*
+ * Slab of allocation records. Records come from mmap()ed slabs and are
+ * never returned to the system; a freed record goes to the free list of
+ * the freeing thread, and the threads exchange batches of records through
+ * a shared list. Taking and returning a record is a few pointer moves,
+ * libc malloc is not called on the allocation path. Free records are
+ * linked through hash_next.
+ */
+
+#define ALLOCATED_SLAB_SIZE (64 * 1024)
+#define ALLOCATED_SLAB_BATCH 64
+
+static pthread_mutex_t slab_mutex = PTHREAD_MUTEX_INITIALIZER;
+static allocated_device_memory *slab_free = NULL;
+
+static pthread_once_t slab_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slab_key;
+
+typedef struct {
+    allocated_device_memory *head;
+    size_t count;
+    int registered;
+} slab_cache_t;
+
+static __thread slab_cache_t slab_cache = {NULL, 0, 0};
+
+// Hand count records of the thread cache to the shared list
+static void slab_release(slab_cache_t *cache, size_t count) {
+    allocated_device_memory *first = cache->head, *last = first;
+    size_t n = 1;
+    if (first == NULL || count == 0)
+        return;
+    while (n < count && last->hash_next != NULL) {
+        last = last->hash_next;
+        n++;
+    }
+    cache->head = last->hash_next;
+    cache->count -= n;
+    pthread_mutex_lock(&slab_mutex);
+    last->hash_next = slab_free;
+    slab_free = first;
+    pthread_mutex_unlock(&slab_mutex);
+}
+
+// The records of an exiting thread go back to the shared list
+static void slab_thread_exit(void *arg) {
+    slab_release(&slab_cache, slab_cache.count);
+}
+
+static void slab_key_init() {
+    pthread_key_create(&slab_key, slab_thread_exit);
+}
+
+static void slab_register(slab_cache_t *cache) {
+    pthread_once(&slab_key_once, slab_key_init);
+    pthread_setspecific(slab_key, cache);
+    cache->registered = 1;
+}
+
+// Refill the thread cache with a batch from the shared list, or a new slab
+static int slab_refill(slab_cache_t *cache) {
+    if (!cache->registered)
+        slab_register(cache);
+    pthread_mutex_lock(&slab_mutex);
+    if (slab_free == NULL) {
+        char *slab = mmap(NULL, ALLOCATED_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (slab == MAP_FAILED) {
+            pthread_mutex_unlock(&slab_mutex);
+            LOG_ERROR("allocated_slab: mmap failed");
+            return -1;
+        }
+        size_t i, n = ALLOCATED_SLAB_SIZE / sizeof(allocated_device_memory);
+        allocated_device_memory *records = (allocated_device_memory *)slab;
+        for (i = 0; i < n; i++)
+            records[i].hash_next = i + 1 < n ? &records[i + 1] : NULL;
+        slab_free = records;
+    }
+    allocated_device_memory *first = slab_free, *last = first;
+    size_t n = 1;
+    while (n < ALLOCATED_SLAB_BATCH && last->hash_next != NULL) {
+        last = last->hash_next;
+        n++;
+    }
+    slab_free = last->hash_next;
+    pthread_mutex_unlock(&slab_mutex);
+    last->hash_next = cache->head;
+    cache->head = first;
+    cache->count += n;
+    return 0;
+}
+
+allocated_device_memory *allocated_entry_alloc() {
+    slab_cache_t *cache = &slab_cache;
+    if (cache->head == NULL && slab_refill(cache) != 0)
+        return NULL;
+    allocated_device_memory *e = cache->head;
+    cache->head = e->hash_next;
+    cache->count--;
+    e->hash_next = NULL;
+    return e;
+}
+
+void allocated_entry_free(allocated_device_memory *e) {
+    slab_cache_t *cache = &slab_cache;
+    if (!cache->registered)
+        slab_register(cache);
+    e->hash_next = cache->head;
+    cache->head = e;
+    cache->count++;
+    // Threads that only free do not hoard records
+    if (cache->count >= 2 * ALLOCATED_SLAB_BATCH)
+        slab_release(cache, ALLOCATED_SLAB_BATCH);
+}
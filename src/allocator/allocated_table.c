@@ -0,0 +1,188 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "allocator.h"
+#include "include/log_utils.h"
+
+/*
+ * Allocation table and range index. Frees look up an exact address in a
+ * chained hash table; pointer queries need the allocation containing an
+ * address, which the index, a treap ordered by address, answers in
+ * O(log n). The treap priority is a hash of the address, so the shape
+ * does not depend on allocation order and no random state is kept.
+ */
+
+#define ALLOCATED_TABLE_INITIAL_BUCKETS 1024
+
+// Split t into the records below address and the others
+static void treap_split(allocated_device_memory *t, CUdeviceptr address,
+                        allocated_device_memory **lower, allocated_device_memory **upper) {
+    if (t == NULL) {
+        *lower = *upper = NULL;
+    } else if (t->address < address) {
+        treap_split(t->right, address, &t->right, upper);
+        *lower = t;
+    } else {
+        treap_split(t->left, address, lower, &t->left);
+        *upper = t;
+    }
+}
+
+// Join two treaps, every address of lower below those of upper
+static allocated_device_memory *treap_merge(allocated_device_memory *lower, allocated_device_memory *upper) {
+    if (lower == NULL)
+        return upper;
+    if (upper == NULL)
+        return lower;
+    if (allocated_address_hash(lower->address) > allocated_address_hash(upper->address)) {
+        lower->right = treap_merge(lower->right, upper);
+        return lower;
+    }
+    upper->left = treap_merge(lower, upper->left);
+    return upper;
+}
+
+static allocated_device_memory *treap_insert(allocated_device_memory *t, allocated_device_memory *entry) {
+    if (t == NULL)
+        return entry;
+    if (allocated_address_hash(entry->address) > allocated_address_hash(t->address)) {
+        treap_split(t, entry->address, &entry->left, &entry->right);
+        return entry;
+    }
+    if (entry->address < t->address)
+        t->left = treap_insert(t->left, entry);
+    else
+        t->right = treap_insert(t->right, entry);
+    return t;
+}
+
+static allocated_device_memory *treap_remove(allocated_device_memory *t, CUdeviceptr address) {
+    if (t == NULL)
+        return NULL;
+    if (t->address == address)
+        return treap_merge(t->left, t->right);
+    if (address < t->address)
+        t->left = treap_remove(t->left, address);
+    else
+        t->right = treap_remove(t->right, address);
+    return t;
+}
+
+int allocated_table_init(allocated_table *table) {
+    table->buckets = calloc(ALLOCATED_TABLE_INITIAL_BUCKETS, sizeof(allocated_device_memory *));
+    if (table->buckets == NULL)
+        return -1;
+    table->mask = ALLOCATED_TABLE_INITIAL_BUCKETS - 1;
+    table->length = 0;
+    table->limit = 0;
+    return 0;
+}
+
+// Double the buckets once there are as many records, a failure keeps the chains longer
+static void allocated_table_grow(allocated_table *table) {
+    size_t count = (table->mask + 1) * 2;
+    allocated_device_memory **buckets = calloc(count, sizeof(allocated_device_memory *));
+    if (buckets == NULL) {
+        LOG_WARN("allocated_table: cannot grow to %lu buckets", count);
+        return;
+    }
+    size_t i;
+    for (i = 0; i <= table->mask; i++) {
+        allocated_device_memory *e = table->buckets[i];
+        while (e != NULL) {
+            allocated_device_memory *next = e->hash_next;
+            size_t b = allocated_address_hash(e->address) & (count - 1);
+            e->hash_next = buckets[b];
+            buckets[b] = e;
+            e = next;
+        }
+    }
+    free(table->buckets);
+    table->buckets = buckets;
+    table->mask = count - 1;
+}
+
+int allocated_table_insert(allocated_table *table, allocated_device_memory *entry) {
+    if (table->length > table->mask)
+        allocated_table_grow(table);
+    size_t b = allocated_address_hash(entry->address) & table->mask;
+    entry->hash_next = table->buckets[b];
+    table->buckets[b] = entry;
+    table->length++;
+    return 0;
+}
+
+allocated_device_memory *allocated_table_find(allocated_table *table, CUdeviceptr address) {
+    allocated_device_memory *e = table->buckets[allocated_address_hash(address) & table->mask];
+    while (e != NULL && e->address != address)
+        e = e->hash_next;
+    return e;
+}
+
+allocated_device_memory *allocated_table_remove(allocated_table *table, CUdeviceptr address) {
+    allocated_device_memory **link = &table->buckets[allocated_address_hash(address) & table->mask];
+    while (*link != NULL && (*link)->address != address)
+        link = &(*link)->hash_next;
+    allocated_device_memory *e = *link;
+    if (e == NULL)
+        return NULL;
+    *link = e->hash_next;
+    table->length--;
+    e->hash_next = NULL;
+    return e;
+}
+
+void allocated_table_foreach(allocated_table *table, void (*fn)(allocated_device_memory *, void *), void *arg) {
+    size_t i;
+    for (i = 0; i <= table->mask; i++) {
+        allocated_device_memory *e;
+        for (e = table->buckets[i]; e != NULL; e = e->hash_next)
+            fn(e, arg);
+    }
+}
+
+int allocated_index_init(allocated_index *index) {
+    index->root = NULL;
+    return pthread_rwlock_init(&index->lock, NULL);
+}
+
+void allocated_index_insert(allocated_index *index, allocated_device_memory *entry) {
+    entry->left = entry->right = NULL;
+    index->root = treap_insert(index->root, entry);
+}
+
+void allocated_index_remove(allocated_index *index, allocated_device_memory *entry) {
+    index->root = treap_remove(index->root, entry->address);
+    entry->left = entry->right = NULL;
+}
+
+allocated_device_memory *allocated_index_find_range(allocated_index *index, CUdeviceptr address) {
+    // Allocation with the highest start not above address
+    allocated_device_memory *t = index->root, *floor = NULL;
+    while (t != NULL) {
+        if (t->address == address)
+            return t;
+        if (t->address < address) {
+            floor = t;
+            t = t->right;
+        } else {
+            t = t->left;
+        }
+    }
+    if (floor != NULL && floor->address + floor->length >= address)
+        return floor;
+    return NULL;
+}
+
+allocated_device_memory *allocated_index_lower_bound(allocated_index *index, CUdeviceptr address) {
+    allocated_device_memory *t = index->root, *ceil = NULL;
+    while (t != NULL) {
+        if (t->address >= address) {
+            ceil = t;
+            t = t->left;
+        } else {
+            t = t->right;
+        }
+    }
+    return ceil;
+}
@@ -6,26 +6,23 @@
 
 size_t BITSIZE = 512;
 size_t IPCSIZE = 2097152;
-size_t OVERSIZE = 134217728;
 //int pidfound;
 
 region_list *r_list;
-allocated_list *device_overallocated;
-allocated_list *device_allocasync;
+allocated_shard *device_overallocated;
+allocated_index *device_ranges;
+allocated_table *device_allocasync;
 
 #define ALIGN       2097152
 #define MULTI_PARAM 1
 
-#define CHUNK_SIZE  (OVERSIZE/BITSIZE)
-#define __CHUNK_SIZE__  CHUNK_SIZE
-
 extern size_t initial_offset;
 extern CUresult
     cuMemoryAllocate(CUdeviceptr* dptr, size_t bytesize, void* data);
 extern CUresult cuMemoryFree(CUdeviceptr dptr);
 
 pthread_once_t allocator_allocate_flag = PTHREAD_ONCE_INIT;
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t async_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 size_t round_up(size_t size, size_t unit) {
     if (size & (unit-1))
@@ -33,39 +30,92 @@ size_t round_up(size_t size, size_t unit) {
     return size;
 }
 
-int oom_check(const int dev, size_t addon) {
+// Free the allocation caches of this process, then of the others; 1 if usage dropped
+static int flush_caches(const int dev) {
+    if (allocated_cache_flush(dev) > 0)
+        return 1;
+    size_t usage = get_gpu_memory_usage(dev);
+    if (shrreg_request_cache_flush(SHRREG_CACHE_FLUSH_WAIT_MS) == 0)
+        return 0;
+    return get_gpu_memory_usage(dev) < usage;
+}
+
+int oom_check(const int dev, size_t addon, int api) {
     CUdevice d;
     if (dev==-1)
         cuCtxGetDevice(&d);
     else
         d=dev;
     uint64_t limit = get_current_device_memory_limit(d);
-    size_t _usage = get_gpu_memory_usage(d);
-
-    if (limit == 0) {
+    uint64_t group_limit = get_current_group_memory_limit(d);
+    if (limit == 0 && group_limit == 0) {
+        return 0;
+    }
+    // Already charged to this process's lease
+    if (addon > 0 && get_gpu_memory_lease(d) >= addon) {
         return 0;
     }
+    size_t _usage = get_gpu_memory_usage(d);
 
     size_t new_allocated = _usage + addon;
     LOG_INFO("_usage=%lu limit=%lu new_allocated=%lu",_usage,limit,new_allocated);
-    if (new_allocated > limit) {
-        LOG_ERROR("Device %d OOM %lu / %lu", d, new_allocated, limit);
+    size_t group_allocated = group_limit == 0 ? 0 : get_current_group_memory_usage(d) + addon;
+    if ((limit != 0 && new_allocated > limit) || group_allocated > group_limit) {
+        if (group_allocated > group_limit) {
+            LOG_ERROR("Device %d group OOM %lu / %lu", d, group_allocated, group_limit);
+        } else {
+            LOG_ERROR("Device %d OOM %lu / %lu", d, new_allocated, limit);
+        }
 
-        if (clear_proc_slot_nolock(1) > 0)
-            return oom_check(dev,addon);
+        if (reap_dead_proc_slots() > 0 || reclaim_gpu_memory_leases(d) > 0 || flush_caches(d))
+            return oom_check(dev,addon,api);
+        shrreg_record_oom(d, addon, api);
         return 1;
     }
     return 0;
 }
 
+int reserve_memory(const int dev, size_t size, int api) {
+    if (reserve_gpu_device_memory_usage(getpid(), dev, size, 2) == 0)
+        return 0;
+    // Dead processes and idle leases may hold the missing quota
+    int reaped = reap_dead_proc_slots();
+    if ((reaped > 0 || reclaim_gpu_memory_leases(dev) > 0) &&
+        reserve_gpu_device_memory_usage(getpid(), dev, size, 2) == 0)
+        return 0;
+    // Then cached allocations, of this process first
+    while (flush_caches(dev)) {
+        if (reserve_gpu_device_memory_usage(getpid(), dev, size, 2) == 0)
+            return 0;
+    }
+    LOG_ERROR("Device %d OOM %lu + %lu / %lu", dev, get_gpu_memory_usage(dev), size,
+        get_current_device_memory_limit(dev));
+    shrreg_record_oom(dev, size, api);
+    return 1;
+}
+
+void unreserve_memory(const int dev, size_t size) {
+    rm_gpu_device_memory_usage(getpid(), dev, size, 2);
+}
+
+static void view_entry(allocated_device_memory *e, void *arg) {
+    LOG_INFO("(%p %lu)\t",(void *)e->address,e->length);
+    *(size_t *)arg += e->length;
+}
+
+static void sum_entry(allocated_device_memory *e, void *arg) {
+    *(size_t *)arg += e->length;
+}
+
 CUresult view_vgpu_allocator() {
-    allocated_list_entry *al;
     size_t total;
     total=0;
     LOG_INFO("[view1]:overallocated:");
-    for (al=device_overallocated->head;al!=NULL;al=al->next){
-        LOG_INFO("(%p %lu)\t",(void *)al->entry->address,al->entry->length);
-        total+=al->entry->length;
+    int i;
+    for (i = 0; i < ALLOCATOR_SHARDS; i++) {
+        pthread_mutex_lock(&device_overallocated[i].mutex);
+        allocated_table_foreach(&device_overallocated[i].table, view_entry, &total);
+        pthread_mutex_unlock(&device_overallocated[i].mutex);
     }
     LOG_INFO("total=%lu",total);
     size_t t = get_current_device_memory_usage(0);
@@ -73,16 +123,9 @@ CUresult view_vgpu_allocator() {
     return 0;
 }
 
-CUresult get_listsize(allocated_list *al, size_t *size) {
-    if (al->length == 0){
-        *size = 0;
-        return CUDA_SUCCESS;
-    }
+CUresult get_listsize(allocated_table *al, size_t *size) {
     size_t count=0;
-    allocated_list_entry *val;
-    for (val=al->head;val!=NULL;val=val->next){
-        count+=val->entry->length;
-    }
+    allocated_table_foreach(al, sum_entry, &count);
     *size = count;
     return CUDA_SUCCESS;
 }
@@ -90,20 +133,93 @@ CUresult get_listsize(allocated_list *al, size_t *size) {
 void allocator_init() {
     LOG_DEBUG("Allocator_init\n");
 
-    device_overallocated = malloc(sizeof(allocated_list));
+    device_overallocated = aligned_alloc(64, sizeof(allocated_shard) * ALLOCATOR_SHARDS);
     if (!device_overallocated) {
         LOG_ERROR("allocator_init: malloc failed");
         exit(EXIT_FAILURE);
     }
-    LIST_INIT(device_overallocated);
-    device_allocasync = malloc(sizeof(allocated_list));
-    if (!device_allocasync) {
+    int i;
+    for (i = 0; i < ALLOCATOR_SHARDS; i++) {
+        if (allocated_table_init(&device_overallocated[i].table) != 0) {
+            LOG_ERROR("allocator_init: malloc failed");
+            exit(EXIT_FAILURE);
+        }
+        pthread_mutex_init(&device_overallocated[i].mutex, NULL);
+    }
+    device_ranges = malloc(sizeof(allocated_index));
+    if (!device_ranges || allocated_index_init(device_ranges) != 0) {
+        LOG_ERROR("allocator_init: malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    device_allocasync = malloc(sizeof(allocated_table));
+    if (!device_allocasync || allocated_table_init(device_allocasync) != 0) {
         LOG_ERROR("allocator_init: malloc failed");
         exit(EXIT_FAILURE);
     }
-    LIST_INIT(device_allocasync);
 
-    pthread_mutex_init(&mutex,NULL);
+    region_init();
+    allocated_cache_init();
+    pthread_mutex_init(&async_mutex,NULL);
+}
+
+static void insert_chunk(allocated_device_memory *e) {
+    allocated_shard *shard = allocated_shard_of(device_overallocated, e->address);
+    pthread_mutex_lock(&shard->mutex);
+    allocated_table_insert(&shard->table, e);
+    pthread_mutex_unlock(&shard->mutex);
+    pthread_rwlock_wrlock(&device_ranges->lock);
+    allocated_index_insert(device_ranges, e);
+    pthread_rwlock_unlock(&device_ranges->lock);
+}
+
+static allocated_device_memory *take_chunk(CUdeviceptr address) {
+    allocated_shard *shard = allocated_shard_of(device_overallocated, address);
+    pthread_mutex_lock(&shard->mutex);
+    allocated_device_memory *e = allocated_table_remove(&shard->table, address);
+    pthread_mutex_unlock(&shard->mutex);
+    if (e != NULL) {
+        pthread_rwlock_wrlock(&device_ranges->lock);
+        allocated_index_remove(device_ranges, e);
+        pthread_rwlock_unlock(&device_ranges->lock);
+    }
+    return e;
+}
+
+// Call fn on the allocation containing address, its end included, -1 if there is none
+static int with_chunk_range(CUdeviceptr address, void (*fn)(allocated_device_memory *, void *), void *arg) {
+    pthread_rwlock_rdlock(&device_ranges->lock);
+    allocated_device_memory *e = allocated_index_find_range(device_ranges, address);
+    if (e != NULL)
+        fn(e, arg);
+    pthread_rwlock_unlock(&device_ranges->lock);
+    return e != NULL ? 0 : -1;
+}
+
+static int track_chunk(CUdeviceptr address, size_t size, CUdevice dev, unsigned int flags) {
+    allocated_device_memory *e;
+    INIT_ALLOCATED_ENTRY(e, address, size, dev);
+    e->flags = flags;
+    /* Tracking inside the shard and index locks — pure in-memory ops */
+    insert_chunk(e);
+    return 0;
+}
+
+// Track an allocation whose size was charged by reserve_memory()
+int add_chunk_only(CUdeviceptr address, size_t size, CUdevice dev) {
+    return track_chunk(address, size, dev, 0);
+}
+
+// Carve a small allocation out of a region, a new one if none has room
+static int add_chunk_region(CUdeviceptr *address, size_t size, CUdevice dev) {
+    allocated_device_memory *e;
+    INIT_ALLOCATED_ENTRY(e, 0, size, dev);
+    if (region_carve(e, size) == NULL) {
+        allocated_entry_free(e);
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+    insert_chunk(e);
+    *address = e->address;
+    return 0;
 }
 
 int add_chunk(CUdeviceptr *address, size_t size) {
@@ -112,118 +228,153 @@ int add_chunk(CUdeviceptr *address, size_t size) {
 
     cuCtxGetDevice(&dev);
 
-    /* OOM pre-check without lock */
-    if (oom_check(dev, size))
+    if (region_carves(dev, size))
+        return add_chunk_region(address, size, dev);
+
+    /* A cached allocation of the size class needs no driver call */
+    size_t csize = allocated_cache_class(dev, size);
+    if (csize > 0) {
+        CUcontext ctx;
+        cuCtxGetCurrent(&ctx);
+        allocated_device_memory *e = allocated_cache_take(dev, ctx, csize);
+        if (e != NULL) {
+            insert_chunk(e);
+            *address = e->address;
+            return 0;
+        }
+        size = csize;
+    }
+
+    /* Charge the quota first, concurrent allocations cannot overshoot it */
+    if (reserve_memory(dev, size, SHRREG_API_MEM_ALLOC))
         return CUDA_ERROR_OUT_OF_MEMORY;
 
     /* GPU allocation outside lock — the expensive part */
-    if (size <= IPCSIZE) {
-        res = CUDA_OVERRIDE_CALL(cuda_library_entry, cuMemAlloc_v2, address, size);
-    } else {
-        res = cuMemoryAllocate(address, size, NULL);
-    }
+    do {
+        if (size <= IPCSIZE) {
+            res = CUDA_OVERRIDE_CALL(cuda_library_entry, cuMemAlloc_v2, address, size);
+        } else {
+            res = cuMemoryAllocate(address, size, NULL);
+        }
+        // Without a limit, cached allocations may be what fills the device
+    } while (res == CUDA_ERROR_OUT_OF_MEMORY && flush_caches(dev));
     if (res != CUDA_SUCCESS) {
         LOG_ERROR("cuMemoryAllocate failed res=%d", res);
+        unreserve_memory(dev, size);
         return res;
     }
-
-    /* Tracking inside lock — pure in-memory ops, microseconds */
-    pthread_mutex_lock(&mutex);
-
-    if (oom_check(dev, size)) {
-        /* Another process consumed memory between our pre-check and now */
-        pthread_mutex_unlock(&mutex);
+    if (track_chunk(*address, size, dev, csize > 0 ? ALLOCATED_CACHEABLE : 0) != 0) {
         CUDA_OVERRIDE_CALL(cuda_library_entry, cuMemFree_v2, *address);
+        unreserve_memory(dev, size);
         return CUDA_ERROR_OUT_OF_MEMORY;
     }
-
-    allocated_list_entry *e;
-    INIT_ALLOCATED_LIST_ENTRY(e, 0, size, dev);
-    e->entry->address = *address;
-    LIST_ADD(device_overallocated, e);
-    add_gpu_device_memory_usage(getpid(), dev, size, 2);
-
-    pthread_mutex_unlock(&mutex);
     return 0;
 }
 
-int add_chunk_only(CUdeviceptr address, size_t size, CUdevice dev) {
-    pthread_mutex_lock(&mutex);
-    size_t addr=0;
-    size_t allocsize;
-    if (oom_check(dev,size)){
-        pthread_mutex_unlock(&mutex);
-        return -1;
-    }
-    allocated_list_entry *e;
-    INIT_ALLOCATED_LIST_ENTRY(e, addr, size, dev);
-    LIST_ADD(device_overallocated,e);
-    //uint64_t t_size;
-    e->entry->address=address;
-    allocsize = size;
-    add_gpu_device_memory_usage(getpid(), dev, allocsize, 2);
-    pthread_mutex_unlock(&mutex);
-    return 0;
+static void no_op(allocated_device_memory *e, void *arg) {
 }
 
 int check_memory_type(CUdeviceptr address) {
-    allocated_list_entry *cursor;
-    cursor = device_overallocated->head;
-    for (cursor=device_overallocated->head;cursor!=NULL;cursor=cursor->next){
-        if ((cursor->entry->address <= address) && (cursor->entry->address+cursor->entry->length>=address))
-            return CU_MEMORYTYPE_DEVICE;
-    }
-    return CU_MEMORYTYPE_HOST;
+    return with_chunk_range(address, no_op, NULL) == 0 ? CU_MEMORYTYPE_DEVICE : CU_MEMORYTYPE_HOST;
 }
 
-int remove_chunk(allocated_list *a_list, CUdeviceptr dptr) {
-    size_t t_size;
-    CUdevice t_dev;
+// Wait for the work of the context of an allocation, which need not be current
+static void synchronize_chunk(allocated_device_memory *e) {
+    CUcontext current = NULL, popped;
+    CUDA_OVERRIDE_CALL(cuda_library_entry, cuCtxGetCurrent, &current);
+    if (e->ctx != current)
+        CUDA_OVERRIDE_CALL(cuda_library_entry, cuCtxPushCurrent_v2, e->ctx);
+    CUDA_OVERRIDE_CALL(cuda_library_entry, cuCtxSynchronize);
+    if (e->ctx != current)
+        CUDA_OVERRIDE_CALL(cuda_library_entry, cuCtxPopCurrent_v2, &popped);
+}
 
-    if (a_list->length == 0) {
+// Give a carved allocation back to its region, and an empty region to the driver
+static int remove_chunk_region(allocated_device_memory *e) {
+    /* Units are reused at once, wait for the work that may use them as cuMemFree does */
+    synchronize_chunk(e);
+    region_release(e);
+    allocated_entry_free(e);
+    return 0;
+}
+
+int remove_chunk(CUdeviceptr dptr) {
+    allocated_device_memory *e = take_chunk(dptr);
+    if (e == NULL) {
         return -1;
     }
-
-    pthread_mutex_lock(&mutex);
-
-    allocated_list_entry *val;
-    for (val = a_list->head; val != NULL; val = val->next) {
-        if (val->entry->address == dptr) {
-            t_size = val->entry->length;
-            t_dev = val->entry->dev;
-            LIST_REMOVE(a_list, val);
-            rm_gpu_device_memory_usage(getpid(), t_dev, t_size, 2);
-
-            pthread_mutex_unlock(&mutex);
-
-            /* GPU free outside lock */
-            cuMemoryFree(dptr);
-            return 0;
-        }
+    if (e->region != NULL) {
+        return remove_chunk_region(e);
+    }
+    if (e->flags & ALLOCATED_CACHEABLE) {
+        /* Reused at once, wait for the work that may use it as cuMemFree does */
+        synchronize_chunk(e);
+        allocated_cache_put(e);
+        return 0;
     }
+    /* Shared region and GPU free outside lock */
+    rm_gpu_device_memory_usage(getpid(), e->dev, e->length, 2);
+    allocated_entry_free(e);
+    cuMemoryFree(dptr);
+    return 0;
+}
 
-    pthread_mutex_unlock(&mutex);
-    return -1;
+typedef struct {
+    CUdeviceptr base;
+    size_t size;
+    int carved;
+} chunk_range;
+
+static void get_range(allocated_device_memory *e, void *arg) {
+    chunk_range *range = arg;
+    range->base = e->address;
+    range->size = e->length;
+    range->carved = e->region != NULL;
+}
+
+int region_address_range(CUdeviceptr address, CUdeviceptr *base, size_t *size) {
+    chunk_range range;
+    if (with_chunk_range(address, get_range, &range) != 0 || !range.carved)
+        return -1;
+    if (base != NULL)
+        *base = range.base;
+    if (size != NULL)
+        *size = range.size;
+    return 0;
 }
 
 int remove_chunk_only(CUdeviceptr dptr) {
-    allocated_list *a_list = device_overallocated;
-    size_t t_size;
-    CUdevice t_dev;
-    if (a_list->length == 0) {
+    allocated_device_memory *e = take_chunk(dptr);
+    if (e == NULL) {
         return -1;
     }
-    allocated_list_entry *val;
-    for (val = a_list->head; val != NULL; val = val->next) {
-        if (val->entry->address == dptr) {
-            t_size = val->entry->length;
-            t_dev = val->entry->dev;
-            LIST_REMOVE(a_list, val);
-            rm_gpu_device_memory_usage(getpid(), t_dev, t_size, 2);
-            return 0;
-        }
+    rm_gpu_device_memory_usage(getpid(), e->dev, e->length, 2);
+    allocated_entry_free(e);
+    return 0;
+}
+
+void remove_chunk_range(CUdeviceptr start, size_t size) {
+    allocated_device_memory *list = NULL, *e;
+    pthread_rwlock_wrlock(&device_ranges->lock);
+    while ((e = allocated_index_lower_bound(device_ranges, start)) != NULL &&
+           e->address < start + size) {
+        allocated_index_remove(device_ranges, e);
+        e->left = list;
+        list = e;
+    }
+    pthread_rwlock_unlock(&device_ranges->lock);
+    while (list != NULL) {
+        e = list;
+        list = e->left;
+        e->left = NULL;
+        allocated_shard *shard = allocated_shard_of(device_overallocated, e->address);
+        pthread_mutex_lock(&shard->mutex);
+        // A free taking the record at the same time frees it
+        int taken = allocated_table_remove(&shard->table, e->address) == e;
+        pthread_mutex_unlock(&shard->mutex);
+        if (taken)
+            allocated_entry_free(e);
     }
-    return -1;
 }
 
 int allocate_raw(CUdeviceptr *dptr, size_t size) {
@@ -231,55 +382,49 @@ int allocate_raw(CUdeviceptr *dptr, size_t size) {
 }
 
 int free_raw(CUdeviceptr dptr) {
-    return remove_chunk(device_overallocated, dptr);
+    return remove_chunk(dptr);
 }
 
 int remove_chunk_async(
-    allocated_list *a_list, CUdeviceptr dptr, CUstream hStream) {
-    size_t t_size;
-    if (a_list->length == 0) {
+    allocated_table *a_table, CUdeviceptr dptr, CUstream hStream) {
+    pthread_mutex_lock(&async_mutex);
+    allocated_device_memory *e = allocated_table_remove(a_table, dptr);
+    if (e == NULL) {
+        pthread_mutex_unlock(&async_mutex);
         return -1;
     }
-    allocated_list_entry *val;
-    for (val = a_list->head; val != NULL; val = val->next) {
-        if (val->entry->address == dptr) {
-            t_size=val->entry->length;
-            CUDA_OVERRIDE_CALL(cuda_library_entry,cuMemFreeAsync,dptr,hStream);
-            LIST_REMOVE(a_list,val);
-            a_list->limit-=t_size;
-            CUdevice dev;
-            cuCtxGetDevice(&dev);
-            rm_gpu_device_memory_usage(getpid(),dev,t_size,2);
-            return 0;
-        }
-    }
-    return -1;
+    size_t t_size=e->length;
+    a_table->limit-=t_size;
+    pthread_mutex_unlock(&async_mutex);
+    /* GPU free and shared region outside lock */
+    CUDA_OVERRIDE_CALL(cuda_library_entry,cuMemFreeAsync,dptr,hStream);
+    rm_gpu_device_memory_usage(getpid(),e->dev,t_size,2);
+    allocated_entry_free(e);
+    return 0;
 }
 
 int free_raw_async(CUdeviceptr dptr, CUstream hStream) {
-    pthread_mutex_lock(&mutex);
-    unsigned int tmp = remove_chunk_async(device_allocasync, dptr, hStream);
-    pthread_mutex_unlock(&mutex);
-    return tmp;
+    return remove_chunk_async(device_allocasync, dptr, hStream);
 }
 
 int add_chunk_async(CUdeviceptr *address, size_t size, CUstream hStream) {
     size_t addr=0;
-    size_t allocsize;
+    size_t allocsize=0;
     CUresult res = CUDA_SUCCESS;
     CUdevice dev;
     cuCtxGetDevice(&dev);
-    if (oom_check(dev,size))
+    if (oom_check(dev,size,SHRREG_API_MEM_ALLOC_ASYNC))
         return -1;
 
-    allocated_list_entry *e;
-    INIT_ALLOCATED_LIST_ENTRY(e, addr, size, dev);
-    res = CUDA_OVERRIDE_CALL(cuda_library_entry,cuMemAllocAsync,&e->entry->address,size,hStream);
+    allocated_device_memory *e;
+    INIT_ALLOCATED_ENTRY(e, addr, size, dev);
+    res = CUDA_OVERRIDE_CALL(cuda_library_entry,cuMemAllocAsync,&e->address,size,hStream);
     if (res != CUDA_SUCCESS) {
         LOG_ERROR("cuMemoryAllocate failed res=%d",res);
+        allocated_entry_free(e);
         return res;
     }
-    *address = e->entry->address;
+    *address = e->address;
     CUmemoryPool pool;
     res = CUDA_OVERRIDE_CALL(cuda_library_entry,cuDeviceGetMemPool,&pool,dev);
     if (res != CUDA_SUCCESS) {
@@ -292,25 +437,24 @@ int add_chunk_async(CUdeviceptr *address, size_t size, CUstream hStream) {
         LOG_ERROR("cuMemPoolGetAttribute failed res=%d",res);
         return res;
     }
+    pthread_mutex_lock(&async_mutex);
     if (poollimit != 0) {
         if (poollimit> device_allocasync->limit) {
             allocsize = (poollimit-device_allocasync->limit < size)? poollimit-device_allocasync->limit : size;
-            cuCtxGetDevice(&dev);
-            add_gpu_device_memory_usage(getpid(), dev, allocsize, 2);
             device_allocasync->limit=device_allocasync->limit+allocsize;
-            e->entry->length=allocsize;
+            e->length=allocsize;
         }else{
-            e->entry->length=0;
+            e->length=0;
         }
     }
-    LIST_ADD(device_allocasync,e);
+    allocated_table_insert(device_allocasync,e);
+    pthread_mutex_unlock(&async_mutex);
+    /* Shared region outside lock */
+    if (allocsize > 0)
+        add_gpu_device_memory_usage(getpid(), dev, allocsize, 2);
     return 0;
 }
 
 int allocate_async_raw(CUdeviceptr *dptr, size_t size, CUstream hStream) {
-    int tmp;
-    pthread_mutex_lock(&mutex);
-    tmp = add_chunk_async(dptr,size,hStream);
-    pthread_mutex_unlock(&mutex);
-    return tmp;
+    return add_chunk_async(dptr,size,hStream);
 }
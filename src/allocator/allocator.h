@@ -6,164 +6,223 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <errno.h>
+#include <stdint.h>
 
 #define CUMALLOC 0
 #define CUCREATE 1
 
+// Units of a region
+#define CHUNK_SIZE  (IPCSIZE/BITSIZE)
+
+// Carve small cuMemAlloc_v2 allocations out of shared driver allocations
+#define CUDA_DEVICE_MEMORY_SUBALLOC_ENV "CUDA_DEVICE_MEMORY_SUBALLOC"
+// Keep freed cuMemAlloc_v2 allocations for reuse, charged to the process
+#define CUDA_DEVICE_MEMORY_CACHING_ENV "CUDA_DEVICE_MEMORY_CACHING"
+
+// The allocation is of a cache size class and goes to the cache when freed
+#define ALLOCATED_CACHEABLE 0x1
+
 struct allocated_device_memory_struct{
     CUdeviceptr address;
     size_t length;
     CUcontext ctx;
     CUdevice dev;
-    CUmemGenericAllocationHandle *allocHandle;
+    // Links of the allocated_table and of the allocated_index holding the record
+    struct allocated_device_memory_struct *hash_next;
+    struct allocated_device_memory_struct *left,*right;
+    // Region the allocation was carved from, NULL for a driver allocation
+    struct region_struct *region;
+    unsigned int flags;     // ALLOCATED_*
 };
 typedef struct allocated_device_memory_struct allocated_device_memory;
 
-struct allocated_list_entry_struct{
-    allocated_device_memory *entry;
-    struct allocated_list_entry_struct *next,*prev;
-};
-typedef struct allocated_list_entry_struct allocated_list_entry;
-
-struct allocated_list_struct{
-    allocated_list_entry *head;
-    allocated_list_entry *tail;
+/*
+ * Tracked allocations of a process, see allocated_table.c. Records are
+ * chained in a hash table by address for frees; intrusive, a record is
+ * one allocation. Not synchronized, callers hold the lock guarding it.
+ */
+struct allocated_table_struct{
+    allocated_device_memory **buckets;
+    size_t mask;                       // Bucket count - 1, a power of two
     size_t length;
     size_t limit;
 };
-typedef struct allocated_list_struct allocated_list;
+typedef struct allocated_table_struct allocated_table;
+
+/*
+ * Allocations are tracked in ALLOCATOR_SHARDS tables picked by a hash of
+ * the address, each behind its own lock, so that threads allocating and
+ * freeing at the same time rarely wait for each other. A free knows the
+ * shard from the address. The allocation containing an address is found
+ * in one range index shared by the shards.
+ */
+#define ALLOCATOR_SHARDS 16
+#define ALLOCATOR_SHARD_BITS 4
+
+struct allocated_shard_struct{
+    pthread_mutex_t mutex;
+    allocated_table table;
+} __attribute__((aligned(64)));
+typedef struct allocated_shard_struct allocated_shard;
+
+/*
+ * Range index of the tracked allocations, a treap ordered by address
+ * through the left and right links of the records. Lookups share the
+ * lock, updates hold it alone for the O(log n) treap operation.
+ */
+struct allocated_index_struct{
+    pthread_rwlock_t lock;
+    allocated_device_memory *root;     // Heap-ordered by a hash of the address
+};
+typedef struct allocated_index_struct allocated_index;
+
+static inline uint64_t allocated_address_hash(CUdeviceptr address) {
+    uint64_t x = (uint64_t)address;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
 
+// Tables index buckets with the low bits of the hash, shards use the high ones
+static inline allocated_shard *allocated_shard_of(allocated_shard *shards, CUdeviceptr address) {
+    return &shards[allocated_address_hash(address) >> (64 - ALLOCATOR_SHARD_BITS)];
+}
+
+/*
+ * Region of IPCSIZE bytes allocated from the driver, small allocations are
+ * carved out of it in slots of a power of two units of CHUNK_SIZE, see
+ * allocated_region.c. Regions are on the region_list of their device and
+ * slot size, those with free slots first.
+ */
 struct region_struct{
-    size_t start;
-    size_t freemark;
-    size_t freed_map;
-    size_t length;
+    CUdeviceptr start;
+    size_t slot;            // Units of a slot
+    size_t freemark;        // Units below it are all in use
+    size_t freed_map;       // Free units
+    size_t length;          // Bytes carved out
     CUcontext ctx;
-    allocated_list *region_allocs;
-    char *bitmap;
-    CUmemGenericAllocationHandle *allocHandle;
+    CUdevice dev;
+    uint64_t *bitmap;       // A bit per unit, set while it is in use
+    struct region_struct *next,*prev;
 };
 typedef struct region_struct region;
 
-struct region_list_entry_struct{
-    region *entry;
-    struct region_list_entry_struct *next,*prev;
-};
-typedef struct region_list_entry_struct region_list_entry;
-
 struct region_list_struct{
-    region_list_entry   *head;
-    region_list_entry   *tail;
+    pthread_mutex_t lock;
+    region *head;
+    region *tail;
     size_t length;
 };
 typedef struct region_list_struct region_list;
 
+// Region lists, one per device and slot size
 extern region_list *r_list;
-extern allocated_list *device_overallocated;
-extern allocated_list *device_allocasync;
-extern pthread_mutex_t mutex;
-
-#define LIST_INIT(list) {   \
-    list->head=NULL;         \
-    list->tail=NULL;         \
-    list->length=0;          \
-    list->limit=0;           \
-    }
-#define __LIST_INIT(list) LIST_INIT(list)
+extern size_t BITSIZE;
+extern size_t IPCSIZE;
+extern allocated_shard *device_overallocated;
+// Range index of the records in device_overallocated
+extern allocated_index *device_ranges;
+// Allocations of cuMemAllocAsync, the table's limit is the memory pool
+// usage charged to the process
+extern allocated_table *device_allocasync;
+extern pthread_mutex_t async_mutex;
 
 #define QUIT_WITH_ERROR(__message) {    \
     LOG_ERROR("%s\n",#__message);  \
     return -1;                          \
 }
 
-#define LIST_REMOVE(list,val) {             \
-    if (val->prev!=NULL)                    \
-        val->prev->next=val->next;          \
-    if (val->next!=NULL)                    \
-        val->next->prev=val->prev;          \
-    if (val == list->tail)                  \
-        list->tail = val->prev;             \
-    if (val == list->head)                  \
-        list->head = val->next;             \
-    free(val->entry->allocHandle);          \
-    free(val->entry);                       \
-    free(val);                              \
-    list->length--;                         \
-}   
-
-#define INIT_ALLOCATED_LIST_ENTRY(__list_entry, __address, __size, __dev) {             \
+#define INIT_ALLOCATED_ENTRY(__entry, __address, __size, __dev) {            \
     CUcontext __ctx;                                                           \
     CUresult __res=cuCtxGetCurrent(&__ctx);                                    \
     if (__res!=CUDA_SUCCESS) QUIT_WITH_ERROR("cuCtxGetCurrent failed");        \
-    __list_entry = malloc(sizeof(allocated_list_entry));                       \
-    if (__list_entry == NULL) QUIT_WITH_ERROR("malloc failed");                \
-    __list_entry->entry = malloc(sizeof(allocated_device_memory));             \
-    if (__list_entry->entry == NULL) QUIT_WITH_ERROR("malloc failed");         \
-    __list_entry->entry->address=__address;                                    \
-    __list_entry->entry->length=__size;                                        \
-    __list_entry->entry->dev = __dev;                                            \
-    __list_entry->entry->allocHandle=malloc(sizeof(CUmemGenericAllocationHandle)); \
-    __list_entry->entry->ctx=__ctx;                                            \
-    __list_entry->next=NULL;                                                   \
-    __list_entry->prev=NULL;                                                   \
+    __entry = allocated_entry_alloc();                                         \
+    if (__entry == NULL) QUIT_WITH_ERROR("allocated_entry_alloc failed");      \
+    __entry->address=__address;                                                \
+    __entry->length=__size;                                                    \
+    __entry->dev = __dev;                                                      \
+    __entry->ctx=__ctx;                                                        \
+    __entry->region=NULL;                                                      \
+    __entry->flags=0;                                                          \
 }
 
-#define INIT_REGION_LIST_ENTRY(__list_entry,__address,__size)                      \
-    do{                                                                            \
-        CUcontext __ctx;                                                           \
-        CUresult __res;                                                            \
-        __res = cuCtxGetCurrent(&__ctx);                                           \
-        if (__res!=CUDA_SUCCESS) QUIT_WITH_ERROR("cuCtxGetCurrent failed");        \
-        __list_entry = malloc(sizeof(region_list_entry));                          \
-        if (__list_entry == NULL) QUIT_WITH_ERROR("malloc failed");                \
-        __list_entry->entry = malloc(sizeof(region));                              \
-        if (__list_entry->entry == NULL) QUIT_WITH_ERROR("malloc failed")          \
-        __list_entry->entry->region_allocs = malloc(sizeof(allocated_list));       \
-        if (__list_entry->entry->region_allocs == NULL) QUIT_WITH_ERROR("malloc failed") \
-        __list_entry->entry->start=__address;                                      \
-        __list_entry->entry->freed_map=__CHUNK_SIZE__;                             \
-        __list_entry->entry->freemark=0;                                           \
-        __list_entry->entry->length=0;                                             \
-        __list_entry->entry->ctx=__ctx;                                            \
-        __list_entry->entry->allocHandle=malloc(sizeof(CUmemGenericAllocationHandle)); \
-        __list_entry->entry->bitmap=malloc(__CHUNK_SIZE__);                        \
-        memset(__list_entry->entry->bitmap,0,__CHUNK_SIZE__);                      \
-        __LIST_INIT(__list_entry->entry->region_allocs);                           \
-        region_fill(__list_entry->entry,0,__size);                                 \
-        __list_entry->next=NULL;                                                   \
-        __list_entry->prev=NULL;                                                   \
-    }while(0);                                                                     
-
-#define LIST_ADD(list,__entry) { \
-    if (list->head == NULL) {    \
-        list->head = __entry;    \
-        list->tail = __entry;    \
-        list->length=1;          \
-    }else{                      \
-        __entry->prev = list->tail; \
-        list->tail->next=__entry;   \
-        list->tail = __entry;       \
-        list->length++;             \
-    }                               \
-}                                   
-
+// Allocation records, from a per-thread cache of slabs, see allocated_slab.c
+allocated_device_memory *allocated_entry_alloc();
+void allocated_entry_free(allocated_device_memory *e);
+
+// Allocation table, see allocated_table.c
+int allocated_table_init(allocated_table *table);
+int allocated_table_insert(allocated_table *table, allocated_device_memory *entry);
+// Unlink the record of an allocation starting at address, NULL if there is none
+allocated_device_memory *allocated_table_remove(allocated_table *table, CUdeviceptr address);
+allocated_device_memory *allocated_table_find(allocated_table *table, CUdeviceptr address);
+void allocated_table_foreach(allocated_table *table, void (*fn)(allocated_device_memory *, void *), void *arg);
+
+// Range index, see allocated_table.c. Callers hold its lock, shared for lookups.
+int allocated_index_init(allocated_index *index);
+void allocated_index_insert(allocated_index *index, allocated_device_memory *entry);
+void allocated_index_remove(allocated_index *index, allocated_device_memory *entry);
+// Record of the allocation containing address, its end included
+allocated_device_memory *allocated_index_find_range(allocated_index *index, CUdeviceptr address);
+// Record with the lowest address not below address
+allocated_device_memory *allocated_index_lower_bound(allocated_index *index, CUdeviceptr address);
+
+// Regions, see allocated_region.c
+void region_init();
+// Whether an allocation of size on dev is carved out of a region
+int region_carves(CUdevice dev, size_t size);
+// Carve size bytes for the record e out of a region of its device and
+// context, allocating a region if none has room. NULL when out of memory.
+region *region_carve(allocated_device_memory *e, size_t size);
+// Give the slot of e back to its region, and an empty region to the driver
+void region_release(allocated_device_memory *e);
+// Drop the regions of ctx on dev, or on every device if dev is -1, with the
+// allocations carved from them, as the context is destroyed with its
+// memory. Returns the bytes given back to the quota.
+size_t region_flush(int dev, CUcontext ctx);
+
+// Allocation cache, see allocated_cache.c
+void allocated_cache_init();
+// Size an allocation of size on dev is made with to be cached, 0 if it is not cached
+size_t allocated_cache_class(CUdevice dev, size_t size);
+// A cached allocation of class size csize made in ctx, NULL if there is none
+allocated_device_memory *allocated_cache_take(CUdevice dev, CUcontext ctx, size_t csize);
+// Keep a freed ALLOCATED_CACHEABLE allocation, it stays charged
+void allocated_cache_put(allocated_device_memory *e);
+// Free the cached allocations of dev, or of every device if dev is -1.
+// Returns the bytes given back to the driver and the quota.
+size_t allocated_cache_flush(int dev);
+// The same for the allocations made in ctx, before it is destroyed
+size_t allocated_cache_flush_ctx(CUcontext ctx);
 
 int getallochandle(CUmemGenericAllocationHandle *handle, size_t size, size_t *allocsize);
 
 // Check result of Allocator
 CUresult view_vgpu_allocator();
 
-// Checks if oom
-int oom_check(const int dev,size_t addon);
+// Checks if oom. Denials are recorded as OOM events of api, a SHRREG_API_*
+int oom_check(const int dev,size_t addon,int api);
+// Charge size against the device limit before allocating it, 1 if it does
+// not fit. unreserve_memory() rolls back when the allocation fails.
+int reserve_memory(const int dev, size_t size, int api);
+void unreserve_memory(const int dev, size_t size);
 
 // Allocate and free device memory
 int allocate_raw(CUdeviceptr *dptr, size_t size);
 int free_raw(CUdeviceptr dptr);
 int add_chunk_only(CUdeviceptr address, size_t size, CUdevice dev);
 int remove_chunk_only(CUdeviceptr address);
+// Forget the allocations from start to start + size, their memory already freed
+void remove_chunk_range(CUdeviceptr start, size_t size);
 int allocate_async_raw(CUdeviceptr *dptr, size_t size, CUstream hStream);
 int free_raw_async(CUdeviceptr dptr, CUstream hStream);
 
 // Checks memory type
 int check_memory_type(CUdeviceptr address);
+// Range of the allocation holding address if it was carved from a region,
+// 0 when it was. Either pointer may be NULL.
+int region_address_range(CUdeviceptr address, CUdeviceptr *base, size_t *size);
 
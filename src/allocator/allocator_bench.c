@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "allocator.h"
+#include "include/libcuda_hook.h"
+#include "multiprocess/multiprocess_memory_limit.h"
+
+/*
+ * Allocator benchmark against a stub driver. The driver calls the
+ * allocator makes are counted instead of made and the quota is a local
+ * counter, so the allocator alone is measured, without a GPU. It
+ * allocates [count] buffers of 256 bytes to 256 KiB, frees and
+ * reallocates them at random, then drops the context. Run once plain,
+ * once with CUDA_DEVICE_MEMORY_SUBALLOC=1 and once with
+ * CUDA_DEVICE_MEMORY_CACHING=1 to compare the driver calls and the memory
+ * charged; nothing may be left charged at the end.
+ * Usage: allocator-bench [count]
+ */
+
+#define BENCH_CHURN 200000
+
+static long driver_allocs, driver_frees, driver_syncs;
+static CUdeviceptr next_address = 0x700000000000ULL;
+static CUcontext bench_ctx = (CUcontext)0x1;
+static size_t charged;
+
+// The driver hands out 2 MB pages
+static CUresult stub_alloc(CUdeviceptr *dptr, size_t size) {
+    driver_allocs++;
+    *dptr = next_address;
+    next_address += (size + 0x1fffff) & ~0x1fffffULL;
+    return CUDA_SUCCESS;
+}
+
+static CUresult stub_free(CUdeviceptr dptr) {
+    driver_frees++;
+    return CUDA_SUCCESS;
+}
+
+static CUresult stub_sync() {
+    driver_syncs++;
+    return CUDA_SUCCESS;
+}
+
+cuda_entry_t cuda_library_entry[CUDA_ENTRY_END];
+
+CUresult cuCtxGetDevice(CUdevice *device) {
+    *device = 0;
+    return CUDA_SUCCESS;
+}
+
+CUresult cuCtxGetCurrent(CUcontext *pctx) {
+    *pctx = bench_ctx;
+    return CUDA_SUCCESS;
+}
+
+CUresult cuMemoryAllocate(CUdeviceptr *dptr, size_t bytesize, void *data) {
+    return stub_alloc(dptr, bytesize);
+}
+
+CUresult cuMemoryFree(CUdeviceptr dptr) {
+    return stub_free(dptr);
+}
+
+// The shared region of a single process without a limit
+int reserve_gpu_device_memory_usage(int32_t pid, int dev, size_t usage, int type) {
+    charged += usage;
+    return 0;
+}
+
+int add_gpu_device_memory_usage(int32_t pid, int dev, size_t usage, int type) {
+    charged += usage;
+    return 0;
+}
+
+int rm_gpu_device_memory_usage(int32_t pid, int dev, size_t usage, int type) {
+    charged -= usage;
+    return 0;
+}
+
+size_t get_gpu_memory_usage(const int dev) { return charged; }
+uint64_t get_current_device_memory_usage(const int dev) { return charged; }
+uint64_t get_current_device_memory_limit(const int dev) { return 0; }
+uint64_t get_current_group_memory_limit(const int dev) { return 0; }
+uint64_t get_current_group_memory_usage(const int dev) { return 0; }
+size_t get_gpu_memory_lease(const int dev) { return 0; }
+int reap_dead_proc_slots() { return 0; }
+size_t reclaim_gpu_memory_leases(const int dev) { return 0; }
+void shrreg_record_oom(int dev, size_t requested, int api) {}
+int shrreg_request_cache_flush(int timeout_ms) { return 0; }
+int32_t shrreg_register_cache_flusher() { return 0; }
+void shrreg_unregister_cache_flusher() {}
+int32_t shrreg_cache_flush_seq() { return 0; }
+void shrreg_wait_cache_flush(int32_t seq, int timeout_ms) { usleep(timeout_ms * 1000); }
+void shrreg_ack_cache_flush(int32_t seq) {}
+
+extern void allocator_init();
+
+static double elapsed_us(struct timespec *t0, struct timespec *t1) {
+    return (t1->tv_sec - t0->tv_sec) * 1e6 + (t1->tv_nsec - t0->tv_nsec) / 1e3;
+}
+
+static size_t random_size() {
+    return (size_t)256 << (rand() % 11);
+}
+
+int main(int argc, char *argv[]) {
+    int count = argc > 1 ? atoi(argv[1]) : 20000;
+    cuda_library_entry[OVERRIDE_cuMemAlloc_v2].fn_ptr = stub_alloc;
+    cuda_library_entry[OVERRIDE_cuMemFree_v2].fn_ptr = stub_free;
+    cuda_library_entry[OVERRIDE_cuCtxSynchronize].fn_ptr = stub_sync;
+    cuda_library_entry[OVERRIDE_cuCtxGetCurrent].fn_ptr = cuCtxGetCurrent;
+    allocator_init();
+
+    CUdeviceptr *ptrs = malloc(count * sizeof(CUdeviceptr));
+    size_t requested = 0;
+    struct timespec t0, t1;
+    int i;
+    srand(1);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < count; i++) {
+        size_t size = random_size();
+        if (allocate_raw(&ptrs[i], size) != 0) {
+            fprintf(stderr, "allocation %d of %lu bytes failed\n", i, size);
+            return 1;
+        }
+        requested += size;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("alloc: %8.3f us per alloc, %ld driver allocs, %lu MB charged for %lu MB\n",
+        elapsed_us(&t0, &t1) / count, driver_allocs, charged >> 20, requested >> 20);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < BENCH_CHURN; i++) {
+        int k = rand() % count;
+        free_raw(ptrs[k]);
+        if (allocate_raw(&ptrs[k], random_size()) != 0) {
+            fprintf(stderr, "reallocation %d failed\n", i);
+            return 1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("churn: %8.3f us per free and alloc, %ld driver allocs, %ld frees, %ld syncs, %lu MB charged\n",
+        elapsed_us(&t0, &t1) / BENCH_CHURN, driver_allocs, driver_frees, driver_syncs, charged >> 20);
+
+    // Free the driver allocations and leave the carved ones to the context,
+    // destroying it must give back their regions and the cached allocations
+    char *carved = calloc(count, 1);
+    for (i = 0; i < count; i++) {
+        carved[i] = region_address_range(ptrs[i], NULL, NULL) == 0;
+        if (!carved[i])
+            free_raw(ptrs[i]);
+    }
+    size_t dropped = allocated_cache_flush_ctx(bench_ctx) + region_flush(-1, bench_ctx);
+    for (i = 0; i < count; i++)
+        if (carved[i] && check_memory_type(ptrs[i]) != CU_MEMORYTYPE_HOST) {
+            fprintf(stderr, "allocation %d still tracked after its context was destroyed\n", i);
+            return 1;
+        }
+    printf("context destroyed: %lu MB cached and in regions given back, %lu bytes left charged\n",
+        dropped >> 20, charged);
+    free(carved);
+    free(ptrs);
+    return charged == 0 ? 0 : 1;
+}
@@ -3,7 +3,11 @@
 
 extern size_t context_size;
 extern int ctx_activate[16];
+extern size_t allocated_cache_flush_ctx(CUcontext ctx);
+extern size_t region_flush(int dev, CUcontext ctx);
 
+// References to the primary context of each device taken through the hook
+static _Atomic int primary_retains[CUDA_DEVICE_MAX_COUNT];
 
 CUresult cuDevicePrimaryCtxGetState( CUdevice dev, unsigned int* flags, int* active ){
     LOG_DEBUG("into cuDevicePrimaryCtxGetState dev=%d",dev);
@@ -15,6 +19,8 @@ CUresult cuDevicePrimaryCtxRetain(CUcontext *pctx, CUdevice dev){
     LOG_INFO("dev=%d context_size=%ld",dev,context_size);
     //for Initialization only
     CUresult res = CUDA_OVERRIDE_CALL(cuda_library_entry,cuDevicePrimaryCtxRetain,pctx,dev);
+    if (res == CUDA_SUCCESS && dev >= 0 && dev < CUDA_DEVICE_MAX_COUNT)
+        atomic_fetch_add(&primary_retains[dev], 1);
     if (ctx_activate[dev] == 0) {
         add_gpu_device_memory_usage(getpid(),dev,context_size,0); 
     }
@@ -35,7 +41,29 @@ CUresult cuDevicePrimaryCtxRelease_v2( CUdevice dev ){
         rm_gpu_device_memory_usage(getpid(),dev,context_size,0);
     }
     ctx_activate[dev] = 0;
+    // Handle of the primary context, to drop its regions if this is the last reference
+    CUcontext primary = NULL;
+    unsigned int flags;
+    int active = 0;
+    if (CUDA_OVERRIDE_CALL(cuda_library_entry,cuDevicePrimaryCtxGetState,dev,&flags,&active) == CUDA_SUCCESS &&
+        active &&
+        CUDA_OVERRIDE_CALL(cuda_library_entry,cuDevicePrimaryCtxRetain,&primary,dev) == CUDA_SUCCESS)
+        CUDA_OVERRIDE_CALL(cuda_library_entry,cuDevicePrimaryCtxRelease_v2,dev);
+    // Cached allocations cannot outlive their context, and are freed
+    // through it: flush them before the last reference goes. References
+    // taken around the hook only make this happen early.
+    int retains = 0;
+    if (dev >= 0 && dev < CUDA_DEVICE_MAX_COUNT) {
+        retains = atomic_load(&primary_retains[dev]);
+        while (retains > 0 && !atomic_compare_exchange_weak(&primary_retains[dev], &retains, retains - 1));
+    }
+    if (primary != NULL && retains <= 1)
+        allocated_cache_flush_ctx(primary);
     CUresult res = CUDA_OVERRIDE_CALL(cuda_library_entry,cuDevicePrimaryCtxRelease_v2,dev);
+    if (res == CUDA_SUCCESS && primary != NULL &&
+        CUDA_OVERRIDE_CALL(cuda_library_entry,cuDevicePrimaryCtxGetState,dev,&flags,&active) == CUDA_SUCCESS &&
+        !active)
+        region_flush(dev, primary);
     return res;
 }
 
@@ -66,6 +94,8 @@ CUresult cuCtxCreate_v4(CUcontext* pctx, CUctxCreateParams* ctxCreateParams, uns
 
 CUresult cuCtxDestroy_v2 ( CUcontext ctx ){
     LOG_DEBUG("into cuCtxDestroy_v2 ctx=%p",ctx);
+    allocated_cache_flush_ctx(ctx);
+    region_flush(-1, ctx);
     return CUDA_OVERRIDE_CALL(cuda_library_entry,cuCtxDestroy_v2,ctx);
 }
 
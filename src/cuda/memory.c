@@ -47,11 +47,11 @@ const size_t cuarray_format_bytes[33] = {
 extern size_t round_up(size_t size,size_t align);
 extern void rate_limiter(int grids, int blocks);
 
-int check_oom() {
+int check_oom(int api) {
 //    return 0;
     CUdevice dev;
     CHECK_DRV_API(cuCtxGetDevice(&dev));
-    return oom_check(dev,0);
+    return oom_check(dev,0,api);
 }
 
 uint64_t compute_3d_array_alloc_bytes(const CUDA_ARRAY3D_DESCRIPTOR* desc) {
@@ -133,7 +133,7 @@ CUresult cuMemAllocHost_v2(void** hptr, size_t bytesize) {
     if (res != CUDA_SUCCESS) {
         return res;
     }
-    if (check_oom()) {
+    if (check_oom(SHRREG_API_MEM_ALLOC_HOST)) {
         CUDA_OVERRIDE_CALL(cuda_library_entry,cuMemFreeHost, *hptr);
         return CUDA_ERROR_OUT_OF_MEMORY;
     }
@@ -145,12 +145,18 @@ CUresult cuMemAllocManaged(CUdeviceptr* dptr, size_t bytesize, unsigned int flag
     ENSURE_RUNNING();
     CUdevice dev;
     CHECK_DRV_API(cuCtxGetDevice(&dev));
-    if (oom_check(dev,bytesize)){
+    if (reserve_memory(dev,bytesize,SHRREG_API_MEM_ALLOC_MANAGED)){
         return CUDA_ERROR_OUT_OF_MEMORY;
     }
     CUresult res = CUDA_OVERRIDE_CALL(cuda_library_entry,cuMemAllocManaged, dptr, bytesize, flags);
     if (res == CUDA_SUCCESS) {
-        add_chunk_only(*dptr, bytesize, dev);
+        if (add_chunk_only(*dptr, bytesize, dev) != 0) {
+            CUDA_OVERRIDE_CALL(cuda_library_entry,cuMemFree_v2,*dptr);
+            unreserve_memory(dev,bytesize);
+            return CUDA_ERROR_OUT_OF_MEMORY;
+        }
+    } else {
+        unreserve_memory(dev,bytesize);
     }
     return res;
 }
@@ -163,12 +169,18 @@ CUresult cuMemAllocPitch_v2(CUdeviceptr* dptr, size_t* pPitch, size_t WidthInByt
     ENSURE_RUNNING();
     CUdevice dev;
     CHECK_DRV_API(cuCtxGetDevice(&dev));
-    if (oom_check(dev,bytesize)){
+    if (reserve_memory(dev,bytesize,SHRREG_API_MEM_ALLOC_PITCH)){
         return CUDA_ERROR_OUT_OF_MEMORY;
     }
     CUresult res = CUDA_OVERRIDE_CALL(cuda_library_entry,cuMemAllocPitch_v2, dptr, pPitch, WidthInBytes, Height, ElementSizeBytes);
     if (res == CUDA_SUCCESS) {
-        add_chunk_only(*dptr, bytesize, dev);
+        if (add_chunk_only(*dptr, bytesize, dev) != 0) {
+            CUDA_OVERRIDE_CALL(cuda_library_entry,cuMemFree_v2,*dptr);
+            unreserve_memory(dev,bytesize);
+            return CUDA_ERROR_OUT_OF_MEMORY;
+        }
+    } else {
+        unreserve_memory(dev,bytesize);
     }
     return res;
 }
@@ -201,7 +213,7 @@ CUresult cuMemHostAlloc(void** hptr, size_t bytesize, unsigned int flags) {
     if (res != CUDA_SUCCESS) {
         return res;
     }
-    if (check_oom()) {
+    if (check_oom(SHRREG_API_MEM_HOST_ALLOC)) {
         CUDA_OVERRIDE_CALL(cuda_library_entry,cuMemFreeHost, *hptr);
         *hptr = NULL;
         return CUDA_ERROR_OUT_OF_MEMORY;
@@ -226,7 +238,7 @@ CUresult cuMemHostRegister_v2(void* hptr, size_t bytesize, unsigned int flags) {
     if (res != CUDA_SUCCESS) {
         return res;
     }
-    if (check_oom()) {
+    if (check_oom(SHRREG_API_MEM_HOST_REGISTER)) {
         CUDA_OVERRIDE_CALL(cuda_library_entry,cuMemHostUnregister, hptr);
         return CUDA_ERROR_OUT_OF_MEMORY;
     }
@@ -307,6 +319,8 @@ CUresult cuIpcCloseMemHandle(CUdeviceptr dptr){
 CUresult cuIpcGetMemHandle(CUipcMemHandle* pHandle, CUdeviceptr dptr) {
     LOG_MSG("cuIpcGetMemHandle dptr=%llx", dptr);
     ENSURE_RUNNING();
+    if (region_address_range(dptr, NULL, NULL) == 0)
+        LOG_WARN("cuIpcGetMemHandle: %llx was carved from a region, the handle maps the whole region", dptr);
     return CUDA_OVERRIDE_CALL(cuda_library_entry,cuIpcGetMemHandle,pHandle,dptr);
 }
 
@@ -318,9 +332,11 @@ CUresult cuIpcOpenMemHandle_v2 ( CUdeviceptr* pdptr, CUipcMemHandle handle, unsi
 
 
 CUresult cuMemGetAddressRange_v2( CUdeviceptr* pbase, size_t* psize, CUdeviceptr dptr ){
-    //TODO: Translate back
     LOG_DEBUG("cuMemGetAddressRange_v2,dptr=%llx",dptr);
     ENSURE_RUNNING();
+    // The driver only knows the region an allocation was carved from
+    if (region_address_range(dptr, pbase, psize) == 0)
+        return CUDA_SUCCESS;
     CUresult res = CUDA_OVERRIDE_CALL(cuda_library_entry,cuMemGetAddressRange_v2,pbase,psize,dptr);
     return res;
 }
@@ -523,7 +539,7 @@ CUresult cuMipmappedArrayCreate(CUmipmappedArray* pHandle,
     if (res != CUDA_SUCCESS) {
         return res;
     }
-    if (check_oom()) {
+    if (check_oom(SHRREG_API_MIPMAPPED_ARRAY_CREATE)) {
         CUDA_OVERRIDE_CALL(cuda_library_entry,cuMipmappedArrayDestroy, *pHandle);
         return CUDA_ERROR_OUT_OF_MEMORY;
     }
@@ -590,13 +606,19 @@ CUresult cuMemCreate ( CUmemGenericAllocationHandle* handle, size_t size, const
     if (do_oom_check && cuCtxGetDevice(&dev) != CUDA_SUCCESS) {
         dev = prop->location.id;
     }
-    if (do_oom_check && oom_check(dev, size)) {
+    if (do_oom_check && reserve_memory(dev, size, SHRREG_API_MEM_CREATE)) {
         return CUDA_ERROR_OUT_OF_MEMORY;
     }
     CUresult res = CUDA_OVERRIDE_CALL(cuda_library_entry,
         cuMemCreate, handle, size, prop, flags);
     if (do_oom_check && res == CUDA_SUCCESS) {
-        add_chunk_only(*handle, size, dev);
+        if (add_chunk_only(*handle, size, dev) != 0) {
+            CUDA_OVERRIDE_CALL(cuda_library_entry, cuMemRelease, *handle);
+            unreserve_memory(dev, size);
+            return CUDA_ERROR_OUT_OF_MEMORY;
+        }
+    } else if (do_oom_check) {
+        unreserve_memory(dev, size);
     }
     return res;
 }
@@ -17,11 +17,13 @@
 #define ENSURE_INITIALIZED() ensure_initialized();        \
 
 extern int wait_status_self(int status);
+extern int wait_status_self_timeout(int status, int timeout_ms);
 
+// Blocks while the process is suspended, woken by the resume itself
 #define ENSURE_RUNNING() {                                \
    /* LOG_DEBUG("Memory op at %d",__LINE__); */              \
     ensure_initialized();                                 \
-    while(!wait_status_self(1)) { LOG_DEBUG("E1"); sleep(1); }             \
+    while(!wait_status_self_timeout(1, 1000)) { LOG_DEBUG("E1"); }             \
 }                                                         \
 
 #define INC_MEMORY_OR_RETURN_ERROR(bytes) {               \
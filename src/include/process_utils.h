@@ -5,6 +5,8 @@
 #include <dirent.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <sys/stat.h>
 
 #define BUFFER_LENGTH 8192  // ensure larger than linux max filename length
 #define FILENAME_LENGTH 8192
@@ -14,7 +16,7 @@
 #define PROC_STATE_UNKNOWN 2
 
 
-int proc_alive(int32_t pid) {
+static inline int proc_alive(int32_t pid) {
     char filename[FILENAME_LENGTH] = {0};
     snprintf(filename, sizeof(filename), "/proc/%d/stat", pid);
 
@@ -39,5 +41,12 @@ int proc_alive(int32_t pid) {
     return res;
 }
 
+// Inode of the pid namespace of the calling process, 0 if /proc does not tell
+static inline uint64_t proc_pid_namespace() {
+    struct stat st;
+    if (stat("/proc/self/ns/pid", &st) != 0)
+        return 0;
+    return (uint64_t)st.st_ino;
+}
 
 #endif  // __UTILS_PROCESS_UTILS_H__
@@ -14,6 +14,8 @@
 #include "multiprocess/multiprocess_memory_limit.h"
 
 extern void init_utilization_watcher(void);
+extern void init_proc_reaper(void);
+extern void init_limits_watcher(void);
 extern void utilization_watcher(void);
 extern void initial_virtual_map(void); 
 extern int set_host_pid(int hostpid);
@@ -919,6 +921,8 @@ void postInit(){
     //add_gpu_device_memory_usage(getpid(),0,context_size,0);
     env_utilization_switch = set_env_utilization_switch();
     init_utilization_watcher();
+    init_proc_reaper();
+    init_limits_watcher();
 }
 
 void childReinitPostInit() {
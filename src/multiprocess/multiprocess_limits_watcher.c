@@ -0,0 +1,144 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "include/log_utils.h"
+#include "multiprocess/multiprocess_memory_limit.h"
+#include "multiprocess/multiprocess_limits_watcher.h"
+
+/*
+ * Hot-reloadable limits. The file named by CUDA_DEVICE_LIMITS_FILE_ENV is
+ * watched by a single process of the region, the limits owner, through
+ * inotify on its directory so that editors replacing the file and
+ * Kubernetes swapping a ConfigMap's "..data" link are seen as well. The
+ * owner stores changed limits in the region and bumps the limits
+ * generation, a futex the other processes' watchers sleep on. An owner
+ * that dies is replaced within SHRREG_LIMITS_OWNER_CHECK_MS.
+ */
+
+static pid_t limits_watcher_owner = 0;
+static char limits_path[PATH_MAX];
+static int32_t seen_generation = 0;
+
+int limits_watcher_enabled() {
+    char* path = getenv(CUDA_DEVICE_LIMITS_FILE_ENV);
+    return path != NULL && path[0] != '\0';
+}
+
+static void refresh_if_changed() {
+    int32_t generation = shrreg_limits_generation();
+    if (generation == seen_generation)
+        return;
+    seen_generation = generation;
+    shrreg_refresh_limits();
+    refresh_sm_limits();
+    LOG_INFO("Limits refreshed, generation %d", generation);
+}
+
+static void reload_limits() {
+    // A missing file leaves the limits as they are
+    if (load_limits_from_file(limits_path) > 0)
+        LOG_INFO("Limits reloaded from %s", limits_path);
+    refresh_if_changed();
+}
+
+// Whether an event in the directory may have changed the limits file
+static int is_limits_event(const struct inotify_event* ev, const char* base) {
+    if (ev->len == 0)
+        return 0;
+    return strcmp(ev->name, base) == 0 || strncmp(ev->name, "..", 2) == 0;
+}
+
+/**
+ * Watch the limits file until inotify fails. The directory is watched
+ * rather than the file, which an editor or a ConfigMap update replaces.
+ */
+static void run_limits_owner() {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", limits_path);
+    char* slash = strrchr(dir, '/');
+    const char* base = limits_path;
+    if (slash == NULL) {
+        snprintf(dir, sizeof(dir), ".");
+    } else {
+        base = limits_path + (slash - dir) + 1;
+        if (slash == dir)
+            slash++;
+        *slash = '\0';
+    }
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0) {
+        LOG_WARN("inotify unavailable (errno=%d), limits file %s is not watched", errno, limits_path);
+        return;
+    }
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int wd = -1;
+    while (1) {
+        if (wd < 0) {
+            wd = inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE_SELF);
+            if (wd < 0) {
+                LOG_DEBUG("Fail to watch %s: errno=%d", dir, errno);
+                usleep(SHRREG_LIMITS_RETRY_MS * 1000);
+                continue;
+            }
+            // Changes made while nothing watched
+            reload_limits();
+        }
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            LOG_ERROR("Limits watcher read failed: errno=%d", errno);
+            break;
+        }
+        int changed = 0;
+        char* p;
+        for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+            struct inotify_event* ev = (struct inotify_event*)p;
+            if (ev->mask & IN_IGNORED)
+                wd = -1;  // Directory removed, watched again once it is back
+            else if (is_limits_event(ev, base))
+                changed = 1;
+        }
+        if (changed)
+            reload_limits();
+    }
+    close(fd);
+}
+
+static void* limits_watcher(void* arg) {
+    while (1) {
+        if (shrreg_claim_limits_owner()) {
+            LOG_INFO("Watching limits file %s", limits_path);
+            run_limits_owner();
+            // Let another process take over
+            shrreg_release_limits_owner();
+            usleep(SHRREG_LIMITS_RETRY_MS * 1000);
+            continue;
+        }
+        shrreg_wait_limits(seen_generation, SHRREG_LIMITS_OWNER_CHECK_MS);
+        refresh_if_changed();
+    }
+    return NULL;
+}
+
+void init_limits_watcher() {
+    // The watcher thread does not survive fork(), the child starts its own
+    if (limits_watcher_owner == getpid() || !limits_watcher_enabled())
+        return;
+    limits_watcher_owner = getpid();
+    snprintf(limits_path, sizeof(limits_path), "%s", getenv(CUDA_DEVICE_LIMITS_FILE_ENV));
+    // Cached limits were read after any earlier change
+    seen_generation = shrreg_limits_generation();
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, limits_watcher, NULL) != 0) {
+        LOG_WARN("Fail to start the limits watcher thread");
+        return;
+    }
+    pthread_detach(tid);
+}
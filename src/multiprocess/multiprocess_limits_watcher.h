@@ -0,0 +1,25 @@
+#ifndef __MULTIPROCESS_LIMITS_WATCHER_H__
+#define __MULTIPROCESS_LIMITS_WATCHER_H__
+
+// Longest wait of a limits watcher before it checks that the owner is alive
+#define SHRREG_LIMITS_OWNER_CHECK_MS 1000
+// Retry interval of the owner while the directory of the limits file is missing
+#define SHRREG_LIMITS_RETRY_MS 5000
+
+/**
+ * Start the limits watcher of this process if CUDA_DEVICE_LIMITS_FILE_ENV
+ * is set, once per process. One process of the region watches the file
+ * with inotify and publishes its limits with load_limits_from_file(); the
+ * others sleep on the limits generation and refresh their cached limits
+ * when it changes. Allocations keep reading the limits as before, nothing
+ * is polled on their path.
+ */
+void init_limits_watcher();
+
+// Whether CUDA_DEVICE_LIMITS_FILE_ENV is set, limits may then change at any time
+int limits_watcher_enabled();
+
+// Re-read the SM limits cached by the utilization watcher
+void refresh_sm_limits();
+
+#endif  // __MULTIPROCESS_LIMITS_WATCHER_H__
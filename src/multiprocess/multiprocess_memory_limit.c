@@ -11,6 +11,10 @@
 #include <unistd.h>
 #include <time.h>
 #include <signal.h>
+#include <sched.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include <assert.h>
 #include <cuda.h>
@@ -20,6 +24,7 @@
 #include "include/process_utils.h"
 #include "include/memory_limit.h"
 #include "multiprocess/multiprocess_memory_limit.h"
+#include "multiprocess/shrreg_legacy.h"
 
 
 #ifndef SEM_WAIT_TIME
@@ -30,10 +35,6 @@
 #define SEM_WAIT_TIME_ON_EXIT 3
 #endif
 
-#ifndef SEM_WAIT_RETRY_TIMES
-#define SEM_WAIT_RETRY_TIMES 30
-#endif
-
 // Longer timeout for postinit since set_task_pid() with adaptive polling can take several seconds
 #ifndef SEM_WAIT_TIME_POSTINIT
 #define SEM_WAIT_TIME_POSTINIT 30
@@ -62,23 +63,187 @@ int _record_kernel_interval = 1;
 void do_init_device_memory_limits(uint64_t*, int);
 void exit_withlock(int exitcode);
 
-void set_current_gpu_status(int status){
-    // Fast path: use cached slot if available
-    if (region_info.my_slot != NULL) {
-        atomic_store_explicit(&region_info.my_slot->status, status, memory_order_release);
+static inline int proc_slot_index(shrreg_proc_slot_t* slot) {
+    return slot - shrreg_procs(region_info.shared_region);
+}
+
+// Hot counters of a slot for one device, see shared_region_t.proc_used_offset
+static inline device_memory_t* proc_slot_used(shrreg_proc_slot_t* slot, int dev) {
+    return shrreg_proc_used(region_info.shared_region, dev, proc_slot_index(slot));
+}
+
+// Watcher-written values of a slot for one device
+static inline device_util_t* proc_slot_util(shrreg_proc_slot_t* slot, int dev) {
+    return shrreg_proc_util(region_info.shared_region, dev, proc_slot_index(slot));
+}
+
+// Peak and size histogram of a slot for one device, NULL before 2.8
+static inline device_memory_stats_t* proc_slot_stats(shrreg_proc_slot_t* slot, int dev) {
+    return shrreg_proc_stats(region_info.shared_region, dev, proc_slot_index(slot));
+}
+
+// Devices beyond the region's device_count are not tracked
+static inline int region_has_device(int dev) {
+    return dev >= 0 && (uint32_t)dev < region_info.shared_region->device_count;
+}
+
+/*
+ * pid/hostpid -> slot number index, see shrreg_proc_index_t.
+ * Writers hold lock_shrreg. Readers are lock-free and only trust an entry
+ * after checking the slot still carries the key, since slots can be
+ * compacted between the lookup and the check.
+ */
+#define PROC_INDEX_TOMBSTONE 0xffffffffu
+#define PROC_INDEX_ENTRY(key, slot) (((uint64_t)(uint32_t)(key) << 32) | (uint32_t)(slot))
+#define PROC_INDEX_KEY(entry) ((uint32_t)((entry) >> 32))
+#define PROC_INDEX_SLOT(entry) ((int)(uint32_t)(entry))
+
+static inline uint32_t proc_index_hash(shrreg_proc_index_t* index, int32_t key) {
+    return ((uint32_t)key * 2654435761u) & index->mask;
+}
+
+static inline int32_t proc_index_slot_key(shrreg_proc_slot_t* slot, int by_hostpid) {
+    return by_hostpid ? atomic_load_explicit(&slot->hostpid, memory_order_acquire)
+                      : atomic_load_explicit(&slot->pid, memory_order_acquire);
+}
+
+static shrreg_proc_slot_t* proc_index_lookup(shrreg_proc_index_t* index, int32_t key, int by_hostpid) {
+    shared_region_t* region = region_info.shared_region;
+    if (key <= 0)
+        return NULL;
+    int proc_num = atomic_load_explicit(&region->proc_num, memory_order_acquire);
+    uint32_t pos = proc_index_hash(index, key);
+    for (uint32_t probe = 0; probe <= index->mask; probe++) {
+        uint64_t entry = atomic_load_explicit(&index->entries[pos], memory_order_acquire);
+        if (entry == 0)
+            break;
+        if (PROC_INDEX_KEY(entry) == (uint32_t)key) {
+            int slot = PROC_INDEX_SLOT(entry);
+            shrreg_proc_slot_t* proc = &shrreg_procs(region)[slot];
+            // A pid is only meaningful in its pid namespace, other containers
+            // sharing the region may register the same one
+            if (slot < proc_num && proc_index_slot_key(proc, by_hostpid) == key &&
+                (by_hostpid || proc->pidns == region_info.pidns))
+                return proc;
+        }
+        pos = (pos + 1) & index->mask;
+    }
+    return NULL;
+}
+
+// Replace the entry (key, from) with (key, to); to == -1 leaves a tombstone
+static void proc_index_move(shrreg_proc_index_t* index, int32_t key, int from, int to) {
+    if (key <= 0)
         return;
+    uint64_t target = PROC_INDEX_ENTRY(key, from);
+    uint32_t pos = proc_index_hash(index, key);
+    for (uint32_t probe = 0; probe <= index->mask; probe++) {
+        uint64_t entry = atomic_load_explicit(&index->entries[pos], memory_order_relaxed);
+        if (entry == 0)
+            break;
+        if (entry == target) {
+            uint64_t next = to < 0 ? PROC_INDEX_ENTRY(PROC_INDEX_TOMBSTONE, 0) : PROC_INDEX_ENTRY(key, to);
+            atomic_store_explicit(&index->entries[pos], next, memory_order_release);
+            return;
+        }
+        pos = (pos + 1) & index->mask;
     }
+    LOG_WARN("Index entry for key %d slot %d not found", key, from);
+}
 
-    // Slow path: search for our slot
-    int proc_num = atomic_load_explicit(&region_info.shared_region->proc_num, memory_order_acquire);
+static inline void proc_index_remove(shrreg_proc_index_t* index, int32_t key, int slot) {
+    proc_index_move(index, key, slot, -1);
+}
+
+/**
+ * Rebuild an index from the live slots, dropping all tombstones.
+ * Lock-free readers racing with this may miss; it only runs after
+ * hundreds of slot removals.
+ */
+static void proc_index_rebuild(shrreg_proc_index_t* index, int by_hostpid);
+
+static void proc_index_insert(shrreg_proc_index_t* index, int32_t key, int slot, int by_hostpid) {
+    if (key <= 0)
+        return;
+    uint32_t pos = proc_index_hash(index, key);
+    for (;;) {
+        uint64_t entry = atomic_load_explicit(&index->entries[pos], memory_order_relaxed);
+        if (entry == 0 || PROC_INDEX_KEY(entry) == PROC_INDEX_TOMBSTONE) {
+            if (entry == 0)
+                index->used++;
+            // Release: the slot contents must be visible before the entry
+            atomic_store_explicit(&index->entries[pos], PROC_INDEX_ENTRY(key, slot), memory_order_release);
+            break;
+        }
+        pos = (pos + 1) & index->mask;
+    }
+    // Keep enough empty entries for misses to terminate quickly
+    if (index->used > (index->mask + 1) * 3 / 4)
+        proc_index_rebuild(index, by_hostpid);
+}
+
+static void proc_index_rebuild(shrreg_proc_index_t* index, int by_hostpid) {
+    shared_region_t* region = region_info.shared_region;
+    shrreg_proc_slot_t* procs = shrreg_procs(region);
     int i;
-    int32_t my_pid = getpid();
+    for (i = 0; i <= (int)index->mask; i++)
+        atomic_store_explicit(&index->entries[i], 0, memory_order_relaxed);
+    index->used = 0;
+    int proc_num = atomic_load_explicit(&region->proc_num, memory_order_acquire);
     for (i = 0; i < proc_num; i++) {
-        int32_t slot_pid = atomic_load_explicit(&region_info.shared_region->procs[i].pid, memory_order_acquire);
-        if (my_pid == slot_pid) {
-            atomic_store_explicit(&region_info.shared_region->procs[i].status, status, memory_order_release);
-            return;
-        }
+        int32_t key = by_hostpid ? atomic_load_explicit(&procs[i].hostpid, memory_order_relaxed)
+                                 : procs[i].indexed_pid;
+        if (key > 0)
+            proc_index_insert(index, key, i, by_hostpid);
+    }
+    LOG_DEBUG("Rebuilt %s index, %d entries", by_hostpid ? "hostpid" : "pid", index->used);
+}
+
+shrreg_proc_slot_t *find_proc_by_pid(int pid) {
+    return proc_index_lookup(shrreg_pid_index(region_info.shared_region), pid, 0);
+}
+
+shrreg_proc_slot_t *find_proc_by_hostpid(int hostpid) {
+    return proc_index_lookup(shrreg_hostpid_index(region_info.shared_region), hostpid, 1);
+}
+
+/**
+ * This process's slot. The cached pointer is revalidated because another
+ * process compacting the slot array may have moved us.
+ */
+static inline shrreg_proc_slot_t* get_my_slot() {
+    shrreg_proc_slot_t* slot = region_info.my_slot;
+    if (slot == NULL || atomic_load_explicit(&slot->pid, memory_order_acquire) == region_info.pid)
+        return slot;
+    slot = find_proc_by_pid(region_info.pid);
+    region_info.my_slot = slot;
+    return slot;
+}
+
+/*
+ * Futexes on words of the shared mapping, hence not FUTEX_PRIVATE_FLAG.
+ * Both calls are async-signal-safe, the status is set from signal handlers.
+ */
+static void futex_wait_shared(_Atomic int32_t* word, int32_t val, int timeout_ms) {
+    struct timespec ts = { timeout_ms / 1000, (long)(timeout_ms % 1000) * 1000000 };
+    syscall(SYS_futex, (int32_t*)word, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+// Returns the number of woken waiters
+static int futex_wake_shared(_Atomic int32_t* word) {
+    return (int)syscall(SYS_futex, (int32_t*)word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+void set_current_gpu_status(int status){
+    // Fast path: use cached slot if available
+    shrreg_proc_slot_t* slot = get_my_slot();
+    if (slot == NULL)
+        slot = find_proc_by_pid(getpid());
+    if (slot != NULL) {
+        atomic_store_explicit(&slot->status, status, memory_order_release);
+        futex_wake_shared(&slot->status);
+        atomic_fetch_add_explicit(&region_info.shared_region->status_seq, 1, memory_order_release);
+        futex_wake_shared(&region_info.shared_region->status_seq);
     }
 }
 
@@ -91,6 +256,8 @@ void sig_swap_stub(int signo){
 }
 
 
+static size_t parse_limit(const char* env_name, char* env_limit);
+
 // get device memory from env
 size_t get_limit_from_env(const char* env_name) {
     char* env_limit = getenv(env_name);
@@ -98,6 +265,11 @@ size_t get_limit_from_env(const char* env_name) {
         // fprintf(stderr, "No %s set in environment\n", env_name);
         return 0;
     }
+    return parse_limit(env_name, env_limit);
+}
+
+// Value of a limit named env_name, with an optional K, M or G suffix
+static size_t parse_limit(const char* env_name, char* env_limit) {
     size_t len = strlen(env_limit);
     if (len == 0) {
         // fprintf(stderr, "Empty %s set in environment\n", env_name);
@@ -139,10 +311,15 @@ int init_device_info() {
     unsigned int i,nvmlDevicesCount;
     CHECK_NVML_API(nvmlDeviceGetCount_v2(&nvmlDevicesCount));
     region_info.shared_region->device_num=nvmlDevicesCount;
+    if (nvmlDevicesCount > region_info.shared_region->device_count) {
+        LOG_WARN("%u devices visible but the shared region tracks %u, the rest are not limited",
+            nvmlDevicesCount, region_info.shared_region->device_count);
+        nvmlDevicesCount = region_info.shared_region->device_count;
+    }
     nvmlDevice_t dev;
     for(i=0;i<nvmlDevicesCount;i++){
         CHECK_NVML_API(nvmlDeviceGetHandleByIndex(i, &dev));
-        CHECK_NVML_API(nvmlDeviceGetUUID(dev,region_info.shared_region->uuids[i],NVML_DEVICE_UUID_V2_BUFFER_SIZE));
+        CHECK_NVML_API(nvmlDeviceGetUUID(dev,shrreg_uuids(region_info.shared_region)[i],NVML_DEVICE_UUID_V2_BUFFER_SIZE));
     }
     LOG_INFO("put_device_info finished %d",nvmlDevicesCount);
     return 0;
@@ -175,6 +352,234 @@ int load_env_from_file(char *filename) {
     return 0;
 }
 
+int load_limits_from_file(const char* filename) {
+    FILE* f = fopen(filename, "r");
+    if (f == NULL)
+        return -1;
+    uint64_t memory_limits[CUDA_DEVICE_MAX_COUNT];
+    uint64_t sm_limits[CUDA_DEVICE_MAX_COUNT];
+    uint64_t memory_fallback = SHRREG_LIMIT_UNSET;
+    uint64_t sm_fallback = SHRREG_LIMIT_UNSET;
+    size_t memory_len = strlen(CUDA_DEVICE_MEMORY_LIMIT);
+    size_t sm_len = strlen(CUDA_DEVICE_SM_LIMIT);
+    char line[1024];
+    int dev;
+    for (dev = 0; dev < CUDA_DEVICE_MAX_COUNT; dev++) {
+        memory_limits[dev] = SHRREG_LIMIT_UNSET;
+        sm_limits[dev] = SHRREG_LIMIT_UNSET;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char* value = strchr(line, '=');
+        if (value == NULL)
+            continue;
+        *value++ = '\0';
+        uint64_t* limits;
+        uint64_t* fallback;
+        size_t prefix;
+        if (strncmp(line, CUDA_DEVICE_MEMORY_LIMIT, memory_len) == 0) {
+            limits = memory_limits;
+            fallback = &memory_fallback;
+            prefix = memory_len;
+        } else if (strncmp(line, CUDA_DEVICE_SM_LIMIT, sm_len) == 0) {
+            limits = sm_limits;
+            fallback = &sm_fallback;
+            prefix = sm_len;
+        } else {
+            continue;
+        }
+        uint64_t limit = value[0] == '\0' ? 0 : parse_limit(line, value);
+        if (line[prefix] == '\0') {
+            *fallback = limit;
+        } else if (line[prefix] == '_' && isdigit((unsigned char)line[prefix + 1])) {
+            dev = atoi(line + prefix + 1);
+            if (dev < CUDA_DEVICE_MAX_COUNT)
+                limits[dev] = limit;
+        }
+    }
+    fclose(f);
+    for (dev = 0; dev < CUDA_DEVICE_MAX_COUNT; dev++) {
+        // Like in the environment, a device set to 0 falls back to the unindexed key
+        if ((memory_limits[dev] == SHRREG_LIMIT_UNSET || memory_limits[dev] == 0) &&
+            memory_fallback != SHRREG_LIMIT_UNSET)
+            memory_limits[dev] = memory_fallback;
+        if ((sm_limits[dev] == SHRREG_LIMIT_UNSET || sm_limits[dev] == 0) && sm_fallback != SHRREG_LIMIT_UNSET)
+            sm_limits[dev] = sm_fallback;
+        // No SM limit is stored as 100%, see do_init_device_sm_limits()
+        if (sm_limits[dev] == 0)
+            sm_limits[dev] = 100;
+    }
+    return shrreg_publish_limits(memory_limits, sm_limits, CUDA_DEVICE_MAX_COUNT);
+}
+
+/**
+ * Limits are plain words read on every check, so a store is all the
+ * allocation path needs. Values a process derives from them, cached SM
+ * limits and lease sizes, are refreshed by its limits watcher when the
+ * generation changes.
+ */
+int shrreg_publish_limits(const uint64_t* memory_limits, const uint64_t* sm_limits, int count) {
+    ensure_initialized();
+    shared_region_t* region = region_info.shared_region;
+    int changed = 0;
+    int dev;
+    lock_shrreg();
+    for (dev = 0; dev < count && dev < (int)region->device_count; dev++) {
+        if (memory_limits[dev] != SHRREG_LIMIT_UNSET && memory_limits[dev] != shrreg_limit(region)[dev]) {
+            LOG_INFO("Memory limit of device %d: %lu -> %lu", dev, shrreg_limit(region)[dev], memory_limits[dev]);
+            shrreg_limit(region)[dev] = memory_limits[dev];
+            changed++;
+        }
+        if (sm_limits[dev] != SHRREG_LIMIT_UNSET && sm_limits[dev] != shrreg_sm_limit(region)[dev]) {
+            LOG_INFO("SM limit of device %d: %lu -> %lu", dev, shrreg_sm_limit(region)[dev], sm_limits[dev]);
+            shrreg_sm_limit(region)[dev] = sm_limits[dev];
+            changed++;
+        }
+    }
+    if (changed > 0) {
+        atomic_fetch_add_explicit(&region->limits_generation, 1, memory_order_release);
+        futex_wake_shared(&region->limits_generation);
+    }
+    unlock_shrreg();
+    return changed > 0;
+}
+
+int32_t shrreg_limits_generation() {
+    ensure_initialized();
+    return atomic_load_explicit(&region_info.shared_region->limits_generation, memory_order_acquire);
+}
+
+void shrreg_wait_limits(int32_t generation, int timeout_ms) {
+    ensure_initialized();
+    futex_wait_shared(&region_info.shared_region->limits_generation, generation, timeout_ms);
+}
+
+int shrreg_claim_limits_owner() {
+    ensure_initialized();
+    shared_region_t* region = region_info.shared_region;
+    int32_t owner = atomic_load_explicit(&region->limits_owner, memory_order_acquire);
+    if (owner == region_info.pid)
+        return 1;
+    if (owner != 0 && proc_alive(owner) != PROC_STATE_NONALIVE)
+        return 0;
+    return atomic_compare_exchange_strong_explicit(&region->limits_owner, &owner, region_info.pid,
+                                                   memory_order_acq_rel, memory_order_relaxed);
+}
+
+void shrreg_release_limits_owner() {
+    ensure_initialized();
+    int32_t owner = region_info.pid;
+    atomic_compare_exchange_strong_explicit(&region_info.shared_region->limits_owner, &owner, 0,
+                                            memory_order_release, memory_order_relaxed);
+}
+
+/**
+ * Cached allocations are device memory of the process holding them, so
+ * only that process can free them. Each caching process flags its slot
+ * and runs a thread sleeping on cache_flush_seq, which records in the slot
+ * the last request it answered. A request waits for the answers of the
+ * flagged slots but the requester's own; a slot whose process died is
+ * removed by the reaper, and with it the wait for its answer.
+ */
+int shrreg_request_cache_flush(int timeout_ms) {
+    ensure_initialized();
+    shared_region_t* region = region_info.shared_region;
+    shrreg_proc_slot_t* mine = get_my_slot();
+    int32_t others = atomic_load_explicit(&region->caching_procs, memory_order_acquire);
+    if (mine != NULL && (mine->flags & SHRREG_SLOT_CACHING))
+        others--;
+    if (others <= 0)
+        return 0;
+    int32_t seq = atomic_fetch_add_explicit(&region->cache_flush_seq, 1, memory_order_acq_rel) + 1;
+    futex_wake_shared(&region->cache_flush_seq);
+    struct timespec now, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += (long)timeout_ms * 1000000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+    shrreg_proc_slot_t* procs = shrreg_procs(region);
+    int asked;
+    while (1) {
+        int32_t acks = atomic_load_explicit(&region->cache_flush_acks, memory_order_acquire);
+        int proc_num = atomic_load_explicit(&region->proc_num, memory_order_acquire);
+        int i, pending = 0;
+        asked = 0;
+        for (i = 0; i < proc_num; i++) {
+            int32_t pid = atomic_load_explicit(&procs[i].pid, memory_order_acquire);
+            if (pid == 0 || pid == region_info.pid || !(procs[i].flags & SHRREG_SLOT_CACHING))
+                continue;
+            asked++;
+            if ((int32_t)((uint32_t)atomic_load_explicit(&procs[i].cache_flush_ack, memory_order_acquire) -
+                          (uint32_t)seq) < 0)
+                pending++;
+        }
+        if (pending == 0)
+            break;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long left_ms = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+        if (left_ms <= 0) {
+            LOG_WARN("%d of %d processes flushed their caches in %d ms", asked - pending, asked, timeout_ms);
+            break;
+        }
+        futex_wait_shared(&region->cache_flush_acks, acks, (int)left_ms);
+    }
+    return asked;
+}
+
+int32_t shrreg_register_cache_flusher() {
+    ensure_initialized();
+    shared_region_t* region = region_info.shared_region;
+    lock_shrreg();
+    int32_t seq = atomic_load_explicit(&region->cache_flush_seq, memory_order_acquire);
+    shrreg_proc_slot_t* slot = get_my_slot();
+    if (slot != NULL && !(slot->flags & SHRREG_SLOT_CACHING)) {
+        // Requests made before are not waiting for this process
+        atomic_store_explicit(&slot->cache_flush_ack, seq, memory_order_release);
+        slot->flags |= SHRREG_SLOT_CACHING;
+        atomic_fetch_add_explicit(&region->caching_procs, 1, memory_order_release);
+    }
+    unlock_shrreg();
+    return seq;
+}
+
+// Stop waiting for the answers of a slot, under lock_shrreg
+static void drop_cache_flusher_nolock(shrreg_proc_slot_t* slot) {
+    if (!(slot->flags & SHRREG_SLOT_CACHING))
+        return;
+    slot->flags &= ~SHRREG_SLOT_CACHING;
+    atomic_fetch_sub_explicit(&region_info.shared_region->caching_procs, 1, memory_order_release);
+    futex_wake_shared(&region_info.shared_region->cache_flush_acks);
+}
+
+void shrreg_unregister_cache_flusher() {
+    ensure_initialized();
+    lock_shrreg();
+    shrreg_proc_slot_t* slot = get_my_slot();
+    if (slot != NULL)
+        drop_cache_flusher_nolock(slot);
+    unlock_shrreg();
+}
+
+int32_t shrreg_cache_flush_seq() {
+    ensure_initialized();
+    return atomic_load_explicit(&region_info.shared_region->cache_flush_seq, memory_order_acquire);
+}
+
+void shrreg_wait_cache_flush(int32_t seq, int timeout_ms) {
+    ensure_initialized();
+    futex_wait_shared(&region_info.shared_region->cache_flush_seq, seq, timeout_ms);
+}
+
+void shrreg_ack_cache_flush(int32_t seq) {
+    ensure_initialized();
+    shrreg_proc_slot_t* slot = get_my_slot();
+    if (slot == NULL)
+        return;
+    atomic_store_explicit(&slot->cache_flush_ack, seq, memory_order_release);
+    atomic_fetch_add_explicit(&region_info.shared_region->cache_flush_acks, 1, memory_order_release);
+    futex_wake_shared(&region_info.shared_region->cache_flush_acks);
+}
+
 void do_init_device_memory_limits(uint64_t* arr, int len) {
     size_t fallback_limit = get_limit_from_env(CUDA_DEVICE_MEMORY_LIMIT);
     int i;
@@ -212,8 +617,9 @@ void do_init_device_sm_limits(uint64_t *arr, int len) {
 
 int active_oom_killer() {
     int i;
+    shrreg_proc_slot_t* procs = shrreg_procs(region_info.shared_region);
     for (i=0;i<region_info.shared_region->proc_num;i++) {
-        kill(region_info.shared_region->procs[i].pid,9);
+        kill(procs[i].pid,9);
     }
     return 0;
 }
@@ -263,14 +669,16 @@ size_t get_gpu_memory_monitor(const int dev) {
     ensure_initialized();
     int i=0;
     size_t total=0;
+    if (!region_has_device(dev))
+        return 0;
 
     int proc_num = atomic_load_explicit(&region_info.shared_region->proc_num, memory_order_acquire);
     for (i=0; i < proc_num; i++) {
         uint64_t monitor = atomic_load_explicit(
-            &region_info.shared_region->procs[i].monitorused[dev],
+            &shrreg_proc_util(region_info.shared_region, dev, i)->monitorused,
             memory_order_relaxed);
         uint64_t used_total = atomic_load_explicit(
-            &region_info.shared_region->procs[i].used[dev].total,
+            &shrreg_proc_used(region_info.shared_region, dev, i)->total,
             memory_order_relaxed);
         LOG_DEBUG("dev=%d i=%lu,%lu\n", dev, monitor, used_total);
         total+=monitor;
@@ -278,122 +686,169 @@ size_t get_gpu_memory_monitor(const int dev) {
     return total;
 }
 
-// Lock-free memory usage aggregation with seqlock for consistent snapshots
+// O(1) memory usage lookup from the per-device aggregate counter
 size_t get_gpu_memory_usage(const int dev) {
-    LOG_INFO("get_gpu_memory_usage_lockfree dev=%d", dev);
     ensure_initialized();
-    int i=0;
-    size_t total=0;
-
-    // Lock-free read with acquire semantics for proc_num
-    int proc_num = atomic_load_explicit(&region_info.shared_region->proc_num, memory_order_acquire);
-
-    for (i=0; i < proc_num; i++) {
-        shrreg_proc_slot_t* slot = &region_info.shared_region->procs[i];
-        uint64_t proc_usage;
-        uint64_t seq1, seq2;
-        int retry_count = 0;
-
-        // Seqlock read protocol: retry until we get a consistent snapshot
-        // CRITICAL: Memory checks require accurate data, cannot use stale reads
-        do {
-            // Read sequence number (must be even = no write in progress)
-            seq1 = atomic_load_explicit(&slot->seqlock, memory_order_acquire);
-
-            // If odd, writer is in progress, back off with exponential delay
-            while (seq1 & 1) {
-                // Exponential backoff to reduce contention
-                if (retry_count < 5) {
-                    // First 5 retries: just CPU pause (fast path)
-                    #if defined(__x86_64__) || defined(__i386__)
-                    __asm__ __volatile__("pause" ::: "memory");
-                    #elif defined(__aarch64__)
-                    __asm__ __volatile__("yield" ::: "memory");
-                    #endif
-                } else if (retry_count < 20) {
-                    // Next 15 retries: 1μs delay
-                    usleep(1);
-                } else if (retry_count < 100) {
-                    // Next 80 retries: 10μs delay
-                    usleep(10);
-                } else {
-                    // After 100 retries: 100μs delay
-                    usleep(100);
-                    // Log if we're spinning for a very long time
-                    if (retry_count % 100 == 0) {
-                        LOG_DEBUG("Seqlock spinning for slot %d, retry %d (writer active)", i, retry_count);
-                    }
-                }
-
-                retry_count++;
-                seq1 = atomic_load_explicit(&slot->seqlock, memory_order_acquire);
-            }
-
-            // Read the data with acquire semantics
-            proc_usage = atomic_load_explicit(&slot->used[dev].total, memory_order_acquire);
-
-            // Memory barrier to prevent reordering
-            atomic_thread_fence(memory_order_acquire);
+    if (!region_has_device(dev))
+        return initial_offset;
+    if (atomic_load_explicit(&region_info.shared_region->legacy_active, memory_order_relaxed))
+        shrreg_sync_legacy(region_info.shared_region, 0);
+    uint64_t total = atomic_load_explicit(&shrreg_dev_usage(region_info.shared_region)[dev].usage, memory_order_acquire);
+    LOG_INFO("get_gpu_memory_usage dev=%d usage=%lu", dev, total);
+    return total + initial_offset;
+}
 
-            // Read sequence number again
-            seq2 = atomic_load_explicit(&slot->seqlock, memory_order_acquire);
+int shrreg_read_proc_used(device_memory_t* used, device_memory_snapshot_t* out) {
+    int retries;
+    for (retries = 0; retries < 100; retries++) {
+        uint64_t seq = atomic_load_explicit(&used->seqlock, memory_order_acquire);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        out->context_size = atomic_load_explicit(&used->context_size, memory_order_relaxed);
+        out->module_size = atomic_load_explicit(&used->module_size, memory_order_relaxed);
+        out->data_size = atomic_load_explicit(&used->data_size, memory_order_relaxed);
+        out->offset = atomic_load_explicit(&used->offset, memory_order_relaxed);
+        out->total = atomic_load_explicit(&used->total, memory_order_relaxed);
+        out->lease = atomic_load_explicit(&used->lease, memory_order_relaxed);
+        out->allocated = atomic_load_explicit(&used->allocated, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&used->seqlock, memory_order_relaxed) == seq)
+            return 1;
+    }
+    return 0;
+}
 
-            // If sequence numbers match and still even, read was consistent
-        } while (seq1 != seq2);
+/*
+ * Whole-region snapshots. Slot contents are copied entry by entry, each
+ * device_memory_t through its seqlock, and the copy is only retried when
+ * the epoch shows that slots were added or moved meanwhile.
+ */
+#define SHRREG_SNAPSHOT_RETRIES 64
+
+shrreg_snapshot_t* shrreg_snapshot_alloc(shared_region_t* region) {
+    size_t devices = region->device_count;
+    size_t entries = devices * region->max_procs;
+    size_t size = sizeof(shrreg_snapshot_t) +
+        sizeof(uint64_t) * 3 * devices +
+        sizeof(shrreg_proc_snapshot_t) * region->max_procs +
+        sizeof(device_memory_snapshot_t) * entries +
+        sizeof(device_util_snapshot_t) * entries +
+        sizeof(device_memory_stats_snapshot_t) * entries;
+    shrreg_snapshot_t* snap = calloc(1, size);
+    if (snap == NULL)
+        return NULL;
+    snap->device_count = region->device_count;
+    snap->max_procs = region->max_procs;
+    snap->used = (device_memory_snapshot_t*)(snap + 1);
+    snap->util = (device_util_snapshot_t*)(snap->used + entries);
+    snap->stats = (device_memory_stats_snapshot_t*)(snap->util + entries);
+    snap->usage = (uint64_t*)(snap->stats + entries);
+    snap->limit = snap->usage + devices;
+    snap->sm_limit = snap->limit + devices;
+    snap->procs = (shrreg_proc_snapshot_t*)(snap->sm_limit + devices);
+    return snap;
+}
 
-        // Consistent read obtained
-        int32_t pid = atomic_load_explicit(&slot->pid, memory_order_relaxed);
-        int32_t hostpid = atomic_load_explicit(&slot->hostpid, memory_order_relaxed);
+void shrreg_snapshot_free(shrreg_snapshot_t* snap) {
+    free(snap);
+}
 
-        LOG_INFO("dev=%d pid=%d host pid=%d i=%lu", dev, pid, hostpid, proc_usage);
-        total+=proc_usage;
+static void snapshot_slots(shared_region_t* region, shrreg_snapshot_t* snap) {
+    shrreg_proc_slot_t* procs = shrreg_procs(region);
+    int proc_num = atomic_load_explicit(&region->proc_num, memory_order_acquire);
+    if (proc_num < 0)
+        proc_num = 0;
+    if (proc_num > (int)snap->max_procs)
+        proc_num = snap->max_procs;
+    snap->proc_num = proc_num;
+    int i, dev;
+    for (i = 0; i < proc_num; i++) {
+        snap->procs[i].pid = atomic_load_explicit(&procs[i].pid, memory_order_relaxed);
+        snap->procs[i].hostpid = atomic_load_explicit(&procs[i].hostpid, memory_order_relaxed);
+        snap->procs[i].status = atomic_load_explicit(&procs[i].status, memory_order_relaxed);
+        snap->procs[i].flags = procs[i].flags;
+    }
+    for (dev = 0; dev < (int)snap->device_count; dev++) {
+        for (i = 0; i < proc_num; i++) {
+            shrreg_read_proc_used(shrreg_proc_used(region, dev, i), shrreg_snapshot_used(snap, dev, i));
+            device_util_t* util = shrreg_proc_util(region, dev, i);
+            device_util_snapshot_t* copy = shrreg_snapshot_util(snap, dev, i);
+            copy->monitorused = atomic_load_explicit(&util->monitorused, memory_order_relaxed);
+            copy->dec_util = atomic_load_explicit(&util->dec_util, memory_order_relaxed);
+            copy->enc_util = atomic_load_explicit(&util->enc_util, memory_order_relaxed);
+            copy->sm_util = atomic_load_explicit(&util->sm_util, memory_order_relaxed);
+            device_memory_stats_t* stats = shrreg_proc_stats(region, dev, i);
+            if (stats == NULL)
+                continue;
+            device_memory_stats_snapshot_t* stats_copy = shrreg_snapshot_stats(snap, dev, i);
+            stats_copy->peak = atomic_load_explicit(&stats->peak, memory_order_relaxed);
+            for (int b = 0; b < SHRREG_SIZE_BUCKETS; b++)
+                stats_copy->size_buckets[b] = atomic_load_explicit(&stats->size_buckets[b], memory_order_relaxed);
+        }
     }
+}
 
-    total+=initial_offset;
-    return total;
+int shrreg_snapshot(shared_region_t* region, shrreg_snapshot_t* snap) {
+    if (snap->device_count != region->device_count || snap->max_procs != region->max_procs)
+        return -1;
+    int dev, retries;
+    for (dev = 0; dev < (int)snap->device_count; dev++) {
+        snap->usage[dev] = atomic_load_explicit(&shrreg_dev_usage(region)[dev].usage, memory_order_relaxed);
+        snap->limit[dev] = shrreg_limit(region)[dev];
+        snap->sm_limit[dev] = shrreg_sm_limit(region)[dev];
+    }
+    for (retries = 0; retries < SHRREG_SNAPSHOT_RETRIES; retries++) {
+        uint64_t epoch = shrreg_epoch_begin(region);
+        if (epoch & 1) {
+            sched_yield();
+            continue;
+        }
+        snapshot_slots(region, snap);
+        if (!shrreg_epoch_retry(region, epoch)) {
+            snap->epoch = epoch;
+            return 0;
+        }
+    }
+    return -1;
 }
 
 // Lock-free memory monitor update
 int set_gpu_device_memory_monitor(int32_t pid,int dev,size_t monitor){
     // LOG_WARN("set_gpu_device_memory_monitor_lockfree:%d %d %lu",pid,dev,monitor);
-    int i;
     ensure_initialized();
 
-    int proc_num = atomic_load_explicit(&region_info.shared_region->proc_num, memory_order_acquire);
-    for (i=0; i < proc_num; i++) {
-        int32_t hostpid = atomic_load_explicit(&region_info.shared_region->procs[i].hostpid, memory_order_acquire);
-        if (hostpid == pid) {
-            uint64_t used_total = atomic_load_explicit(
-                &region_info.shared_region->procs[i].used[dev].total,
-                memory_order_relaxed);
-            LOG_INFO("set_gpu_device_memory_monitor_lockfree:%d %d %lu->%lu", pid, dev, used_total, monitor);
-            atomic_store_explicit(&region_info.shared_region->procs[i].monitorused[dev], monitor, memory_order_relaxed);
-            return 1;
-        }
-    }
-    return 0;
+    shrreg_proc_slot_t* slot = find_proc_by_hostpid(pid);
+    if (slot == NULL || !region_has_device(dev))
+        return 0;
+    uint64_t used_total = atomic_load_explicit(&proc_slot_used(slot, dev)->total, memory_order_relaxed);
+    LOG_INFO("set_gpu_device_memory_monitor_lockfree:%d %d %lu->%lu", pid, dev, used_total, monitor);
+    atomic_store_explicit(&proc_slot_util(slot, dev)->monitorused, monitor, memory_order_relaxed);
+    return 1;
 }
 
 // Lock-free SM utilization update
 int set_gpu_device_sm_utilization(int32_t pid, int dev, unsigned int smUtil) {
-    int i;
     ensure_initialized();
 
-    int proc_num = atomic_load_explicit(&region_info.shared_region->proc_num, memory_order_acquire);
-    for (i = 0; i < proc_num; i++) {
-        int32_t hostpid = atomic_load_explicit(&region_info.shared_region->procs[i].hostpid, memory_order_acquire);
-        if (hostpid == pid) {
-            uint64_t old_util = atomic_load_explicit(
-                &region_info.shared_region->procs[i].device_util[dev].sm_util,
-                memory_order_relaxed);
-            LOG_INFO("set_gpu_device_sm_utilization_lockfree:%d %d %lu->%u", pid, dev, old_util, smUtil);
-            atomic_store_explicit(
-                &region_info.shared_region->procs[i].device_util[dev].sm_util, smUtil,
-                memory_order_relaxed);
-            return 1;
-        }
-    }
-    return 0;
+    shrreg_proc_slot_t* slot = find_proc_by_hostpid(pid);
+    if (slot == NULL || !region_has_device(dev))
+        return 0;
+    device_util_t* util = proc_slot_util(slot, dev);
+    uint64_t old_util = atomic_load_explicit(&util->sm_util, memory_order_relaxed);
+    LOG_INFO("set_gpu_device_sm_utilization_lockfree:%d %d %lu->%u", pid, dev, old_util, smUtil);
+    atomic_store_explicit(&util->sm_util, smUtil, memory_order_relaxed);
+    return 1;
+}
+
+// Device-wide SM utilization, published for the history samples
+int set_gpu_device_sm_utilization_sum(int dev, unsigned int smUtil) {
+    ensure_initialized();
+    if (!region_has_device(dev))
+        return 0;
+    atomic_store_explicit(&shrreg_dev_usage(region_info.shared_region)[dev].sm_util, smUtil, memory_order_relaxed);
+    return 1;
 }
 
 // Lock-free utilization initialization
@@ -401,14 +856,13 @@ int init_gpu_device_utilization(){
     int i,dev;
     ensure_initialized();
 
-    int proc_num = atomic_load_explicit(&region_info.shared_region->proc_num, memory_order_acquire);
-    for (i=0; i < proc_num; i++) {
-        for (dev=0;dev<CUDA_DEVICE_MAX_COUNT;dev++){
-            atomic_store_explicit(
-                &region_info.shared_region->procs[i].device_util[dev].sm_util,
-                0,
-                memory_order_relaxed);
-            atomic_store_explicit(&region_info.shared_region->procs[i].monitorused[dev], 0, memory_order_relaxed);
+    shared_region_t* region = region_info.shared_region;
+    int proc_num = atomic_load_explicit(&region->proc_num, memory_order_acquire);
+    for (dev=0; dev < (int)region->device_count; dev++) {
+        for (i=0; i < proc_num; i++) {
+            device_util_t* util = shrreg_proc_util(region, dev, i);
+            atomic_store_explicit(&util->sm_util, 0, memory_order_relaxed);
+            atomic_store_explicit(&util->monitorused, 0, memory_order_relaxed);
         }
     }
     return 1;
@@ -432,92 +886,720 @@ uint64_t nvml_get_device_memory_usage(const int dev) {
     uint64_t usage = 0;
     shared_region_t* region = region_info.shared_region;
 
-    // Lock-free read of proc_num and pid fields
-    int proc_num = atomic_load_explicit(&region->proc_num, memory_order_acquire);
+    // Lock-free index lookup per reported process
     for (; i < pcnt; i++) {
-        int slot = 0;
-        for (; slot < proc_num; slot++) {
-            int32_t slot_pid = atomic_load_explicit(&region->procs[slot].pid, memory_order_relaxed);
-            if (infos[i].pid != slot_pid)
-                continue;
+        if (find_proc_by_pid(infos[i].pid) != NULL)
             usage += infos[i].usedGpuMemory;
-        }
     }
     LOG_DEBUG("Device %d current memory %lu / %lu", 
-            dev, usage, region->limit[dev]);
+            dev, usage, region_has_device(dev) ? shrreg_limit(region)[dev] : 0);
     return usage;
 }
 
-// Lock-free memory add using atomics with seqlock for consistent reads
-int add_gpu_device_memory_usage(int32_t pid, int cudadev, size_t usage, int type) {
+/*
+ * Usage history. Every change of a device aggregate, and every round of
+ * the utilization watcher, appends a sample to the device's ring, so that
+ * readers see spikes shorter than their polling interval. Appending costs
+ * one fetch_add on the ring head plus stores to the claimed line.
+ */
+void shrreg_record_sample(int dev, int source) {
+    if (!region_has_device(dev))
+        return;
+    shared_region_t* region = region_info.shared_region;
+    shrreg_history_t* history = shrreg_history(region, dev);
+    if (history == NULL)
+        return;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t pos = atomic_fetch_add_explicit(&history->head, 1, memory_order_relaxed);
+    shrreg_sample_t* sample = &history->samples[pos & (SHRREG_HISTORY_LEN - 1)];
+    atomic_store_explicit(&sample->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&sample->time_us, ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000, memory_order_relaxed);
+    atomic_store_explicit(&sample->usage,
+        atomic_load_explicit(&shrreg_dev_usage(region)[dev].usage, memory_order_relaxed), memory_order_relaxed);
+    atomic_store_explicit(&sample->limit, shrreg_limit(region)[dev], memory_order_relaxed);
+    atomic_store_explicit(&sample->sm_util,
+        atomic_load_explicit(&shrreg_dev_usage(region)[dev].sm_util, memory_order_relaxed), memory_order_relaxed);
+    atomic_store_explicit(&sample->tokens, get_current_device_tokens(dev), memory_order_relaxed);
+    atomic_store_explicit(&sample->pid, region_info.pid, memory_order_relaxed);
+    atomic_store_explicit(&sample->source, source, memory_order_relaxed);
+    atomic_store_explicit(&sample->seq, pos + 1, memory_order_release);
+}
+
+/**
+ * Lock-free read of the history, usable on a region mapped read-only.
+ * Samples being written, or overwritten while read, are skipped.
+ */
+int shrreg_read_history(shared_region_t* region, int dev, shrreg_sample_t* out, int max) {
+    if (dev < 0 || dev >= (int)region->device_count || max <= 0)
+        return 0;
+    shrreg_history_t* history = shrreg_history(region, dev);
+    if (history == NULL)
+        return 0;
+    uint64_t head = atomic_load_explicit(&history->head, memory_order_acquire);
+    uint64_t first = head > SHRREG_HISTORY_LEN ? head - SHRREG_HISTORY_LEN : 0;
+    if (head - first > (uint64_t)max)
+        first = head - max;
+    int n = 0;
+    uint64_t pos;
+    for (pos = first; pos < head; pos++) {
+        shrreg_sample_t* sample = &history->samples[pos & (SHRREG_HISTORY_LEN - 1)];
+        if (atomic_load_explicit(&sample->seq, memory_order_acquire) != pos + 1)
+            continue;
+        shrreg_sample_t* copy = &out[n];
+        atomic_store_explicit(&copy->seq, pos + 1, memory_order_relaxed);
+        atomic_store_explicit(&copy->time_us, atomic_load_explicit(&sample->time_us, memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&copy->usage, atomic_load_explicit(&sample->usage, memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&copy->limit, atomic_load_explicit(&sample->limit, memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&copy->sm_util, atomic_load_explicit(&sample->sm_util, memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&copy->tokens, atomic_load_explicit(&sample->tokens, memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&copy->pid, atomic_load_explicit(&sample->pid, memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&copy->source, atomic_load_explicit(&sample->source, memory_order_relaxed), memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&sample->seq, memory_order_relaxed) == pos + 1)
+            n++;
+    }
+    return n;
+}
+
+/*
+ * OOM events. Each denial records the device state and its largest
+ * consumers at that moment, so that capacity planning can work from the
+ * denials themselves. The slots are scanned without lock_shrreg; a slot
+ * moving meanwhile only makes the consumer list approximate.
+ */
+void shrreg_record_oom(int dev, size_t size, int api) {
+    if (!region_has_device(dev))
+        return;
+    shared_region_t* region = region_info.shared_region;
+    shrreg_oom_events_t* events = shrreg_oom_events(region, dev);
+    if (events == NULL)
+        return;
+    int32_t top_pid[SHRREG_OOM_TOP_PROCS] = {0};
+    uint64_t top_usage[SHRREG_OOM_TOP_PROCS] = {0};
+    int proc_num = atomic_load_explicit(&region->proc_num, memory_order_acquire);
+    int i, j;
+    for (i = 0; i < proc_num; i++) {
+        int32_t pid = atomic_load_explicit(&shrreg_procs(region)[i].pid, memory_order_relaxed);
+        uint64_t total = atomic_load_explicit(&shrreg_proc_used(region, dev, i)->total, memory_order_relaxed);
+        if (pid == 0 || total <= top_usage[SHRREG_OOM_TOP_PROCS - 1])
+            continue;
+        for (j = SHRREG_OOM_TOP_PROCS - 1; j > 0 && top_usage[j - 1] < total; j--) {
+            top_pid[j] = top_pid[j - 1];
+            top_usage[j] = top_usage[j - 1];
+        }
+        top_pid[j] = pid;
+        top_usage[j] = total;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t pos = atomic_fetch_add_explicit(&events->head, 1, memory_order_relaxed);
+    shrreg_oom_event_t* event = &events->events[pos & (SHRREG_OOM_EVENTS_LEN - 1)];
+    atomic_store_explicit(&event->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&event->time_us, ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000, memory_order_relaxed);
+    atomic_store_explicit(&event->size, size, memory_order_relaxed);
+    atomic_store_explicit(&event->usage,
+        atomic_load_explicit(&shrreg_dev_usage(region)[dev].usage, memory_order_relaxed), memory_order_relaxed);
+    atomic_store_explicit(&event->limit, shrreg_limit(region)[dev], memory_order_relaxed);
+    atomic_store_explicit(&event->pid, region_info.pid, memory_order_relaxed);
+    atomic_store_explicit(&event->api, api, memory_order_relaxed);
+    for (j = 0; j < SHRREG_OOM_TOP_PROCS; j++) {
+        atomic_store_explicit(&event->top_pid[j], top_pid[j], memory_order_relaxed);
+        atomic_store_explicit(&event->top_usage[j], top_usage[j], memory_order_relaxed);
+    }
+    atomic_store_explicit(&event->seq, pos + 1, memory_order_release);
+}
+
+// Lock-free like shrreg_read_history()
+int shrreg_read_oom_events(shared_region_t* region, int dev, shrreg_oom_event_t* out, int max) {
+    if (dev < 0 || dev >= (int)region->device_count || max <= 0)
+        return 0;
+    shrreg_oom_events_t* events = shrreg_oom_events(region, dev);
+    if (events == NULL)
+        return 0;
+    uint64_t head = atomic_load_explicit(&events->head, memory_order_acquire);
+    uint64_t first = head > SHRREG_OOM_EVENTS_LEN ? head - SHRREG_OOM_EVENTS_LEN : 0;
+    if (head - first > (uint64_t)max)
+        first = head - max;
+    int n = 0, j;
+    uint64_t pos;
+    for (pos = first; pos < head; pos++) {
+        shrreg_oom_event_t* event = &events->events[pos & (SHRREG_OOM_EVENTS_LEN - 1)];
+        if (atomic_load_explicit(&event->seq, memory_order_acquire) != pos + 1)
+            continue;
+        shrreg_oom_event_t* copy = &out[n];
+        atomic_store_explicit(&copy->seq, pos + 1, memory_order_relaxed);
+        atomic_store_explicit(&copy->time_us, atomic_load_explicit(&event->time_us, memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&copy->size, atomic_load_explicit(&event->size, memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&copy->usage, atomic_load_explicit(&event->usage, memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&copy->limit, atomic_load_explicit(&event->limit, memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&copy->pid, atomic_load_explicit(&event->pid, memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&copy->api, atomic_load_explicit(&event->api, memory_order_relaxed), memory_order_relaxed);
+        for (j = 0; j < SHRREG_OOM_TOP_PROCS; j++) {
+            atomic_store_explicit(&copy->top_pid[j], atomic_load_explicit(&event->top_pid[j], memory_order_relaxed), memory_order_relaxed);
+            atomic_store_explicit(&copy->top_usage[j], atomic_load_explicit(&event->top_usage[j], memory_order_relaxed), memory_order_relaxed);
+        }
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&event->seq, memory_order_relaxed) == pos + 1)
+            n++;
+    }
+    return n;
+}
+
+// Resolve the slot of pid: the cached slot for ourselves, the pid index otherwise
+static inline shrreg_proc_slot_t* resolve_proc_slot(int32_t pid) {
+    if (pid == getpid()) {
+        shrreg_proc_slot_t* slot = get_my_slot();
+        if (slot != NULL)
+            return slot;
+    }
+    return find_proc_by_pid(pid);
+}
+
+/*
+ * Writes to the counters of a slot. The seqlock is odd while one is in
+ * progress, and writers take it in turn so that it stays odd until the
+ * last one is done. A write landing on a slot that remove_proc_slot_nolock()
+ * is moving would be lost with the old slot, while the aggregates charged
+ * with it keep it: they would drift for good. A lock-free writer enters
+ * the slot and then checks that no move started; the mover bumps the
+ * epoch and then waits for the seqlock to turn even. One of them always
+ * sees the other.
+ */
+#define SLOT_WRITE_RETRIES 64
+// Yields before a writer killed mid-write is given up on
+#define SLOT_WRITE_WAIT 4096
+
+static void seq_write_begin(device_memory_t* used) {
+    int retries = 0;
+    uint64_t seq = atomic_load_explicit(&used->seqlock, memory_order_relaxed);
+    while ((seq & 1) || !atomic_compare_exchange_weak(&used->seqlock, &seq, seq + 1)) {
+        if (!(seq & 1))
+            continue;
+        if (++retries > SLOT_WRITE_WAIT) {
+            LOG_WARN("Seqlock held for %d yields, taking it over", SLOT_WRITE_WAIT);
+            return;
+        }
+        sched_yield();
+        seq = atomic_load_explicit(&used->seqlock, memory_order_relaxed);
+    }
+}
+
+static inline void seq_write_end(device_memory_t* used) {
+    atomic_fetch_add_explicit(&used->seqlock, 1, memory_order_release);
+}
+
+// Enter the slot of pid on dev for a write without lock_shrreg, NULL if pid has none
+static device_memory_t* begin_slot_write(int32_t pid, int dev, shrreg_proc_slot_t** slot) {
+    shared_region_t* region = region_info.shared_region;
+    int retries;
+    for (retries = 1; ; retries++) {
+        uint64_t epoch = atomic_load(&region->epoch);
+        if (!(epoch & 1)) {
+            *slot = resolve_proc_slot(pid);
+            if (*slot == NULL)
+                return NULL;
+            device_memory_t* used = proc_slot_used(*slot, dev);
+            seq_write_begin(used);
+            if (atomic_load(&region->epoch) == epoch)
+                return used;
+            seq_write_end(used);
+        }
+        // A lock owner dying mid-compaction leaves the epoch odd until
+        // the next lock_shrreg() repairs it
+        if (retries % SLOT_WRITE_RETRIES == 0) {
+            lock_shrreg();
+            unlock_shrreg();
+        } else {
+            sched_yield();
+        }
+    }
+}
+
+// Wait for the writers that entered slot before the epoch was bumped
+static void wait_slot_writers(shrreg_proc_slot_t* slot) {
+    for (int dev = 0; dev < (int)region_info.shared_region->device_count; dev++) {
+        device_memory_t* used = proc_slot_used(slot, dev);
+        int retries = 0;
+        while ((atomic_load(&used->seqlock) & 1) && retries++ < SLOT_WRITE_WAIT)
+            sched_yield();
+    }
+}
+
+/*
+ * Memory leases. With CUDA_DEVICE_MEMORY_LEASE_ENV set, a process charges
+ * the device aggregate in chunks and keeps the unallocated part of the
+ * chunk in its slot's lease. Allocations and frees covered by the lease
+ * only touch the process's own slot line. The lease stays part of the
+ * slot's total, so the limit holds exactly, and other processes take it
+ * back with reclaim_gpu_memory_leases() when they run out of quota.
+ */
+// Read by the allocating threads while the limits watcher rewrites it
+static _Atomic uint64_t lease_size[CUDA_DEVICE_MAX_COUNT];
+
+static inline uint64_t memory_lease_size(int dev) {
+    return dev < CUDA_DEVICE_MAX_COUNT ? atomic_load(&lease_size[dev]) : 0;
+}
+
+static void release_memory_lease(int dev);
+
+static void init_memory_leases() {
+    char* env = getenv(CUDA_DEVICE_MEMORY_LEASE_ENV);
+    if (env == NULL)
+        return;
+    size_t len = strlen(env);
+    int percent = len > 0 && env[len - 1] == '%';
+    size_t size = percent ? 0 : get_limit_from_env(CUDA_DEVICE_MEMORY_LEASE_ENV);
+    shared_region_t* region = region_info.shared_region;
+    int dev;
+    for (dev = 0; dev < (int)region->device_count && dev < CUDA_DEVICE_MAX_COUNT; dev++) {
+        uint64_t limit = shrreg_limit(region)[dev];
+        uint64_t lease;
+        // Without a limit there is nothing to reserve against
+        if (limit == 0)
+            lease = 0;
+        else if (percent)
+            lease = limit / 100 * atoi(env);
+        else
+            lease = size;
+        atomic_store(&lease_size[dev], lease);
+        LOG_INFO("Memory lease of device %d: %lu bytes", dev, lease);
+        // Frees no longer go through the lease, nothing would give it back
+        if (lease == 0)
+            release_memory_lease(dev);
+    }
+}
+
+/*
+ * Quota groups. The slot of a process in a group charges the group's
+ * usage on a device along with the device aggregate, and an allocation
+ * must fit under both limits. The helpers below move the two together.
+ */
+static inline group_usage_t* proc_slot_group_usage(shrreg_proc_slot_t* slot, int dev) {
+    if (slot->group <= 0)
+        return NULL;
+    return shrreg_group_usage(region_info.shared_region, slot->group - 1, dev);
+}
+
+static inline void add_device_usage(shrreg_proc_slot_t* slot, int dev, uint64_t bytes) {
+    group_usage_t* group = proc_slot_group_usage(slot, dev);
+    if (group != NULL)
+        atomic_fetch_add_explicit(&group->usage, bytes, memory_order_release);
+    atomic_fetch_add_explicit(&shrreg_dev_usage(region_info.shared_region)[dev].usage, bytes, memory_order_release);
+}
+
+static inline void sub_device_usage(shrreg_proc_slot_t* slot, int dev, uint64_t bytes) {
+    group_usage_t* group = proc_slot_group_usage(slot, dev);
+    if (group != NULL)
+        atomic_fetch_sub_explicit(&group->usage, bytes, memory_order_release);
+    atomic_fetch_sub_explicit(&shrreg_dev_usage(region_info.shared_region)[dev].usage, bytes, memory_order_release);
+}
+
+// Raise usage by bytes if it stays within limit, 0 meaning none
+static int charge_quota(_Atomic uint64_t* usage, uint64_t limit, uint64_t bytes) {
+    uint64_t cur = atomic_load_explicit(usage, memory_order_relaxed);
+    do {
+        if (limit != 0 && cur + bytes > limit)
+            return 0;
+    } while (!atomic_compare_exchange_weak_explicit(usage, &cur, cur + bytes,
+                                                    memory_order_acq_rel, memory_order_relaxed));
+    return 1;
+}
+
+// Charge bytes to the group of slot and the device aggregate if they fit under both limits
+static int charge_device_quota(shrreg_proc_slot_t* slot, int dev, uint64_t bytes) {
+    shared_region_t* region = region_info.shared_region;
+    group_usage_t* group = proc_slot_group_usage(slot, dev);
+    if (group != NULL &&
+        !charge_quota(&group->usage, atomic_load_explicit(&group->limit, memory_order_relaxed), bytes))
+        return 0;
+    if (!charge_quota(&shrreg_dev_usage(region)[dev].usage, shrreg_limit(region)[dev], bytes)) {
+        if (group != NULL)
+            atomic_fetch_sub_explicit(&group->usage, bytes, memory_order_release);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Drift reconciliation. NVML sees memory the hooks do not track: the CUDA
+ * context, pool and array allocations, driver internals. The watcher keeps
+ * the difference between a process's NVML usage and its tracked breakdown
+ * in the slot's offset, which is part of total and so of every limit check.
+ * The correction is capped per CUDA_DEVICE_MEMORY_DRIFT_LIMIT_ENV and never
+ * negative: NVML lags behind reservations, which must stay charged.
+ */
+// Rewritten by the limits watcher while the utilization watcher reads it
+static _Atomic uint64_t drift_limit[CUDA_DEVICE_MAX_COUNT];
+
+// Corrections below this are NVML noise, it reports whole MiBs
+#define SHRREG_DRIFT_STEP (2 * 1024 * 1024)
+
+static inline uint64_t drift_limit_of(int dev) {
+    return dev < CUDA_DEVICE_MAX_COUNT ? atomic_load_explicit(&drift_limit[dev], memory_order_relaxed) : 0;
+}
+
+static void init_drift_limits() {
+    char* env = getenv(CUDA_DEVICE_MEMORY_DRIFT_LIMIT_ENV);
+    if (env == NULL)
+        return;
+    size_t len = strlen(env);
+    int percent = len > 0 && env[len - 1] == '%';
+    size_t size = percent ? 0 : get_limit_from_env(CUDA_DEVICE_MEMORY_DRIFT_LIMIT_ENV);
+    shared_region_t* region = region_info.shared_region;
+    int dev;
+    for (dev = 0; dev < (int)region->device_count && dev < CUDA_DEVICE_MAX_COUNT; dev++) {
+        uint64_t limit = shrreg_limit(region)[dev];
+        uint64_t bound;
+        if (limit == 0)
+            bound = 0;
+        else if (percent)
+            bound = limit / 100 * atoi(env);
+        else
+            bound = size;
+        atomic_store_explicit(&drift_limit[dev], bound, memory_order_relaxed);
+        LOG_INFO("Drift correction limit of device %d: %lu bytes", dev, bound);
+    }
+}
+
+void shrreg_refresh_limits() {
+    ensure_initialized();
+    init_memory_leases();
+    init_drift_limits();
+}
+
+int drift_correction_enabled() {
+    ensure_initialized();
+    int dev;
+    for (dev = 0; dev < CUDA_DEVICE_MAX_COUNT; dev++) {
+        if (drift_limit_of(dev) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+// Move used->offset to target, keeping total and the aggregate in step.
+// Watchers of several processes may race here; the CAS makes each apply
+// its own delta exactly once.
+static int set_proc_used_offset(shrreg_proc_slot_t* slot, int dev, uint64_t target) {
+    device_memory_t* used = proc_slot_used(slot, dev);
+    uint64_t old = atomic_load_explicit(&used->offset, memory_order_relaxed);
+    do {
+        if (old == target)
+            return 0;
+    } while (!atomic_compare_exchange_weak_explicit(&used->offset, &old, target,
+                                                    memory_order_relaxed, memory_order_relaxed));
+    seq_write_begin(used);
+    if (target > old) {
+        atomic_fetch_add_explicit(&used->total, target - old, memory_order_release);
+        add_device_usage(slot, dev, target - old);
+    } else {
+        atomic_fetch_sub_explicit(&used->total, old - target, memory_order_release);
+        sub_device_usage(slot, dev, old - target);
+    }
+    seq_write_end(used);
+    return 1;
+}
+
+/**
+ * One pass over the slots on dev for an NVML report: adds the difference
+ * between NVML and the tracked breakdown to *drift, and returns the number
+ * of corrections due. Corrections are dropped at once but raised only
+ * halfway per round, so that memory freed before NVML notices does not
+ * block allocations for long. They are applied only with apply, which
+ * needs lock_shrreg: slots must not move while their group is charged.
+ */
+static int reconcile_slots(int dev, const int32_t* hostpids, const uint64_t* used, int count,
+                           int apply, int64_t* drift) {
+    shared_region_t* region = region_info.shared_region;
+    uint64_t bound = drift_limit_of(dev);
+    int proc_num = atomic_load_explicit(&region->proc_num, memory_order_acquire);
+    int i, j, due = 0;
+    *drift = 0;
+    for (i = 0; i < proc_num; i++) {
+        shrreg_proc_slot_t* slot = &shrreg_procs(region)[i];
+        int32_t hostpid = atomic_load_explicit(&slot->hostpid, memory_order_relaxed);
+        if (hostpid == 0 || atomic_load_explicit(&slot->pid, memory_order_relaxed) == 0 ||
+            (slot->flags & SHRREG_SLOT_LEGACY))
+            continue;
+        uint64_t seen = 0;
+        for (j = 0; j < count; j++) {
+            if (hostpids[j] == hostpid) {
+                seen = used[j];
+                break;
+            }
+        }
+        device_memory_snapshot_t entry;
+        shrreg_read_proc_used(shrreg_proc_used(region, dev, i), &entry);
+        uint64_t tracked = entry.context_size + entry.module_size + entry.data_size;
+        if (j < count)
+            *drift += (int64_t)seen - (int64_t)tracked;
+        uint64_t target = seen > tracked ? seen - tracked : 0;
+        if (target > bound)
+            target = bound;
+        if (target > entry.offset)
+            target = entry.offset + (target - entry.offset) / 2;
+        uint64_t change = target > entry.offset ? target - entry.offset : entry.offset - target;
+        // Dropping the correction altogether is never noise
+        if (change == 0 || (change < SHRREG_DRIFT_STEP && target != 0))
+            continue;
+        if (!apply) {
+            due++;
+        } else if (set_proc_used_offset(slot, dev, target)) {
+            due++;
+            LOG_DEBUG("Drift correction of hostpid %d on device %d: %lu -> %lu", hostpid, dev, entry.offset, target);
+        }
+    }
+    return due;
+}
+
+/**
+ * Reconcile the processes on dev with one NVML report. A process missing
+ * from it has no device memory left beyond what it tracks. The slots are
+ * read without the lock; it is only taken in the rounds with a correction
+ * to apply, or when slots moved during the read.
+ */
+void reconcile_gpu_device_memory(int dev, const int32_t* hostpids, const uint64_t* used, int count) {
+    ensure_initialized();
+    if (!region_has_device(dev))
+        return;
+    shared_region_t* region = region_info.shared_region;
+    int64_t drift;
+    int corrections = 0;
+    uint64_t epoch = shrreg_epoch_begin(region);
+    int due = reconcile_slots(dev, hostpids, used, count, 0, &drift);
+    if (due > 0 || shrreg_epoch_retry(region, epoch)) {
+        lock_shrreg();
+        corrections = reconcile_slots(dev, hostpids, used, count, 1, &drift);
+        unlock_shrreg();
+    }
+    atomic_store_explicit(&shrreg_dev_usage(region)[dev].drift, drift, memory_order_relaxed);
+    if (corrections > 0) {
+        atomic_fetch_add_explicit(&shrreg_dev_usage(region)[dev].drift_corrections, corrections, memory_order_relaxed);
+        shrreg_record_sample(dev, SHRREG_SAMPLE_WATCHER);
+    }
+}
+
+
+/**
+ * Per-slot statistics, kept on the charge path: a relaxed increment of
+ * the size bucket, and a CAS on the peak only when total exceeds it.
+ */
+static inline void record_memory_stats(shrreg_proc_slot_t* slot, int dev, uint64_t total, size_t usage, int type) {
+    device_memory_stats_t* stats = proc_slot_stats(slot, dev);
+    if (stats == NULL)
+        return;
+    if (type == 2)
+        atomic_fetch_add_explicit(&stats->size_buckets[shrreg_size_bucket(usage)], 1, memory_order_relaxed);
+    uint64_t peak = atomic_load_explicit(&stats->peak, memory_order_relaxed);
+    while (total > peak &&
+           !atomic_compare_exchange_weak_explicit(&stats->peak, &peak, total,
+                                                  memory_order_relaxed, memory_order_relaxed));
+}
+
+// Hand the lease of used back to the device quota, between begin_slot_write() and seq_write_end()
+static uint64_t drop_memory_lease(shrreg_proc_slot_t* slot, device_memory_t* used, int dev) {
+    uint64_t lease = atomic_exchange(&used->lease, 0);
+    if (lease != 0) {
+        atomic_fetch_sub_explicit(&used->total, lease, memory_order_release);
+        sub_device_usage(slot, dev, lease);
+    }
+    return lease;
+}
+
+/**
+ * Cover an allocation by this process's lease, taking a new lease from
+ * the device quota when the current one is too small. Returns 0 when the
+ * quota has no room for a new lease; the caller then charges the
+ * allocation alone. Called between begin_slot_write() and seq_write_end().
+ */
+static int take_memory_lease(shrreg_proc_slot_t* slot, device_memory_t* used, int dev, size_t usage) {
+    uint64_t avail = atomic_load_explicit(&used->lease, memory_order_relaxed);
+    while (avail >= usage) {
+        if (atomic_compare_exchange_weak_explicit(&used->lease, &avail, avail - usage,
+                                                  memory_order_relaxed, memory_order_relaxed))
+            return 1;
+    }
+    uint64_t lease = memory_lease_size(dev);
+    uint64_t grant = usage + lease;
+    if (!charge_device_quota(slot, dev, grant))
+        return 0;
+    atomic_fetch_add_explicit(&used->total, grant, memory_order_release);
+    atomic_fetch_add(&used->lease, lease);
+    // Leases were turned off meanwhile, init_memory_leases() may have missed this one
+    if (memory_lease_size(dev) == 0)
+        drop_memory_lease(slot, used, dev);
+    shrreg_record_sample(dev, SHRREG_SAMPLE_ALLOC);
+    LOG_DEBUG("New memory lease on device %d: %lu bytes", dev, grant);
+    return 1;
+}
+
+// Put freed bytes back into the lease, handing back what exceeds two leases.
+// Called between begin_slot_write() and seq_write_end().
+static void return_memory_lease(shrreg_proc_slot_t* slot, device_memory_t* used, int dev, size_t usage) {
+    uint64_t avail = atomic_fetch_add_explicit(&used->lease, usage, memory_order_relaxed) + usage;
+    uint64_t lease = memory_lease_size(dev);
+    while (avail > 2 * lease) {
+        if (!atomic_compare_exchange_weak_explicit(&used->lease, &avail, lease,
+                                                   memory_order_relaxed, memory_order_relaxed))
+            continue;
+        uint64_t excess = avail - lease;
+        atomic_fetch_sub_explicit(&used->total, excess, memory_order_release);
+        sub_device_usage(slot, dev, excess);
+        shrreg_record_sample(dev, SHRREG_SAMPLE_FREE);
+        break;
+    }
+}
+
+// Hand the whole unallocated lease of this process on dev back to the device quota
+static void release_memory_lease(int dev) {
+    shrreg_proc_slot_t* slot;
+    device_memory_t* used = begin_slot_write(getpid(), dev, &slot);
+    if (used == NULL)
+        return;
+    uint64_t lease = drop_memory_lease(slot, used, dev);
+    seq_write_end(used);
+    if (lease == 0)
+        return;
+    shrreg_record_sample(dev, SHRREG_SAMPLE_FREE);
+    LOG_INFO("Memory lease of device %d released: %lu bytes", dev, lease);
+}
+
+// Unallocated bytes of this process's lease on dev
+size_t get_gpu_memory_lease(const int dev) {
+    ensure_initialized();
+    if (!region_has_device(dev) || memory_lease_size(dev) == 0)
+        return 0;
+    shrreg_proc_slot_t* slot = get_my_slot();
+    if (slot == NULL)
+        return 0;
+    return atomic_load_explicit(&proc_slot_used(slot, dev)->lease, memory_order_relaxed);
+}
+
+/**
+ * Take back the unallocated leases of all processes on dev, returns the
+ * number of bytes released to the device quota. The owners take a new
+ * lease, or charge their allocations one by one, on their next allocation.
+ */
+size_t reclaim_gpu_memory_leases(const int dev) {
+    ensure_initialized();
+    if (!region_has_device(dev))
+        return 0;
+    shared_region_t* region = region_info.shared_region;
+    size_t reclaimed = 0;
+    int i;
+    // Slots must not be compacted under us
+    lock_shrreg();
+    int proc_num = atomic_load_explicit(&region->proc_num, memory_order_acquire);
+    for (i = 0; i < proc_num; i++) {
+        shrreg_proc_slot_t* slot = &shrreg_procs(region)[i];
+        device_memory_t* used = proc_slot_used(slot, dev);
+        uint64_t lease = atomic_exchange_explicit(&used->lease, 0, memory_order_relaxed);
+        if (lease == 0)
+            continue;
+        seq_write_begin(used);
+        atomic_fetch_sub_explicit(&used->total, lease, memory_order_release);
+        sub_device_usage(slot, dev, lease);
+        seq_write_end(used);
+        reclaimed += lease;
+    }
+    unlock_shrreg();
+    if (reclaimed > 0) {
+        shrreg_record_sample(dev, SHRREG_SAMPLE_FREE);
+        LOG_INFO("Reclaimed %lu bytes of memory leases on device %d", reclaimed, dev);
+    }
+    return reclaimed;
+}
+
+/**
+ * Lock-free memory add using atomics with seqlock for consistent reads.
+ * With check_limit, the aggregate is only raised if it stays within the
+ * device limit and 1 is returned otherwise.
+ */
+static int charge_gpu_device_memory(int32_t pid, int cudadev, size_t usage, int type, int check_limit) {
     LOG_INFO("add_gpu_device_memory_lockfree:%d %d->%d %lu", pid, cudadev, cuda_to_nvml_map(cudadev), usage);
 
     int dev = cuda_to_nvml_map(cudadev);
     ensure_initialized();
 
-    // Fast path: use cached slot pointer for our own process
-    if (pid == getpid() && region_info.my_slot != NULL) {
-        shrreg_proc_slot_t* slot = region_info.my_slot;
-
-        // Seqlock protocol: increment to odd (write in progress)
-        atomic_fetch_add_explicit(&slot->seqlock, 1, memory_order_release);
+    if (!region_has_device(dev)) {
+        LOG_WARN("Device %d is not tracked by the shared region", dev);
+        return -1;
+    }
+    // Seqlock protocol: odd while the write is in progress
+    shrreg_proc_slot_t* slot;
+    device_memory_t* used = begin_slot_write(pid, dev, &slot);
+    if (used == NULL) {
+        LOG_WARN("Process slot not found for pid %d", pid);
+        return -1;
+    }
 
-        // Perform updates with release semantics for visibility
-        atomic_fetch_add_explicit(&slot->used[dev].total, usage, memory_order_release);
+    if (pid == region_info.pid && memory_lease_size(dev) != 0 &&
+        take_memory_lease(slot, used, dev, usage)) {
+        // Already part of total, only the breakdown changes
+        atomic_fetch_add_explicit(&used->allocated, usage, memory_order_relaxed);
+        record_memory_stats(slot, dev, atomic_load_explicit(&used->total, memory_order_relaxed), usage, type);
         switch (type) {
             case 0:
-                atomic_fetch_add_explicit(&slot->used[dev].context_size, usage, memory_order_release);
+                atomic_fetch_add_explicit(&used->context_size, usage, memory_order_relaxed);
                 break;
             case 1:
-                atomic_fetch_add_explicit(&slot->used[dev].module_size, usage, memory_order_release);
+                atomic_fetch_add_explicit(&used->module_size, usage, memory_order_relaxed);
                 break;
             case 2:
-                atomic_fetch_add_explicit(&slot->used[dev].data_size, usage, memory_order_release);
+                atomic_fetch_add_explicit(&used->data_size, usage, memory_order_relaxed);
                 break;
         }
+        seq_write_end(used);
+        return 0;
+    }
 
-        // Seqlock protocol: increment to even (write complete)
-        atomic_fetch_add_explicit(&slot->seqlock, 1, memory_order_release);
+    if (check_limit) {
+        if (!charge_device_quota(slot, dev, usage)) {
+            seq_write_end(used);
+            return 1;
+        }
+    } else {
+        add_device_usage(slot, dev, usage);
+    }
 
-        LOG_INFO("gpu_device_memory_added_lockfree:%d %d %lu", pid, dev, usage);
-        return 0;
+    // Perform updates with release semantics for visibility
+    uint64_t new_total = atomic_fetch_add_explicit(&used->total, usage, memory_order_release) + usage;
+    atomic_fetch_add_explicit(&used->allocated, usage, memory_order_release);
+    switch (type) {
+        case 0:
+            atomic_fetch_add_explicit(&used->context_size, usage, memory_order_release);
+            break;
+        case 1:
+            atomic_fetch_add_explicit(&used->module_size, usage, memory_order_release);
+            break;
+        case 2:
+            atomic_fetch_add_explicit(&used->data_size, usage, memory_order_release);
+            break;
     }
 
-    // Slow path: find slot for other process (still lock-free)
-    int proc_num = atomic_load_explicit(&region_info.shared_region->proc_num, memory_order_acquire);
-    int i;
-    for (i=0; i < proc_num; i++) {
-        int32_t slot_pid = atomic_load_explicit(&region_info.shared_region->procs[i].pid, memory_order_acquire);
-        if (slot_pid == pid) {
-            shrreg_proc_slot_t* slot = &region_info.shared_region->procs[i];
-
-            // Seqlock protocol: increment to odd (write in progress)
-            atomic_fetch_add_explicit(&slot->seqlock, 1, memory_order_release);
-
-            // Perform updates
-            atomic_fetch_add_explicit(&slot->used[dev].total, usage, memory_order_release);
-            switch (type) {
-                case 0:
-                    atomic_fetch_add_explicit(&slot->used[dev].context_size, usage, memory_order_release);
-                    break;
-                case 1:
-                    atomic_fetch_add_explicit(&slot->used[dev].module_size, usage, memory_order_release);
-                    break;
-                case 2:
-                    atomic_fetch_add_explicit(&slot->used[dev].data_size, usage, memory_order_release);
-                    break;
-            }
+    record_memory_stats(slot, dev, new_total, usage, type);
+    // Seqlock protocol: even again (write complete)
+    seq_write_end(used);
+    shrreg_record_sample(dev, SHRREG_SAMPLE_ALLOC);
 
-            // Seqlock protocol: increment to even (write complete)
-            atomic_fetch_add_explicit(&slot->seqlock, 1, memory_order_release);
+    LOG_INFO("gpu_device_memory_added_lockfree:%d %d %lu", pid, dev, usage);
+    return 0;
+}
 
-            LOG_INFO("gpu_device_memory_added_lockfree:%d %d %lu", pid, dev, usage);
-            return 0;
-        }
-    }
+int add_gpu_device_memory_usage(int32_t pid, int cudadev, size_t usage, int type) {
+    return charge_gpu_device_memory(pid, cudadev, usage, type, 0);
+}
 
-    LOG_WARN("Process slot not found for pid %d", pid);
-    return -1;
+int reserve_gpu_device_memory_usage(int32_t pid, int cudadev, size_t usage, int type) {
+    ensure_initialized();
+    // Admission reads the aggregate, 1.2 processes are in it as of the last sync
+    if (atomic_load_explicit(&region_info.shared_region->legacy_active, memory_order_relaxed))
+        shrreg_sync_legacy(region_info.shared_region, 0);
+    return charge_gpu_device_memory(pid, cudadev, usage, type, 1);
 }
 
 // Lock-free memory remove using atomics with seqlock for consistent reads
@@ -526,71 +1608,57 @@ int rm_gpu_device_memory_usage(int32_t pid, int cudadev, size_t usage, int type)
     int dev = cuda_to_nvml_map(cudadev);
     ensure_initialized();
 
-    // Fast path: use cached slot pointer for our own process
-    if (pid == getpid() && region_info.my_slot != NULL) {
-        shrreg_proc_slot_t* slot = region_info.my_slot;
-
-        // Seqlock protocol: increment to odd (write in progress)
-        atomic_fetch_add_explicit(&slot->seqlock, 1, memory_order_release);
+    if (!region_has_device(dev)) {
+        LOG_WARN("Device %d is not tracked by the shared region", dev);
+        return -1;
+    }
+    // Seqlock protocol: odd while the write is in progress
+    shrreg_proc_slot_t* slot;
+    device_memory_t* used = begin_slot_write(pid, dev, &slot);
+    if (used == NULL) {
+        LOG_WARN("Process slot not found for pid %d", pid);
+        return -1;
+    }
 
-        // Perform updates with release semantics
-        atomic_fetch_sub_explicit(&slot->used[dev].total, usage, memory_order_release);
+    if (pid == region_info.pid && memory_lease_size(dev) != 0) {
         switch (type) {
             case 0:
-                atomic_fetch_sub_explicit(&slot->used[dev].context_size, usage, memory_order_release);
+                atomic_fetch_sub_explicit(&used->context_size, usage, memory_order_relaxed);
                 break;
             case 1:
-                atomic_fetch_sub_explicit(&slot->used[dev].module_size, usage, memory_order_release);
+                atomic_fetch_sub_explicit(&used->module_size, usage, memory_order_relaxed);
                 break;
             case 2:
-                atomic_fetch_sub_explicit(&slot->used[dev].data_size, usage, memory_order_release);
+                atomic_fetch_sub_explicit(&used->data_size, usage, memory_order_relaxed);
                 break;
         }
-
-        // Seqlock protocol: increment to even (write complete)
-        atomic_fetch_add_explicit(&slot->seqlock, 1, memory_order_release);
-
-        uint64_t new_total = atomic_load_explicit(&slot->used[dev].total, memory_order_acquire);
-        LOG_INFO("after delete_lockfree:%lu", new_total);
+        return_memory_lease(slot, used, dev, usage);
+        seq_write_end(used);
         return 0;
     }
 
-    // Slow path: find slot for other process (still lock-free)
-    int proc_num = atomic_load_explicit(&region_info.shared_region->proc_num, memory_order_acquire);
-    int i;
-    for (i = 0; i < proc_num; i++) {
-        int32_t slot_pid = atomic_load_explicit(&region_info.shared_region->procs[i].pid, memory_order_acquire);
-        if (slot_pid == pid) {
-            shrreg_proc_slot_t* slot = &region_info.shared_region->procs[i];
-
-            // Seqlock protocol: increment to odd (write in progress)
-            atomic_fetch_add_explicit(&slot->seqlock, 1, memory_order_release);
-
-            // Perform updates
-            atomic_fetch_sub_explicit(&slot->used[dev].total, usage, memory_order_release);
-            switch (type) {
-                case 0:
-                    atomic_fetch_sub_explicit(&slot->used[dev].context_size, usage, memory_order_release);
-                    break;
-                case 1:
-                    atomic_fetch_sub_explicit(&slot->used[dev].module_size, usage, memory_order_release);
-                    break;
-                case 2:
-                    atomic_fetch_sub_explicit(&slot->used[dev].data_size, usage, memory_order_release);
-                    break;
-            }
-
-            // Seqlock protocol: increment to even (write complete)
-            atomic_fetch_add_explicit(&slot->seqlock, 1, memory_order_release);
-
-            uint64_t new_total = atomic_load_explicit(&slot->used[dev].total, memory_order_acquire);
-            LOG_INFO("after delete_lockfree:%lu", new_total);
-            return 0;
-        }
+    // Perform updates with release semantics
+    atomic_fetch_sub_explicit(&used->total, usage, memory_order_release);
+    sub_device_usage(slot, dev, usage);
+    switch (type) {
+        case 0:
+            atomic_fetch_sub_explicit(&used->context_size, usage, memory_order_release);
+            break;
+        case 1:
+            atomic_fetch_sub_explicit(&used->module_size, usage, memory_order_release);
+            break;
+        case 2:
+            atomic_fetch_sub_explicit(&used->data_size, usage, memory_order_release);
+            break;
     }
 
-    LOG_WARN("Process slot not found for pid %d", pid);
-    return -1;
+    // Seqlock protocol: even again (write complete)
+    seq_write_end(used);
+    shrreg_record_sample(dev, SHRREG_SAMPLE_FREE);
+
+    uint64_t new_total = atomic_load_explicit(&used->total, memory_order_acquire);
+    LOG_INFO("after delete_lockfree:%lu", new_total);
+    return 0;
 }
 
 void get_timespec(int seconds, struct timespec* spec) {
@@ -600,48 +1668,6 @@ void get_timespec(int seconds, struct timespec* spec) {
     spec->tv_nsec = 0;
 }
 
-int fix_lock_shrreg() {
-    int res = 1;
-    if (region_info.fd == -1) {
-        // should never happen
-        LOG_ERROR("Uninitialized shrreg");
-    }
-    // upgrade
-    if (lockf(region_info.fd, F_LOCK, SHARED_REGION_SIZE_MAGIC) != 0) {
-        LOG_ERROR("Fail to upgraded lock: errno=%d", errno);
-    }
-    SEQ_POINT_MARK(SEQ_FIX_SHRREG_ACQUIRE_FLOCK_OK);
-
-    shared_region_t* region = region_info.shared_region;
-    int32_t current_owner = region->owner_pid;
-    if (current_owner != 0) {
-        int flag = 0;
-        if (current_owner == region_info.pid) {
-            LOG_INFO("Detect owner pid = self pid (%d), "
-                "indicates pid loopback or race condition", current_owner);
-            flag = 1;
-        } else {
-            int proc_status = proc_alive(current_owner);
-            if (proc_status == PROC_STATE_NONALIVE) {
-                LOG_INFO("Kick dead owner proc (%d)", current_owner);
-                flag = 1;
-            }
-        }
-        if (flag == 1) {
-            LOG_INFO("Take upgraded lock (%d)", region_info.pid);
-            region->owner_pid = region_info.pid;
-            SEQ_POINT_MARK(SEQ_FIX_SHRREG_UPDATE_OWNER_OK);
-            res = 0;     
-        }
-    }
-
-    if (lockf(region_info.fd, F_ULOCK, SHARED_REGION_SIZE_MAGIC) != 0) {
-        LOG_ERROR("Fail to upgraded unlock: errno=%d", errno);
-    }
-    SEQ_POINT_MARK(SEQ_FIX_SHRREG_RELEASE_FLOCK_OK);
-    return res;
-}
-
 void exit_withlock(int exitcode) {
     unlock_shrreg();
     exit(exitcode);
@@ -658,33 +1684,261 @@ static inline void copy_proc_slot_atomic(shrreg_proc_slot_t* dst, shrreg_proc_sl
         atomic_load_explicit(&src->pid, memory_order_relaxed), memory_order_relaxed);
     atomic_store_explicit(&dst->hostpid,
         atomic_load_explicit(&src->hostpid, memory_order_relaxed), memory_order_relaxed);
-    atomic_store_explicit(&dst->seqlock,
-        atomic_load_explicit(&src->seqlock, memory_order_relaxed), memory_order_relaxed);
     atomic_store_explicit(&dst->status,
         atomic_load_explicit(&src->status, memory_order_relaxed), memory_order_relaxed);
+    dst->indexed_pid = src->indexed_pid;
+    dst->flags = src->flags;
+    dst->group = src->group;
+    dst->pidns = src->pidns;
+    atomic_store_explicit(&dst->cache_flush_ack,
+        atomic_load_explicit(&src->cache_flush_ack, memory_order_relaxed), memory_order_relaxed);
+
+    for (int dev = 0; dev < (int)region_info.shared_region->device_count; dev++) {
+        device_memory_t* dst_used = proc_slot_used(dst, dev);
+        device_memory_t* src_used = proc_slot_used(src, dev);
+        atomic_store_explicit(&dst_used->total,
+            atomic_load_explicit(&src_used->total, memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&dst_used->context_size,
+            atomic_load_explicit(&src_used->context_size, memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&dst_used->module_size,
+            atomic_load_explicit(&src_used->module_size, memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&dst_used->data_size,
+            atomic_load_explicit(&src_used->data_size, memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&dst_used->offset,
+            atomic_load_explicit(&src_used->offset, memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&dst_used->lease,
+            atomic_load_explicit(&src_used->lease, memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&dst_used->allocated,
+            atomic_load_explicit(&src_used->allocated, memory_order_relaxed), memory_order_relaxed);
+
+        device_util_t* dst_util = proc_slot_util(dst, dev);
+        device_util_t* src_util = proc_slot_util(src, dev);
+        atomic_store_explicit(&dst_util->monitorused,
+            atomic_load_explicit(&src_util->monitorused, memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&dst_util->dec_util,
+            atomic_load_explicit(&src_util->dec_util, memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&dst_util->enc_util,
+            atomic_load_explicit(&src_util->enc_util, memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&dst_util->sm_util,
+            atomic_load_explicit(&src_util->sm_util, memory_order_relaxed), memory_order_relaxed);
+
+        device_memory_stats_t* dst_stats = proc_slot_stats(dst, dev);
+        device_memory_stats_t* src_stats = proc_slot_stats(src, dev);
+        if (dst_stats != NULL) {
+            atomic_store_explicit(&dst_stats->peak,
+                atomic_load_explicit(&src_stats->peak, memory_order_relaxed), memory_order_relaxed);
+            for (int b = 0; b < SHRREG_SIZE_BUCKETS; b++)
+                atomic_store_explicit(&dst_stats->size_buckets[b],
+                    atomic_load_explicit(&src_stats->size_buckets[b], memory_order_relaxed), memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * Zero the per-device counters of a slot, hot and cold.
+ * pid, hostpid and status are left to the caller. The seqlocks are left
+ * as they are, a writer backing out of a moved slot may still be on it.
+ */
+static inline void reset_proc_slot_counters(shrreg_proc_slot_t* slot) {
+    for (int dev = 0; dev < (int)region_info.shared_region->device_count; dev++) {
+        device_memory_t* used = proc_slot_used(slot, dev);
+        atomic_store_explicit(&used->total, 0, memory_order_relaxed);
+        atomic_store_explicit(&used->context_size, 0, memory_order_relaxed);
+        atomic_store_explicit(&used->module_size, 0, memory_order_relaxed);
+        atomic_store_explicit(&used->data_size, 0, memory_order_relaxed);
+        atomic_store_explicit(&used->lease, 0, memory_order_relaxed);
+        atomic_store_explicit(&used->offset, 0, memory_order_relaxed);
+        atomic_store_explicit(&used->allocated, 0, memory_order_relaxed);
+        device_util_t* util = proc_slot_util(slot, dev);
+        atomic_store_explicit(&util->sm_util, 0, memory_order_relaxed);
+        atomic_store_explicit(&util->monitorused, 0, memory_order_relaxed);
+        device_memory_stats_t* stats = proc_slot_stats(slot, dev);
+        if (stats != NULL) {
+            atomic_store_explicit(&stats->peak, 0, memory_order_relaxed);
+            for (int b = 0; b < SHRREG_SIZE_BUCKETS; b++)
+                atomic_store_explicit(&stats->size_buckets[b], 0, memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * Retire a slot's usage from the per-device and group aggregates. Must be
+ * called before the slot is overwritten or zeroed, otherwise they leak.
+ * The total is taken out of the slot in the same step, so that a removal
+ * repeated after its lock owner died releases nothing twice.
+ */
+static inline void release_proc_slot_usage(shrreg_proc_slot_t* slot) {
+    shared_region_t* region = region_info.shared_region;
+    for (int dev = 0; dev < (int)region->device_count; dev++) {
+        device_memory_t* used = proc_slot_used(slot, dev);
+        seq_write_begin(used);
+        uint64_t total = atomic_exchange_explicit(&used->total, 0, memory_order_acq_rel);
+        // Both are part of the total just released
+        atomic_store_explicit(&used->lease, 0, memory_order_relaxed);
+        atomic_store_explicit(&used->offset, 0, memory_order_relaxed);
+        seq_write_end(used);
+        if (total != 0) {
+            sub_device_usage(slot, dev, total);
+        }
+    }
+}
+
+/**
+ * Name of the quota group of this process from CUDA_DEVICE_MEMORY_GROUP_ENV:
+ * a literal name, or the cgroup path of the process (or of its parent for
+ * "cgroup-parent"). A path longer than a group name keeps its tail, the
+ * part that tells containers apart. Returns 0 when the process has a group.
+ */
+static int get_proc_group_name(char* name, size_t len) {
+    const char* env = getenv(CUDA_DEVICE_MEMORY_GROUP_ENV);
+    if (env == NULL || env[0] == '\0')
+        return -1;
+    int parent = strcmp(env, "cgroup-parent") == 0;
+    if (!parent && strcmp(env, "cgroup") != 0) {
+        snprintf(name, len, "%s", env);
+        return 0;
+    }
+    FILE* f = fopen("/proc/self/cgroup", "r");
+    if (f == NULL) {
+        LOG_WARN("Fail to read /proc/self/cgroup, %s=%s is ignored", CUDA_DEVICE_MEMORY_GROUP_ENV, env);
+        return -1;
+    }
+    // The unified hierarchy if mounted ("0::/path"), otherwise the first one
+    char line[4096];
+    char path[4096] = "";
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char* p = strchr(line, ':');
+        p = p == NULL ? NULL : strchr(p + 1, ':');
+        if (p == NULL)
+            continue;
+        p[strcspn(p, "\n")] = '\0';
+        if (path[0] == '\0' || strncmp(line, "0::", 3) == 0)
+            snprintf(path, sizeof(path), "%s", p + 1);
+        if (strncmp(line, "0::", 3) == 0)
+            break;
+    }
+    fclose(f);
+    if (path[0] == '\0')
+        return -1;
+    if (parent) {
+        char* slash = strrchr(path, '/');
+        if (slash != NULL && slash != path)
+            *slash = '\0';
+        else
+            snprintf(path, sizeof(path), "/");
+    }
+    size_t plen = strlen(path);
+    snprintf(name, len, "%s", plen < len ? path : path + plen - (len - 1));
+    return 0;
+}
+
+static void set_group_limits(shrreg_group_t* group, int g) {
+    shared_region_t* region = region_info.shared_region;
+    uint64_t limits[CUDA_DEVICE_MAX_COUNT];
+    int count = region->device_count < CUDA_DEVICE_MAX_COUNT ? region->device_count : CUDA_DEVICE_MAX_COUNT;
+    size_t fallback_limit = get_limit_from_env(CUDA_DEVICE_MEMORY_GROUP_LIMIT_ENV);
+    int dev;
+    for (dev = 0; dev < count; dev++) {
+        char env_name[64];
+        snprintf(env_name, sizeof(env_name), "%s_%d", CUDA_DEVICE_MEMORY_GROUP_LIMIT_ENV, dev);
+        size_t cur_limit = getenv(env_name) != NULL ? get_limit_from_env(env_name) : fallback_limit;
+        limits[dev] = cur_limit;
+    }
+    for (dev = 0; dev < count; dev++) {
+        group_usage_t* usage = shrreg_group_usage(region, g, dev);
+        uint64_t cur = atomic_load_explicit(&usage->limit, memory_order_relaxed);
+        // The first member that sets a limit decides it
+        if (cur == 0) {
+            atomic_store_explicit(&usage->limit, limits[dev], memory_order_relaxed);
+        } else if (limits[dev] != 0 && limits[dev] != cur) {
+            LOG_WARN("Group %s keeps its memory limit %lu on device %d, not %lu",
+                group->name, cur, dev, limits[dev]);
+        }
+    }
+}
 
-    for (int dev = 0; dev < CUDA_DEVICE_MAX_COUNT; dev++) {
-        atomic_store_explicit(&dst->used[dev].total,
-            atomic_load_explicit(&src->used[dev].total, memory_order_relaxed), memory_order_relaxed);
-        atomic_store_explicit(&dst->used[dev].context_size,
-            atomic_load_explicit(&src->used[dev].context_size, memory_order_relaxed), memory_order_relaxed);
-        atomic_store_explicit(&dst->used[dev].module_size,
-            atomic_load_explicit(&src->used[dev].module_size, memory_order_relaxed), memory_order_relaxed);
-        atomic_store_explicit(&dst->used[dev].data_size,
-            atomic_load_explicit(&src->used[dev].data_size, memory_order_relaxed), memory_order_relaxed);
-        atomic_store_explicit(&dst->used[dev].offset,
-            atomic_load_explicit(&src->used[dev].offset, memory_order_relaxed), memory_order_relaxed);
+static void free_group_nolock(int g) {
+    shared_region_t* region = region_info.shared_region;
+    shrreg_group_t* group = shrreg_group(region, g);
+    int dev;
+    // Usage still charged was lost in a race with a slot move, no one owns it
+    for (dev = 0; dev < (int)region->device_count; dev++) {
+        atomic_store_explicit(&shrreg_group_usage(region, g, dev)->usage, 0, memory_order_relaxed);
+        atomic_store_explicit(&shrreg_group_usage(region, g, dev)->limit, 0, memory_order_relaxed);
+    }
+    group->procs = 0;
+    memset(group->name, 0, sizeof(group->name));
+}
 
-        atomic_store_explicit(&dst->monitorused[dev],
-            atomic_load_explicit(&src->monitorused[dev], memory_order_relaxed), memory_order_relaxed);
+// Member counts are derived from the slots, a join or leave may have been cut short
+static void recount_groups_nolock() {
+    shared_region_t* region = region_info.shared_region;
+    shrreg_proc_slot_t* procs = shrreg_procs(region);
+    int g, i;
+    if (region->groups_offset == 0)
+        return;
+    for (g = 0; g < (int)region->group_count; g++)
+        shrreg_group(region, g)->procs = 0;
+    for (i = 0; i < region->proc_num; i++) {
+        g = procs[i].group - 1;
+        if (g >= 0 && g < (int)region->group_count && shrreg_group(region, g)->name[0] != '\0')
+            shrreg_group(region, g)->procs++;
+        else
+            procs[i].group = 0;
+    }
+    for (g = 0; g < (int)region->group_count; g++) {
+        if (shrreg_group(region, g)->procs == 0 && shrreg_group(region, g)->name[0] != '\0')
+            free_group_nolock(g);
+    }
+}
 
-        atomic_store_explicit(&dst->device_util[dev].dec_util,
-            atomic_load_explicit(&src->device_util[dev].dec_util, memory_order_relaxed), memory_order_relaxed);
-        atomic_store_explicit(&dst->device_util[dev].enc_util,
-            atomic_load_explicit(&src->device_util[dev].enc_util, memory_order_relaxed), memory_order_relaxed);
-        atomic_store_explicit(&dst->device_util[dev].sm_util,
-            atomic_load_explicit(&src->device_util[dev].sm_util, memory_order_relaxed), memory_order_relaxed);
+/**
+ * Put slot into the quota group of this process, claiming a free entry for
+ * a group seen for the first time. Without a group, or with all entries in
+ * use, only the device limits apply.
+ */
+static void join_proc_group_nolock(shrreg_proc_slot_t* slot) {
+    shared_region_t* region = region_info.shared_region;
+    char name[SHRREG_GROUP_NAME_LEN];
+    slot->group = 0;
+    if (region->groups_offset == 0 || get_proc_group_name(name, sizeof(name)) != 0)
+        return;
+    int g, free_g = -1;
+    for (g = 0; g < (int)region->group_count; g++) {
+        shrreg_group_t* group = shrreg_group(region, g);
+        if (group->name[0] == '\0') {
+            if (free_g < 0)
+                free_g = g;
+        } else if (strncmp(group->name, name, SHRREG_GROUP_NAME_LEN) == 0) {
+            break;
+        }
     }
+    if (g == (int)region->group_count) {
+        if (free_g < 0) {
+            LOG_WARN("All %lu quota groups are in use, group %s is not limited", region->group_count, name);
+            return;
+        }
+        g = free_g;
+        free_group_nolock(g);
+        memcpy(shrreg_group(region, g)->name, name, SHRREG_GROUP_NAME_LEN);
+    }
+    shrreg_group_t* group = shrreg_group(region, g);
+    set_group_limits(group, g);
+    group->procs++;
+    slot->group = g + 1;
+    LOG_INFO("Joined quota group %d (%s), %d processes", g, group->name, group->procs);
+}
+
+// Take slot out of its group, after release_proc_slot_usage()
+static void leave_proc_group_nolock(shrreg_proc_slot_t* slot) {
+    shared_region_t* region = region_info.shared_region;
+    if (slot->group <= 0 || slot->group > (int)region->group_count)
+        return;
+    int g = slot->group - 1;
+    shrreg_group_t* group = shrreg_group(region, g);
+    slot->group = 0;
+    if (--group->procs <= 0)
+        free_group_nolock(g);
 }
 
 void exit_handler() {
@@ -711,24 +1965,26 @@ void exit_handler() {
         size_t expected = (size_t)my_pid;
         if (atomic_compare_exchange_strong_explicit(&region->owner_pid, &expected, 0,
                                                     memory_order_release, memory_order_acquire)) {
-            LOG_DEBUG("Released owner_pid and posting semaphore");
-            sem_post(&region->sem);  // Unlock the semaphore
+            LOG_DEBUG("Released owner_pid and unlocking shrreg");
+            // Fails with EPERM if another thread holds it; the robust
+            // mutex is then released by the kernel when we are gone
+            pthread_mutex_unlock(&region->lock);
         }
     }
 
     // 2. Mark our process slot as exited (atomic, no lock needed)
     // Set PID to 0 so it's detected as dead by clear_proc_slot_nolock()
-    for (int slot = 0; slot < SHARED_REGION_MAX_PROCESS_NUM; slot++) {
-        int32_t slot_pid = atomic_load_explicit(&region->procs[slot].pid, memory_order_acquire);
-        if (slot_pid == my_pid) {
-            LOG_DEBUG("Marking process slot %d as dead (PID %d)", slot, my_pid);
-            // Atomically set PID to 0 - this marks the slot as available
-            atomic_store_explicit(&region->procs[slot].pid, 0, memory_order_release);
-            // Also set status to 0 (inactive)
-            atomic_store_explicit(&region->procs[slot].status, 0, memory_order_release);
-            break;
-        }
-    }
+    shrreg_proc_slot_t* slot = find_proc_by_pid(my_pid);
+    if (slot != NULL) {
+        LOG_DEBUG("Marking process slot %ld as dead (PID %d)", (long)proc_slot_index(slot), my_pid);
+        // Atomically set PID to 0 - this marks the slot as available
+        atomic_store_explicit(&slot->pid, 0, memory_order_release);
+        // Also set status to 0 (inactive)
+        atomic_store_explicit(&slot->status, 0, memory_order_release);
+    }
+    // The slot may be reaped and reused from now on, later frees from
+    // other atexit handlers must not touch it through the cached pointer
+    region_info.my_slot = NULL;
 
     // That's it! The slot will be physically removed by clear_proc_slot_nolock()
     // when the next process acquires the lock. This is lazy cleanup.
@@ -737,71 +1993,95 @@ void exit_handler() {
 }
 
 
+/**
+ * Bring the structures guarded by lock_shrreg back to a usable state
+ * after its owner died inside the critical section. A slot add or
+ * removal may have been cut short, the index is derived state and is
+ * rebuilt from procs[].
+ */
+static void recover_shrreg_nolock(size_t dead_owner) {
+    shared_region_t* region = region_info.shared_region;
+    LOG_WARN("Owner %ld died holding shrreg, repairing %d slots", dead_owner, region->proc_num);
+    if (region->proc_num < 0)
+        region->proc_num = 0;
+    if (region->proc_num > (int)region->max_procs)
+        region->proc_num = region->max_procs;
+    // A slot add or removal was cut short, the slots are usable as they are
+    if (atomic_load_explicit(&region->epoch, memory_order_relaxed) & 1)
+        atomic_fetch_add_explicit(&region->epoch, 1, memory_order_release);
+    proc_index_rebuild(shrreg_pid_index(region), 0);
+    proc_index_rebuild(shrreg_hostpid_index(region), 1);
+    recount_groups_nolock();
+}
+
+/**
+ * Acquire a robust process-shared mutex. A dead owner is reported by
+ * EOWNERDEAD as soon as the kernel has released its robust list, so
+ * there is no polling of proc_alive(). Returns 0 or an errno value from
+ * pthread_mutex_timedlock(). *recovered is set when the caller must
+ * repair the protected state and call pthread_mutex_consistent().
+ */
+static int lock_robust_mutex(pthread_mutex_t* mutex, int timeout_sec, int* recovered) {
+    struct timespec ts;
+    get_timespec(timeout_sec, &ts);
+    int res = pthread_mutex_timedlock(mutex, &ts);
+    *recovered = (res == EOWNERDEAD);
+    return res == EOWNERDEAD ? 0 : res;
+}
+
+static uint64_t monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
 void lock_shrreg() {
     shared_region_t* region = region_info.shared_region;
     int trials = 0;
-    while (1) {
-        // CRITICAL: Create fresh timeout for each iteration!
-        // If created outside loop, timestamp becomes stale after first timeout
-        struct timespec sem_ts;
-        get_timespec(SEM_WAIT_TIME, &sem_ts);
-
-        int status = sem_timedwait(&region->sem, &sem_ts);
+    int recovered;
+    // Only a lock that is already held is timed, see the lock_* statistics
+    int status = pthread_mutex_trylock(&region->lock);
+    recovered = (status == EOWNERDEAD);
+    if (recovered)
+        status = 0;
+    uint64_t wait_start = 0;
+    if (status != 0) {
+        atomic_fetch_add_explicit(&region->lock_contended, 1, memory_order_relaxed);
+        wait_start = monotonic_us();
+    }
+    while (status != 0) {
+        status = lock_robust_mutex(&region->lock, SEM_WAIT_TIME, &recovered);
         SEQ_POINT_MARK(SEQ_ACQUIRE_SEMLOCK_OK);
 
         if (status == 0) {
-            // TODO: irregular exit here will hang pending locks
-            region->owner_pid = region_info.pid;
-            __sync_synchronize();
-            SEQ_POINT_MARK(SEQ_UPDATE_OWNER_OK);
-            trials = 0;
+            atomic_fetch_add_explicit(&region->lock_wait_us, monotonic_us() - wait_start, memory_order_relaxed);
             break;
-        } else if (errno == ETIMEDOUT) {
+        } else if (status == ETIMEDOUT) {
+            // The owner is alive (a dead one would have been reported), keep waiting
             trials++;
-            size_t current_owner = atomic_load_explicit(&region->owner_pid, memory_order_acquire);
-
             if (trials <= 3 || trials % 5 == 0) {  // Log first 3, then every 5th
-                LOG_WARN("Lock shrreg timeout (trial %d/%d), owner=%ld",
-                         trials, SEM_WAIT_RETRY_TIMES, current_owner);
-            }
-
-            // SIGKILL RECOVERY: Check if owner is dead (the ONLY case where exit cleanup fails)
-            if (current_owner != 0) {
-                int owner_status = proc_alive((int32_t)current_owner);
-                if (owner_status == PROC_STATE_NONALIVE) {
-                    LOG_WARN("Owner %ld is dead (was SIGKILL'd), cleaning up stale lock", current_owner);
-                    // Use CAS so only one process does this
-                    size_t expected = current_owner;
-                    if (atomic_compare_exchange_strong_explicit(&region->owner_pid, &expected, 0,
-                                                               memory_order_release, memory_order_acquire)) {
-                        LOG_WARN("Cleared dead owner_pid and posting semaphore");
-                        sem_post(&region->sem);  // Unlock
-                        usleep(10000);  // 10ms for semaphore to propagate
-                        continue;  // Retry immediately
-                    }
-                    // Another process is handling it, wait a bit
-                    usleep(100000);  // 100ms
-                    continue;
-                }
-                continue;  // slow wait path
-            }
-
-            // If we're still waiting after many tries, something is seriously wrong
-            if (trials > 30) {  // 30 × 10s = 5 minutes
-                LOG_ERROR("Cannot acquire lock after 5 minutes, owner=%ld", current_owner);
-                if (current_owner != 0 && proc_alive((int32_t)current_owner) == PROC_STATE_ALIVE) {
-                    LOG_ERROR("Owner is still ALIVE - this is a deadlock bug!");
-                } else {
-                    LOG_ERROR("This should not happen - please report this bug");
-                }
-                LOG_ERROR("Workaround: Delete /tmp/cudevshr.cache and restart all processes");
-                exit(-1);
+                size_t current_owner = atomic_load_explicit(&region->owner_pid, memory_order_acquire);
+                LOG_WARN("Lock shrreg timeout (trial %d), owner=%ld", trials, current_owner);
             }
-            continue;  // Keep retrying
+            continue;
+        } else if (status == ENOTRECOVERABLE) {
+            LOG_ERROR("Shrreg lock is not recoverable");
+            LOG_ERROR("Workaround: Delete /tmp/cudevshr.cache and restart all processes");
+            exit(-1);
         } else {
-            LOG_ERROR("Failed to lock shrreg: %d", errno);
+            LOG_ERROR("Failed to lock shrreg: %d", status);
+            usleep(1000);
         }
     }
+    atomic_fetch_add_explicit(&region->lock_acquired, 1, memory_order_relaxed);
+    if (recovered) {
+        atomic_fetch_add_explicit(&region->lock_recovered, 1, memory_order_relaxed);
+        recover_shrreg_nolock(atomic_load_explicit(&region->owner_pid, memory_order_acquire));
+        pthread_mutex_consistent(&region->lock);
+    }
+    region->owner_pid = region_info.pid;
+    __sync_synchronize();
+    SEQ_POINT_MARK(SEQ_UPDATE_OWNER_OK);
 }
 
 void unlock_shrreg() {
@@ -810,10 +2090,9 @@ void unlock_shrreg() {
 
     __sync_synchronize();
     region->owner_pid = 0;
-    // TODO: irregular exit here will hang pending locks
     SEQ_POINT_MARK(SEQ_RESET_OWNER_OK);
 
-    sem_post(&region->sem);
+    pthread_mutex_unlock(&region->lock);
     SEQ_POINT_MARK(SEQ_RELEASE_SEMLOCK_OK);
 }
 
@@ -821,32 +2100,34 @@ int lock_postinit() {
     shared_region_t* region = region_info.shared_region;
     int trials = 0;
     while (1) {
-        // CRITICAL: Create fresh timeout for each iteration!
-        // If created outside loop, timestamp becomes stale after first timeout
         // Use longer timeout for postinit since set_task_pid() can take several seconds
-        struct timespec sem_ts;
-        get_timespec(SEM_WAIT_TIME_POSTINIT, &sem_ts);
-
-        int status = sem_timedwait(&region->sem_postinit, &sem_ts);
+        int recovered;
+        int status = lock_robust_mutex(&region->lock_postinit, SEM_WAIT_TIME_POSTINIT, &recovered);
         if (status == 0) {
-            // Lock acquired successfully
+            // Nothing to repair, the lock only serializes host PID detection
+            if (recovered) {
+                LOG_WARN("Previous postinit lock owner died, taking over (PID %d)", getpid());
+                pthread_mutex_consistent(&region->lock_postinit);
+            }
             LOG_DEBUG("Acquired postinit lock after %d waits (PID %d)", trials, getpid());
             return 1;  // Success
-        } else if (errno == ETIMEDOUT) {
+        } else if (status == ETIMEDOUT) {
             trials++;
             LOG_MSG("Waiting for postinit lock (trial %d/%d, waited %ds, PID %d)",
                     trials, SEM_WAIT_RETRY_TIMES_POSTINIT, trials * SEM_WAIT_TIME_POSTINIT, getpid());
 
             // After many retries, give up
             if (trials > SEM_WAIT_RETRY_TIMES_POSTINIT) {
-                LOG_ERROR("Postinit lock timeout after %d seconds - another process may have crashed",
+                LOG_ERROR("Postinit lock timeout after %d seconds - another process may be stuck",
                           SEM_WAIT_RETRY_TIMES_POSTINIT * SEM_WAIT_TIME_POSTINIT);
                 LOG_ERROR("Skipping host PID detection for this process (will use container PID)");
                 return 0;  // Timeout - didn't acquire lock
             }
             continue;
         } else {
-            LOG_ERROR("Failed to lock postinit semaphore: errno=%d", errno);
+            LOG_ERROR("Failed to lock postinit mutex: %d", status);
+            if (status == ENOTRECOVERABLE)
+                return 0;
             // Don't give up - keep retrying
             trials++;
             continue;
@@ -856,169 +2137,231 @@ int lock_postinit() {
 
 void unlock_postinit() {
     shared_region_t* region = region_info.shared_region;
-    sem_post(&region->sem_postinit);
+    pthread_mutex_unlock(&region->lock_postinit);
 }
 
+/**
+ * Remove a slot by moving the last slot into it. The vacated last slot is
+ * always cleared, so that its owner notices the move in get_my_slot().
+ */
+static void remove_proc_slot_nolock(int slot) {
+    shared_region_t* region = region_info.shared_region;
+    shrreg_proc_slot_t* procs = shrreg_procs(region);
+    shrreg_proc_slot_t* dead = &procs[slot];
+    atomic_fetch_add(&region->epoch, 1);
+    release_proc_slot_usage(dead);
+    leave_proc_group_nolock(dead);
+    drop_cache_flusher_nolock(dead);
+    proc_index_remove(shrreg_pid_index(region), dead->indexed_pid, slot);
+    proc_index_remove(shrreg_hostpid_index(region),
+        atomic_load_explicit(&dead->hostpid, memory_order_relaxed), slot);
+
+    int last = --region->proc_num;
+    shrreg_proc_slot_t* moved = &procs[last];
+    if (slot != last) {
+        wait_slot_writers(moved);
+        copy_proc_slot_atomic(dead, moved);
+        proc_index_move(shrreg_pid_index(region), moved->indexed_pid, last, slot);
+        proc_index_move(shrreg_hostpid_index(region),
+            atomic_load_explicit(&moved->hostpid, memory_order_relaxed), last, slot);
+        if (region_info.my_slot == moved)
+            region_info.my_slot = dead;
+    }
+    atomic_store_explicit(&moved->pid, 0, memory_order_release);
+    atomic_store_explicit(&moved->hostpid, 0, memory_order_relaxed);
+    atomic_store_explicit(&moved->status, 0, memory_order_release);
+    // Threads of the moved process sleeping on the old slot look it up again
+    futex_wake_shared(&moved->status);
+    moved->indexed_pid = 0;
+    moved->flags = 0;
+    moved->pidns = 0;
+    // moved->group stays for a writer still on the old slot, it is set when the slot is reused
+    reset_proc_slot_counters(moved);
+    __sync_synchronize();
+    atomic_fetch_add_explicit(&region->epoch, 1, memory_order_release);
+}
 
-int clear_proc_slot_nolock(int do_clear) {
+/**
+ * Remove the slots of exited processes, marked by their exit_handler() or
+ * by a reaper. Liveness is never checked here, see multiprocess_reaper.c,
+ * so that the critical section stays short.
+ */
+int clear_proc_slot_nolock() {
     int slot = 0;
-    int res=0;
-    int cleaned_pid_zero = 0;
-    int cleaned_dead = 0;
+    int cleaned = 0;
     shared_region_t* region = region_info.shared_region;
+    shrreg_proc_slot_t* procs = shrreg_procs(region);
     while (slot < region->proc_num) {
-        int32_t pid = atomic_load_explicit(&region->procs[slot].pid, memory_order_acquire);
-
-        // Skip slots that are already marked as dead (PID=0) by exit cleanup
-        if (pid == 0) {
-            LOG_DEBUG("Removing slot %d with PID=0 (marked dead by exit cleanup)", slot);
-            cleaned_pid_zero++;
-            res=1;
-            region->proc_num--;
-            copy_proc_slot_atomic(&region->procs[slot], &region->procs[region->proc_num]);
-            if (region_info.my_slot != NULL && region_info.my_slot == &region->procs[region->proc_num]) {
-                region_info.my_slot = &region->procs[slot];
-                atomic_store_explicit(&region->procs[region->proc_num].seqlock, 0, memory_order_relaxed);
-                atomic_store_explicit(&region->procs[region->proc_num].pid, 0, memory_order_release);
-                atomic_store_explicit(&region->procs[region->proc_num].hostpid, 0, memory_order_relaxed);
-                atomic_store_explicit(&region->procs[region->proc_num].status, 0, memory_order_release);
-
-                for (int dev = 0; dev < CUDA_DEVICE_MAX_COUNT; dev++) {
-                    atomic_store_explicit(&region->procs[region->proc_num].used[dev].total, 0, memory_order_relaxed);
-                    atomic_store_explicit(
-                        &region->procs[region->proc_num].used[dev].context_size, 0, memory_order_relaxed);
-                    atomic_store_explicit(
-                        &region->procs[region->proc_num].used[dev].module_size, 0, memory_order_relaxed);
-                    atomic_store_explicit(
-                        &region->procs[region->proc_num].used[dev].data_size, 0, memory_order_relaxed);
-                    atomic_store_explicit(
-                        &region->procs[region->proc_num].device_util[dev].sm_util, 0, memory_order_relaxed);
-                    atomic_store_explicit(&region->procs[region->proc_num].monitorused[dev], 0, memory_order_relaxed);
-                }
-            }
-            __sync_synchronize();
-
-            // Don't increment slot - check the moved element
-            continue;
-        }
-
-        // Only check proc_alive() if do_clear is enabled and PID is non-zero
-        // Limit to 10 checks per call to avoid holding lock too long
-        if (do_clear > 0 && cleaned_dead < 10 && proc_alive(pid) == PROC_STATE_NONALIVE) {
-            LOG_WARN("Kick dead proc %d (proc_alive check)", pid);
-            cleaned_dead++;
-            res = 1;
-            region->proc_num--;
-            copy_proc_slot_atomic(&region->procs[slot], &region->procs[region->proc_num]);
-            if (region_info.my_slot != NULL && region_info.my_slot == &region->procs[region->proc_num]) {
-                region_info.my_slot = &region->procs[slot];
-                atomic_store_explicit(&region->procs[region->proc_num].seqlock, 0, memory_order_relaxed);
-                atomic_store_explicit(&region->procs[region->proc_num].pid, 0, memory_order_release);
-                atomic_store_explicit(&region->procs[region->proc_num].hostpid, 0, memory_order_relaxed);
-                atomic_store_explicit(&region->procs[region->proc_num].status, 0, memory_order_release);
-
-                for (int dev = 0; dev < CUDA_DEVICE_MAX_COUNT; dev++) {
-                    atomic_store_explicit(&region->procs[region->proc_num].used[dev].total, 0, memory_order_relaxed);
-                    atomic_store_explicit(
-                        &region->procs[region->proc_num].used[dev].context_size, 0, memory_order_relaxed);
-                    atomic_store_explicit(
-                        &region->procs[region->proc_num].used[dev].module_size, 0, memory_order_relaxed);
-                    atomic_store_explicit(
-                        &region->procs[region->proc_num].used[dev].data_size, 0, memory_order_relaxed);
-                    atomic_store_explicit(
-                        &region->procs[region->proc_num].device_util[dev].sm_util, 0, memory_order_relaxed);
-                    atomic_store_explicit(&region->procs[region->proc_num].monitorused[dev], 0, memory_order_relaxed);
-                }
-            }
-            __sync_synchronize();
+        if (atomic_load_explicit(&procs[slot].pid, memory_order_acquire) == 0) {
+            LOG_DEBUG("Removing slot %d of an exited process", slot);
+            cleaned++;
+            remove_proc_slot_nolock(slot);
             // Don't increment slot - check the moved element
             continue;
         }
-
-        // Slot is valid, move to next
         slot++;
     }
-    if (cleaned_pid_zero > 0 || cleaned_dead > 0) {
-        LOG_INFO("Cleaned %d PID=0 slots, %d dead proc slots (proc_num now %d)",
-                 cleaned_pid_zero, cleaned_dead, region->proc_num);
+    if (cleaned > 0) {
+        LOG_INFO("Cleaned %d exited proc slots (proc_num now %d)", cleaned, region->proc_num);
     }
+    return cleaned > 0;
+}
+
+int reap_dead_proc_slots() {
+    ensure_initialized();
+    lock_shrreg();
+    int res = clear_proc_slot_nolock();
+    unlock_shrreg();
     return res;
 }
 
+// Mark the slot of pid like its exit_handler() would
+int shrreg_mark_proc_dead(int32_t pid) {
+    ensure_initialized();
+    shrreg_proc_slot_t* slot = find_proc_by_pid(pid);
+    if (slot == NULL)
+        return 0;
+    int32_t expected = pid;
+    if (!atomic_compare_exchange_strong_explicit(&slot->pid, &expected, 0,
+                                                 memory_order_release, memory_order_relaxed))
+        return 0;
+    atomic_store_explicit(&slot->status, 0, memory_order_release);
+    LOG_WARN("Kick dead proc %d", pid);
+    return 1;
+}
+
+int shrreg_list_proc_pids(int32_t* pids, int max, uint64_t* epoch) {
+    ensure_initialized();
+    shared_region_t* region = region_info.shared_region;
+    shrreg_proc_slot_t* procs = shrreg_procs(region);
+    int retries;
+    for (retries = 0; retries < SHRREG_SNAPSHOT_RETRIES; retries++) {
+        uint64_t e = shrreg_epoch_begin(region);
+        int proc_num = atomic_load_explicit(&region->proc_num, memory_order_acquire);
+        int i, n = 0;
+        for (i = 0; i < proc_num && n < max; i++) {
+            int32_t pid = atomic_load_explicit(&procs[i].pid, memory_order_relaxed);
+            // Mirrored 1.2 processes are reaped by shrreg_sync_legacy(), the
+            // pids of other pid namespaces can't be watched from here
+            if (pid != 0 && pid != region_info.pid && !(procs[i].flags & SHRREG_SLOT_LEGACY) &&
+                procs[i].pidns == region_info.pidns)
+                pids[n++] = pid;
+        }
+        if (!shrreg_epoch_retry(region, e)) {
+            *epoch = e;
+            return n;
+        }
+        sched_yield();
+    }
+    return -1;
+}
+
+uint64_t shrreg_current_epoch() {
+    ensure_initialized();
+    return shrreg_epoch_begin(region_info.shared_region);
+}
+
+int shrreg_max_procs() {
+    ensure_initialized();
+    return region_info.shared_region->max_procs;
+}
+
+shrreg_proc_slot_t* shrreg_add_proc_slot_nolock(int32_t pid) {
+    shared_region_t* region = region_info.shared_region;
+    int proc_num = atomic_load_explicit(&region->proc_num, memory_order_acquire);
+    if (proc_num >= (int)region->max_procs) {
+        LOG_ERROR("All %u process slots of the shared region are in use", region->max_procs);
+        return NULL;
+    }
+    // Initialize new slot with atomics
+    shrreg_proc_slot_t* slot = &shrreg_procs(region)[proc_num];
+    atomic_fetch_add_explicit(&region->epoch, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    reset_proc_slot_counters(slot);
+    slot->indexed_pid = pid;
+    slot->flags = 0;
+    slot->group = 0;
+    slot->pidns = region_info.pidns;
+    atomic_store_explicit(&slot->pid, pid, memory_order_release);
+    atomic_store_explicit(&slot->hostpid, 0, memory_order_relaxed);
+    atomic_store_explicit(&slot->status, 1, memory_order_release);
+    atomic_fetch_add_explicit(&region->proc_num, 1, memory_order_release);
+    proc_index_insert(shrreg_pid_index(region), pid, proc_num, 0);
+    atomic_fetch_add_explicit(&region->epoch, 1, memory_order_release);
+    return slot;
+}
+
+void shrreg_set_proc_hostpid_nolock(shrreg_proc_slot_t* slot, int32_t hostpid) {
+    shared_region_t* region = region_info.shared_region;
+    int i = proc_slot_index(slot);
+    proc_index_remove(shrreg_hostpid_index(region),
+        atomic_load_explicit(&slot->hostpid, memory_order_relaxed), i);
+    atomic_store_explicit(&slot->hostpid, hostpid, memory_order_release);
+    proc_index_insert(shrreg_hostpid_index(region), hostpid, i, 1);
+}
+
 void init_proc_slot_withlock() {
     int32_t current_pid = getpid();
     lock_shrreg();  // Still need lock for modifying process slots
-    shared_region_t* region = region_info.shared_region;
 
-    int proc_num = atomic_load_explicit(&region->proc_num, memory_order_acquire);
-    if (proc_num >= SHARED_REGION_MAX_PROCESS_NUM) {
-        exit_withlock(-1);
-    }
     signal(SIGUSR2,sig_swap_stub);
     signal(SIGUSR1,sig_restore_stub);
 
     // If, by any means a pid of itself is found in region->process, then it is probably caused by crashloop
     // we need to reset it.
-    int i,found=0;
-    for (i=0; i < proc_num; i++) {
-        int32_t slot_pid = atomic_load_explicit(&region->procs[i].pid, memory_order_acquire);
-        if (slot_pid == current_pid) {
-            atomic_store_explicit(&region->procs[i].seqlock, 0, memory_order_relaxed);  // Reset seqlock
-            atomic_store_explicit(&region->procs[i].status, 1, memory_order_release);
-
-            // Zero out atomics
-            for (int dev = 0; dev < CUDA_DEVICE_MAX_COUNT; dev++) {
-                atomic_store_explicit(&region->procs[i].used[dev].total, 0, memory_order_relaxed);
-                atomic_store_explicit(&region->procs[i].used[dev].context_size, 0, memory_order_relaxed);
-                atomic_store_explicit(&region->procs[i].used[dev].module_size, 0, memory_order_relaxed);
-                atomic_store_explicit(&region->procs[i].used[dev].data_size, 0, memory_order_relaxed);
-                atomic_store_explicit(&region->procs[i].device_util[dev].sm_util, 0, memory_order_relaxed);
-                atomic_store_explicit(&region->procs[i].monitorused[dev], 0, memory_order_relaxed);
-            }
-
-            region_info.my_slot = &region->procs[i];  // Cache our slot pointer
-            found = 1;
-            break;
-        }
-    }
-
-    if (!found) {
-        // Initialize new slot with atomics
-        atomic_store_explicit(&region->procs[proc_num].seqlock, 0, memory_order_relaxed);  // Start with even (no write)
-        atomic_store_explicit(&region->procs[proc_num].pid, current_pid, memory_order_release);
-        atomic_store_explicit(&region->procs[proc_num].hostpid, 0, memory_order_relaxed);
-        atomic_store_explicit(&region->procs[proc_num].status, 1, memory_order_release);
-
-        for (int dev = 0; dev < CUDA_DEVICE_MAX_COUNT; dev++) {
-            atomic_store_explicit(&region->procs[proc_num].used[dev].total, 0, memory_order_relaxed);
-            atomic_store_explicit(&region->procs[proc_num].used[dev].context_size, 0, memory_order_relaxed);
-            atomic_store_explicit(&region->procs[proc_num].used[dev].module_size, 0, memory_order_relaxed);
-            atomic_store_explicit(&region->procs[proc_num].used[dev].data_size, 0, memory_order_relaxed);
-            atomic_store_explicit(&region->procs[proc_num].device_util[dev].sm_util, 0, memory_order_relaxed);
-            atomic_store_explicit(&region->procs[proc_num].monitorused[dev], 0, memory_order_relaxed);
-        }
-
-        region_info.my_slot = &region->procs[proc_num];  // Cache our slot pointer
-        atomic_fetch_add_explicit(&region->proc_num, 1, memory_order_release);
+    shrreg_proc_slot_t* slot = find_proc_by_pid(current_pid);
+    if (slot != NULL) {
+        release_proc_slot_usage(slot);
+        leave_proc_group_nolock(slot);
+        drop_cache_flusher_nolock(slot);
+        atomic_store_explicit(&slot->status, 1, memory_order_release);
+        slot->flags = 0;
+        // Zero out the counters
+        reset_proc_slot_counters(slot);
+
+        region_info.my_slot = slot;  // Cache our slot pointer
+    } else {
+        slot = shrreg_add_proc_slot_nolock(current_pid);
+        if (slot == NULL)
+            exit_withlock(-1);
+        region_info.my_slot = slot;  // Cache our slot pointer
     }
+    join_proc_group_nolock(slot);
 
-    clear_proc_slot_nolock(1);
+    clear_proc_slot_nolock();
     unlock_shrreg();
 }
 
 void print_all() {
     int i;
-    LOG_INFO("Total process: %d",region_info.shared_region->proc_num);
-    for (i=0;i<region_info.shared_region->proc_num;i++) {
-        for (int dev=0;dev<CUDA_DEVICE_MAX_COUNT;dev++){
+    shared_region_t* region = region_info.shared_region;
+    shrreg_snapshot_t* snap = shrreg_snapshot_alloc(region);
+    if (snap == NULL || shrreg_snapshot(region, snap) != 0) {
+        LOG_ERROR("Fail to snapshot shrreg");
+        shrreg_snapshot_free(snap);
+        return;
+    }
+    LOG_INFO("Region version %u.%u, %u devices, %u process slots, %lu bytes",
+        region->major_version, region->minor_version,
+        region->device_count, region->max_procs, region->region_size);
+    LOG_INFO("Total process: %d", snap->proc_num);
+    for (i=0;i<snap->proc_num;i++) {
+        for (int dev=0;dev<(int)snap->device_count;dev++){
             LOG_INFO("Process %d hostPid: %d, sm: %lu, memory: %lu, record: %lu",
-                region_info.shared_region->procs[i].pid,
-                region_info.shared_region->procs[i].hostpid, 
-                region_info.shared_region->procs[i].device_util[dev].sm_util, 
-                region_info.shared_region->procs[i].monitorused[dev], 
-                region_info.shared_region->procs[i].used[dev].total);
+                snap->procs[i].pid,
+                snap->procs[i].hostpid,
+                shrreg_snapshot_util(snap, dev, i)->sm_util,
+                shrreg_snapshot_util(snap, dev, i)->monitorused,
+                shrreg_snapshot_used(snap, dev, i)->total);
         }
     }
+    for (int dev=0;dev<(int)snap->device_count;dev++){
+        uint64_t sum = 0;
+        for (i=0;i<snap->proc_num;i++)
+            sum += shrreg_snapshot_used(snap, dev, i)->total;
+        LOG_INFO("Device %d usage: %lu, sum of slots: %lu", dev, snap->usage[dev], sum);
+    }
+    shrreg_snapshot_free(snap);
 }
 
 void child_reinit_flag() {
@@ -1054,6 +2397,214 @@ int set_env_utilization_switch() {
     return 0;
 }
 
+#define SHRREG_ALIGN(size) \
+    (((size) + SHRREG_CACHE_LINE_SIZE - 1) & ~((uint64_t)SHRREG_CACHE_LINE_SIZE - 1))
+
+// Entries of a pid index, a power of two at least twice max_procs
+static uint32_t proc_index_size(uint32_t max_procs) {
+    uint32_t size = 1;
+    while (size < 2 * max_procs)
+        size <<= 1;
+    return size;
+}
+
+size_t shrreg_compute_layout(shared_region_t* header, uint32_t device_count, uint32_t max_procs) {
+    uint64_t offset = SHRREG_ALIGN(sizeof(shared_region_t));
+    uint64_t index_bytes = sizeof(shrreg_proc_index_t) +
+        sizeof(uint64_t) * proc_index_size(max_procs);
+    header->device_count = device_count;
+    header->max_procs = max_procs;
+    header->uuids_offset = offset;
+    offset = SHRREG_ALIGN(offset + sizeof(uuid) * device_count);
+    header->limit_offset = offset;
+    offset = SHRREG_ALIGN(offset + sizeof(uint64_t) * device_count);
+    header->sm_limit_offset = offset;
+    offset = SHRREG_ALIGN(offset + sizeof(uint64_t) * device_count);
+    header->dev_usage_offset = offset;
+    offset = SHRREG_ALIGN(offset + sizeof(device_usage_t) * device_count);
+    header->procs_offset = offset;
+    offset = SHRREG_ALIGN(offset + sizeof(shrreg_proc_slot_t) * max_procs);
+    header->proc_used_offset = offset;
+    offset = SHRREG_ALIGN(offset + sizeof(device_memory_t) * device_count * max_procs);
+    header->proc_util_offset = offset;
+    offset = SHRREG_ALIGN(offset + sizeof(device_util_t) * device_count * max_procs);
+    header->proc_stats_offset = offset;
+    offset = SHRREG_ALIGN(offset + sizeof(device_memory_stats_t) * device_count * max_procs);
+    header->pid_index_offset = offset;
+    offset = SHRREG_ALIGN(offset + index_bytes);
+    header->hostpid_index_offset = offset;
+    offset = SHRREG_ALIGN(offset + index_bytes);
+    header->history_offset = offset;
+    offset = SHRREG_ALIGN(offset + sizeof(shrreg_history_t) * device_count);
+    header->oom_events_offset = offset;
+    offset = SHRREG_ALIGN(offset + sizeof(shrreg_oom_events_t) * device_count);
+    header->group_count = SHRREG_MAX_GROUPS;
+    header->groups_offset = offset;
+    offset = SHRREG_ALIGN(offset + sizeof(shrreg_group_t) * SHRREG_MAX_GROUPS);
+    header->group_usage_offset = offset;
+    offset = SHRREG_ALIGN(offset + sizeof(group_usage_t) * SHRREG_MAX_GROUPS * device_count);
+    header->region_size = offset;
+    return offset;
+}
+
+/**
+ * Device count of a new region: SHARED_REGION_DEVICES_ENV, otherwise
+ * enough for every per-device limit in the environment. The unindexed
+ * limits apply to all devices and keep the default.
+ */
+static uint32_t shrreg_device_count_from_env() {
+    char* env = getenv(SHARED_REGION_DEVICES_ENV);
+    if (env != NULL && atoi(env) > 0) {
+        int count = atoi(env);
+        return count > CUDA_DEVICE_MAX_COUNT ? CUDA_DEVICE_MAX_COUNT : count;
+    }
+    uint32_t count = 0;
+    int i;
+    for (i = 0; i < CUDA_DEVICE_MAX_COUNT; i++) {
+        char mem_env[CUDA_DEVICE_MEMORY_LIMIT_KEY_LENGTH];
+        char sm_env[CUDA_DEVICE_SM_LIMIT_KEY_LENGTH];
+        snprintf(mem_env, sizeof(mem_env), "%s_%d", CUDA_DEVICE_MEMORY_LIMIT, i);
+        snprintf(sm_env, sizeof(sm_env), "%s_%d", CUDA_DEVICE_SM_LIMIT, i);
+        if (getenv(mem_env) != NULL || getenv(sm_env) != NULL)
+            count = i + 1;
+    }
+    if (count == 0 || getenv(CUDA_DEVICE_MEMORY_LIMIT) != NULL || getenv(CUDA_DEVICE_SM_LIMIT) != NULL)
+        count = count > CUDA_DEVICE_DEFAULT_COUNT ? count : CUDA_DEVICE_DEFAULT_COUNT;
+    return count;
+}
+
+static uint32_t shrreg_max_procs_from_env() {
+    char* env = getenv(SHARED_REGION_MAX_PROCS_ENV);
+    if (env == NULL || atoi(env) <= 0)
+        return SHARED_REGION_MAX_PROCESS_NUM;
+    int max_procs = atoi(env);
+    return max_procs > SHARED_REGION_PROCESS_NUM_LIMIT ? SHARED_REGION_PROCESS_NUM_LIMIT : max_procs;
+}
+
+// Process-shared mutex that survives its owner being killed
+static int init_robust_mutex(pthread_mutex_t* mutex) {
+    pthread_mutexattr_t attr;
+    int res = pthread_mutexattr_init(&attr);
+    if (res == 0)
+        res = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    if (res == 0)
+        res = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (res == 0)
+        res = pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (res != 0)
+        errno = res;
+    return res;
+}
+
+int shrreg_init_region(shared_region_t* region, uint32_t device_count, uint32_t max_procs) {
+    shared_region_t header;
+    memset(region, 0, shrreg_compute_layout(&header, device_count, max_procs));
+    shrreg_compute_layout(region, device_count, max_procs);
+    region->major_version = MAJOR_VERSION;
+    region->minor_version = MINOR_VERSION;
+    int res = init_robust_mutex(&region->lock);
+    if (res == 0)
+        res = init_robust_mutex(&region->lock_postinit);
+
+    atomic_store_explicit(&region->sm_init_flag, 0, memory_order_relaxed);
+    atomic_store_explicit(&region->utilization_switch, 1, memory_order_relaxed);
+    atomic_store_explicit(&region->recent_kernel, 2, memory_order_relaxed);
+    atomic_store_explicit(&region->proc_num, 0, memory_order_relaxed);
+    shrreg_pid_index(region)->mask = proc_index_size(max_procs) - 1;
+    shrreg_hostpid_index(region)->mask = proc_index_size(max_procs) - 1;
+    region->priority = 1;
+    return res;
+}
+
+const char* shrreg_legacy_path() {
+    const char* file = getenv(MULTIPROCESS_SHARED_REGION_CACHE_ENV);
+    return file == NULL ? MULTIPROCESS_SHARED_REGION_CACHE_DEFAULT : file;
+}
+
+const char* shrreg_cache_path() {
+    static char path[PATH_MAX];
+    const char* file = shrreg_legacy_path();
+    const char* backing = getenv(SHARED_REGION_BACKING_ENV);
+    if (backing == NULL || strcmp(backing, "shm") != 0) {
+        snprintf(path, sizeof(path), "%s%s", file, MULTIPROCESS_SHARED_REGION_SUFFIX);
+        return path;
+    }
+    // Same name, on tmpfs
+    const char* name = strrchr(file, '/');
+    snprintf(path, sizeof(path), "%s/%s%s", SHARED_REGION_SHM_DIR, name == NULL ? file : name + 1,
+        MULTIPROCESS_SHARED_REGION_SUFFIX);
+    return path;
+}
+
+int shrreg_backing_fd() {
+    const char* backing = getenv(SHARED_REGION_BACKING_ENV);
+    if (backing == NULL || strncmp(backing, "fd:", 3) != 0)
+        return -1;
+    int fd = atoi(backing + 3);
+    if (fd < 0 || fcntl(fd, F_GETFD) == -1) {
+        LOG_ERROR("Invalid shrreg backing %s", backing);
+        return -1;
+    }
+    return fd;
+}
+
+shared_region_t* shrreg_map_readonly(size_t* size) {
+    int fd = shrreg_backing_fd();
+    fd = fd >= 0 ? dup(fd) : open(shrreg_cache_path(), O_RDONLY);
+    if (fd == -1)
+        return NULL;
+    shared_region_t header;
+    struct stat st;
+    shared_region_t* region = NULL;
+    if (pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+        header.initialized_flag == MULTIPROCESS_SHARED_REGION_MAGIC_FLAG &&
+        header.major_version == MAJOR_VERSION &&
+        fstat(fd, &st) == 0 && (size_t)st.st_size >= header.region_size) {
+        region = mmap(NULL, header.region_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (region == MAP_FAILED) {
+            LOG_ERROR("Fail to map shrreg read-only: errno=%d", errno);
+            region = NULL;
+        } else {
+            *size = header.region_size;
+        }
+    }
+    close(fd);
+    return region;
+}
+
+static int shrreg_use_hugepages() {
+    const char* env = getenv(SHARED_REGION_HUGEPAGES_ENV);
+    return env != NULL && atoi(env) > 0;
+}
+
+// Huge page mappings, hugetlbfs ones in particular, cover whole pages
+static size_t shrreg_map_size(size_t region_size) {
+    if (!shrreg_use_hugepages())
+        return region_size;
+    return (region_size + SHARED_REGION_HUGEPAGE_SIZE - 1) & ~((size_t)SHARED_REGION_HUGEPAGE_SIZE - 1);
+}
+
+/**
+ * Map the region with all its pages faulted in up front, on transparent
+ * huge pages if requested. Huge pages have to be requested before the
+ * pages are populated, so that case populates with madvise().
+ */
+static shared_region_t* shrreg_map(int fd, size_t map_size) {
+    int hugepages = shrreg_use_hugepages();
+    void* map = mmap(NULL, map_size, PROT_WRITE | PROT_READ,
+        MAP_SHARED | (hugepages ? 0 : MAP_POPULATE), fd, 0);
+    if (map == MAP_FAILED || !hugepages)
+        return (shared_region_t*) map;
+    if (madvise(map, map_size, MADV_HUGEPAGE) != 0)
+        LOG_WARN("Huge pages unavailable for shrreg: errno=%d", errno);
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(map, map_size, MADV_POPULATE_WRITE) != 0)
+        LOG_DEBUG("Fail to populate shrreg: errno=%d", errno);
+#endif
+    return (shared_region_t*) map;
+}
+
 void try_create_shrreg() {
     LOG_DEBUG("Try create shrreg")
     if (region_info.fd == -1) {
@@ -1069,108 +2620,121 @@ void try_create_shrreg() {
     pthread_atfork(NULL, NULL, child_reinit_flag);
 
     region_info.pid = getpid();
+    region_info.pidns = proc_pid_namespace();
     region_info.fd = -1;
     region_info.last_kernel_time = time(NULL);
 
     umask(0);
 
-    char* shr_reg_file = getenv(MULTIPROCESS_SHARED_REGION_CACHE_ENV);
-    if (shr_reg_file == NULL) {
-        shr_reg_file = MULTIPROCESS_SHARED_REGION_CACHE_DEFAULT;
-    }
+    const char* shr_reg_file = shrreg_cache_path();
+    int backing_fd = shrreg_backing_fd();
     // Initialize NVML BEFORE!! open it
     //nvmlInit();
 
     /* If you need sm modification, do it here */
     /* ... set_sm_scale */
 
-    int fd = open(shr_reg_file, O_RDWR | O_CREAT, 0666);
+    size_t region_size = 0;
+    size_t map_size = 0;
+    struct stat st;
+    int fd = backing_fd >= 0 ? dup(backing_fd) : open(shr_reg_file, O_RDWR | O_CREAT, 0666);
     if (fd == -1) {
         LOG_ERROR("Fail to open shrreg %s: errno=%d", shr_reg_file, errno);
         goto fail;
     }
     region_info.fd = fd;
-    off_t offset = lseek(fd, SHARED_REGION_SIZE_MAGIC, SEEK_SET);
-    if (offset != SHARED_REGION_SIZE_MAGIC) {
-        LOG_ERROR("Fail to init shrreg %s: errno=%d", shr_reg_file, errno);
-        goto fail;
-    }
-    ssize_t check_bytes = write(fd, "\0", 1);
-    if (check_bytes != 1) {
-        LOG_ERROR("Fail to write shrreg %s: errno=%d", shr_reg_file, errno);
+    // Serializes creation; the header then tells how the region is laid out
+    if (lockf(fd, F_LOCK, SHARED_REGION_SIZE_MAGIC) != 0) {
+        LOG_ERROR("Fail to lock shrreg %s: errno=%d", shr_reg_file, errno);
         goto fail;
     }
-    if (lseek(fd, 0, SEEK_SET) != 0) {
-        LOG_ERROR("Fail to reseek shrreg %s: errno=%d", shr_reg_file, errno);
-        goto fail;
+    shared_region_t header;
+    memset(&header, 0, sizeof(header));
+    ssize_t header_bytes = pread(fd, &header, sizeof(header), 0);
+    int32_t init_flag = header_bytes == sizeof(header) ? header.initialized_flag : 0;
+    if (init_flag == MULTIPROCESS_SHARED_REGION_MAGIC_FLAG) {
+        if (header.major_version != MAJOR_VERSION) {
+            LOG_ERROR("Shrreg %s has incompatible version %u.%u, expected %d.x",
+                shr_reg_file, header.major_version, header.minor_version, MAJOR_VERSION);
+            goto fail;
+        }
+        region_size = header.region_size;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < region_size) {
+            LOG_ERROR("Shrreg %s is truncated, %lu bytes expected", shr_reg_file, region_size);
+            goto fail;
+        }
+        map_size = shrreg_map_size(region_size);
+        // Created without huge pages
+        if ((size_t)st.st_size < map_size)
+            map_size = region_size;
+    } else {
+        region_size = shrreg_compute_layout(&header,
+            shrreg_device_count_from_env(), shrreg_max_procs_from_env());
+        map_size = shrreg_map_size(region_size);
+        if (ftruncate(fd, map_size) != 0) {
+            LOG_ERROR("Fail to resize shrreg %s: errno=%d", shr_reg_file, errno);
+            goto fail;
+        }
     }
-    region_info.shared_region = (shared_region_t*) mmap(
-        NULL, SHARED_REGION_SIZE_MAGIC,
-        PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
+    region_info.shared_region = shrreg_map(fd, map_size);
     shared_region_t* region = region_info.shared_region;
     if (region == MAP_FAILED) {
         LOG_ERROR("Fail to map shrreg %s: errno=%d", shr_reg_file, errno);
         goto fail;
     }
-    if (lockf(fd, F_LOCK, SHARED_REGION_SIZE_MAGIC) != 0) {
-        LOG_ERROR("Fail to lock shrreg %s: errno=%d", shr_reg_file, errno);
-        goto fail;
-    }
     //put_device_info();
-    int32_t init_flag = atomic_load_explicit(&region->initialized_flag, memory_order_acquire);
     if (init_flag != MULTIPROCESS_SHARED_REGION_MAGIC_FLAG) {
-        region->major_version = MAJOR_VERSION;
-        region->minor_version = MINOR_VERSION;
+        // A stale file may hold anything, start from zeroes
+        if (shrreg_init_region(region, header.device_count, header.max_procs) != 0) {
+            LOG_ERROR("Fail to init locks of shrreg %s: errno=%d", shr_reg_file, errno);
+        }
+        LOG_INFO("Create shrreg %s: %u devices, %u process slots, %lu bytes",
+            shr_reg_file, region->device_count, region->max_procs, region_size);
         do_init_device_memory_limits(
-            region->limit, CUDA_DEVICE_MAX_COUNT);
+            shrreg_limit(region), region->device_count);
         do_init_device_sm_limits(
-            region->sm_limit,CUDA_DEVICE_MAX_COUNT);
-        if (sem_init(&region->sem, 1, 1) != 0) {
-            LOG_ERROR("Fail to init sem %s: errno=%d", shr_reg_file, errno);
-        }
-        if (sem_init(&region->sem_postinit, 1, 1) != 0) {
-            LOG_ERROR("Fail to init sem_postinit %s: errno=%d", shr_reg_file, errno);
-        }
-
-        atomic_store_explicit(&region->sm_init_flag, 0, memory_order_relaxed);
-        atomic_store_explicit(&region->utilization_switch, 1, memory_order_relaxed);
-        atomic_store_explicit(&region->recent_kernel, 2, memory_order_relaxed);
-        atomic_store_explicit(&region->proc_num, 0, memory_order_relaxed);
-        region->priority = 1;
+            shrreg_sm_limit(region), region->device_count);
         char *_priority_env = getenv(CUDA_TASK_PRIORITY_ENV);
         if (_priority_env != NULL)
             region->priority = atoi(_priority_env);
+        // Processes still on a 1.2 file count against the same limits
+        shrreg_attach_legacy(region, 1);
 
         // Release barrier ensures all initialization is visible before flag is set
         atomic_thread_fence(memory_order_release);
         atomic_store_explicit(&region->initialized_flag, MULTIPROCESS_SHARED_REGION_MAGIC_FLAG, memory_order_release);
     } else {
-        if (region->major_version != MAJOR_VERSION || 
-                region->minor_version != MINOR_VERSION) {
+        if (region->minor_version != MINOR_VERSION) {
             LOG_ERROR("The current version number %d.%d"
                     " is different from the file's version number %d.%d",
                     MAJOR_VERSION, MINOR_VERSION,
                     region->major_version, region->minor_version);
         }
         uint64_t local_limits[CUDA_DEVICE_MAX_COUNT];
-        do_init_device_memory_limits(local_limits, CUDA_DEVICE_MAX_COUNT);
+        int device_count = region->device_count;
+        // Limits changed by the limits file differ from the environment on purpose
+        if (atomic_load_explicit(&region->limits_generation, memory_order_relaxed) != 0)
+            device_count = 0;
+        do_init_device_memory_limits(local_limits, device_count);
         int i;
-        for (i = 0; i < CUDA_DEVICE_MAX_COUNT; ++i) {
-            if (local_limits[i] != region->limit[i]) {
+        for (i = 0; i < device_count; ++i) {
+            if (local_limits[i] != shrreg_limit(region)[i]) {
                 LOG_ERROR("Limit inconsistency detected for %dth device"
                     ", %lu expected, get %lu", 
-                    i, local_limits[i], region->limit[i]);
+                    i, local_limits[i], shrreg_limit(region)[i]);
             }
         }
-        do_init_device_sm_limits(local_limits,CUDA_DEVICE_MAX_COUNT);
-        for (i = 0; i < CUDA_DEVICE_MAX_COUNT; ++i) {
-            if (local_limits[i] != region->sm_limit[i]) {
+        do_init_device_sm_limits(local_limits, device_count);
+        for (i = 0; i < device_count; ++i) {
+            if (local_limits[i] != shrreg_sm_limit(region)[i]) {
                 LOG_INFO("SM limit inconsistency detected for %dth device"
                     ", %lu expected, get %lu", 
-                    i, local_limits[i], region->sm_limit[i]);
+                    i, local_limits[i], shrreg_sm_limit(region)[i]);
             //    exit(1); 
             }
         }
+        // 1.2 processes may have started since the region was created
+        shrreg_attach_legacy(region, 0);
     }
     region->last_kernel_time = region_info.last_kernel_time;
     if (lockf(fd, F_ULOCK, SHARED_REGION_SIZE_MAGIC) != 0) {
@@ -1181,7 +2745,7 @@ void try_create_shrreg() {
 
 fail:
     if (region_info.shared_region != NULL && region_info.shared_region != MAP_FAILED) {
-        munmap(region_info.shared_region, SHARED_REGION_SIZE_MAGIC);
+        munmap(region_info.shared_region, map_size);
     }
     region_info.shared_region = NULL;
     if (fd != -1) {
@@ -1199,6 +2763,8 @@ void initialized() {
     }
     try_create_shrreg();
     init_proc_slot_withlock();
+    init_memory_leases();
+    init_drift_limits();
 }
 
 void ensure_initialized() {
@@ -1206,31 +2772,28 @@ void ensure_initialized() {
 }
 
 int update_host_pid() {
-    int i;
-    for (i=0;i<region_info.shared_region->proc_num;i++){
-        if (region_info.shared_region->procs[i].pid == getpid()){
-            if (region_info.shared_region->procs[i].hostpid!=0)
-                pidfound=1; 
-        }
-    }
+    shrreg_proc_slot_t* slot = find_proc_by_pid(getpid());
+    if (slot != NULL && atomic_load_explicit(&slot->hostpid, memory_order_acquire) != 0)
+        pidfound=1;
     return 0;
 }
 
 int set_host_pid(int hostpid) {
-    int i,j,found=0;
-    for (i=0;i<region_info.shared_region->proc_num;i++){
-        if (region_info.shared_region->procs[i].pid == getpid()){
-            LOG_INFO("SET PID= %d",hostpid);
-            found=1;
-            region_info.shared_region->procs[i].hostpid = hostpid;
-            for (j=0;j<CUDA_DEVICE_MAX_COUNT;j++)
-                region_info.shared_region->procs[i].monitorused[j]=0;
-        }
-    }
-    if (!found) {
+    int j;
+    shared_region_t* region = region_info.shared_region;
+    // The hostpid index is only modified under the lock
+    lock_shrreg();
+    shrreg_proc_slot_t* slot = find_proc_by_pid(getpid());
+    if (slot == NULL) {
+        unlock_shrreg();
         LOG_ERROR("HOST PID NOT FOUND. %d",hostpid);
         return -1;
     }
+    LOG_INFO("SET PID= %d",hostpid);
+    shrreg_set_proc_hostpid_nolock(slot, hostpid);
+    for (j=0;j<(int)region->device_count;j++)
+        atomic_store_explicit(&proc_slot_util(slot, j)->monitorused, 0, memory_order_relaxed);
+    unlock_shrreg();
     setspec();
     return 0;
 }
@@ -1238,44 +2801,48 @@ int set_host_pid(int hostpid) {
 int set_current_device_sm_limit_scale(int dev, int scale) {
     ensure_initialized();
     if (region_info.shared_region->sm_init_flag==1) return 0;
-    if (dev < 0 || dev >= CUDA_DEVICE_MAX_COUNT) {
+    if (!region_has_device(dev)) {
         LOG_ERROR("Illegal device id: %d", dev);
+        return -1;
     }
     LOG_INFO("dev %d new sm limit set mul by %d",dev,scale);
-    region_info.shared_region->sm_limit[dev]=region_info.shared_region->sm_limit[dev]*scale;
+    shrreg_sm_limit(region_info.shared_region)[dev]=shrreg_sm_limit(region_info.shared_region)[dev]*scale;
     region_info.shared_region->sm_init_flag = 1;
     return 0;
 }
 
 int get_current_device_sm_limit(int dev) {
     ensure_initialized();
-    if (dev < 0 || dev >= CUDA_DEVICE_MAX_COUNT) {
+    if (!region_has_device(dev)) {
         LOG_ERROR("Illegal device id: %d", dev);
+        return 0;
     }
-    return region_info.shared_region->sm_limit[dev];
+    return shrreg_sm_limit(region_info.shared_region)[dev];
 }
 
 int set_current_device_memory_limit(const int dev,size_t newlimit) {
     ensure_initialized();
-    if (dev < 0 || dev >= CUDA_DEVICE_MAX_COUNT) {
+    if (!region_has_device(dev)) {
         LOG_ERROR("Illegal device id: %d", dev);
+        return -1;
     }
     LOG_INFO("dev %d new limit set to %ld",dev,newlimit);
-    region_info.shared_region->limit[dev]=newlimit;
+    shrreg_limit(region_info.shared_region)[dev]=newlimit;
     return 0; 
 }
 
 uint64_t get_current_device_memory_limit(const int dev) {
     ensure_initialized();
-    if (dev < 0 || dev >= CUDA_DEVICE_MAX_COUNT) {
+    if (!region_has_device(dev)) {
         LOG_ERROR("Illegal device id: %d", dev);
+        return 0;
     }
-    return region_info.shared_region->limit[dev];       
+    return shrreg_limit(region_info.shared_region)[dev];       
 }
 
 uint64_t get_current_device_memory_monitor(const int dev) {
     ensure_initialized();
-    if (dev < 0 || dev >= CUDA_DEVICE_MAX_COUNT) {
+    if (!region_has_device(dev)) {
         LOG_ERROR("Illegal device id: %d", dev);
     }
     uint64_t result = get_gpu_memory_monitor(dev);
@@ -1288,7 +2855,7 @@ uint64_t get_current_device_memory_usage(const int dev) {
     uint64_t result;
     start = clock();
     ensure_initialized();
-    if (dev < 0 || dev >= CUDA_DEVICE_MAX_COUNT) {
+    if (!region_has_device(dev)) {
         LOG_ERROR("Illegal device id: %d", dev);
     }
     result = get_gpu_memory_usage(dev);
@@ -1298,6 +2865,24 @@ uint64_t get_current_device_memory_usage(const int dev) {
     return result;
 }
 
+uint64_t get_current_group_memory_limit(const int dev) {
+    ensure_initialized();
+    if (!region_has_device(dev))
+        return 0;
+    shrreg_proc_slot_t* slot = get_my_slot();
+    group_usage_t* group = slot == NULL ? NULL : proc_slot_group_usage(slot, dev);
+    return group == NULL ? 0 : atomic_load_explicit(&group->limit, memory_order_relaxed);
+}
+
+uint64_t get_current_group_memory_usage(const int dev) {
+    ensure_initialized();
+    if (!region_has_device(dev))
+        return 0;
+    shrreg_proc_slot_t* slot = get_my_slot();
+    group_usage_t* group = slot == NULL ? NULL : proc_slot_group_usage(slot, dev);
+    return group == NULL ? 0 : atomic_load_explicit(&group->usage, memory_order_acquire);
+}
+
 int get_current_priority() {
     return region_info.shared_region->priority;
 }
@@ -1321,64 +2906,82 @@ int get_utilization_switch() {
 
 void suspend_all(){
     int i;
+    shrreg_proc_slot_t* procs = shrreg_procs(region_info.shared_region);
     for (i=0;i<region_info.shared_region->proc_num;i++){
-        LOG_INFO("Sending USR2 to %d",region_info.shared_region->procs[i].pid);
-        kill(region_info.shared_region->procs[i].pid,SIGUSR2);
+        LOG_INFO("Sending USR2 to %d",procs[i].pid);
+        kill(procs[i].pid,SIGUSR2);
     }
 }
 
 void resume_all(){
     int i;
+    shrreg_proc_slot_t* procs = shrreg_procs(region_info.shared_region);
     for (i=0;i<region_info.shared_region->proc_num;i++){
-        LOG_INFO("Sending USR1 to %d",region_info.shared_region->procs[i].pid);
-        kill(region_info.shared_region->procs[i].pid,SIGUSR1);
+        LOG_INFO("Sending USR1 to %d",procs[i].pid);
+        kill(procs[i].pid,SIGUSR1);
     }
 }
 
 int wait_status_self(int status){
     // Fast path: use cached slot pointer (set during init_proc_slot_withlock)
-    if (region_info.my_slot != NULL) {
-        int32_t cur = atomic_load_explicit(&region_info.my_slot->status, memory_order_acquire);
-        return (cur == status) ? 1 : 0;
-    }
+    shrreg_proc_slot_t* slot = get_my_slot();
+    // Slow path: index lookup (only if my_slot not yet cached)
+    if (slot == NULL)
+        slot = find_proc_by_pid(getpid());
+    if (slot == NULL)
+        return -1;
+    int32_t cur = atomic_load_explicit(&slot->status, memory_order_acquire);
+    return (cur == status) ? 1 : 0;
+}
 
-    // Slow path: linear scan (only if my_slot not yet cached)
-    int i;
-    int proc_num = atomic_load_explicit(&region_info.shared_region->proc_num, memory_order_acquire);
-    int32_t my_pid = getpid();
-    for (i=0; i < proc_num; i++) {
-        int32_t slot_pid = atomic_load_explicit(&region_info.shared_region->procs[i].pid, memory_order_acquire);
-        if (slot_pid == my_pid) {
-            if (atomic_load_explicit(&region_info.shared_region->procs[i].status, memory_order_acquire) == status)
-                return 1;
-            else
-                return 0;
-        }
-    }
-    return -1;
+int wait_status_self_timeout(int status, int timeout_ms) {
+    shrreg_proc_slot_t* slot = get_my_slot();
+    if (slot == NULL)
+        slot = find_proc_by_pid(getpid());
+    if (slot == NULL)
+        return -1;
+    int32_t cur = atomic_load_explicit(&slot->status, memory_order_acquire);
+    if (cur == status)
+        return 1;
+    futex_wait_shared(&slot->status, cur, timeout_ms);
+    return wait_status_self(status);
+}
+
+int wait_status_all_timeout(int status, int timeout_ms) {
+    shared_region_t* region = region_info.shared_region;
+    int32_t seq = atomic_load_explicit(&region->status_seq, memory_order_acquire);
+    if (wait_status_all(status))
+        return 1;
+    futex_wait_shared(&region->status_seq, seq, timeout_ms);
+    return wait_status_all(status);
 }
 
 int wait_status_all(int status){
-    int i;
+    int i, retries;
     int released = 1;
-    for (i=0;i<region_info.shared_region->proc_num;i++) {
-        LOG_INFO("i=%d pid=%d status=%d",i,region_info.shared_region->procs[i].pid,region_info.shared_region->procs[i].status);
-        if ((region_info.shared_region->procs[i].status!=status) && (region_info.shared_region->procs[i].pid!=getpid()))
-            released = 0; 
+    shared_region_t* region = region_info.shared_region;
+    if (atomic_load_explicit(&region->legacy_active, memory_order_relaxed))
+        shrreg_sync_legacy(region, 0);
+    shrreg_proc_slot_t* procs = shrreg_procs(region);
+    // A slot moved during the scan may be missed or seen twice, scan again
+    for (retries = 0; retries < SHRREG_SNAPSHOT_RETRIES; retries++) {
+        uint64_t epoch = shrreg_epoch_begin(region);
+        int proc_num = atomic_load_explicit(&region->proc_num, memory_order_acquire);
+        released = 1;
+        for (i=0;i<proc_num;i++) {
+            int32_t pid = atomic_load_explicit(&procs[i].pid, memory_order_relaxed);
+            int32_t cur = atomic_load_explicit(&procs[i].status, memory_order_relaxed);
+            LOG_INFO("i=%d pid=%d status=%d",i,pid,cur);
+            if ((cur!=status) && (pid!=getpid()))
+                released = 0;
+        }
+        if (!shrreg_epoch_retry(region, epoch))
+            break;
     }
     LOG_INFO("Return released=%d",released);
     return released;
 }
 
-shrreg_proc_slot_t *find_proc_by_hostpid(int hostpid) {
-    int i;
-    for (i=0;i<region_info.shared_region->proc_num;i++) {
-        if (region_info.shared_region->procs[i].hostpid == hostpid) 
-            return &region_info.shared_region->procs[i];
-    }
-    return NULL;
-}
-
 
 int comparelwr(const char *s1,char *s2){
     if ((s1==NULL) || (s2==NULL))
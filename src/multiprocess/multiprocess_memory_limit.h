@@ -26,29 +26,55 @@
 #define MULTIPROCESS_SHARED_REGION_MAGIC_FLAG  19920718
 #define MULTIPROCESS_SHARED_REGION_CACHE_ENV   "CUDA_DEVICE_MEMORY_SHARED_CACHE"
 #define MULTIPROCESS_SHARED_REGION_CACHE_DEFAULT  "/tmp/cudevshr.cache"
+// Appended to the configured path, which is left to 1.2 processes
+#define MULTIPROCESS_SHARED_REGION_SUFFIX ".v2"
 #define ENV_OVERRIDE_FILE "/overrideEnv"
 #define CUDA_TASK_PRIORITY_ENV "CUDA_TASK_PRIORITY"
 
-#define CUDA_DEVICE_MAX_COUNT 16
+// Upper bound for per-process device arrays. The shared region itself is
+// sized by the device_count recorded in its header.
+#define CUDA_DEVICE_MAX_COUNT 64
+#define CUDA_DEVICE_DEFAULT_COUNT 16
 #define CUDA_DEVICE_MEMORY_UPDATE_SUCCESS 0
 #define CUDA_DEVICE_MEMORY_UPDATE_FAILURE 1
 #define MEMORY_LIMIT_TOLERATION_RATE 1.1
 
 #define SHARED_REGION_SIZE_MAGIC  sizeof(shared_region_t)
+// Default max_procs of a new region, also the size of NVML process buffers
 #define SHARED_REGION_MAX_PROCESS_NUM 1024
+#define SHARED_REGION_PROCESS_NUM_LIMIT 65536
+// Geometry of a newly created region, see shrreg_compute_layout()
+#define SHARED_REGION_DEVICES_ENV "CUDA_DEVICE_SHARED_REGION_DEVICES"
+#define SHARED_REGION_MAX_PROCS_ENV "CUDA_DEVICE_SHARED_REGION_MAX_PROCS"
+// Where the region lives: "file" (default, MULTIPROCESS_SHARED_REGION_CACHE_ENV),
+// "shm" (same name under SHARED_REGION_SHM_DIR) or "fd:<n>" (an inherited memfd)
+#define SHARED_REGION_BACKING_ENV "CUDA_DEVICE_SHARED_REGION_BACKING"
+#define SHARED_REGION_SHM_DIR "/dev/shm"
+#define SHARED_REGION_HUGEPAGES_ENV "CUDA_DEVICE_SHARED_REGION_HUGEPAGES"
+#define SHARED_REGION_HUGEPAGE_SIZE (2 * 1024 * 1024)
+// Quota a process reserves ahead of its allocations, a size or a percentage
+// of the device limit. Allocations covered by it skip the shared aggregate.
+#define CUDA_DEVICE_MEMORY_LEASE_ENV "CUDA_DEVICE_MEMORY_LEASE"
+// Largest correction the watcher charges a process for memory NVML sees
+// but the hooks do not track, a size or a percentage of the device limit
+#define CUDA_DEVICE_MEMORY_DRIFT_LIMIT_ENV "CUDA_DEVICE_MEMORY_DRIFT_LIMIT"
+// Quota group of the process: a name, "cgroup" for its cgroup path or
+// "cgroup-parent" for the parent of that path (the pod in Kubernetes)
+#define CUDA_DEVICE_MEMORY_GROUP_ENV "CUDA_DEVICE_MEMORY_GROUP"
+// Memory limit of the group on every device, or on device <i> with a _<i> suffix
+#define CUDA_DEVICE_MEMORY_GROUP_LIMIT_ENV "CUDA_DEVICE_MEMORY_GROUP_LIMIT"
+// File in the format of ENV_OVERRIDE_FILE whose memory and SM limits are
+// applied to the region whenever it changes, see multiprocess_limits_watcher.h
+#define CUDA_DEVICE_LIMITS_FILE_ENV "CUDA_DEVICE_LIMITS_FILE"
+// A device the limits file leaves out keeps its limit
+#define SHRREG_LIMIT_UNSET UINT64_MAX
 
 // macros for debugging
-#define SEQ_FIX_SHRREG_ACQUIRE_FLOCK_OK 0
-#define SEQ_FIX_SHRREG_UPDATE_OWNER_OK 1
-#define SEQ_FIX_SHRREG_RELEASE_FLOCK_OK 2
-#define SEQ_ACQUIRE_SEMLOCK_OK 3
-#define SEQ_UPDATE_OWNER_OK 4
-#define SEQ_RESET_OWNER_OK 5
-#define SEQ_RELEASE_SEMLOCK_OK 6
-#define SEQ_BEFORE_UNLOCK_SHRREG 7
-
-#define SEQ_AFTER_INC 8
-#define SEQ_AFTER_DEC 9
+#define SEQ_ACQUIRE_SEMLOCK_OK 0
+#define SEQ_UPDATE_OWNER_OK 1
+#define SEQ_RESET_OWNER_OK 2
+#define SEQ_RELEASE_SEMLOCK_OK 3
+#define SEQ_BEFORE_UNLOCK_SHRREG 4
 
 #ifndef SEQ_POINT_MARK
     #define SEQ_POINT_MARK(s)
@@ -56,57 +82,415 @@
 
 #define FACTOR 32
 
-#define MAJOR_VERSION 1
-#define MINOR_VERSION 2
+#define MAJOR_VERSION 2
+#define MINOR_VERSION 12
 
+#define SHRREG_CACHE_LINE_SIZE 64
+#define SHRREG_CACHE_ALIGNED __attribute__((aligned(SHRREG_CACHE_LINE_SIZE)))
+
+// Hot per-process, per-device counters. Exactly one cache line, so the
+// writer of one (process, device) pair never shares a line with another.
 typedef struct {
     _Atomic uint64_t context_size;
     _Atomic uint64_t module_size;
     _Atomic uint64_t data_size;
-    _Atomic uint64_t offset;
+    _Atomic uint64_t offset;       // Drift correction, untracked memory seen by NVML
     _Atomic uint64_t total;
-    uint64_t unused[3];
-} device_memory_t;
+    _Atomic uint64_t seqlock;      // Sequence lock for consistent snapshots of this entry
+    _Atomic uint64_t lease;        // Part of total charged but not allocated yet, see CUDA_DEVICE_MEMORY_LEASE_ENV
+    _Atomic uint64_t allocated;    // Bytes ever added to the breakdown, freed ones are allocated - (context + module + data)
+} SHRREG_CACHE_ALIGNED device_memory_t;
+_Static_assert(sizeof(device_memory_t) == SHRREG_CACHE_LINE_SIZE, "device_memory_t must fill one cache line");
+
+// Plain copy of a device_memory_t, see shrreg_read_proc_used()
+typedef struct {
+    uint64_t context_size;
+    uint64_t module_size;
+    uint64_t data_size;
+    uint64_t offset;
+    uint64_t total;
+    uint64_t lease;
+    uint64_t allocated;
+} device_memory_snapshot_t;
+
+/*
+ * Allocation size histogram, log2 buckets: bucket 0 counts sizes up to
+ * 2^SHRREG_SIZE_BUCKET_SHIFT bytes, bucket i sizes in (2^(SHIFT+i-1),
+ * 2^(SHIFT+i)], the last bucket everything larger.
+ */
+#define SHRREG_SIZE_BUCKETS 23
+#define SHRREG_SIZE_BUCKET_SHIFT 12
+
+static inline int shrreg_size_bucket(uint64_t size) {
+    if (size <= (1ULL << SHRREG_SIZE_BUCKET_SHIFT))
+        return 0;
+    int bucket = 64 - __builtin_clzll(size - 1) - SHRREG_SIZE_BUCKET_SHIFT;
+    return bucket < SHRREG_SIZE_BUCKETS ? bucket : SHRREG_SIZE_BUCKETS - 1;
+}
+
+// Per-process, per-device statistics, only written by the owner
+typedef struct {
+    _Atomic uint64_t peak;         // Highest device_memory_t.total seen, leases included
+    _Atomic uint64_t size_buckets[SHRREG_SIZE_BUCKETS];  // Data allocations by size
+} SHRREG_CACHE_ALIGNED device_memory_stats_t;
+_Static_assert(sizeof(device_memory_stats_t) == 3 * SHRREG_CACHE_LINE_SIZE, "device_memory_stats_t must fill three cache lines");
+
+// Plain copy of a device_memory_stats_t
+typedef struct {
+    uint64_t peak;
+    uint64_t size_buckets[SHRREG_SIZE_BUCKETS];
+} device_memory_stats_snapshot_t;
 
+// Per-process, per-device values written by the utilization watcher
 typedef struct {
+    _Atomic uint64_t monitorused;
     _Atomic uint64_t dec_util;
     _Atomic uint64_t enc_util;
     _Atomic uint64_t sm_util;
-    uint64_t unused[3];
 } device_util_t;
 
+// Per-process metadata, read by ENSURE_RUNNING. The per-device values live
+// in the proc_used and proc_util arrays, see shrreg_proc_used().
 typedef struct {
     _Atomic int32_t pid;           // Atomic to detect slot allocation
     _Atomic int32_t hostpid;
-    device_memory_t used[CUDA_DEVICE_MAX_COUNT];
-    _Atomic uint64_t monitorused[CUDA_DEVICE_MAX_COUNT];
-    device_util_t device_util[CUDA_DEVICE_MAX_COUNT];
-    _Atomic int32_t status;
-    _Atomic uint64_t seqlock;      // Sequence lock for consistent snapshots
-    uint64_t unused[2];
-} shrreg_proc_slot_t;
+    _Atomic int32_t status;        // Also a futex, woken on every change
+    int32_t indexed_pid;           // Key in pid_index, survives exit_handler() zeroing pid
+    int32_t flags;                 // SHRREG_SLOT_*
+    int32_t group;                 // 1 + index in the groups, 0 for none; under lock_shrreg
+    _Atomic int32_t cache_flush_ack;   // Last cache_flush_seq answered, see SHRREG_SLOT_CACHING
+    int32_t padding;
+    // Pid namespace pid belongs to, see proc_pid_namespace(); processes
+    // of other containers sharing the region have pids of their own
+    uint64_t pidns;
+    uint64_t unused[3];
+} SHRREG_CACHE_ALIGNED shrreg_proc_slot_t;
+
+// The slot mirrors a process still running on the 1.2 region,
+// see shrreg_sync_legacy()
+#define SHRREG_SLOT_LEGACY 0x1
+// The process caches freed allocations and answers flush requests,
+// counted in caching_procs; set and cleared under lock_shrreg
+#define SHRREG_SLOT_CACHING 0x2
+
+// Per-device aggregate, one cache line per device
+typedef struct {
+    _Atomic uint64_t usage;        // Sum of proc_used[dev][].total
+    _Atomic uint64_t sm_util;      // Sum of proc_util[dev][].sm_util, as last seen by a watcher
+    _Atomic int64_t drift;         // NVML usage minus tracked usage of all processes, last reconciliation
+    _Atomic uint64_t drift_corrections;  // Changes of a proc_used[dev][].offset
+    uint64_t unused[4];
+} SHRREG_CACHE_ALIGNED device_usage_t;
+
+// Samples kept per device in the history ring, a power of two
+#define SHRREG_HISTORY_LEN 256
+
+// Event that produced a history sample
+#define SHRREG_SAMPLE_ALLOC 1
+#define SHRREG_SAMPLE_FREE 2
+#define SHRREG_SAMPLE_WATCHER 3
+
+// One history sample, one cache line. Published like a seqlock: seq is 0
+// while the sample is written, then the sample's position in the ring + 1.
+typedef struct {
+    _Atomic uint64_t seq;
+    _Atomic uint64_t time_us;      // CLOCK_REALTIME
+    _Atomic uint64_t usage;        // Device aggregate after the event
+    _Atomic uint64_t limit;
+    _Atomic uint64_t sm_util;      // device_usage_t.sm_util
+    _Atomic int64_t tokens;        // SM rate limiter tokens left in pid, 0 without an SM limit
+    _Atomic int32_t pid;
+    _Atomic int32_t source;        // SHRREG_SAMPLE_*
+    uint64_t unused[1];
+} SHRREG_CACHE_ALIGNED shrreg_sample_t;
+_Static_assert(sizeof(shrreg_sample_t) == SHRREG_CACHE_LINE_SIZE, "shrreg_sample_t must fill one cache line");
+
+// Per-device ring of the most recent samples. Writers claim a position
+// with one fetch_add on head; readers never block them.
+typedef struct {
+    _Atomic uint64_t head;         // Samples ever appended
+    uint64_t unused[7];
+    shrreg_sample_t samples[SHRREG_HISTORY_LEN];
+} SHRREG_CACHE_ALIGNED shrreg_history_t;
+
+// Denials kept per device in the OOM event ring, a power of two
+#define SHRREG_OOM_EVENTS_LEN 64
+// Largest consumers of the device recorded with each denial
+#define SHRREG_OOM_TOP_PROCS 4
+
+// Entry point of a denied allocation, see shrreg_api_name()
+#define SHRREG_API_UNKNOWN 0
+#define SHRREG_API_MEM_ALLOC 1
+#define SHRREG_API_MEM_ALLOC_MANAGED 2
+#define SHRREG_API_MEM_ALLOC_PITCH 3
+#define SHRREG_API_MEM_ALLOC_ASYNC 4
+#define SHRREG_API_MEM_CREATE 5
+#define SHRREG_API_MEM_ALLOC_HOST 6
+#define SHRREG_API_MEM_HOST_ALLOC 7
+#define SHRREG_API_MEM_HOST_REGISTER 8
+#define SHRREG_API_MIPMAPPED_ARRAY_CREATE 9
+#define SHRREG_API_COUNT 10
+
+static inline const char* shrreg_api_name(int api) {
+    static const char* names[SHRREG_API_COUNT] = {
+        "unknown", "cuMemAlloc_v2", "cuMemAllocManaged", "cuMemAllocPitch_v2",
+        "cuMemAllocAsync", "cuMemCreate", "cuMemAllocHost_v2", "cuMemHostAlloc",
+        "cuMemHostRegister_v2", "cuMipmappedArrayCreate",
+    };
+    return api > 0 && api < SHRREG_API_COUNT ? names[api] : names[0];
+}
+
+// One denied allocation, two cache lines, published like shrreg_sample_t
+typedef struct {
+    _Atomic uint64_t seq;
+    _Atomic uint64_t time_us;      // CLOCK_REALTIME
+    _Atomic uint64_t size;         // Requested bytes, 0 for a check after the fact
+    _Atomic uint64_t usage;        // Device aggregate when denied
+    _Atomic uint64_t limit;
+    _Atomic int32_t pid;
+    _Atomic int32_t api;           // SHRREG_API_*
+    _Atomic int32_t top_pid[SHRREG_OOM_TOP_PROCS];        // Largest first, 0 if unused
+    _Atomic uint64_t top_usage[SHRREG_OOM_TOP_PROCS];
+    uint64_t unused[4];
+} SHRREG_CACHE_ALIGNED shrreg_oom_event_t;
+_Static_assert(sizeof(shrreg_oom_event_t) == 2 * SHRREG_CACHE_LINE_SIZE, "shrreg_oom_event_t must fill two cache lines");
+
+// Per-device ring of the most recent denials, appended like shrreg_history_t
+typedef struct {
+    _Atomic uint64_t head;         // Denials ever recorded
+    uint64_t unused[7];
+    shrreg_oom_event_t events[SHRREG_OOM_EVENTS_LEN];
+} SHRREG_CACHE_ALIGNED shrreg_oom_events_t;
+
+// Quota groups a region holds
+#define SHRREG_MAX_GROUPS 64
+#define SHRREG_GROUP_NAME_LEN 112
+
+// Quota group shared by the processes of several containers. Entries are
+// claimed and released under lock_shrreg.
+typedef struct {
+    char name[SHRREG_GROUP_NAME_LEN];  // Empty for a free entry
+    int32_t procs;                 // Slots in the group
+    int32_t padding;
+    uint64_t unused[1];
+} SHRREG_CACHE_ALIGNED shrreg_group_t;
+_Static_assert(sizeof(shrreg_group_t) == 2 * SHRREG_CACHE_LINE_SIZE, "shrreg_group_t must fill two cache lines");
+
+// Per-group, per-device quota, one cache line
+typedef struct {
+    _Atomic uint64_t usage;        // Sum of proc_used[dev][].total of the group's slots
+    _Atomic uint64_t limit;        // 0 for none
+    uint64_t unused[6];
+} SHRREG_CACHE_ALIGNED group_usage_t;
+_Static_assert(sizeof(group_usage_t) == SHRREG_CACHE_LINE_SIZE, "group_usage_t must fill one cache line");
+
+// Open-addressing index from pid (or hostpid) to slot number. Entries pack
+// (key << 32 | slot); 0 is an empty entry. Only modified under lock_shrreg,
+// lookups are lock-free and validated against the slot itself.
+typedef struct {
+    int32_t used;                  // Live entries plus tombstones
+    uint32_t mask;                 // Entry count - 1, a power of two >= 2 * max_procs
+    _Atomic uint64_t entries[];
+} shrreg_proc_index_t;
 
 typedef char uuid[96];
 
+/*
+ * Header of the shared region. The first three fields keep their offsets
+ * in every version so that any build can identify a file. The arrays
+ * follow the header at the recorded offsets; their sizes derive from
+ * device_count and max_procs, fixed when the region is created.
+ */
 typedef struct {
     _Atomic int32_t initialized_flag;
     uint32_t major_version;
     uint32_t minor_version;
     _Atomic int32_t sm_init_flag;
     _Atomic size_t owner_pid;
-    sem_t sem;  // Only for process slot add/remove
+    pthread_mutex_t lock;  // Robust, only for process slot add/remove
     uint64_t device_num;
-    uuid uuids[CUDA_DEVICE_MAX_COUNT];
-    uint64_t limit[CUDA_DEVICE_MAX_COUNT];
-    uint64_t sm_limit[CUDA_DEVICE_MAX_COUNT];
-    shrreg_proc_slot_t procs[SHARED_REGION_MAX_PROCESS_NUM];
     _Atomic int proc_num;
     _Atomic int utilization_switch;
     _Atomic int recent_kernel;
     int priority;
     _Atomic uint64_t last_kernel_time;
-    sem_t sem_postinit;  // For serializing postInit() host PID detection
-} shared_region_t;
+    pthread_mutex_t lock_postinit;  // Robust, for serializing postInit() host PID detection
+    // Geometry
+    uint64_t region_size;
+    uint32_t device_count;
+    uint32_t max_procs;
+    uint64_t uuids_offset;         // uuid[device_count]
+    uint64_t limit_offset;         // uint64_t[device_count]
+    uint64_t sm_limit_offset;      // uint64_t[device_count]
+    // Per-device sum of the slot counters, kept in sync by add/rm and
+    // slot reaping so that the limit check is a single atomic load
+    uint64_t dev_usage_offset;     // device_usage_t[device_count]
+    uint64_t procs_offset;         // shrreg_proc_slot_t[max_procs]
+    // Hot memory counters, grouped per device and indexed like procs
+    uint64_t proc_used_offset;     // device_memory_t[device_count][max_procs]
+    uint64_t proc_util_offset;     // device_util_t[device_count][max_procs]
+    uint64_t pid_index_offset;     // shrreg_proc_index_t
+    uint64_t hostpid_index_offset; // shrreg_proc_index_t
+    // Set while processes of the 1.2 region are alive
+    _Atomic int32_t legacy_active;
+    int32_t padding;
+    _Atomic uint64_t legacy_sync_time;  // Last shrreg_sync_legacy(), in ms
+    // Futex bumped whenever a slot status changes, see wait_status_all_timeout()
+    _Atomic int32_t status_seq;
+    int32_t padding2;
+    uint64_t history_offset;       // shrreg_history_t[device_count], 0 before 2.4
+    // lock_shrreg() statistics
+    _Atomic uint64_t lock_acquired;
+    _Atomic uint64_t lock_contended;   // Acquisitions that had to wait
+    _Atomic uint64_t lock_wait_us;     // Total time spent waiting
+    _Atomic uint64_t lock_recovered;   // Acquisitions from a dead owner
+    // Odd while a slot is added, moved or removed, see shrreg_snapshot()
+    _Atomic uint64_t epoch;
+    uint64_t proc_stats_offset;    // device_memory_stats_t[device_count][max_procs], 0 before 2.8
+    uint64_t oom_events_offset;    // shrreg_oom_events_t[device_count], 0 before 2.9
+    uint64_t group_count;          // 0 before 2.10
+    uint64_t groups_offset;        // shrreg_group_t[group_count]
+    uint64_t group_usage_offset;   // group_usage_t[group_count][device_count]
+    // Futex bumped whenever the limits are changed in place, 0 before 2.11
+    _Atomic int32_t limits_generation;
+    _Atomic int32_t limits_owner;  // Process watching the limits file
+    // Futexes of cache flush requests and of their answers, 0 before 2.12
+    _Atomic int32_t cache_flush_seq;
+    _Atomic int32_t cache_flush_acks;  // Bumped by every answer
+    _Atomic int32_t caching_procs;     // Slots with SHRREG_SLOT_CACHING
+} SHRREG_CACHE_ALIGNED shared_region_t;
+
+#define SHRREG_AT(region, offset, type) ((type*)((char*)(region) + (offset)))
+
+static inline uuid* shrreg_uuids(shared_region_t* region) {
+    return SHRREG_AT(region, region->uuids_offset, uuid);
+}
+
+static inline uint64_t* shrreg_limit(shared_region_t* region) {
+    return SHRREG_AT(region, region->limit_offset, uint64_t);
+}
+
+static inline uint64_t* shrreg_sm_limit(shared_region_t* region) {
+    return SHRREG_AT(region, region->sm_limit_offset, uint64_t);
+}
+
+static inline device_usage_t* shrreg_dev_usage(shared_region_t* region) {
+    return SHRREG_AT(region, region->dev_usage_offset, device_usage_t);
+}
+
+static inline shrreg_proc_slot_t* shrreg_procs(shared_region_t* region) {
+    return SHRREG_AT(region, region->procs_offset, shrreg_proc_slot_t);
+}
+
+static inline device_memory_t* shrreg_proc_used(shared_region_t* region, int dev, int slot) {
+    return SHRREG_AT(region, region->proc_used_offset, device_memory_t) +
+        (size_t)dev * region->max_procs + slot;
+}
+
+static inline device_util_t* shrreg_proc_util(shared_region_t* region, int dev, int slot) {
+    return SHRREG_AT(region, region->proc_util_offset, device_util_t) +
+        (size_t)dev * region->max_procs + slot;
+}
+
+// NULL if the region predates the statistics
+static inline device_memory_stats_t* shrreg_proc_stats(shared_region_t* region, int dev, int slot) {
+    if (region->proc_stats_offset == 0)
+        return NULL;
+    return SHRREG_AT(region, region->proc_stats_offset, device_memory_stats_t) +
+        (size_t)dev * region->max_procs + slot;
+}
+
+static inline shrreg_proc_index_t* shrreg_pid_index(shared_region_t* region) {
+    return SHRREG_AT(region, region->pid_index_offset, shrreg_proc_index_t);
+}
+
+static inline shrreg_proc_index_t* shrreg_hostpid_index(shared_region_t* region) {
+    return SHRREG_AT(region, region->hostpid_index_offset, shrreg_proc_index_t);
+}
+
+/*
+ * Reads of the slot array validated against the region epoch, which is
+ * bumped around every slot add and compaction:
+ *   e = shrreg_epoch_begin(region); ...read slots...; if (shrreg_epoch_retry(region, e)) retry
+ * Bound the retries: a lock owner dying mid-compaction leaves the epoch
+ * odd until the next lock_shrreg() repairs it.
+ */
+static inline uint64_t shrreg_epoch_begin(shared_region_t* region) {
+    return atomic_load_explicit(&region->epoch, memory_order_acquire);
+}
+
+static inline int shrreg_epoch_retry(shared_region_t* region, uint64_t epoch) {
+    atomic_thread_fence(memory_order_acquire);
+    return (epoch & 1) || atomic_load_explicit(&region->epoch, memory_order_relaxed) != epoch;
+}
+
+// History ring of dev, NULL if the region predates it
+static inline shrreg_history_t* shrreg_history(shared_region_t* region, int dev) {
+    if (region->history_offset == 0)
+        return NULL;
+    return SHRREG_AT(region, region->history_offset, shrreg_history_t) + dev;
+}
+
+// Group g of the region, NULL if the region predates groups
+static inline shrreg_group_t* shrreg_group(shared_region_t* region, int g) {
+    if (region->groups_offset == 0)
+        return NULL;
+    return SHRREG_AT(region, region->groups_offset, shrreg_group_t) + g;
+}
+
+static inline group_usage_t* shrreg_group_usage(shared_region_t* region, int g, int dev) {
+    return SHRREG_AT(region, region->group_usage_offset, group_usage_t) +
+        (size_t)g * region->device_count + dev;
+}
+
+// OOM event ring of dev, NULL if the region predates it
+static inline shrreg_oom_events_t* shrreg_oom_events(shared_region_t* region, int dev) {
+    if (region->oom_events_offset == 0)
+        return NULL;
+    return SHRREG_AT(region, region->oom_events_offset, shrreg_oom_events_t) + dev;
+}
+
+// Plain copies of the slot state, see shrreg_snapshot()
+typedef struct {
+    int32_t pid;
+    int32_t hostpid;
+    int32_t status;
+    int32_t flags;
+} shrreg_proc_snapshot_t;
+
+typedef struct {
+    uint64_t monitorused;
+    uint64_t dec_util;
+    uint64_t enc_util;
+    uint64_t sm_util;
+} device_util_snapshot_t;
+
+// Whole-region copy, arrays sized for the region it was allocated for
+typedef struct {
+    uint64_t epoch;
+    uint32_t device_count;
+    uint32_t max_procs;
+    int32_t proc_num;
+    uint64_t* usage;                    // [device_count] aggregates
+    uint64_t* limit;                    // [device_count]
+    uint64_t* sm_limit;                 // [device_count]
+    shrreg_proc_snapshot_t* procs;      // [proc_num]
+    device_memory_snapshot_t* used;     // [device_count][max_procs], like proc_used
+    device_util_snapshot_t* util;       // [device_count][max_procs], like proc_util
+    device_memory_stats_snapshot_t* stats;  // [device_count][max_procs], zero before 2.8
+} shrreg_snapshot_t;
+
+static inline device_memory_snapshot_t* shrreg_snapshot_used(shrreg_snapshot_t* snap, int dev, int slot) {
+    return snap->used + (size_t)dev * snap->max_procs + slot;
+}
+
+static inline device_util_snapshot_t* shrreg_snapshot_util(shrreg_snapshot_t* snap, int dev, int slot) {
+    return snap->util + (size_t)dev * snap->max_procs + slot;
+}
+
+static inline device_memory_stats_snapshot_t* shrreg_snapshot_stats(shrreg_snapshot_t* snap, int dev, int slot) {
+    return snap->stats + (size_t)dev * snap->max_procs + slot;
+}
 
 typedef struct {
     int32_t pid;
@@ -115,6 +499,7 @@ typedef struct {
     shared_region_t* shared_region;
     uint64_t last_kernel_time; // cache for current process
     shrreg_proc_slot_t* my_slot;  // Cached pointer to this process's slot (lock-free access)
+    uint64_t pidns;               // Pid namespace of this process
 } shared_region_info_t;
 
 
@@ -136,6 +521,11 @@ int set_host_pid(int hostpid);
 uint64_t get_current_device_memory_monitor(const int dev);
 uint64_t get_current_device_memory_usage(const int dev);
 size_t get_gpu_memory_usage(const int dev);
+size_t get_gpu_memory_lease(const int dev);
+size_t reclaim_gpu_memory_leases(const int dev);
+// Quota group of this process on dev, 0 without a group or group limit
+uint64_t get_current_group_memory_limit(const int dev);
+uint64_t get_current_group_memory_usage(const int dev);
 
 // Priority-related
 int get_current_priority();
@@ -146,10 +536,20 @@ int set_env_utilization_switch();
 
 int set_gpu_device_memory_monitor(int32_t pid,int dev,size_t monitor);
 int set_gpu_device_sm_utilization(int32_t pid,int dev, unsigned int smUtil);
+int set_gpu_device_sm_utilization_sum(int dev, unsigned int smUtil);
 int init_gpu_device_utilization();
+// Correct the offsets of the processes on dev from their NVML usage, count
+// entries of hostpids and used as reported by nvmlDeviceGetComputeRunningProcesses
+void reconcile_gpu_device_memory(int dev, const int32_t* hostpids, const uint64_t* used, int count);
+// Whether CUDA_DEVICE_MEMORY_DRIFT_LIMIT_ENV allows any correction
+int drift_correction_enabled();
 int add_gpu_device_memory_usage(int32_t pid,int dev,size_t usage,int type);
+// Like add_gpu_device_memory_usage(), but returns 1 instead of exceeding the
+// device limit. Charge before allocating, undo with rm_gpu_device_memory_usage().
+int reserve_gpu_device_memory_usage(int32_t pid,int dev,size_t usage,int type);
 int rm_gpu_device_memory_usage(int32_t pid,int dev,size_t usage,int type);
 
+shrreg_proc_slot_t *find_proc_by_pid(int pid);
 shrreg_proc_slot_t *find_proc_by_hostpid(int hostpid);
 int active_oom_killer();
 void pre_launch_kernel();
@@ -177,13 +577,100 @@ void suspend_all();
 void resume_all();
 int wait_status_self(int status);
 int wait_status_all(int status);
+// Like the above, but sleep up to timeout_ms for a status change first
+int wait_status_self_timeout(int status, int timeout_ms);
+int wait_status_all_timeout(int status, int timeout_ms);
 void print_all();
 
 int load_env_from_file(char *filename);
+
+/**
+ * Apply the memory and SM limits of a file in the format of
+ * ENV_OVERRIDE_FILE to the region, without touching the environment.
+ * A device named neither by its own key nor by the unindexed one keeps
+ * its limit. Returns 1 if limits changed, 0 if not, -1 if the file
+ * cannot be read.
+ */
+int load_limits_from_file(const char* filename);
+
+// Store the limits that are not SHRREG_LIMIT_UNSET and bump the generation if any changed
+int shrreg_publish_limits(const uint64_t* memory_limits, const uint64_t* sm_limits, int count);
+int32_t shrreg_limits_generation();
+// Sleep until the generation differs from generation, at most timeout_ms
+void shrreg_wait_limits(int32_t generation, int timeout_ms);
+// Become the process watching the limits file if there is none alive, returns 1 if this process is
+int shrreg_claim_limits_owner();
+void shrreg_release_limits_owner();
+// Recompute what this process derives from the limits, after a generation change
+void shrreg_refresh_limits();
+
+// Longest wait for the other processes to flush their allocation caches
+#define SHRREG_CACHE_FLUSH_WAIT_MS 200
+/**
+ * Ask the other processes caching freed allocations to free them, and wait
+ * up to timeout_ms for each to answer. Returns the number of processes
+ * that were asked, 0 right away if none caches.
+ */
+int shrreg_request_cache_flush(int timeout_ms);
+// Count this process among those answering flush requests, returns the
+// current request sequence to wait on
+int32_t shrreg_register_cache_flusher();
+void shrreg_unregister_cache_flusher();
+int32_t shrreg_cache_flush_seq();
+// Sleep until a flush is requested after seq, at most timeout_ms
+void shrreg_wait_cache_flush(int32_t seq, int timeout_ms);
+// Answer the requests up to seq once the cache is flushed
+void shrreg_ack_cache_flush(int32_t seq);
 int comparelwr(const char *s1,char *s2);
 int put_device_info();
 unsigned int nvml_to_cuda_map(unsigned int nvmldev);
 unsigned int cuda_to_nvml_map(unsigned int cudadev);
 
-int clear_proc_slot_nolock(int);
+// Remove the slots of exited processes, the caller holds lock_shrreg
+int clear_proc_slot_nolock();
+// The same, taking lock_shrreg; returns 1 if any slot was removed
+int reap_dead_proc_slots();
+// Mark the slot of a process that exited without its exit_handler(), 1 if marked
+int shrreg_mark_proc_dead(int32_t pid);
+// Up to max pids of the other registered processes, as of *epoch.
+// Returns their number, or -1 if slots kept moving.
+int shrreg_list_proc_pids(int32_t* pids, int max, uint64_t* epoch);
+uint64_t shrreg_current_epoch();
+int shrreg_max_procs();
+
+// SM rate limiter tokens this process has left on dev
+int64_t get_current_device_tokens(int dev);
+// Append a sample of dev's current state to its history ring, source is SHRREG_SAMPLE_*
+void shrreg_record_sample(int dev, int source);
+// Copy up to max of dev's recent samples into out, oldest first, returns their number
+int shrreg_read_history(shared_region_t* region, int dev, shrreg_sample_t* out, int max);
+// Record a denied allocation of size bytes on dev through api, a SHRREG_API_*
+void shrreg_record_oom(int dev, size_t size, int api);
+// Copy up to max of dev's recent denials into out, oldest first, returns their number
+int shrreg_read_oom_events(shared_region_t* region, int dev, shrreg_oom_event_t* out, int max);
+
+// Path of the region file per SHARED_REGION_BACKING_ENV
+const char* shrreg_cache_path();
+// Configured path, where processes of shared region 1.2 keep theirs
+const char* shrreg_legacy_path();
+// Inherited descriptor of the region, -1 unless SHARED_REGION_BACKING_ENV is "fd:<n>"
+int shrreg_backing_fd();
+// Copy used through its seqlock, returns 0 if writers kept it busy and the copy may be torn
+int shrreg_read_proc_used(device_memory_t* used, device_memory_snapshot_t* out);
+// Buffer for shrreg_snapshot() of region, NULL if out of memory
+shrreg_snapshot_t* shrreg_snapshot_alloc(shared_region_t* region);
+void shrreg_snapshot_free(shrreg_snapshot_t* snap);
+// Copy the live state of region into snap without lock_shrreg, the slots
+// as of one epoch. Returns 0, or -1 if slots kept moving.
+int shrreg_snapshot(shared_region_t* region, shrreg_snapshot_t* snap);
+// Map the existing region read-only without registering this process,
+// NULL if there is none of the current major version
+shared_region_t* shrreg_map_readonly(size_t* size);
+// Fill the geometry fields of header, returns the total region size
+size_t shrreg_compute_layout(shared_region_t* header, uint32_t device_count, uint32_t max_procs);
+// Lay out and zero a new region; limits and initialized_flag are left to the caller
+int shrreg_init_region(shared_region_t* region, uint32_t device_count, uint32_t max_procs);
+// Slot helpers for the current region, the caller holds lock_shrreg
+shrreg_proc_slot_t* shrreg_add_proc_slot_nolock(int32_t pid);
+void shrreg_set_proc_hostpid_nolock(shrreg_proc_slot_t* slot, int32_t hostpid);
 #endif  // __MULTIPROCESS_MEMORY_LIMIT_H__
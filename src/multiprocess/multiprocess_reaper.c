@@ -0,0 +1,267 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+
+#include "include/log_utils.h"
+#include "include/process_utils.h"
+#include "multiprocess/multiprocess_memory_limit.h"
+#include "multiprocess/multiprocess_reaper.h"
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+/*
+ * Dead-process reaper. Each process with a CUDA context runs one; it keeps
+ * a pidfd per other registered process in an epoll set, and the kernel
+ * reports an exit as the pidfd becoming readable. Exited processes are
+ * marked like their exit_handler() would and removed under lock_shrreg at
+ * once, which also releases their quota. Without pidfds (before Linux 5.3,
+ * or filtered by seccomp), and beyond SHRREG_REAPER_MAX_WATCHES, processes
+ * are polled with proc_alive() every SHRREG_REAPER_INTERVAL_MS instead,
+ * still outside of the lock. Only the processes of the reaper's own pid
+ * namespace are watched; a region shared across containers holds pids of
+ * other namespaces, reaped by the reapers running there.
+ */
+
+#define REAPER_FD_POLLED -1   // Polled by proc_alive()
+#define REAPER_FD_EXITED -2   // Exited, dropped once its slot is removed
+
+typedef struct {
+    int32_t pid;
+    int fd;
+} reaper_watch_t;
+
+typedef struct {
+    int epfd;
+    int use_pidfd;
+    int max;
+    int num;
+    int pidfds;
+    uint64_t epoch;
+    int rescan;
+    reaper_watch_t* watches;      // [max], sorted by pid
+    reaper_watch_t* next;         // [max], scratch for the next scan
+    int32_t* pids;                // [max], scratch
+    int32_t* dead;                // [max], exited pids found by this round
+    int num_dead;
+} reaper_t;
+
+static pid_t reaper_owner = 0;
+static reaper_t* reaper = NULL;
+
+static int compare_pid(const void* a, const void* b) {
+    int32_t x = *(const int32_t*)a;
+    int32_t y = *(const int32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void add_dead(reaper_t* r, int32_t pid) {
+    if (r->num_dead < r->max)
+        r->dead[r->num_dead++] = pid;
+}
+
+// Watch pid with a pidfd if possible, otherwise leave it to proc_alive()
+static int open_watch(reaper_t* r, int32_t pid) {
+    if (!r->use_pidfd || r->pidfds >= SHRREG_REAPER_MAX_WATCHES)
+        return REAPER_FD_POLLED;
+    int fd = syscall(SYS_pidfd_open, pid, 0);
+    if (fd < 0) {
+        if (errno == ESRCH) {
+            add_dead(r, pid);
+            return REAPER_FD_EXITED;
+        }
+        LOG_WARN("pidfd_open unavailable (errno=%d), polling processes instead", errno);
+        r->use_pidfd = 0;
+        return REAPER_FD_POLLED;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uint64_t)(uint32_t)pid;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        close(fd);
+        return REAPER_FD_POLLED;
+    }
+    r->pidfds++;
+    return fd;
+}
+
+static void close_watch(reaper_t* r, reaper_watch_t* w) {
+    if (w->fd >= 0) {
+        // A forked child may share the epoll set until it starts its own
+        epoll_ctl(r->epfd, EPOLL_CTL_DEL, w->fd, NULL);
+        close(w->fd);
+        r->pidfds--;
+    }
+    w->fd = REAPER_FD_POLLED;
+}
+
+/**
+ * Bring the watches in line with the registered processes. Both lists are
+ * sorted by pid and merged; a scan racing with a slot move is redone on
+ * the next round.
+ */
+static void scan_procs(reaper_t* r) {
+    uint64_t epoch;
+    int n = shrreg_list_proc_pids(r->pids, r->max, &epoch);
+    if (n < 0) {
+        r->rescan = 1;
+        return;
+    }
+    qsort(r->pids, n, sizeof(int32_t), compare_pid);
+    int i = 0, j = 0, k = 0;
+    while (i < r->num || j < n) {
+        if (j < n && k > 0 && r->next[k - 1].pid == r->pids[j]) {
+            j++;  // Duplicate seen during a slot move
+            continue;
+        }
+        if (j >= n || (i < r->num && r->watches[i].pid < r->pids[j])) {
+            // Deregistered since the last scan
+            close_watch(r, &r->watches[i++]);
+            continue;
+        }
+        reaper_watch_t* w = &r->next[k++];
+        w->pid = r->pids[j];
+        if (i < r->num && r->watches[i].pid == r->pids[j]) {
+            w->fd = r->watches[i++].fd;
+        } else {
+            w->fd = open_watch(r, w->pid);
+        }
+        j++;
+    }
+    reaper_watch_t* swap = r->watches;
+    r->watches = r->next;
+    r->next = swap;
+    r->num = k;
+    r->epoch = epoch;
+    r->rescan = 0;
+}
+
+static void poll_procs(reaper_t* r) {
+    int i;
+    for (i = 0; i < r->num; i++) {
+        if (r->watches[i].fd == REAPER_FD_POLLED &&
+            proc_alive(r->watches[i].pid) == PROC_STATE_NONALIVE) {
+            r->watches[i].fd = REAPER_FD_EXITED;
+            add_dead(r, r->watches[i].pid);
+        }
+    }
+}
+
+static void handle_exits(reaper_t* r, struct epoll_event* events, int n) {
+    int i;
+    for (i = 0; i < n; i++) {
+        int32_t pid = (int32_t)events[i].data.u64;
+        reaper_watch_t key = {pid, 0};
+        reaper_watch_t* w = bsearch(&key, r->watches, r->num, sizeof(reaper_watch_t), compare_pid);
+        if (w == NULL || w->fd < 0)
+            continue;
+        close_watch(r, w);
+        w->fd = REAPER_FD_EXITED;
+        add_dead(r, pid);
+    }
+}
+
+/**
+ * Mark and remove the slots of this round's exited processes. Their
+ * watches go too: should a pid come back, it belongs to a new process
+ * and gets a new pidfd on the next scan.
+ */
+static void reap(reaper_t* r) {
+    if (r->num_dead == 0)
+        return;
+    int i, k = 0;
+    for (i = 0; i < r->num_dead; i++)
+        shrreg_mark_proc_dead(r->dead[i]);
+    // Also removes slots an exit_handler() marked, those are released late otherwise
+    reap_dead_proc_slots();
+    for (i = 0; i < r->num; i++) {
+        if (r->watches[i].fd != REAPER_FD_EXITED)
+            r->watches[k++] = r->watches[i];
+    }
+    r->num = k;
+    r->num_dead = 0;
+    r->rescan = 1;
+}
+
+static void reaper_round(reaper_t* r) {
+    if (r->rescan || shrreg_current_epoch() != r->epoch)
+        scan_procs(r);
+    poll_procs(r);
+    reap(r);
+}
+
+static void* proc_reaper(void* arg) {
+    reaper_t* r = arg;
+    struct epoll_event events[64];
+    while (1) {
+        int n = epoll_wait(r->epfd, events, 64, SHRREG_REAPER_INTERVAL_MS);
+        if (n < 0 && errno != EINTR) {
+            LOG_ERROR("Reaper epoll_wait failed: errno=%d", errno);
+            return NULL;
+        }
+        if (n > 0)
+            handle_exits(r, events, n);
+        reaper_round(r);
+    }
+    return NULL;
+}
+
+static void free_reaper(reaper_t* r) {
+    int i;
+    for (i = 0; i < r->num; i++) {
+        if (r->watches[i].fd >= 0)
+            close(r->watches[i].fd);
+    }
+    if (r->epfd >= 0)
+        close(r->epfd);
+    free(r->watches);
+    free(r->next);
+    free(r->pids);
+    free(r->dead);
+    free(r);
+}
+
+void init_proc_reaper() {
+    // The reaper thread does not survive fork(), the child starts its own
+    if (reaper_owner == getpid())
+        return;
+    reaper_owner = getpid();
+    if (reaper != NULL) {
+        // Inherited from the parent, whose thread is not running here
+        free_reaper(reaper);
+        reaper = NULL;
+    }
+    reaper_t* r = calloc(1, sizeof(reaper_t));
+    if (r == NULL)
+        return;
+    r->max = shrreg_max_procs();
+    r->use_pidfd = 1;
+    r->rescan = 1;
+    r->watches = calloc(r->max, sizeof(reaper_watch_t));
+    r->next = calloc(r->max, sizeof(reaper_watch_t));
+    r->pids = calloc(r->max, sizeof(int32_t));
+    r->dead = calloc(r->max, sizeof(int32_t));
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->watches == NULL || r->next == NULL || r->pids == NULL || r->dead == NULL || r->epfd < 0) {
+        LOG_WARN("Fail to start the process reaper");
+        free_reaper(r);
+        return;
+    }
+    // Processes killed while nobody watched them are reaped before the
+    // first allocation of this process
+    reaper_round(r);
+    reaper = r;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, proc_reaper, r) != 0) {
+        LOG_WARN("Fail to start the process reaper thread");
+        return;
+    }
+    pthread_detach(tid);
+}
@@ -0,0 +1,17 @@
+#ifndef __MULTIPROCESS_REAPER_H__
+#define __MULTIPROCESS_REAPER_H__
+
+// Longest wait of the reaper before it looks for newly registered processes
+#define SHRREG_REAPER_INTERVAL_MS 1000
+// Processes a reaper holds a pidfd for, the rest are polled by proc_alive()
+#define SHRREG_REAPER_MAX_WATCHES 256
+
+/**
+ * Start the dead-process reaper of this process, once per process. It
+ * holds a pidfd for every other process registered in the region and
+ * removes their slots as soon as they exit, so that neither lock_shrreg()
+ * nor the allocation path has to check liveness.
+ */
+void init_proc_reaper();
+
+#endif  // __MULTIPROCESS_REAPER_H__
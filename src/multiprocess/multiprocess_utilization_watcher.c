@@ -21,6 +21,7 @@
 
 #include "multiprocess/multiprocess_memory_limit.h"
 #include "multiprocess/multiprocess_utilization_watcher.h"
+#include "multiprocess/multiprocess_limits_watcher.h"
 #include "include/log_utils.h"
 #include "include/nvml_override.h"
 
@@ -32,9 +33,10 @@ static volatile int64_t g_total_cuda_cores[CUDA_DEVICE_MAX_COUNT] = {0};
 extern int pidfound;
 int cuda_to_nvml_map_array[CUDA_DEVICE_MAX_COUNT];
 
-/* Cached at init — these values do not change at runtime */
+/* Cached at init, and refreshed by the limits watcher when they change */
 static int cached_sm_limit[CUDA_DEVICE_MAX_COUNT] = {0};
 static int cached_util_switch = 0;
+static unsigned int cached_device_count = 0;
 
 void rate_limiter(int grids, int blocks) {
   CUdevice current_device;
@@ -69,6 +71,12 @@ CHECK:
   } while (!CAS(&g_cur_cuda_cores[device_id], before_cuda_cores, after_cuda_cores));
 }
 
+int64_t get_current_device_tokens(int dev) {
+  if (dev < 0 || dev >= CUDA_DEVICE_MAX_COUNT)
+    return 0;
+  return g_cur_cuda_cores[dev];
+}
+
 static void change_token(int64_t delta, int device_id) {
   int64_t cuda_cores_before = 0, cuda_cores_after = 0;
 
@@ -148,6 +156,8 @@ int get_used_gpu_utilization(int *userutil,int *sysprocnum) {
     int i;
     unsigned int infcount;
     nvmlProcessInfo_v1_t infos[SHARED_REGION_MAX_PROCESS_NUM];
+    int32_t hostpids[SHARED_REGION_MAX_PROCESS_NUM];
+    uint64_t nvml_used[SHARED_REGION_MAX_PROCESS_NUM];
 
     unsigned int nvmlCounts;
     CHECK_NVML_API(nvmlDeviceGetCount(&nvmlCounts));
@@ -156,7 +166,6 @@ int get_used_gpu_utilization(int *userutil,int *sysprocnum) {
     for (devi=0;devi<nvmlCounts;devi++){
       uint64_t sum=0;
       infcount = SHARED_REGION_MAX_PROCESS_NUM;
-      shrreg_proc_slot_t *proc;
       cudadev = nvml_to_cuda_map((unsigned int)(devi));
       if (cudadev<0)
         continue;
@@ -177,33 +186,34 @@ int get_used_gpu_utilization(int *userutil,int *sysprocnum) {
       unsigned int processes_num = SHARED_REGION_MAX_PROCESS_NUM;
       nvmlReturn_t res2 = nvmlDeviceGetProcessUtilization(device, processes_sample, &processes_num, microsec);
 
-      // Now acquire lock only for the brief period needed to update shared memory
-      lock_shrreg();
-
+      // Update shared memory without lock_shrreg: hostpid lookups go through
+      // the validated index and the fields are single atomic stores. A write
+      // racing with slot compaction is lost and redone on the next round.
       if (res == NVML_SUCCESS) {
+        int reported = 0;
         for (i=0; i<infcount; i++){
-          proc = find_proc_by_hostpid(infos[i].pid);
-          if (proc != NULL){
-              proc->monitorused[cudadev] = infos[i].usedGpuMemory;
+          set_gpu_device_memory_monitor(infos[i].pid, cudadev, infos[i].usedGpuMemory);
+          if (infos[i].usedGpuMemory != NVML_VALUE_NOT_AVAILABLE) {
+            hostpids[reported] = infos[i].pid;
+            nvml_used[reported] = infos[i].usedGpuMemory;
+            reported++;
           }
         }
+        reconcile_gpu_device_memory(cudadev, hostpids, nvml_used, reported);
       }
 
       if (res2 == NVML_SUCCESS) {
         for (i=0; i<processes_num; i++){
-          proc = find_proc_by_hostpid(processes_sample[i].pid);
-          if (proc != NULL){
+          if (set_gpu_device_sm_utilization(processes_sample[i].pid, cudadev, processes_sample[i].smUtil)){
               sum += processes_sample[i].smUtil;
-              proc->device_util[cudadev].sm_util = processes_sample[i].smUtil;
           }
         }
       }
 
-      unlock_shrreg();
-
       if (sum < 0)
         sum = 0;
       userutil[cudadev] = sum;
+      set_gpu_device_sm_utilization_sum(cudadev, sum);
     }
     return 0;
 }
@@ -254,6 +264,18 @@ void* utilization_watcher() {
                      dev, userutil[dev], g_cur_cuda_cores[dev], g_total_cuda_cores[dev],
                      cached_sm_limit[dev], share[dev]);
         }
+        for (unsigned int dev = 0; dev < device_count && dev < CUDA_DEVICE_MAX_COUNT; dev++) {
+            shrreg_record_sample(dev, SHRREG_SAMPLE_WATCHER);
+        }
+    }
+}
+
+void refresh_sm_limits() {
+    for (unsigned int dev = 0; dev < cached_device_count && dev < CUDA_DEVICE_MAX_COUNT; dev++) {
+        int limit = get_current_device_sm_limit(dev);
+        if (limit != cached_sm_limit[dev])
+            LOG_INFO("device %d: core utilization limit = %d", dev, limit);
+        cached_sm_limit[dev] = limit;
     }
 }
 
@@ -265,6 +287,7 @@ void init_utilization_watcher() {
     }
 
     setspec();
+    cached_device_count = device_count;
 
     // Initialize cached_sm_limit for each device
     int has_limit = 0;
@@ -277,7 +300,9 @@ void init_utilization_watcher() {
     }
 
     pthread_t tid;
-    if (has_limit) {
+    // The watcher also reconciles tracked usage with NVML, and limits
+    // from the limits file may turn on at any time
+    if (has_limit || drift_correction_enabled() || limits_watcher_enabled()) {
         pthread_create(&tid, NULL, utilization_watcher, NULL);
     }
     return;
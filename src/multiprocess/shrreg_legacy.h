@@ -0,0 +1,84 @@
+#ifndef __SHRREG_LEGACY_H__
+#define __SHRREG_LEGACY_H__
+
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "multiprocess/multiprocess_memory_limit.h"
+
+/*
+ * Frozen layout of shared region 1.2, the last fixed-size layout. Only
+ * used to count the processes still running on a 1.2 file, never extend.
+ */
+#define SHRREG_V1_2_MAJOR_VERSION 1
+#define SHRREG_V1_2_MINOR_VERSION 2
+#define SHRREG_V1_2_DEVICE_COUNT 16
+#define SHRREG_V1_2_PROCESS_NUM 1024
+
+typedef struct {
+    _Atomic uint64_t context_size;
+    _Atomic uint64_t module_size;
+    _Atomic uint64_t data_size;
+    _Atomic uint64_t offset;
+    _Atomic uint64_t total;
+    uint64_t unused[3];
+} shrreg_v1_2_device_memory_t;
+
+typedef struct {
+    _Atomic uint64_t dec_util;
+    _Atomic uint64_t enc_util;
+    _Atomic uint64_t sm_util;
+    uint64_t unused[3];
+} shrreg_v1_2_device_util_t;
+
+typedef struct {
+    _Atomic int32_t pid;
+    _Atomic int32_t hostpid;
+    shrreg_v1_2_device_memory_t used[SHRREG_V1_2_DEVICE_COUNT];
+    _Atomic uint64_t monitorused[SHRREG_V1_2_DEVICE_COUNT];
+    shrreg_v1_2_device_util_t device_util[SHRREG_V1_2_DEVICE_COUNT];
+    _Atomic int32_t status;
+    _Atomic uint64_t seqlock;
+    uint64_t unused[2];
+} shrreg_v1_2_proc_slot_t;
+
+typedef struct {
+    _Atomic int32_t initialized_flag;
+    uint32_t major_version;
+    uint32_t minor_version;
+    _Atomic int32_t sm_init_flag;
+    _Atomic size_t owner_pid;
+    sem_t sem;
+    uint64_t device_num;
+    uuid uuids[SHRREG_V1_2_DEVICE_COUNT];
+    uint64_t limit[SHRREG_V1_2_DEVICE_COUNT];
+    uint64_t sm_limit[SHRREG_V1_2_DEVICE_COUNT];
+    shrreg_v1_2_proc_slot_t procs[SHRREG_V1_2_PROCESS_NUM];
+    _Atomic int proc_num;
+    _Atomic int utilization_switch;
+    _Atomic int recent_kernel;
+    int priority;
+    _Atomic uint64_t last_kernel_time;
+    sem_t sem_postinit;
+} shrreg_v1_2_region_t;
+
+// Minimum interval between two syncs of the legacy slots
+#define SHRREG_LEGACY_SYNC_INTERVAL_MS 100
+
+/**
+ * Start mirroring the slots of the 1.2 region at shrreg_legacy_path()
+ * into region if processes still run on it. created tells that region
+ * was just created, it then takes the limits of the 1.2 region. The
+ * caller holds the creation lock of region.
+ */
+void shrreg_attach_legacy(shared_region_t* region, int created);
+
+/**
+ * Mirror the slots of the processes still on the 1.2 file into region.
+ * Rate limited to SHRREG_LEGACY_SYNC_INTERVAL_MS unless force is set.
+ * Clears region->legacy_active once the last of them is gone.
+ */
+void shrreg_sync_legacy(shared_region_t* region, int force);
+
+#endif  // __SHRREG_LEGACY_H__
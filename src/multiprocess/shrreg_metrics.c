@@ -0,0 +1,352 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "include/log_utils.h"
+#include "multiprocess/multiprocess_memory_limit.h"
+#include "multiprocess/shrreg_metrics.h"
+
+#define METRICS_CONTENT_TYPE "application/openmetrics-text; version=1.0.0; charset=utf-8"
+#define METRICS_IO_TIMEOUT_SEC 5
+
+static void write_family(FILE* out, const char* name, const char* type, const char* unit, const char* help) {
+    fprintf(out, "# TYPE %s %s\n", name, type);
+    if (unit != NULL)
+        fprintf(out, "# UNIT %s %s\n", name, unit);
+    fprintf(out, "# HELP %s %s\n", name, help);
+}
+
+static void write_device_metrics(shared_region_t* region, FILE* out) {
+    int dev;
+    write_family(out, "hami_device_memory_limit_bytes", "gauge", "bytes", "Device memory limit, 0 for none.");
+    for (dev = 0; dev < (int)region->device_count; dev++)
+        fprintf(out, "hami_device_memory_limit_bytes{device=\"%d\"} %lu\n", dev, shrreg_limit(region)[dev]);
+    write_family(out, "hami_device_memory_used_bytes", "gauge", "bytes", "Device memory charged by all processes.");
+    for (dev = 0; dev < (int)region->device_count; dev++)
+        fprintf(out, "hami_device_memory_used_bytes{device=\"%d\"} %lu\n", dev,
+            atomic_load_explicit(&shrreg_dev_usage(region)[dev].usage, memory_order_relaxed));
+    write_family(out, "hami_device_sm_limit_percent", "gauge", NULL, "SM utilization limit, 0 for none.");
+    for (dev = 0; dev < (int)region->device_count; dev++)
+        fprintf(out, "hami_device_sm_limit_percent{device=\"%d\"} %lu\n", dev, shrreg_sm_limit(region)[dev]);
+    write_family(out, "hami_device_sm_utilization_percent", "gauge", NULL, "SM utilization of all processes, as last seen by a watcher.");
+    for (dev = 0; dev < (int)region->device_count; dev++)
+        fprintf(out, "hami_device_sm_utilization_percent{device=\"%d\"} %lu\n", dev,
+            atomic_load_explicit(&shrreg_dev_usage(region)[dev].sm_util, memory_order_relaxed));
+    write_family(out, "hami_device_history_samples", "counter", NULL, "Samples appended to the usage history.");
+    for (dev = 0; dev < (int)region->device_count; dev++) {
+        shrreg_history_t* history = shrreg_history(region, dev);
+        if (history != NULL)
+            fprintf(out, "hami_device_history_samples_total{device=\"%d\"} %lu\n", dev,
+                atomic_load_explicit(&history->head, memory_order_relaxed));
+    }
+    write_family(out, "hami_device_memory_drift_bytes", "gauge", "bytes", "NVML usage minus tracked usage of all processes, at the last reconciliation.");
+    for (dev = 0; dev < (int)region->device_count; dev++)
+        fprintf(out, "hami_device_memory_drift_bytes{device=\"%d\"} %ld\n", dev,
+            atomic_load_explicit(&shrreg_dev_usage(region)[dev].drift, memory_order_relaxed));
+    write_family(out, "hami_device_memory_drift_corrections", "counter", NULL, "Changes of a process's drift correction.");
+    for (dev = 0; dev < (int)region->device_count; dev++)
+        fprintf(out, "hami_device_memory_drift_corrections_total{device=\"%d\"} %lu\n", dev,
+            atomic_load_explicit(&shrreg_dev_usage(region)[dev].drift_corrections, memory_order_relaxed));
+    write_family(out, "hami_device_oom_events", "counter", NULL, "Allocations denied by the memory limit.");
+    for (dev = 0; dev < (int)region->device_count; dev++) {
+        shrreg_oom_events_t* events = shrreg_oom_events(region, dev);
+        if (events != NULL)
+            fprintf(out, "hami_device_oom_events_total{device=\"%d\"} %lu\n", dev,
+                atomic_load_explicit(&events->head, memory_order_relaxed));
+    }
+}
+
+// Group name as a label value; read without the lock, a name being reset may show torn
+static void copy_group_label(shrreg_group_t* group, char* label, size_t len) {
+    size_t i, n = 0;
+    for (i = 0; i < SHRREG_GROUP_NAME_LEN && group->name[i] != '\0' && n + 2 < len; i++) {
+        char c = group->name[i];
+        if (c == '"' || c == '\\' || c == '\n') {
+            label[n++] = '\\';
+            c = c == '\n' ? 'n' : c;
+        }
+        label[n++] = c;
+    }
+    label[n] = '\0';
+}
+
+static void write_group_metrics(shared_region_t* region, FILE* out) {
+    char label[2 * SHRREG_GROUP_NAME_LEN];
+    int g, dev;
+    if (region->groups_offset == 0)
+        return;
+    write_family(out, "hami_group_memory_limit_bytes", "gauge", "bytes", "Memory limit of a quota group, 0 for none.");
+    for (g = 0; g < (int)region->group_count; g++) {
+        shrreg_group_t* group = shrreg_group(region, g);
+        if (group->name[0] == '\0')
+            continue;
+        copy_group_label(group, label, sizeof(label));
+        for (dev = 0; dev < (int)region->device_count; dev++)
+            fprintf(out, "hami_group_memory_limit_bytes{device=\"%d\",group=\"%s\"} %lu\n", dev, label,
+                atomic_load_explicit(&shrreg_group_usage(region, g, dev)->limit, memory_order_relaxed));
+    }
+    write_family(out, "hami_group_memory_used_bytes", "gauge", "bytes", "Device memory charged by the processes of a quota group.");
+    for (g = 0; g < (int)region->group_count; g++) {
+        shrreg_group_t* group = shrreg_group(region, g);
+        if (group->name[0] == '\0')
+            continue;
+        copy_group_label(group, label, sizeof(label));
+        for (dev = 0; dev < (int)region->device_count; dev++)
+            fprintf(out, "hami_group_memory_used_bytes{device=\"%d\",group=\"%s\"} %lu\n", dev, label,
+                atomic_load_explicit(&shrreg_group_usage(region, g, dev)->usage, memory_order_relaxed));
+    }
+    write_family(out, "hami_group_processes", "gauge", NULL, "Process slots in a quota group.");
+    for (g = 0; g < (int)region->group_count; g++) {
+        shrreg_group_t* group = shrreg_group(region, g);
+        if (group->name[0] == '\0')
+            continue;
+        copy_group_label(group, label, sizeof(label));
+        fprintf(out, "hami_group_processes{group=\"%s\"} %d\n", label, group->procs);
+    }
+}
+
+// Most recent rate limiter token level of each process, from the history
+static void write_token_metrics(shared_region_t* region, FILE* out) {
+    shrreg_sample_t* samples = malloc(sizeof(shrreg_sample_t) * SHRREG_HISTORY_LEN);
+    if (samples == NULL)
+        return;
+    write_family(out, "hami_process_sm_tokens", "gauge", NULL, "SM rate limiter tokens left in a process, as last sampled.");
+    int dev, i, j;
+    for (dev = 0; dev < (int)region->device_count; dev++) {
+        int n = shrreg_read_history(region, dev, samples, SHRREG_HISTORY_LEN);
+        // Newest first, once per pid
+        for (i = n - 1; i >= 0; i--) {
+            int32_t pid = samples[i].pid;
+            for (j = n - 1; j > i && samples[j].pid != pid; j--);
+            if (j == i && pid != 0)
+                fprintf(out, "hami_process_sm_tokens{device=\"%d\",pid=\"%d\"} %ld\n", dev, pid, (int64_t)samples[i].tokens);
+        }
+    }
+    free(samples);
+}
+
+static void write_process_metrics(shrreg_snapshot_t* snap, FILE* out) {
+    static const char* kinds[] = {"context", "module", "data", "lease", "correction"};
+    int i, dev, k;
+
+    write_family(out, "hami_process_status", "gauge", NULL, "Process status, 1 running, 2 suspended.");
+    for (i = 0; i < snap->proc_num; i++) {
+        if (snap->procs[i].pid != 0)
+            fprintf(out, "hami_process_status{pid=\"%d\",hostpid=\"%d\"} %d\n",
+                snap->procs[i].pid, snap->procs[i].hostpid, snap->procs[i].status);
+    }
+    write_family(out, "hami_process_memory_used_bytes", "gauge", "bytes", "Device memory charged to a process, by kind.");
+    for (i = 0; i < snap->proc_num; i++) {
+        if (snap->procs[i].pid == 0)
+            continue;
+        for (dev = 0; dev < (int)snap->device_count; dev++) {
+            device_memory_snapshot_t* used = shrreg_snapshot_used(snap, dev, i);
+            if (used->total == 0)
+                continue;
+            uint64_t values[] = {used->context_size, used->module_size, used->data_size, used->lease, used->offset};
+            for (k = 0; k < 5; k++)
+                fprintf(out, "hami_process_memory_used_bytes{device=\"%d\",pid=\"%d\",kind=\"%s\"} %lu\n",
+                    dev, snap->procs[i].pid, kinds[k], values[k]);
+        }
+    }
+    write_family(out, "hami_process_memory_peak_bytes", "gauge", "bytes", "Highest device memory charged to a process.");
+    for (i = 0; i < snap->proc_num; i++) {
+        if (snap->procs[i].pid == 0)
+            continue;
+        for (dev = 0; dev < (int)snap->device_count; dev++) {
+            uint64_t peak = shrreg_snapshot_stats(snap, dev, i)->peak;
+            if (peak != 0)
+                fprintf(out, "hami_process_memory_peak_bytes{device=\"%d\",pid=\"%d\"} %lu\n",
+                    dev, snap->procs[i].pid, peak);
+        }
+    }
+    write_family(out, "hami_process_allocation_size_bytes", "histogram", "bytes", "Sizes of a process's data allocations.");
+    for (i = 0; i < snap->proc_num; i++) {
+        if (snap->procs[i].pid == 0)
+            continue;
+        for (dev = 0; dev < (int)snap->device_count; dev++) {
+            device_memory_stats_snapshot_t* stats = shrreg_snapshot_stats(snap, dev, i);
+            uint64_t count = 0;
+            for (k = 0; k < SHRREG_SIZE_BUCKETS; k++)
+                count += stats->size_buckets[k];
+            if (count == 0)
+                continue;
+            count = 0;
+            for (k = 0; k < SHRREG_SIZE_BUCKETS - 1; k++) {
+                count += stats->size_buckets[k];
+                fprintf(out, "hami_process_allocation_size_bytes_bucket{device=\"%d\",pid=\"%d\",le=\"%llu\"} %lu\n",
+                    dev, snap->procs[i].pid, 1ULL << (SHRREG_SIZE_BUCKET_SHIFT + k), count);
+            }
+            count += stats->size_buckets[k];
+            fprintf(out, "hami_process_allocation_size_bytes_bucket{device=\"%d\",pid=\"%d\",le=\"+Inf\"} %lu\n",
+                dev, snap->procs[i].pid, count);
+            fprintf(out, "hami_process_allocation_size_bytes_count{device=\"%d\",pid=\"%d\"} %lu\n",
+                dev, snap->procs[i].pid, count);
+        }
+    }
+    write_family(out, "hami_process_memory_monitor_bytes", "gauge", "bytes", "Device memory of a process as reported by NVML.");
+    for (i = 0; i < snap->proc_num; i++) {
+        if (snap->procs[i].pid == 0)
+            continue;
+        for (dev = 0; dev < (int)snap->device_count; dev++) {
+            uint64_t monitor = shrreg_snapshot_util(snap, dev, i)->monitorused;
+            if (monitor != 0)
+                fprintf(out, "hami_process_memory_monitor_bytes{device=\"%d\",pid=\"%d\"} %lu\n",
+                    dev, snap->procs[i].pid, monitor);
+        }
+    }
+    write_family(out, "hami_process_memory_drift_bytes", "gauge", "bytes", "NVML usage of a process minus its tracked usage.");
+    for (i = 0; i < snap->proc_num; i++) {
+        if (snap->procs[i].pid == 0)
+            continue;
+        for (dev = 0; dev < (int)snap->device_count; dev++) {
+            uint64_t monitor = shrreg_snapshot_util(snap, dev, i)->monitorused;
+            device_memory_snapshot_t* used = shrreg_snapshot_used(snap, dev, i);
+            if (monitor != 0)
+                fprintf(out, "hami_process_memory_drift_bytes{device=\"%d\",pid=\"%d\"} %ld\n",
+                    dev, snap->procs[i].pid,
+                    (int64_t)monitor - (int64_t)(used->context_size + used->module_size + used->data_size));
+        }
+    }
+    write_family(out, "hami_process_sm_utilization_percent", "gauge", NULL, "SM utilization of a process as reported by NVML.");
+    for (i = 0; i < snap->proc_num; i++) {
+        if (snap->procs[i].pid == 0)
+            continue;
+        for (dev = 0; dev < (int)snap->device_count; dev++) {
+            uint64_t util = shrreg_snapshot_util(snap, dev, i)->sm_util;
+            if (util != 0)
+                fprintf(out, "hami_process_sm_utilization_percent{device=\"%d\",pid=\"%d\"} %lu\n",
+                    dev, snap->procs[i].pid, util);
+        }
+    }
+}
+
+void shrreg_write_metrics(shared_region_t* region, FILE* out) {
+    write_family(out, "hami_region", "info", NULL, "Shared region layout.");
+    fprintf(out, "hami_region_info{version=\"%u.%u\",devices=\"%u\",max_procs=\"%u\"} 1\n",
+        region->major_version, region->minor_version, region->device_count, region->max_procs);
+    write_family(out, "hami_processes", "gauge", NULL, "Process slots in use.");
+    fprintf(out, "hami_processes %d\n", atomic_load_explicit(&region->proc_num, memory_order_relaxed));
+    write_family(out, "hami_lock_acquisitions", "counter", NULL, "Acquisitions of the region lock.");
+    fprintf(out, "hami_lock_acquisitions_total %lu\n", atomic_load_explicit(&region->lock_acquired, memory_order_relaxed));
+    write_family(out, "hami_lock_contended", "counter", NULL, "Acquisitions of the region lock that had to wait.");
+    fprintf(out, "hami_lock_contended_total %lu\n", atomic_load_explicit(&region->lock_contended, memory_order_relaxed));
+    write_family(out, "hami_lock_wait_seconds", "counter", "seconds", "Time spent waiting for the region lock.");
+    fprintf(out, "hami_lock_wait_seconds_total %.6f\n",
+        atomic_load_explicit(&region->lock_wait_us, memory_order_relaxed) / 1e6);
+    write_family(out, "hami_lock_recovered", "counter", NULL, "Acquisitions of the region lock from a dead owner.");
+    fprintf(out, "hami_lock_recovered_total %lu\n", atomic_load_explicit(&region->lock_recovered, memory_order_relaxed));
+    write_device_metrics(region, out);
+    write_group_metrics(region, out);
+    shrreg_snapshot_t* snap = shrreg_snapshot_alloc(region);
+    if (snap != NULL && shrreg_snapshot(region, snap) == 0)
+        write_process_metrics(snap, out);
+    else
+        LOG_WARN("Fail to snapshot shrreg, process metrics skipped");
+    shrreg_snapshot_free(snap);
+    write_token_metrics(region, out);
+    fprintf(out, "# EOF\n");
+}
+
+static int listen_metrics(const char* listen_addr) {
+    int fd;
+    if (strncmp(listen_addr, "unix:", 5) == 0) {
+        struct sockaddr_un addr = {0};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, listen_addr + 5, sizeof(addr.sun_path) - 1);
+        unlink(addr.sun_path);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+            goto fail;
+    } else {
+        struct sockaddr_in addr = {0};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(atoi(listen_addr));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int one = 1;
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+            bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+            goto fail;
+    }
+    if (listen(fd, 16) != 0)
+        goto fail;
+    return fd;
+fail:
+    LOG_ERROR("Fail to listen on %s: errno=%d", listen_addr, errno);
+    if (fd >= 0)
+        close(fd);
+    return -1;
+}
+
+static void write_all(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n <= 0)
+            return;
+        buf += n;
+        len -= n;
+    }
+}
+
+// Answer one request, whatever it asks for
+static void serve_one(int conn) {
+    char request[1024];
+    if (read(conn, request, sizeof(request)) <= 0)
+        return;
+    char* body = NULL;
+    size_t body_len = 0;
+    FILE* out = open_memstream(&body, &body_len);
+    if (out == NULL)
+        return;
+    // Mapped per scrape, the region may be recreated in between
+    size_t region_size = 0;
+    shared_region_t* region = shrreg_map_readonly(&region_size);
+    if (region != NULL) {
+        shrreg_write_metrics(region, out);
+        munmap(region, region_size);
+    } else {
+        fprintf(out, "# EOF\n");
+    }
+    fclose(out);
+    char header[256];
+    int header_len = snprintf(header, sizeof(header),
+        "HTTP/1.0 200 OK\r\nContent-Type: " METRICS_CONTENT_TYPE "\r\nContent-Length: %zu\r\n\r\n", body_len);
+    write_all(conn, header, header_len);
+    write_all(conn, body, body_len);
+    free(body);
+}
+
+int shrreg_serve_metrics(const char* listen_addr) {
+    int fd = listen_metrics(listen_addr);
+    if (fd < 0)
+        return -1;
+    signal(SIGPIPE, SIG_IGN);
+    LOG_INFO("Serving metrics on %s", listen_addr);
+    while (1) {
+        int conn = accept(fd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR)
+                continue;
+            LOG_ERROR("Fail to accept metrics connection: errno=%d", errno);
+            close(fd);
+            return -1;
+        }
+        // A client that never sends its request must not stall the others
+        struct timeval timeout = {METRICS_IO_TIMEOUT_SEC, 0};
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        serve_one(conn);
+        close(conn);
+    }
+}
@@ -0,0 +1,24 @@
+#ifndef __SHRREG_METRICS_H__
+#define __SHRREG_METRICS_H__
+
+#include <stdio.h>
+
+#include "multiprocess/multiprocess_memory_limit.h"
+
+// Default listen address of shrreg_tool --serve
+#define SHRREG_METRICS_DEFAULT_LISTEN "9400"
+
+/**
+ * Write the state of region in the OpenMetrics text format. Only reads
+ * the region, without lock_shrreg, so a read-only mapping is enough.
+ */
+void shrreg_write_metrics(shared_region_t* region, FILE* out);
+
+/**
+ * Serve shrreg_write_metrics() over HTTP until an error occurs. listen is
+ * "unix:<path>" for a Unix socket, otherwise a port on 127.0.0.1.
+ * The region is mapped read-only, see shrreg_map_readonly().
+ */
+int shrreg_serve_metrics(const char* listen);
+
+#endif  // __SHRREG_METRICS_H__
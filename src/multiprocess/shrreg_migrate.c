@@ -0,0 +1,239 @@
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "multiprocess/multiprocess_memory_limit.h"
+#include "multiprocess/shrreg_legacy.h"
+
+/*
+ * Upgrade from a live 1.2 region. The current layout lives in a file of
+ * its own, shrreg_cache_path(), and the configured path stays a valid 1.2
+ * file: 1.2 processes, running or started later, keep using it and never
+ * map the current region. The process that creates the current region
+ * takes the limits of the 1.2 one, and the slots of live 1.2 processes
+ * are mirrored into the current region by shrreg_sync_legacy(). Current
+ * processes thus count the usage of 1.2 processes against the limits, but
+ * not the other way round: the limits only hold for every process once
+ * all of them run the current version.
+ */
+
+// Process-local mapping of the 1.2 file, opened by the first sync
+static shrreg_v1_2_region_t* legacy_region = NULL;
+
+static shrreg_v1_2_region_t* map_legacy_region(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(shrreg_v1_2_region_t))
+        map = mmap(NULL, sizeof(shrreg_v1_2_region_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+    shrreg_v1_2_region_t* legacy = (shrreg_v1_2_region_t*)map;
+    if (atomic_load_explicit(&legacy->initialized_flag, memory_order_acquire) != MULTIPROCESS_SHARED_REGION_MAGIC_FLAG ||
+        legacy->major_version != SHRREG_V1_2_MAJOR_VERSION ||
+        legacy->minor_version != SHRREG_V1_2_MINOR_VERSION) {
+        munmap(map, sizeof(shrreg_v1_2_region_t));
+        return NULL;
+    }
+    return legacy;
+}
+
+static uint64_t legacy_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// 1.2 processes may be killed without zeroing their slot
+static int legacy_proc_alive(int32_t pid) {
+    return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+static shrreg_v1_2_proc_slot_t* find_legacy_proc(shrreg_v1_2_region_t* legacy, int32_t pid) {
+    int proc_num = atomic_load_explicit(&legacy->proc_num, memory_order_acquire);
+    if (proc_num > SHRREG_V1_2_PROCESS_NUM)
+        proc_num = SHRREG_V1_2_PROCESS_NUM;
+    int i;
+    for (i = 0; i < proc_num; i++) {
+        if (atomic_load_explicit(&legacy->procs[i].pid, memory_order_acquire) == pid)
+            return &legacy->procs[i];
+    }
+    return NULL;
+}
+
+static int legacy_live_procs(shrreg_v1_2_region_t* legacy) {
+    int proc_num = atomic_load_explicit(&legacy->proc_num, memory_order_acquire);
+    if (proc_num > SHRREG_V1_2_PROCESS_NUM)
+        proc_num = SHRREG_V1_2_PROCESS_NUM;
+    int i, live = 0;
+    for (i = 0; i < proc_num; i++) {
+        int32_t pid = atomic_load_explicit(&legacy->procs[i].pid, memory_order_acquire);
+        if (pid > 0 && legacy_proc_alive(pid))
+            live++;
+    }
+    return live;
+}
+
+void shrreg_attach_legacy(shared_region_t* region, int created) {
+    const char* path = shrreg_legacy_path();
+    shrreg_v1_2_region_t* legacy = map_legacy_region(path);
+    if (legacy == NULL)
+        return;
+    if (legacy_live_procs(legacy) == 0) {
+        munmap(legacy, sizeof(shrreg_v1_2_region_t));
+        return;
+    }
+    if (created) {
+        // The 1.2 processes run with these, keep them the same
+        size_t devices = region->device_count < SHRREG_V1_2_DEVICE_COUNT ?
+            region->device_count : SHRREG_V1_2_DEVICE_COUNT;
+        region->device_num = legacy->device_num;
+        memcpy(shrreg_uuids(region), legacy->uuids, devices * sizeof(uuid));
+        memcpy(shrreg_limit(region), legacy->limit, devices * sizeof(uint64_t));
+        memcpy(shrreg_sm_limit(region), legacy->sm_limit, devices * sizeof(uint64_t));
+        region->priority = legacy->priority;
+        atomic_store_explicit(&region->sm_init_flag,
+            atomic_load_explicit(&legacy->sm_init_flag, memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&region->utilization_switch,
+            atomic_load_explicit(&legacy->utilization_switch, memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&region->recent_kernel,
+            atomic_load_explicit(&legacy->recent_kernel, memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&region->last_kernel_time,
+            atomic_load_explicit(&legacy->last_kernel_time, memory_order_relaxed), memory_order_relaxed);
+    }
+    munmap(legacy, sizeof(shrreg_v1_2_region_t));
+    if (atomic_exchange_explicit(&region->legacy_active, 1, memory_order_acq_rel) == 0)
+        LOG_MSG("Processes of the %d.%d shrreg %s count against the limits of %s",
+            SHRREG_V1_2_MAJOR_VERSION, SHRREG_V1_2_MINOR_VERSION, path, shrreg_cache_path());
+    // Bring in their slots before anyone else can attach and check limits
+    shrreg_sync_legacy(region, 1);
+}
+
+/**
+ * Copy the memory counters of a 1.2 slot into its mirror, moving the
+ * per-device aggregates by the difference. src NULL zeroes the mirror.
+ */
+static void mirror_legacy_slot(shared_region_t* region, shrreg_proc_slot_t* slot,
+                               shrreg_v1_2_proc_slot_t* src) {
+    int index = slot - shrreg_procs(region);
+    int dev;
+    for (dev = 0; dev < (int)region->device_count; dev++) {
+        device_memory_t* used = shrreg_proc_used(region, dev, index);
+        shrreg_v1_2_device_memory_t* from = NULL;
+        if (src != NULL && dev < SHRREG_V1_2_DEVICE_COUNT)
+            from = &src->used[dev];
+        uint64_t total = from == NULL ? 0 :
+            atomic_load_explicit(&from->total, memory_order_relaxed);
+
+        atomic_fetch_add_explicit(&used->seqlock, 1, memory_order_release);
+        uint64_t old = atomic_exchange_explicit(&used->total, total, memory_order_release);
+        if (total > old)
+            atomic_fetch_add_explicit(&shrreg_dev_usage(region)[dev].usage, total - old, memory_order_release);
+        else if (total < old)
+            atomic_fetch_sub_explicit(&shrreg_dev_usage(region)[dev].usage, old - total, memory_order_release);
+        atomic_store_explicit(&used->context_size, from == NULL ? 0 :
+            atomic_load_explicit(&from->context_size, memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&used->module_size, from == NULL ? 0 :
+            atomic_load_explicit(&from->module_size, memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&used->data_size, from == NULL ? 0 :
+            atomic_load_explicit(&from->data_size, memory_order_relaxed), memory_order_relaxed);
+        atomic_fetch_add_explicit(&used->seqlock, 1, memory_order_release);
+    }
+    if (src != NULL) {
+        atomic_store_explicit(&slot->status,
+            atomic_load_explicit(&src->status, memory_order_acquire), memory_order_release);
+    }
+}
+
+void shrreg_sync_legacy(shared_region_t* region, int force) {
+    uint64_t now = legacy_now_ms();
+    uint64_t last = atomic_load_explicit(&region->legacy_sync_time, memory_order_relaxed);
+    if (!force) {
+        // One process per interval does the work, the others go on
+        if (now < last + SHRREG_LEGACY_SYNC_INTERVAL_MS ||
+            !atomic_compare_exchange_strong_explicit(&region->legacy_sync_time, &last, now,
+                                                     memory_order_relaxed, memory_order_relaxed))
+            return;
+    } else {
+        atomic_store_explicit(&region->legacy_sync_time, now, memory_order_relaxed);
+    }
+
+    if (legacy_region == NULL) {
+        // Missing if the 1.2 file was removed, its slots are then dropped
+        legacy_region = map_legacy_region(shrreg_legacy_path());
+    }
+    shrreg_v1_2_region_t* legacy = legacy_region;
+
+    lock_shrreg();
+    if (!atomic_load_explicit(&region->legacy_active, memory_order_acquire)) {
+        unlock_shrreg();
+        return;
+    }
+    int live = 0;
+    int i;
+    if (legacy != NULL) {
+        int proc_num = atomic_load_explicit(&legacy->proc_num, memory_order_acquire);
+        if (proc_num > SHRREG_V1_2_PROCESS_NUM)
+            proc_num = SHRREG_V1_2_PROCESS_NUM;
+        for (i = 0; i < proc_num; i++) {
+            shrreg_v1_2_proc_slot_t* src = &legacy->procs[i];
+            int32_t pid = atomic_load_explicit(&src->pid, memory_order_acquire);
+            if (pid <= 0 || !legacy_proc_alive(pid))
+                continue;
+            shrreg_proc_slot_t* slot = find_proc_by_pid(pid);
+            if (slot == NULL) {
+                // Not mirrored yet, or attached to the 1.2 file late
+                slot = shrreg_add_proc_slot_nolock(pid);
+                if (slot == NULL)
+                    continue;
+                slot->flags |= SHRREG_SLOT_LEGACY;
+                LOG_INFO("Mirroring slot of 1.2 process %d", pid);
+            } else if (!(slot->flags & SHRREG_SLOT_LEGACY)) {
+                continue;
+            }
+            int32_t hostpid = atomic_load_explicit(&src->hostpid, memory_order_acquire);
+            if (hostpid != atomic_load_explicit(&slot->hostpid, memory_order_relaxed))
+                shrreg_set_proc_hostpid_nolock(slot, hostpid);
+            mirror_legacy_slot(region, slot, src);
+            live++;
+        }
+    }
+
+    // Release the mirrors of exited 1.2 processes, the slots are then
+    // reaped like any other with pid 0
+    shrreg_proc_slot_t* procs = shrreg_procs(region);
+    int proc_num = atomic_load_explicit(&region->proc_num, memory_order_acquire);
+    for (i = 0; i < proc_num; i++) {
+        if (!(procs[i].flags & SHRREG_SLOT_LEGACY))
+            continue;
+        int32_t pid = atomic_load_explicit(&procs[i].pid, memory_order_acquire);
+        if (pid > 0 && legacy != NULL && legacy_proc_alive(pid) &&
+            find_legacy_proc(legacy, pid) != NULL)
+            continue;
+        LOG_INFO("1.2 process %d has exited", pid);
+        mirror_legacy_slot(region, &procs[i], NULL);
+        procs[i].flags &= ~SHRREG_SLOT_LEGACY;
+        atomic_store_explicit(&procs[i].pid, 0, memory_order_release);
+    }
+
+    if (live == 0) {
+        atomic_store_explicit(&region->legacy_active, 0, memory_order_release);
+        LOG_MSG("No process uses the 1.2 shrreg %s anymore", shrreg_legacy_path());
+    }
+    unlock_shrreg();
+    if (live == 0 && legacy != NULL) {
+        legacy_region = NULL;
+        munmap(legacy, sizeof(shrreg_v1_2_region_t));
+    }
+}
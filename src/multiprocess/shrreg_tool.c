@@ -1,26 +1,36 @@
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <assert.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
 
 #include "include/memory_limit.h"
+#include "multiprocess/shrreg_metrics.h"
+#include "multiprocess/shrreg_top.h"
 
 
 void create_new() {
     load_env_from_file(ENV_OVERRIDE_FILE);
     umask(000);
-	char* shrreg_file = getenv(MULTIPROCESS_SHARED_REGION_CACHE_ENV);
-    if (shrreg_file == NULL) {
-        shrreg_file = MULTIPROCESS_SHARED_REGION_CACHE_DEFAULT;
-    }
-    int fd = open(shrreg_file, O_RDWR | O_CREAT | O_TRUNC, 0666);
-    if (fd < 0) {
-    	LOG_ERROR("Fail to create new shrreg file\n");
-        assert(0);
+    int fd = shrreg_backing_fd();
+    if (fd >= 0) {
+        // Truncated in place, the region is rebuilt on the same descriptor
+        if (ftruncate(fd, 0) != 0) {
+            LOG_ERROR("Fail to truncate shrreg fd %d\n", fd);
+            assert(0);
+        }
+    } else {
+        fd = open(shrreg_cache_path(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) {
+            LOG_ERROR("Fail to create new shrreg file\n");
+            assert(0);
+        }
+        close(fd);
     }
-    close(fd);
     ensure_initialized();
 }
 
@@ -34,21 +44,57 @@ void print_shared_region(){
 void send_stop_signal(){
     ensure_initialized();
     suspend_all();
-    while (1){
-        if (wait_status_all(2))
-            break;
-        sleep(1);
-    }
+    // Woken as soon as a process acknowledges
+    while (!wait_status_all_timeout(2, 1000));
 }
 
 void send_resume_signal(){
     ensure_initialized();
     resume_all();
-    while (1){
-        if (wait_status_all(1))
-            break;
-        sleep(1);
+    while (!wait_status_all_timeout(1, 1000));
+}
+
+// Print the OOM event rings, oldest first per device, without registering
+int dump_oom_events(){
+    size_t region_size = 0;
+    shared_region_t* region = shrreg_map_readonly(&region_size);
+    if (region == NULL) {
+        fprintf(stderr, "No shared region at %s\n", shrreg_cache_path());
+        return 1;
+    }
+    shrreg_oom_event_t* events = malloc(sizeof(shrreg_oom_event_t) * SHRREG_OOM_EVENTS_LEN);
+    if (events == NULL) {
+        munmap(region, region_size);
+        return 1;
     }
+    printf("%-26s %4s %8s %-22s %14s %14s %14s  %s\n",
+        "TIME", "DEV", "PID", "API", "SIZE", "USAGE", "LIMIT", "TOP PID:USAGE");
+    int dev, i, j;
+    for (dev = 0; dev < (int)region->device_count; dev++) {
+        int n = shrreg_read_oom_events(region, dev, events, SHRREG_OOM_EVENTS_LEN);
+        for (i = 0; i < n; i++) {
+            shrreg_oom_event_t* e = &events[i];
+            uint64_t time_us = atomic_load_explicit(&e->time_us, memory_order_relaxed);
+            time_t sec = time_us / 1000000;
+            char stamp[32];
+            strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", localtime(&sec));
+            printf("%s.%06lu %4d %8d %-22s %14lu %14lu %14lu ", stamp, time_us % 1000000, dev,
+                atomic_load_explicit(&e->pid, memory_order_relaxed),
+                shrreg_api_name(atomic_load_explicit(&e->api, memory_order_relaxed)),
+                atomic_load_explicit(&e->size, memory_order_relaxed),
+                atomic_load_explicit(&e->usage, memory_order_relaxed),
+                atomic_load_explicit(&e->limit, memory_order_relaxed));
+            for (j = 0; j < SHRREG_OOM_TOP_PROCS; j++) {
+                int32_t pid = atomic_load_explicit(&e->top_pid[j], memory_order_relaxed);
+                if (pid != 0)
+                    printf(" %d:%lu", pid, atomic_load_explicit(&e->top_usage[j], memory_order_relaxed));
+            }
+            printf("\n");
+        }
+    }
+    free(events);
+    munmap(region, region_size);
+    return 0;
 }
 
 int main(int argc, char* argv[]) {
@@ -56,6 +102,10 @@ int main(int argc, char* argv[]) {
     if (argc > 1 && strcmp(argv[1], "--help") == 0) {
         printf(
             "--create_new    Create new shared region file\n"
+            "--serve [addr]  Serve OpenMetrics on addr, unix:<path> or a localhost port (default "
+            SHRREG_METRICS_DEFAULT_LISTEN ")\n"
+            "--top [seconds] Show per-process usage and alloc/free rates, refreshed every seconds (default 1)\n"
+            "--oom-events    Dump the recent allocations denied by the memory limit\n"
         );
         return 0;
     }
@@ -74,6 +124,23 @@ int main(int argc, char* argv[]) {
         if (strcmp(arg, "--resume") == 0){
             send_resume_signal();
         }
+        if (strcmp(arg, "--serve") == 0){
+            const char* addr = SHRREG_METRICS_DEFAULT_LISTEN;
+            if (k + 1 < argc && strncmp(argv[k + 1], "--", 2) != 0)
+                addr = argv[++k];
+            return shrreg_serve_metrics(addr) == 0 ? 0 : 1;
+        }
+        if (strcmp(arg, "--top") == 0){
+            double interval = SHRREG_TOP_DEFAULT_INTERVAL;
+            if (k + 1 < argc && strncmp(argv[k + 1], "--", 2) != 0)
+                interval = atof(argv[++k]);
+            if (interval <= 0)
+                interval = SHRREG_TOP_DEFAULT_INTERVAL;
+            return shrreg_top(interval, 0);
+        }
+        if (strcmp(arg, "--oom-events") == 0){
+            return dump_oom_events();
+        }
         if (strcmp(arg, "--version") == 0){
             printf("shrreg size: %ld, version %d.%d\n", 
                     sizeof(shared_region_t),
@@ -0,0 +1,200 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "include/log_utils.h"
+#include "multiprocess/multiprocess_memory_limit.h"
+#include "multiprocess/shrreg_top.h"
+
+// One (process, device) pair with memory charged or seen by NVML
+typedef struct {
+    int32_t pid;
+    int32_t hostpid;
+    int32_t status;
+    int32_t dev;
+    device_memory_snapshot_t used;
+    uint64_t freed;
+    uint64_t peak;
+    uint64_t monitor;
+    uint64_t sm_util;
+    double alloc_rate;
+    double free_rate;
+} top_row_t;
+
+typedef struct {
+    top_row_t* rows;
+    int num;
+} top_rows_t;
+
+static int compare_key(const void* a, const void* b) {
+    const top_row_t* x = a;
+    const top_row_t* y = b;
+    if (x->pid != y->pid)
+        return x->pid < y->pid ? -1 : 1;
+    return x->dev - y->dev;
+}
+
+// Busiest allocator first
+static int compare_rate(const void* a, const void* b) {
+    const top_row_t* x = a;
+    const top_row_t* y = b;
+    double rx = x->alloc_rate + x->free_rate;
+    double ry = y->alloc_rate + y->free_rate;
+    if (rx != ry)
+        return rx > ry ? -1 : 1;
+    return compare_key(a, b);
+}
+
+static int collect_rows(shrreg_snapshot_t* snap, top_rows_t* out) {
+    out->num = 0;
+    out->rows = malloc(sizeof(top_row_t) * ((size_t)snap->proc_num * snap->device_count + 1));
+    if (out->rows == NULL)
+        return -1;
+    int i, dev;
+    for (i = 0; i < snap->proc_num; i++) {
+        if (snap->procs[i].pid == 0)
+            continue;
+        for (dev = 0; dev < (int)snap->device_count; dev++) {
+            top_row_t* row = &out->rows[out->num];
+            memset(row, 0, sizeof(*row));
+            row->used = *shrreg_snapshot_used(snap, dev, i);
+            row->peak = shrreg_snapshot_stats(snap, dev, i)->peak;
+            row->monitor = shrreg_snapshot_util(snap, dev, i)->monitorused;
+            row->sm_util = shrreg_snapshot_util(snap, dev, i)->sm_util;
+            if (row->used.total == 0 && row->used.allocated == 0 && row->monitor == 0 && row->sm_util == 0)
+                continue;
+            row->pid = snap->procs[i].pid;
+            row->hostpid = snap->procs[i].hostpid;
+            row->status = snap->procs[i].status;
+            row->dev = dev;
+            uint64_t held = row->used.context_size + row->used.module_size + row->used.data_size;
+            row->freed = row->used.allocated > held ? row->used.allocated - held : 0;
+            out->num++;
+        }
+    }
+    qsort(out->rows, out->num, sizeof(top_row_t), compare_key);
+    return 0;
+}
+
+// Rates since prev; a pid seen for the first time has none yet
+static void compute_rates(top_rows_t* cur, top_rows_t* prev, double elapsed) {
+    int i;
+    for (i = 0; i < cur->num; i++) {
+        top_row_t* row = &cur->rows[i];
+        top_row_t* old = prev->num > 0 ?
+            bsearch(row, prev->rows, prev->num, sizeof(top_row_t), compare_key) : NULL;
+        if (old == NULL || elapsed <= 0 || row->used.allocated < old->used.allocated)
+            continue;
+        row->alloc_rate = (row->used.allocated - old->used.allocated) / elapsed;
+        row->free_rate = row->freed > old->freed ? (row->freed - old->freed) / elapsed : 0;
+    }
+}
+
+static const char* format_bytes(double bytes, char* buf, size_t len) {
+    static const char* units[] = {"B", "K", "M", "G", "T"};
+    int unit = 0;
+    while (bytes >= 1024 && unit < 4) {
+        bytes /= 1024;
+        unit++;
+    }
+    snprintf(buf, len, unit == 0 ? "%.0f%s" : "%.1f%s", bytes, units[unit]);
+    return buf;
+}
+
+static void print_top(shared_region_t* region, top_rows_t* rows, double interval) {
+    char b[8][16];
+    int dev, i;
+    time_t now = time(NULL);
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime(&now));
+    printf("shrreg %u.%u  %s  processes %d/%u  every %.1fs\n",
+        region->major_version, region->minor_version, stamp,
+        atomic_load_explicit(&region->proc_num, memory_order_relaxed), region->max_procs, interval);
+    printf("%4s %9s %9s %5s %5s\n", "DEV", "USED", "LIMIT", "SM%", "SMLIM");
+    for (dev = 0; dev < (int)region->device_count; dev++) {
+        uint64_t usage = atomic_load_explicit(&shrreg_dev_usage(region)[dev].usage, memory_order_relaxed);
+        if (usage == 0 && shrreg_limit(region)[dev] == 0)
+            continue;
+        printf("%4d %9s %9s %5lu %5lu\n", dev,
+            format_bytes(usage, b[0], sizeof(b[0])),
+            format_bytes(shrreg_limit(region)[dev], b[1], sizeof(b[1])),
+            atomic_load_explicit(&shrreg_dev_usage(region)[dev].sm_util, memory_order_relaxed),
+            shrreg_sm_limit(region)[dev]);
+    }
+    printf("\n%8s %8s %3s %4s %9s %9s %9s %9s %9s %9s %4s %9s %9s\n",
+        "PID", "HOSTPID", "ST", "DEV", "CONTEXT", "MODULE", "DATA", "LEASE", "PEAK", "NVML", "SM%", "ALLOC/s", "FREE/s");
+    for (i = 0; i < rows->num; i++) {
+        top_row_t* row = &rows->rows[i];
+        printf("%8d %8d %3d %4d %9s %9s %9s %9s %9s %9s %4lu %9s %9s\n",
+            row->pid, row->hostpid, row->status, row->dev,
+            format_bytes(row->used.context_size, b[0], sizeof(b[0])),
+            format_bytes(row->used.module_size, b[1], sizeof(b[1])),
+            format_bytes(row->used.data_size, b[2], sizeof(b[2])),
+            format_bytes(row->used.lease, b[3], sizeof(b[3])),
+            format_bytes(row->peak, b[7], sizeof(b[7])),
+            format_bytes(row->monitor, b[4], sizeof(b[4])),
+            row->sm_util,
+            format_bytes(row->alloc_rate, b[5], sizeof(b[5])),
+            format_bytes(row->free_rate, b[6], sizeof(b[6])));
+    }
+}
+
+static double monotonic_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int shrreg_top(double interval, int rounds) {
+    top_rows_t prev = {NULL, 0};
+    double prev_time = 0;
+    int clear = isatty(STDOUT_FILENO);
+    int round;
+    for (round = 0; rounds <= 0 || round < rounds; round++) {
+        if (round > 0)
+            usleep((useconds_t)(interval * 1e6));
+        // Mapped per refresh, the region may be recreated in between
+        size_t region_size = 0;
+        shared_region_t* region = shrreg_map_readonly(&region_size);
+        if (clear)
+            printf("\033[H\033[2J");
+        else if (round > 0)
+            printf("\n");
+        if (region == NULL) {
+            printf("No shared region at %s\n", shrreg_cache_path());
+            fflush(stdout);
+            continue;
+        }
+        top_rows_t cur;
+        double now = monotonic_sec();
+        shrreg_snapshot_t* snap = shrreg_snapshot_alloc(region);
+        if (snap == NULL || shrreg_snapshot(region, snap) != 0 || collect_rows(snap, &cur) != 0) {
+            printf("Fail to snapshot shrreg\n");
+            shrreg_snapshot_free(snap);
+            munmap(region, region_size);
+            continue;
+        }
+        shrreg_snapshot_free(snap);
+        compute_rates(&cur, &prev, now - prev_time);
+        free(prev.rows);
+        prev = cur;
+        prev_time = now;
+        // Displayed in rate order, matched in key order on the next round
+        top_rows_t shown = cur;
+        shown.rows = malloc(sizeof(top_row_t) * (cur.num + 1));
+        if (shown.rows != NULL) {
+            memcpy(shown.rows, cur.rows, sizeof(top_row_t) * cur.num);
+            qsort(shown.rows, shown.num, sizeof(top_row_t), compare_rate);
+            print_top(region, &shown, interval);
+            free(shown.rows);
+        }
+        munmap(region, region_size);
+        fflush(stdout);
+    }
+    free(prev.rows);
+    return 0;
+}
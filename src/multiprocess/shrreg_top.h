@@ -0,0 +1,15 @@
+#ifndef __SHRREG_TOP_H__
+#define __SHRREG_TOP_H__
+
+// Default refresh interval of shrreg_tool --top, in seconds
+#define SHRREG_TOP_DEFAULT_INTERVAL 1.0
+
+/**
+ * Print the per-process, per-device state of the region every interval
+ * seconds, with the bytes allocated and freed per second since the last
+ * refresh. Runs until interrupted, or for rounds refreshes if positive.
+ * The region is mapped read-only and its lock is never taken.
+ */
+int shrreg_top(double interval, int rounds);
+
+#endif  // __SHRREG_TOP_H__
@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <cuda.h>
+
+#include "test_utils.h"
+
+/*
+ * Per-request allocation benchmark. Each of [requests] iterations
+ * allocates the buffers of an inference request, 4 KiB to 64 MiB with
+ * sizes varying between requests, writes to them and frees them all, so
+ * every allocation but the first few of each size could reuse a freed
+ * one. Run once plain and once with CUDA_DEVICE_MEMORY_CACHING=1 to
+ * compare the latency; after the cache has been flushed by destroying
+ * the context, the device memory taken must be back to where it started.
+ * Usage: test_alloc_cache [requests]
+ */
+
+#define BUFFERS 8
+
+static const size_t buffer_sizes[BUFFERS] = {
+    4096, 65536, 300000, 1 << 20, 5000000, 16 << 20, 1000, 64 << 20,
+};
+
+static double elapsed_us(struct timespec *t0, struct timespec *t1) {
+    return (t1->tv_sec - t0->tv_sec) * 1e6 + (t1->tv_nsec - t0->tv_nsec) / 1e3;
+}
+
+int main(int argc, char *argv[]) {
+    int requests = argc > 1 ? atoi(argv[1]) : 1000;
+    CHECK_DRV_API(cuInit(0));
+    CUdevice device;
+    CHECK_DRV_API(cuDeviceGet(&device, TEST_DEVICE_ID));
+    CUcontext ctx;
+#if CUDA_VERSION >= 13000
+    CHECK_DRV_API(cuCtxCreate(&ctx, NULL, 0, device));
+#else
+    CHECK_DRV_API(cuCtxCreate(&ctx, 0, device));
+#endif
+
+    size_t free_before, free_after, total;
+    CHECK_DRV_API(cuMemGetInfo(&free_before, &total));
+    CUdeviceptr ptrs[BUFFERS];
+    struct timespec t0, t1;
+    double alloc_us = 0, free_us = 0;
+    int r, i;
+    for (r = 0; r < requests; r++) {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (i = 0; i < BUFFERS; i++)
+            CHECK_DRV_API(cuMemAlloc(&ptrs[i], buffer_sizes[i] + (r % 7) * 256));
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        alloc_us += elapsed_us(&t0, &t1);
+        for (i = 0; i < BUFFERS; i++)
+            CHECK_DRV_API(cuMemsetD8(ptrs[i], (unsigned char)r, buffer_sizes[i]));
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (i = 0; i < BUFFERS; i++)
+            CHECK_DRV_API(cuMemFree(ptrs[i]));
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        free_us += elapsed_us(&t0, &t1);
+    }
+    printf("alloc: %8.2f us per alloc, free: %8.2f us per free, %d requests\n",
+        alloc_us / requests / BUFFERS, free_us / requests / BUFFERS, requests);
+
+    CHECK_DRV_API(cuCtxDestroy(ctx));
+#if CUDA_VERSION >= 13000
+    CHECK_DRV_API(cuCtxCreate(&ctx, NULL, 0, device));
+#else
+    CHECK_DRV_API(cuCtxCreate(&ctx, 0, device));
+#endif
+    CHECK_DRV_API(cuMemGetInfo(&free_after, &total));
+    printf("after context destroy: %ld bytes not returned\n", (long)(free_before - free_after));
+    CHECK_DRV_API(cuCtxDestroy(ctx));
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <cuda.h>
+
+#include "test_utils.h"
+
+/*
+ * Alloc/free churn benchmark with many live allocations, the pattern of
+ * frameworks that keep tens of thousands of tensors. After filling the
+ * device with [live] small allocations, each iteration frees a random one
+ * and allocates a replacement, and every pointer query looks up a random
+ * live pointer. The cost of the hook's allocation tracking shows in the
+ * growth of the latency with [live]. Usage: test_alloc_churn [live] [iterations]
+ */
+
+#define ALLOC_SIZE 4096
+
+static double elapsed_us(struct timespec *t0, struct timespec *t1) {
+    return (t1->tv_sec - t0->tv_sec) * 1e6 + (t1->tv_nsec - t0->tv_nsec) / 1e3;
+}
+
+int main(int argc, char *argv[]) {
+    int live = argc > 1 ? atoi(argv[1]) : 100000;
+    int iterations = argc > 2 ? atoi(argv[2]) : 100000;
+    CHECK_DRV_API(cuInit(0));
+    CUdevice device;
+    CHECK_DRV_API(cuDeviceGet(&device, TEST_DEVICE_ID));
+    CUcontext ctx;
+#if CUDA_VERSION >= 13000
+    CHECK_DRV_API(cuCtxCreate(&ctx, NULL, 0, device));
+#else
+    CHECK_DRV_API(cuCtxCreate(&ctx, 0, device));
+#endif
+
+    CUdeviceptr *ptrs = malloc(sizeof(CUdeviceptr) * live);
+    if (ptrs == NULL)
+        return -1;
+    struct timespec t0, t1;
+    int i;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < live; i++)
+        CHECK_DRV_API(cuMemAlloc(&ptrs[i], ALLOC_SIZE));
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("fill:  %8.2f us per alloc, %d live allocations\n", elapsed_us(&t0, &t1) / live, live);
+
+    srand(1);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < iterations; i++) {
+        int k = rand() % live;
+        CHECK_DRV_API(cuMemFree(ptrs[k]));
+        CHECK_DRV_API(cuMemAlloc(&ptrs[k], ALLOC_SIZE));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("churn: %8.2f us per free/alloc pair\n", elapsed_us(&t0, &t1) / iterations);
+
+    CUpointer_attribute attrs[] = {CU_POINTER_ATTRIBUTE_MEMORY_TYPE};
+    CUmemorytype type;
+    void *data[] = {&type};
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < iterations; i++) {
+        int k = rand() % live;
+        CHECK_DRV_API(cuPointerGetAttributes(1, attrs, data, ptrs[k] + ALLOC_SIZE / 2));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("query: %8.2f us per pointer query\n", elapsed_us(&t0, &t1) / iterations);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < live; i++)
+        CHECK_DRV_API(cuMemFree(ptrs[i]));
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("drain: %8.2f us per free\n", elapsed_us(&t0, &t1) / live);
+    free(ptrs);
+    CHECK_DRV_API(cuCtxDestroy(ctx));
+    return 0;
+}
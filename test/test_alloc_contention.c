@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/perf_event.h>
+#include <cuda.h>
+
+#include "test_utils.h"
+
+/*
+ * Multi-process alloc/free contention benchmark. Every worker runs in its
+ * own process and context and hammers cuMemAlloc/cuMemFree, so all of them
+ * update the shared region concurrently. Each worker reports its latency
+ * and the hardware cache misses counted around the loop; compare the
+ * numbers between two libvgpu.so builds to see the effect of a region
+ * layout change. Usage: test_alloc_contention [workers] [iterations]
+ */
+
+#define ALLOC_SIZE (64 * 1024)
+
+int open_cache_miss_counter() {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+int worker(int id, int iterations, int start_fd) {
+    CHECK_DRV_API(cuInit(0));
+    CUdevice device;
+    CHECK_DRV_API(cuDeviceGet(&device, TEST_DEVICE_ID));
+    CUcontext ctx;
+#if CUDA_VERSION >= 13000
+    CHECK_DRV_API(cuCtxCreate(&ctx, NULL, 0, device));
+#else
+    CHECK_DRV_API(cuCtxCreate(&ctx, 0, device));
+#endif
+
+    // Start all workers at once
+    char c;
+    if (read(start_fd, &c, 1) != 1)
+        return -1;
+
+    int perf_fd = open_cache_miss_counter();
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    CUdeviceptr dptr;
+    int k;
+    for (k = 0; k < iterations; k++) {
+        CHECK_DRV_API(cuMemAlloc(&dptr, ALLOC_SIZE));
+        CHECK_DRV_API(cuMemFree(dptr));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    long long misses = -1;
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(perf_fd, &misses, sizeof(misses)) != sizeof(misses))
+            misses = -1;
+        close(perf_fd);
+    }
+
+    double us = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3;
+    printf("worker %2d: %8.2f us per alloc/free pair, cache misses per pair: %.1f\n",
+        id, us / iterations, misses < 0 ? -1.0 : (double)misses / iterations);
+    CHECK_DRV_API(cuCtxDestroy(ctx));
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int workers = argc > 1 ? atoi(argv[1]) : 8;
+    int iterations = argc > 2 ? atoi(argv[2]) : 20000;
+    int fds[2];
+    if (pipe(fds) != 0)
+        return -1;
+
+    int i;
+    for (i = 0; i < workers; i++) {
+        if (fork() == 0) {
+            close(fds[1]);
+            exit(worker(i, iterations, fds[0]));
+        }
+    }
+    close(fds[0]);
+    // Give the workers time to create their contexts
+    sleep(5);
+    for (i = 0; i < workers; i++) {
+        char c = 1;
+        if (write(fds[1], &c, 1) != 1)
+            return -1;
+    }
+    close(fds[1]);
+
+    int status, res = 0;
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            res = -1;
+    }
+    return res;
+}
@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <cuda.h>
+
+#include "test_utils.h"
+
+/*
+ * Measures cuMemAlloc/cuMemFree latency while the number of processes
+ * registered in the shared region grows from 1 to 1024. Idle processes
+ * only call nvmlInit(), which registers a slot without creating a context.
+ * Run with LD_PRELOAD=libvgpu.so and a CUDA_DEVICE_MEMORY_LIMIT set.
+ */
+
+#define MAX_PROCS   1024
+#define ITERATIONS  2000
+#define ALLOC_SIZE  (1024 * 1024)
+
+static pid_t children[MAX_PROCS];
+static int child_num = 0;
+
+int run_idle() {
+    CHECK_NVML_API(nvmlInit());
+    char c = 1;
+    if (write(STDOUT_FILENO, &c, 1) != 1)
+        return -1;
+    pause();
+    return 0;
+}
+
+int spawn_idle() {
+    int fds[2];
+    if (pipe(fds) != 0)
+        return -1;
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        execl("/proc/self/exe", "test_alloc_latency_procs", "--idle", NULL);
+        _exit(1);
+    }
+    close(fds[1]);
+    char c;
+    int ok = (pid > 0 && read(fds[0], &c, 1) == 1);
+    close(fds[0]);
+    if (!ok)
+        return -1;
+    children[child_num++] = pid;
+    return 0;
+}
+
+double elapsed_us(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e6 + (end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+int measure(int procs) {
+    CUdeviceptr dptr;
+    struct timespec t0, t1;
+    double alloc_us = 0, free_us = 0;
+    int k;
+    for (k = 0; k < ITERATIONS; k++) {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        CHECK_DRV_API(cuMemAlloc(&dptr, ALLOC_SIZE));
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        alloc_us += elapsed_us(&t0, &t1);
+        CHECK_DRV_API(cuMemFree(dptr));
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        free_us += elapsed_us(&t1, &t0);
+    }
+    printf("procs=%4d alloc=%8.2f us free=%8.2f us\n",
+        procs, alloc_us / ITERATIONS, free_us / ITERATIONS);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "--idle") == 0)
+        return run_idle();
+
+    CHECK_DRV_API(cuInit(0));
+
+    CUdevice device;
+    CHECK_DRV_API(cuDeviceGet(&device, TEST_DEVICE_ID));
+
+    CUcontext ctx;
+#if CUDA_VERSION >= 13000
+    CHECK_DRV_API(cuCtxCreate(&ctx, NULL, 0, device));
+#else
+    CHECK_DRV_API(cuCtxCreate(&ctx, 0, device));
+#endif
+
+    int procs;
+    int res = 0;
+    for (procs = 1; procs <= MAX_PROCS; procs *= 2) {
+        while (child_num + 1 < procs) {
+            if (spawn_idle() != 0) {
+                fprintf(stderr, "failed to spawn idle process %d\n", child_num);
+                res = -1;
+                goto out;
+            }
+        }
+        measure(procs);
+    }
+
+out:
+    for (int i = 0; i < child_num; i++) {
+        kill(children[i], SIGTERM);
+        waitpid(children[i], NULL, 0);
+    }
+    CHECK_DRV_API(cuCtxDestroy(ctx));
+    return res;
+}
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <cuda.h>
+
+#include "test_utils.h"
+
+/*
+ * Multi-process admission stress test. Every worker keeps a few
+ * allocations of random size alive and replaces them as fast as it can,
+ * so the processes together ask for several times the memory limit. The
+ * bytes held by all workers are summed in shared memory and must never
+ * exceed the limit, which the hooked cuMemGetInfo reports as total memory.
+ * Run with LD_PRELOAD=libvgpu.so and CUDA_DEVICE_MEMORY_LIMIT set.
+ * Usage: test_alloc_limit_stress [workers] [iterations]
+ */
+
+#define HELD_ALLOCS 4
+
+typedef struct {
+    _Atomic long long held;
+    _Atomic long long max_held;
+    _Atomic long long limit;
+} shared_counter_t;
+
+int worker(int id, int iterations, shared_counter_t* counter) {
+    CHECK_DRV_API(cuInit(0));
+    CUdevice device;
+    CHECK_DRV_API(cuDeviceGet(&device, TEST_DEVICE_ID));
+    CUcontext ctx;
+#if CUDA_VERSION >= 13000
+    CHECK_DRV_API(cuCtxCreate(&ctx, NULL, 0, device));
+#else
+    CHECK_DRV_API(cuCtxCreate(&ctx, 0, device));
+#endif
+    size_t free_mem, limit;
+    CHECK_DRV_API(cuMemGetInfo(&free_mem, &limit));
+    atomic_store(&counter->limit, limit);
+    CUdeviceptr dptr[HELD_ALLOCS] = {0};
+    size_t size[HELD_ALLOCS] = {0};
+    int k, denied = 0;
+    srand(id + 1);
+    for (k = 0; k < iterations; k++) {
+        int i = k % HELD_ALLOCS;
+        if (dptr[i] != 0) {
+            atomic_fetch_sub(&counter->held, size[i]);
+            CHECK_DRV_API(cuMemFree(dptr[i]));
+            dptr[i] = 0;
+        }
+        // Between 1/64 and 1/16 of the limit
+        size[i] = limit / 64 + (size_t)rand() % (limit / 16 - limit / 64);
+        CUresult res = cuMemAlloc(&dptr[i], size[i]);
+        if (res == CUDA_ERROR_OUT_OF_MEMORY) {
+            dptr[i] = 0;
+            denied++;
+            continue;
+        }
+        CHECK_DRV_API(res);
+        long long held = atomic_fetch_add(&counter->held, size[i]) + size[i];
+        long long max_held = atomic_load(&counter->max_held);
+        while (held > max_held && !atomic_compare_exchange_weak(&counter->max_held, &max_held, held));
+    }
+    for (k = 0; k < HELD_ALLOCS; k++) {
+        if (dptr[k] != 0) {
+            atomic_fetch_sub(&counter->held, size[k]);
+            CHECK_DRV_API(cuMemFree(dptr[k]));
+        }
+    }
+    printf("worker %2d: %d of %d allocations denied\n", id, denied, iterations);
+    CHECK_DRV_API(cuCtxDestroy(ctx));
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int workers = argc > 1 ? atoi(argv[1]) : 8;
+    int iterations = argc > 2 ? atoi(argv[2]) : 2000;
+
+    shared_counter_t* counter = mmap(NULL, sizeof(shared_counter_t),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (counter == MAP_FAILED)
+        return -1;
+    atomic_store(&counter->held, 0);
+    atomic_store(&counter->max_held, 0);
+    atomic_store(&counter->limit, 0);
+
+    int i;
+    for (i = 0; i < workers; i++) {
+        if (fork() == 0)
+            exit(worker(i, iterations, counter));
+    }
+    int status, res = 0;
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            res = -1;
+    }
+    long long max_held = atomic_load(&counter->max_held);
+    long long limit = atomic_load(&counter->limit);
+    printf("max held %lld / limit %lld\n", max_held, limit);
+    if (max_held > limit) {
+        fprintf(stderr, "Memory limit exceeded by %lld bytes\n", max_held - limit);
+        res = -1;
+    }
+    return res;
+}
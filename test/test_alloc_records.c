@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <cuda.h>
+
+#include "test_utils.h"
+
+/*
+ * Allocation records handed between threads. In every round short-lived
+ * producer threads allocate small buffers and pass them through a pipe
+ * to consumer threads, which free them; the records are thus freed on
+ * other threads than the one that took them, and both threads exit with
+ * records in their caches. Every free must find its allocation, and the
+ * memory reported free must come back to where it was after each round,
+ * so run it without CUDA_DEVICE_MEMORY_CACHING, which keeps freed memory.
+ * Usage: test_alloc_records [pairs] [rounds] [count]
+ */
+
+static CUcontext ctx;
+static int count;
+
+typedef struct {
+    int fds[2];
+    unsigned int seed;
+} pair_t;
+
+static void *producer(void *arg) {
+    pair_t *pair = arg;
+    int i;
+    if (cuCtxSetCurrent(ctx) != CUDA_SUCCESS)
+        return (void *)1;
+    for (i = 0; i < count; i++) {
+        CUdeviceptr ptr;
+        if (cuMemAlloc(&ptr, (size_t)256 << (rand_r(&pair->seed) % 5)) != CUDA_SUCCESS)
+            return (void *)1;
+        if (write(pair->fds[1], &ptr, sizeof(ptr)) != sizeof(ptr))
+            return (void *)1;
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    pair_t *pair = arg;
+    int i;
+    if (cuCtxSetCurrent(ctx) != CUDA_SUCCESS)
+        return (void *)1;
+    for (i = 0; i < count; i++) {
+        CUdeviceptr ptr;
+        if (read(pair->fds[0], &ptr, sizeof(ptr)) != sizeof(ptr))
+            return (void *)1;
+        if (cuMemFree(ptr) != CUDA_SUCCESS)
+            return (void *)1;
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int pairs = argc > 1 ? atoi(argv[1]) : 8;
+    int rounds = argc > 2 ? atoi(argv[2]) : 20;
+    count = argc > 3 ? atoi(argv[3]) : 1000;
+    CHECK_DRV_API(cuInit(0));
+    CUdevice device;
+    CHECK_DRV_API(cuDeviceGet(&device, TEST_DEVICE_ID));
+#if CUDA_VERSION >= 13000
+    CHECK_DRV_API(cuCtxCreate(&ctx, NULL, 0, device));
+#else
+    CHECK_DRV_API(cuCtxCreate(&ctx, 0, device));
+#endif
+    size_t baseline, free_mem, total;
+    CHECK_DRV_API(cuMemGetInfo(&baseline, &total));
+
+    pair_t *pair = malloc(sizeof(pair_t) * pairs);
+    pthread_t *tids = malloc(sizeof(pthread_t) * 2 * pairs);
+    if (pair == NULL || tids == NULL)
+        return -1;
+    int round, i, failed = 0;
+    for (round = 0; round < rounds && !failed; round++) {
+        for (i = 0; i < pairs; i++) {
+            if (pipe(pair[i].fds) != 0)
+                return -1;
+            pair[i].seed = round * pairs + i + 1;
+            pthread_create(&tids[2 * i], NULL, producer, &pair[i]);
+            pthread_create(&tids[2 * i + 1], NULL, consumer, &pair[i]);
+        }
+        for (i = 0; i < 2 * pairs; i++) {
+            void *res;
+            pthread_join(tids[i], &res);
+            failed |= res != NULL;
+        }
+        for (i = 0; i < pairs; i++) {
+            close(pair[i].fds[0]);
+            close(pair[i].fds[1]);
+        }
+        CHECK_DRV_API(cuMemGetInfo(&free_mem, &total));
+        if (free_mem != baseline) {
+            fprintf(stderr, "round %d: %lu bytes free, %lu before\n", round, free_mem, baseline);
+            failed = 1;
+        }
+    }
+    printf("%d rounds of %d pairs passing %d allocations each\n", round, pairs, count);
+    free(pair);
+    free(tids);
+    CHECK_DRV_API(cuCtxDestroy(ctx));
+    if (failed) {
+        fprintf(stderr, "a record was lost between threads\n");
+        return -1;
+    }
+    return 0;
+}
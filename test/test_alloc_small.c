@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <cuda.h>
+
+#include "test_utils.h"
+
+/*
+ * Small allocation benchmark. Fills the device with [count] allocations
+ * of 256 bytes to 64 KiB, checks that they do not overlap by writing a
+ * distinct byte to each and reading the ends back, then frees them in
+ * two interleaved passes. Run once plain and once with
+ * CUDA_DEVICE_MEMORY_SUBALLOC=1 to compare the latency and the device
+ * memory taken per allocation; with it set, the hook's debug log shows
+ * each driver allocation and free of a region.
+ * Usage: test_alloc_small [count]
+ */
+
+static double elapsed_us(struct timespec *t0, struct timespec *t1) {
+    return (t1->tv_sec - t0->tv_sec) * 1e6 + (t1->tv_nsec - t0->tv_nsec) / 1e3;
+}
+
+static size_t alloc_size(int i) {
+    return (size_t)256 << (i % 9);
+}
+
+int main(int argc, char *argv[]) {
+    int count = argc > 1 ? atoi(argv[1]) : 20000;
+    CHECK_DRV_API(cuInit(0));
+    CUdevice device;
+    CHECK_DRV_API(cuDeviceGet(&device, TEST_DEVICE_ID));
+    CUcontext ctx;
+#if CUDA_VERSION >= 13000
+    CHECK_DRV_API(cuCtxCreate(&ctx, NULL, 0, device));
+#else
+    CHECK_DRV_API(cuCtxCreate(&ctx, 0, device));
+#endif
+
+    CUdeviceptr *ptrs = malloc(sizeof(CUdeviceptr) * count);
+    if (ptrs == NULL)
+        return -1;
+    size_t free_before, free_after, total, requested = 0;
+    struct timespec t0, t1;
+    int i;
+    CHECK_DRV_API(cuMemGetInfo(&free_before, &total));
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < count; i++) {
+        CHECK_DRV_API(cuMemAlloc(&ptrs[i], alloc_size(i)));
+        requested += alloc_size(i);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    CHECK_DRV_API(cuMemGetInfo(&free_after, &total));
+    printf("alloc: %8.2f us per alloc, %d allocations\n", elapsed_us(&t0, &t1) / count, count);
+    printf("usage: %lu bytes requested, %lu bytes of device memory\n", requested, free_before - free_after);
+
+    for (i = 0; i < count; i++)
+        CHECK_DRV_API(cuMemsetD8(ptrs[i], (unsigned char)i, alloc_size(i)));
+    for (i = 0; i < count; i++) {
+        unsigned char first, last;
+        CHECK_DRV_API(cuMemcpyDtoH(&first, ptrs[i], 1));
+        CHECK_DRV_API(cuMemcpyDtoH(&last, ptrs[i] + alloc_size(i) - 1, 1));
+        if (first != (unsigned char)i || last != (unsigned char)i) {
+            fprintf(stderr, "allocation %d overlaps another one\n", i);
+            return -1;
+        }
+        CUdeviceptr base;
+        size_t size;
+        CHECK_DRV_API(cuMemGetAddressRange(&base, &size, ptrs[i] + 1));
+        if (base != ptrs[i] || size < alloc_size(i)) {
+            fprintf(stderr, "allocation %d has range %llx+%lu\n", i, base, size);
+            return -1;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < count; i += 2)
+        CHECK_DRV_API(cuMemFree(ptrs[i]));
+    for (i = 1; i < count; i += 2)
+        CHECK_DRV_API(cuMemFree(ptrs[i]));
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    CHECK_DRV_API(cuMemGetInfo(&free_after, &total));
+    printf("free:  %8.2f us per free, %ld bytes not returned\n", elapsed_us(&t0, &t1) / count,
+        (long)(free_before - free_after));
+    free(ptrs);
+    CHECK_DRV_API(cuCtxDestroy(ctx));
+    return 0;
+}
@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <cuda.h>
+
+#include "test_utils.h"
+
+/*
+ * Multi-thread alloc/free scaling benchmark. One process, one context
+ * shared by 1, 2, 4 ... [max_threads] threads, each keeping [live]
+ * allocations and replacing a random one per iteration, the pattern of
+ * data loader threads. Throughput that stops growing with the thread
+ * count shows serialization in the hook's allocation tracking rather
+ * than in the driver; run it with CUDA_DEVICE_MEMORY_SUBALLOC=1 to take
+ * the driver off the path. Usage: test_alloc_threads [max_threads] [iterations]
+ */
+
+#define ALLOC_SIZE 4096
+#define LIVE 64
+
+static CUcontext ctx;
+static int iterations;
+
+static void *worker(void *arg) {
+    CUdeviceptr ptrs[LIVE];
+    unsigned int seed = (unsigned int)(size_t)arg;
+    int i;
+    if (cuCtxSetCurrent(ctx) != CUDA_SUCCESS)
+        return (void *)1;
+    for (i = 0; i < LIVE; i++)
+        if (cuMemAlloc(&ptrs[i], ALLOC_SIZE) != CUDA_SUCCESS)
+            return (void *)1;
+    for (i = 0; i < iterations; i++) {
+        int k = rand_r(&seed) % LIVE;
+        if (cuMemFree(ptrs[k]) != CUDA_SUCCESS || cuMemAlloc(&ptrs[k], ALLOC_SIZE) != CUDA_SUCCESS)
+            return (void *)1;
+    }
+    for (i = 0; i < LIVE; i++)
+        if (cuMemFree(ptrs[i]) != CUDA_SUCCESS)
+            return (void *)1;
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 64;
+    iterations = argc > 2 ? atoi(argv[2]) : 10000;
+    CHECK_DRV_API(cuInit(0));
+    CUdevice device;
+    CHECK_DRV_API(cuDeviceGet(&device, TEST_DEVICE_ID));
+#if CUDA_VERSION >= 13000
+    CHECK_DRV_API(cuCtxCreate(&ctx, NULL, 0, device));
+#else
+    CHECK_DRV_API(cuCtxCreate(&ctx, 0, device));
+#endif
+
+    pthread_t *tids = malloc(sizeof(pthread_t) * max_threads);
+    if (tids == NULL)
+        return -1;
+    int threads, i, failed = 0;
+    for (threads = 1; threads <= max_threads; threads *= 2) {
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (i = 0; i < threads; i++)
+            pthread_create(&tids[i], NULL, worker, (void *)(size_t)(i + 1));
+        for (i = 0; i < threads; i++) {
+            void *res;
+            pthread_join(tids[i], &res);
+            failed |= res != NULL;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        double s = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        printf("threads %2d: %10.0f free/alloc pairs per second\n", threads, (double)threads * iterations / s);
+    }
+    free(tids);
+    CHECK_DRV_API(cuCtxDestroy(ctx));
+    if (failed) {
+        fprintf(stderr, "a worker failed to allocate or free\n");
+        return -1;
+    }
+    return 0;
+}
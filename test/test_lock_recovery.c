@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "test_utils.h"
+
+/*
+ * Kills the holder of the shared region lock and measures how long the
+ * processes blocked on it take to resume. The lock functions come from
+ * the preloaded libvgpu.so, so run with LD_PRELOAD=libvgpu.so.
+ * Usage: test_lock_recovery [waiters] [rounds]
+ */
+
+extern void lock_shrreg() __attribute__((weak));
+extern void unlock_shrreg() __attribute__((weak));
+
+double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Registers in the shared region, then reports when it got the lock
+int waiter(int go_fd, int result_fd) {
+    CHECK_NVML_API(nvmlInit());
+    char c = 1;
+    if (write(result_fd, &c, 1) != 1 || read(go_fd, &c, 1) != 1)
+        return -1;
+    lock_shrreg();
+    double t = now_us();
+    unlock_shrreg();
+    if (write(result_fd, &t, sizeof(t)) != sizeof(t))
+        return -1;
+    return 0;
+}
+
+int holder(int ready_fd) {
+    CHECK_NVML_API(nvmlInit());
+    lock_shrreg();
+    char c = 1;
+    if (write(ready_fd, &c, 1) != 1)
+        return -1;
+    pause();
+    return 0;
+}
+
+int run_round(int waiters) {
+    int go[2], result[2], ready[2];
+    if (pipe(go) != 0 || pipe(result) != 0 || pipe(ready) != 0)
+        return -1;
+    int i;
+    char c;
+    for (i = 0; i < waiters; i++) {
+        if (fork() == 0)
+            _exit(waiter(go[0], result[1]));
+    }
+    for (i = 0; i < waiters; i++) {
+        if (read(result[0], &c, 1) != 1)
+            return -1;
+    }
+    pid_t holder_pid = fork();
+    if (holder_pid == 0)
+        _exit(holder(ready[1]));
+    if (read(ready[0], &c, 1) != 1)
+        return -1;
+
+    // Let the waiters block on the lock before killing its holder
+    for (i = 0; i < waiters; i++) {
+        if (write(go[1], &c, 1) != 1)
+            return -1;
+    }
+    usleep(200000);
+    double killed = now_us();
+    kill(holder_pid, SIGKILL);
+
+    double first = -1, last = 0;
+    for (i = 0; i < waiters; i++) {
+        double t;
+        if (read(result[0], &t, sizeof(t)) != sizeof(t))
+            return -1;
+        if (first < 0 || t - killed < first)
+            first = t - killed;
+        if (t - killed > last)
+            last = t - killed;
+    }
+    while (wait(NULL) > 0);
+    printf("waiters=%d first resumed after %.1f us, all resumed after %.1f us\n",
+        waiters, first, last);
+    close(go[0]); close(go[1]);
+    close(result[0]); close(result[1]);
+    close(ready[0]); close(ready[1]);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int waiters = argc > 1 ? atoi(argv[1]) : 8;
+    int rounds = argc > 2 ? atoi(argv[2]) : 5;
+    if (lock_shrreg == NULL || unlock_shrreg == NULL) {
+        fprintf(stderr, "lock_shrreg not found, run with LD_PRELOAD=libvgpu.so\n");
+        return -1;
+    }
+    int k;
+    for (k = 0; k < rounds; k++) {
+        if (run_round(waiters) != 0)
+            return -1;
+    }
+    return 0;
+}
@@ -12,7 +12,7 @@
  *   3. If token pools are INDEPENDENT (correct), both complete normally
  *
  * Usage:
- *   rm -f /tmp/cudevshr.cache
+ *   rm -f /tmp/cudevshr.cache.v2
  *   export CUDA_DEVICE_SM_LIMIT=25
  *   export GPU_CORE_UTILIZATION_POLICY=FORCE
  *   LD_PRELOAD=./build/libvgpu.so ./build/test/test_multi_gpu_utilization
@@ -198,7 +198,7 @@ int main(int argc, char** argv) {
     }
 
     printf("\n[NOTE] Test prerequisites:\n");
-    printf("       rm -f /tmp/cudevshr.cache\n");
+    printf("       rm -f /tmp/cudevshr.cache.v2\n");
     printf("       export CUDA_DEVICE_SM_LIMIT=25\n");
     printf("       export GPU_CORE_UTILIZATION_POLICY=FORCE\n");
 
@@ -0,0 +1,131 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "multiprocess/multiprocess_memory_limit.h"
+#include "test_utils.h"
+
+/*
+ * Compares the shared region backings: startup of the process creating
+ * the region and of one attaching to it, then the latency of the first
+ * and of later charge/uncharge pairs on the region. Every mode starts
+ * from a fresh region in its own cache file.
+ * Usage: test_shrreg_backing [iterations]
+ */
+
+typedef struct {
+    const char* name;
+    const char* backing;
+    const char* hugepages;
+} backing_mode_t;
+
+static const backing_mode_t modes[] = {
+    {"file", "file", "0"},
+    {"shm", "shm", "0"},
+    {"memfd", NULL, "0"},
+    {"shm+huge", "shm", "1"},
+};
+
+typedef struct {
+    double startup;
+    double first_access;
+    double access;
+} sample_t;
+
+double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int measure(int iterations, int result_fd) {
+    sample_t s;
+    double t = now_us();
+    ensure_initialized();
+    s.startup = now_us() - t;
+
+    int32_t pid = getpid();
+    t = now_us();
+    add_gpu_device_memory_usage(pid, 0, 4096, 2);
+    rm_gpu_device_memory_usage(pid, 0, 4096, 2);
+    s.first_access = now_us() - t;
+
+    int i;
+    t = now_us();
+    for (i = 0; i < iterations; i++) {
+        add_gpu_device_memory_usage(pid, 0, 4096, 2);
+        rm_gpu_device_memory_usage(pid, 0, 4096, 2);
+    }
+    s.access = (now_us() - t) / iterations;
+    if (write(result_fd, &s, sizeof(s)) != sizeof(s))
+        return -1;
+    return 0;
+}
+
+int run_child(int iterations, sample_t* s) {
+    int fds[2];
+    if (pipe(fds) != 0)
+        return -1;
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        _exit(measure(iterations, fds[1]));
+    }
+    close(fds[1]);
+    int ok = read(fds[0], s, sizeof(*s)) == sizeof(*s);
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+int run_mode(const backing_mode_t* mode, int iterations) {
+    char backing[32];
+    setenv(SHARED_REGION_HUGEPAGES_ENV, mode->hugepages, 1);
+    int memfd = -1;
+    if (mode->backing == NULL) {
+        memfd = memfd_create("cudevshr", 0);
+        if (memfd < 0)
+            return -1;
+        snprintf(backing, sizeof(backing), "fd:%d", memfd);
+        setenv(SHARED_REGION_BACKING_ENV, backing, 1);
+    } else {
+        setenv(SHARED_REGION_BACKING_ENV, mode->backing, 1);
+    }
+
+    sample_t create, attach;
+    int res = run_child(iterations, &create);
+    if (res == 0)
+        res = run_child(iterations, &attach);
+    if (res == 0) {
+        printf("%-10s %12.1f %12.1f %12.2f %12.2f\n", mode->name,
+            create.startup, attach.startup, attach.first_access, attach.access);
+    }
+
+    if (memfd >= 0)
+        close(memfd);
+    shrreg_test_cleanup();
+    return res;
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+    if (shrreg_test_init("backing") != 0)
+        return -1;
+    printf("%-10s %12s %12s %12s %12s\n", "backing",
+        "create(us)", "attach(us)", "first(us)", "access(us)");
+    size_t i;
+    for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        if (run_mode(&modes[i], iterations) != 0) {
+            fprintf(stderr, "%s backing failed\n", modes[i].name);
+            return -1;
+        }
+    }
+    return 0;
+}
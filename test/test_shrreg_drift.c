@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "multiprocess/multiprocess_memory_limit.h"
+#include "test_utils.h"
+
+/*
+ * Feeds the drift reconciler NVML reports of more memory than this
+ * process tracks: the correction must grow round by round up to its cap,
+ * be charged to the slot and the device aggregate, take no lock once it
+ * stopped changing, and go away once the process is missing from the
+ * report.
+ * Usage: test_shrreg_drift
+ */
+
+#define TEST_HOSTPID 4242
+#define TEST_TRACKED (100ULL << 20)
+#define TEST_SEEN (400ULL << 20)
+// 20% of the 1 GiB limit
+#define TEST_BOUND ((1ULL << 30) / 100 * 20)
+#define TEST_ROUNDS 8
+
+// This process's slot on device 0 in a fresh snapshot, NULL if not found
+device_memory_snapshot_t* own_used(shared_region_t* region, shrreg_snapshot_t* snap) {
+    if (shrreg_snapshot(region, snap) != 0)
+        return NULL;
+    int i;
+    for (i = 0; i < snap->proc_num; i++) {
+        if (snap->procs[i].pid == getpid())
+            return shrreg_snapshot_used(snap, 0, i);
+    }
+    return NULL;
+}
+
+int main() {
+    if (shrreg_test_init("drift") != 0)
+        return -1;
+    setenv("CUDA_DEVICE_MEMORY_LIMIT", "1g", 1);
+    setenv(CUDA_DEVICE_MEMORY_DRIFT_LIMIT_ENV, "20%", 1);
+    ensure_initialized();
+    set_host_pid(TEST_HOSTPID);
+    add_gpu_device_memory_usage(getpid(), 0, TEST_TRACKED, 2);
+
+    size_t size;
+    shared_region_t* region = shrreg_map_readonly(&size);
+    shrreg_snapshot_t* snap = shrreg_snapshot_alloc(region);
+    if (snap == NULL)
+        return -1;
+    int32_t hostpids[1] = {TEST_HOSTPID};
+    uint64_t seen[1] = {TEST_SEEN};
+    int failed = 0, round;
+    uint64_t last = 0;
+    for (round = 0; round < TEST_ROUNDS; round++) {
+        reconcile_gpu_device_memory(0, hostpids, seen, 1);
+        device_memory_snapshot_t* used = own_used(region, snap);
+        if (used == NULL)
+            return -1;
+        printf("round %d: offset=%luM total=%luM usage=%luM drift=%ldM\n", round,
+            used->offset >> 20, used->total >> 20, snap->usage[0] >> 20,
+            (long)(shrreg_dev_usage(region)[0].drift >> 20));
+        if (used->offset < last || used->offset > TEST_BOUND ||
+            used->total != TEST_TRACKED + used->offset || snap->usage[0] != used->total) {
+            fprintf(stderr, "correction of round %d applied wrong\n", round);
+            failed++;
+        }
+        last = used->offset;
+    }
+    if (last < TEST_BOUND / 2 || shrreg_dev_usage(region)[0].drift != (int64_t)(TEST_SEEN - TEST_TRACKED) ||
+        shrreg_dev_usage(region)[0].drift_corrections == 0) {
+        fprintf(stderr, "drift not corrected\n");
+        failed++;
+    }
+
+    // Converged, the next rounds have nothing to apply and skip the lock
+    uint64_t locks = region->lock_acquired;
+    for (round = 0; round < TEST_ROUNDS; round++)
+        reconcile_gpu_device_memory(0, hostpids, seen, 1);
+    if (region->lock_acquired != locks) {
+        fprintf(stderr, "%lu locks taken without a correction\n", region->lock_acquired - locks);
+        failed++;
+    }
+
+    reconcile_gpu_device_memory(0, hostpids, seen, 0);
+    device_memory_snapshot_t* used = own_used(region, snap);
+    if (used == NULL)
+        return -1;
+    printf("missing from the report: offset=%lu total=%luM usage=%luM\n",
+        used->offset, used->total >> 20, snap->usage[0] >> 20);
+    if (used->offset != 0 || used->total != TEST_TRACKED || snap->usage[0] != TEST_TRACKED) {
+        fprintf(stderr, "correction not dropped\n");
+        failed++;
+    }
+    shrreg_snapshot_free(snap);
+    shrreg_test_cleanup();
+    return failed == 0 ? 0 : 1;
+}
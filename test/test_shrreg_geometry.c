@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "multiprocess/multiprocess_memory_limit.h"
+#include "test_utils.h"
+
+/*
+ * Creates a region of 3 devices and 4 process slots, then checks that it
+ * is laid out for them, that processes asking for another geometry attach
+ * to it as created and that a fifth process finds no slot.
+ * Usage: test_shrreg_geometry
+ */
+
+#define TEST_DEVICES 3
+#define TEST_MAX_PROCS 4
+
+// Attaches with another geometry, reports the one of the region
+int attach(int result_fd) {
+    setenv(SHARED_REGION_DEVICES_ENV, "8", 1);
+    setenv(SHARED_REGION_MAX_PROCS_ENV, "64", 1);
+    ensure_initialized();
+    size_t size;
+    shared_region_t* region = shrreg_map_readonly(&size);
+    uint32_t geometry[2] = {region->device_count, region->max_procs};
+    if (write(result_fd, geometry, sizeof(geometry)) != sizeof(geometry))
+        return -1;
+    pause();
+    return 0;
+}
+
+int main() {
+    if (shrreg_test_init("geometry") != 0)
+        return -1;
+    setenv(SHARED_REGION_DEVICES_ENV, "3", 1);
+    setenv(SHARED_REGION_MAX_PROCS_ENV, "4", 1);
+    ensure_initialized();
+
+    int failed = 0;
+    size_t size;
+    shared_region_t* region = shrreg_map_readonly(&size);
+    struct stat st;
+    if (region == NULL || stat(shrreg_cache_path(), &st) != 0) {
+        fprintf(stderr, "region not mapped\n");
+        return -1;
+    }
+    printf("devices=%u max_procs=%u region_size=%lu file=%ld\n",
+        region->device_count, region->max_procs, region->region_size, (long)st.st_size);
+    if (region->device_count != TEST_DEVICES || region->max_procs != TEST_MAX_PROCS ||
+        region->region_size != size || (size_t)st.st_size < size) {
+        fprintf(stderr, "region not laid out for %d devices and %d slots\n",
+            TEST_DEVICES, TEST_MAX_PROCS);
+        failed++;
+    }
+    fflush(stdout);
+
+    // Fill the remaining slots, the last process must find none
+    int result[2];
+    if (pipe(result) != 0)
+        return -1;
+    pid_t attached[TEST_MAX_PROCS - 1];
+    int i;
+    for (i = 0; i < TEST_MAX_PROCS - 1; i++) {
+        attached[i] = fork();
+        if (attached[i] == 0)
+            _exit(attach(result[1]));
+        uint32_t geometry[2];
+        if (read(result[0], geometry, sizeof(geometry)) != sizeof(geometry))
+            return -1;
+        if (geometry[0] != TEST_DEVICES || geometry[1] != TEST_MAX_PROCS) {
+            fprintf(stderr, "process %d attached to %u devices and %u slots\n",
+                attached[i], geometry[0], geometry[1]);
+            failed++;
+        }
+    }
+    pid_t extra = fork();
+    if (extra == 0) {
+        ensure_initialized();
+        _exit(0);
+    }
+    int status;
+    waitpid(extra, &status, 0);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        fprintf(stderr, "process beyond %d slots registered\n", TEST_MAX_PROCS);
+        failed++;
+    }
+    printf("%d processes attached, the next one exited with %d\n",
+        TEST_MAX_PROCS - 1, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+
+    for (i = 0; i < TEST_MAX_PROCS - 1; i++)
+        kill(attached[i], SIGKILL);
+    while (wait(NULL) > 0);
+    shrreg_test_cleanup();
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "multiprocess/multiprocess_memory_limit.h"
+#include "test_utils.h"
+
+/*
+ * Runs two processes of a quota group limited to 300 bytes on a device
+ * limited to 1000: together they must not get past the group limit, while
+ * a process of another group still gets the rest of the device. A member
+ * killed without its exit handler must leave the group's usage once
+ * reaped.
+ * Usage: test_shrreg_groups
+ */
+
+#define TEST_GROUP_LIMIT 300
+
+// Reserves each of sizes and reports which were granted
+int member(const char* group, const size_t* sizes, int count, int result_fd) {
+    setenv(CUDA_DEVICE_MEMORY_GROUP_ENV, group, 1);
+    ensure_initialized();
+    int granted[4] = {0}, i;
+    for (i = 0; i < count; i++)
+        granted[i] = reserve_gpu_device_memory_usage(getpid(), 0, sizes[i], 2) == 0;
+    if (write(result_fd, granted, sizeof(granted)) != sizeof(granted))
+        return -1;
+    pause();
+    return 0;
+}
+
+pid_t run_member(const char* group, const size_t* sizes, int count, int* granted) {
+    int result[2];
+    if (pipe(result) != 0)
+        return -1;
+    pid_t pid = fork();
+    if (pid == 0)
+        _exit(member(group, sizes, count, result[1]));
+    int ok = read(result[0], granted, 4 * sizeof(int)) == 4 * sizeof(int);
+    close(result[0]);
+    close(result[1]);
+    return ok ? pid : -1;
+}
+
+int main() {
+    if (shrreg_test_init("groups") != 0)
+        return -1;
+    setenv("CUDA_DEVICE_MEMORY_LIMIT", "1000", 1);
+    setenv(CUDA_DEVICE_MEMORY_GROUP_ENV, "group-a", 1);
+    setenv(CUDA_DEVICE_MEMORY_GROUP_LIMIT_ENV, "300", 1);
+    ensure_initialized();
+
+    int failed = 0;
+    if (get_current_group_memory_limit(0) != TEST_GROUP_LIMIT ||
+        reserve_gpu_device_memory_usage(getpid(), 0, 200, 2) != 0) {
+        fprintf(stderr, "group limit not set\n");
+        failed++;
+    }
+    // 150 would take the group past its limit, 100 fills it
+    int granted[4];
+    size_t sizes_a[] = {150, 100};
+    pid_t other = run_member("group-a", sizes_a, 2, granted);
+    printf("second member of group-a: 150 granted=%d, 100 granted=%d, group usage=%lu\n",
+        granted[0], granted[1], get_current_group_memory_usage(0));
+    if (other < 0 || granted[0] || !granted[1] || get_current_group_memory_usage(0) != TEST_GROUP_LIMIT)
+        failed++;
+
+    // Without a group limit only the device limit holds
+    unsetenv(CUDA_DEVICE_MEMORY_GROUP_LIMIT_ENV);
+    size_t sizes_b[] = {600, 200};
+    pid_t outsider = run_member("group-b", sizes_b, 2, granted);
+    printf("member of group-b: 600 granted=%d, 200 granted=%d\n", granted[0], granted[1]);
+    if (outsider < 0 || !granted[0] || granted[1])
+        failed++;
+
+    kill(other, SIGKILL);
+    waitpid(other, NULL, 0);
+    shrreg_mark_proc_dead(other);
+    reap_dead_proc_slots();
+    printf("second member reaped: group usage=%lu\n", get_current_group_memory_usage(0));
+    if (get_current_group_memory_usage(0) != 200)
+        failed++;
+    rm_gpu_device_memory_usage(getpid(), 0, 200, 2);
+    if (get_current_group_memory_usage(0) != 0)
+        failed++;
+
+    kill(outsider, SIGKILL);
+    while (wait(NULL) > 0);
+    shrreg_test_cleanup();
+    return failed == 0 ? 0 : 1;
+}
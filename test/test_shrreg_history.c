@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "multiprocess/multiprocess_memory_limit.h"
+#include "test_utils.h"
+
+/*
+ * Reads the usage history of a device while processes keep charging and
+ * uncharging it: every read must return samples in order with a usage
+ * the writers could have produced, and the last sample must show the
+ * device empty once they are done.
+ * Usage: test_shrreg_history [writers] [iterations]
+ */
+
+#define TEST_CHUNK 4096
+
+int writer(int iterations) {
+    ensure_initialized();
+    int32_t pid = getpid();
+    int i;
+    for (i = 0; i < iterations; i++) {
+        add_gpu_device_memory_usage(pid, 0, TEST_CHUNK, 2);
+        rm_gpu_device_memory_usage(pid, 0, TEST_CHUNK, 2);
+    }
+    return 0;
+}
+
+// Count the samples of n that could not have been written by the writers
+int check_samples(shrreg_sample_t* samples, int n, int writers) {
+    int bad = 0, i;
+    for (i = 0; i < n; i++) {
+        if (i > 0 && samples[i].seq <= samples[i - 1].seq)
+            bad++;
+        if (samples[i].usage % TEST_CHUNK != 0 || samples[i].usage > (uint64_t)writers * TEST_CHUNK)
+            bad++;
+        if (samples[i].source < SHRREG_SAMPLE_ALLOC || samples[i].source > SHRREG_SAMPLE_WATCHER)
+            bad++;
+        if (samples[i].pid == 0)
+            bad++;
+    }
+    return bad;
+}
+
+int main(int argc, char *argv[]) {
+    int writers = argc > 1 ? atoi(argv[1]) : 4;
+    int iterations = argc > 2 ? atoi(argv[2]) : 100000;
+    if (shrreg_test_init("history") != 0)
+        return -1;
+    setenv("CUDA_DEVICE_MEMORY_LIMIT", "1g", 1);
+    ensure_initialized();
+    size_t size;
+    shared_region_t* region = shrreg_map_readonly(&size);
+
+    int i;
+    for (i = 0; i < writers; i++) {
+        if (fork() == 0)
+            _exit(writer(iterations));
+    }
+    shrreg_sample_t samples[SHRREG_HISTORY_LEN];
+    long reads = 0, bad = 0;
+    int running = writers;
+    while (running > 0) {
+        int n = shrreg_read_history(region, 0, samples, SHRREG_HISTORY_LEN);
+        bad += check_samples(samples, n, writers);
+        reads++;
+        while (waitpid(-1, NULL, WNOHANG) > 0)
+            running--;
+    }
+    int n = shrreg_read_history(region, 0, samples, SHRREG_HISTORY_LEN);
+    bad += check_samples(samples, n, writers);
+    printf("%ld reads, %ld bad samples, %d samples kept, last seq %lu usage %lu\n",
+        reads, bad, n, n > 0 ? samples[n - 1].seq : 0, n > 0 ? samples[n - 1].usage : 0);
+    if (n == 0 || samples[n - 1].usage != 0)
+        bad++;
+    shrreg_test_cleanup();
+    return bad == 0 ? 0 : 1;
+}
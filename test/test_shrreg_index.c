@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "multiprocess/multiprocess_memory_limit.h"
+#include "test_utils.h"
+
+/*
+ * Registers processes in a fresh region while others exit, so that
+ * removing the exited ones moves the slots of the live ones, then checks
+ * that the pid and hostpid indexes still find every live process.
+ * Usage: test_shrreg_index [processes]
+ */
+
+#define TEST_HOSTPID 4242
+
+// One in three registers and waits to be killed, the others exit
+int child(int k, int ready_fd) {
+    ensure_initialized();
+    if (k % 3 != 0)
+        exit(0);
+    char c = 1;
+    if (write(ready_fd, &c, 1) != 1)
+        return -1;
+    pause();
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int processes = argc > 1 ? atoi(argv[1]) : 96;
+    if (shrreg_test_init("index") != 0)
+        return -1;
+    ensure_initialized();
+
+    int ready[2];
+    if (pipe(ready) != 0)
+        return -1;
+    pid_t* live = malloc(processes * sizeof(pid_t));
+    int i, num_live = 0;
+    char c;
+    for (i = 0; i < processes; i++) {
+        pid_t pid = fork();
+        if (pid == 0)
+            _exit(child(i, ready[1]));
+        if (i % 3 == 0) {
+            if (read(ready[0], &c, 1) != 1)
+                return -1;
+            live[num_live++] = pid;
+        } else {
+            waitpid(pid, NULL, 0);
+        }
+    }
+    reap_dead_proc_slots();
+
+    int missing = 0;
+    for (i = 0; i < num_live; i++) {
+        shrreg_proc_slot_t* slot = find_proc_by_pid(live[i]);
+        if (slot == NULL || slot->pid != live[i]) {
+            fprintf(stderr, "process %d not found by its pid\n", live[i]);
+            missing++;
+        }
+    }
+    if (find_proc_by_pid(live[num_live - 1] + 100000) != NULL) {
+        fprintf(stderr, "an unregistered pid was found\n");
+        missing++;
+    }
+    set_host_pid(TEST_HOSTPID);
+    shrreg_proc_slot_t* slot = find_proc_by_hostpid(TEST_HOSTPID);
+    if (slot == NULL || slot->pid != getpid()) {
+        fprintf(stderr, "hostpid %d not found\n", TEST_HOSTPID);
+        missing++;
+    }
+    printf("%d processes registered, %d live, %d lookups failed\n",
+        processes, num_live, missing);
+
+    for (i = 0; i < num_live; i++)
+        kill(live[i], SIGKILL);
+    while (wait(NULL) > 0);
+    free(live);
+    shrreg_test_cleanup();
+    return missing == 0 ? 0 : 1;
+}
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "multiprocess/multiprocess_memory_limit.h"
+#include "test_utils.h"
+
+/*
+ * Runs a process with a memory lease of 10% of a 1000 byte limit: its
+ * allocations within the lease must leave the device aggregate alone and
+ * its frees must hand back what exceeds the lease. A second process then
+ * asks for more than the lease leaves and must get it once it reclaimed
+ * the lease.
+ * Usage: test_shrreg_lease
+ */
+
+#define TEST_LIMIT 1000
+#define TEST_LEASE 100
+#define TEST_LARGE 950
+
+// Takes TEST_LARGE bytes, reclaiming the leases of others if needed
+int reclaimer(int result_fd) {
+    ensure_initialized();
+    int32_t pid = getpid();
+    int result[2] = {reserve_gpu_device_memory_usage(pid, 0, TEST_LARGE, 2) == 0, 0};
+    if (!result[0]) {
+        reclaim_gpu_memory_leases(0);
+        result[1] = reserve_gpu_device_memory_usage(pid, 0, TEST_LARGE, 2) == 0;
+    }
+    if (write(result_fd, result, sizeof(result)) != sizeof(result))
+        return -1;
+    pause();
+    return 0;
+}
+
+int main() {
+    if (shrreg_test_init("lease") != 0)
+        return -1;
+    setenv("CUDA_DEVICE_MEMORY_LIMIT", "1000", 1);
+    setenv(CUDA_DEVICE_MEMORY_LEASE_ENV, "10%", 1);
+    ensure_initialized();
+
+    int failed = 0;
+    int32_t pid = getpid();
+    reserve_gpu_device_memory_usage(pid, 0, 10, 2);
+    size_t first = get_gpu_memory_usage(0);
+    reserve_gpu_device_memory_usage(pid, 0, 50, 2);
+    printf("after 10 and 50 bytes: usage=%lu lease=%lu\n",
+        get_gpu_memory_usage(0), get_gpu_memory_lease(0));
+    if (first != 10 + TEST_LEASE || get_gpu_memory_usage(0) != first ||
+        get_gpu_memory_lease(0) != TEST_LEASE - 50) {
+        fprintf(stderr, "allocations within the lease charged the device\n");
+        failed++;
+    }
+    reserve_gpu_device_memory_usage(pid, 0, 300, 2);
+    rm_gpu_device_memory_usage(pid, 0, 360, 2);
+    printf("after freeing everything: usage=%lu lease=%lu\n",
+        get_gpu_memory_usage(0), get_gpu_memory_lease(0));
+    if (get_gpu_memory_usage(0) != get_gpu_memory_lease(0) ||
+        get_gpu_memory_lease(0) > 2 * TEST_LEASE) {
+        fprintf(stderr, "freed bytes beyond the lease not handed back\n");
+        failed++;
+    }
+    fflush(stdout);
+
+    int result_fds[2];
+    if (pipe(result_fds) != 0)
+        return -1;
+    pid_t child = fork();
+    if (child == 0)
+        _exit(reclaimer(result_fds[1]));
+    int result[2];
+    if (read(result_fds[0], result, sizeof(result)) != sizeof(result))
+        return -1;
+    printf("%d bytes: granted=%d, after reclaiming=%d; usage=%lu lease=%lu\n",
+        TEST_LARGE, result[0], result[1], get_gpu_memory_usage(0), get_gpu_memory_lease(0));
+    if (result[0] || !result[1] || get_gpu_memory_lease(0) != 0 ||
+        get_gpu_memory_usage(0) > TEST_LIMIT) {
+        fprintf(stderr, "lease not reclaimed by the other process\n");
+        failed++;
+    }
+
+    kill(child, SIGKILL);
+    while (wait(NULL) > 0);
+    shrreg_test_cleanup();
+    return failed == 0 ? 0 : 1;
+}
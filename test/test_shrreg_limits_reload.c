@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "multiprocess/multiprocess_memory_limit.h"
+#include "multiprocess/multiprocess_limits_watcher.h"
+#include "test_utils.h"
+
+/*
+ * Rewrites the limits file under two running processes: both must pick
+ * up the new memory limit and enforce it, raised then lowered, without
+ * restarting.
+ * Usage: test_shrreg_limits_reload
+ */
+
+#define TEST_TIMEOUT_MS 5000
+
+double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Replace the file at once, like a ConfigMap update
+int write_limits(const char* path, const char* text) {
+    char tmp[128];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE* f = fopen(tmp, "w");
+    if (f == NULL)
+        return -1;
+    fputs(text, f);
+    fclose(f);
+    return rename(tmp, path);
+}
+
+// Wait for the limit of device 0 to become limit, returns the time it took or -1
+double wait_limit(uint64_t limit) {
+    double start = now_ms();
+    while (get_current_device_memory_limit(0) != limit) {
+        if (now_ms() - start > TEST_TIMEOUT_MS)
+            return -1;
+        usleep(100);
+    }
+    return now_ms() - start;
+}
+
+// Reports whether it gets 1500 bytes under each of the two new limits, -1 if one never came
+int follower(int ready_fd, int result_fd) {
+    ensure_initialized();
+    init_limits_watcher();
+    char c = 1;
+    if (write(ready_fd, &c, 1) != 1)
+        return -1;
+    int granted[2];
+    granted[0] = wait_limit(2000) >= 0 && reserve_gpu_device_memory_usage(getpid(), 0, 1500, 2) == 0;
+    if (granted[0])
+        rm_gpu_device_memory_usage(getpid(), 0, 1500, 2);
+    granted[1] = wait_limit(500) < 0 ? -1 : reserve_gpu_device_memory_usage(getpid(), 0, 1500, 2) == 0;
+    if (write(result_fd, granted, sizeof(granted)) != sizeof(granted))
+        return -1;
+    return 0;
+}
+
+int main() {
+    if (shrreg_test_init("limits_reload") != 0)
+        return -1;
+    char dir[64], limits[80];
+    snprintf(dir, sizeof(dir), "/tmp/shrreg_limits_%d.d", getpid());
+    snprintf(limits, sizeof(limits), "%s/limits", dir);
+    if (mkdir(dir, 0755) != 0)
+        return -1;
+    setenv("CUDA_DEVICE_MEMORY_LIMIT", "1000", 1);
+    setenv(CUDA_DEVICE_LIMITS_FILE_ENV, limits, 1);
+    ensure_initialized();
+    init_limits_watcher();
+
+    int ready[2], result[2];
+    if (pipe(ready) != 0 || pipe(result) != 0)
+        return -1;
+    pid_t pid = fork();
+    if (pid == 0)
+        _exit(follower(ready[1], result[1]));
+    char c;
+    if (read(ready[0], &c, 1) != 1)
+        return -1;
+
+    int failed = 0;
+    int32_t generation = shrreg_limits_generation();
+    if (reserve_gpu_device_memory_usage(getpid(), 0, 1500, 2) == 0) {
+        fprintf(stderr, "1500 bytes granted under a limit of 1000\n");
+        failed++;
+    }
+    write_limits(limits, "CUDA_DEVICE_MEMORY_LIMIT=2000\n");
+    double raised = wait_limit(2000);
+    // Keep the follower from seeing the second limit before the first
+    usleep(200 * 1000);
+    write_limits(limits, "CUDA_DEVICE_MEMORY_LIMIT=500\n");
+    double lowered = wait_limit(500);
+    int granted[2] = {0, 0};
+    if (read(result[0], granted, sizeof(granted)) != sizeof(granted))
+        failed++;
+    waitpid(pid, NULL, 0);
+    printf("raised after %.2f ms, lowered after %.2f ms, generation %d -> %d, "
+        "follower granted 1500 bytes: %d then %d\n",
+        raised, lowered, generation, shrreg_limits_generation(), granted[0], granted[1]);
+    if (raised < 0 || lowered < 0 || shrreg_limits_generation() == generation ||
+        granted[0] != 1 || granted[1] != 0)
+        failed++;
+
+    unlink(limits);
+    rmdir(dir);
+    shrreg_test_cleanup();
+    return failed == 0 ? 0 : 1;
+}
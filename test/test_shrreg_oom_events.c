@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "multiprocess/multiprocess_memory_limit.h"
+#include "test_utils.h"
+
+/*
+ * Gets an allocation denied while another process holds most of the
+ * device, records the denial like the allocator does and checks the
+ * event: requester, size, device state and largest consumers. Then
+ * overflows the ring, which must keep the latest denials in order.
+ * Usage: test_shrreg_oom_events
+ */
+
+#define TEST_LIMIT (100 << 20)
+#define TEST_OTHER (50 << 20)
+#define TEST_OWN (30 << 20)
+#define TEST_DENIED (40 << 20)
+
+int holder(int ready_fd) {
+    ensure_initialized();
+    add_gpu_device_memory_usage(getpid(), 0, TEST_OTHER, 2);
+    char c = 1;
+    if (write(ready_fd, &c, 1) != 1)
+        return -1;
+    pause();
+    return 0;
+}
+
+int main() {
+    if (shrreg_test_init("oom_events") != 0)
+        return -1;
+    setenv("CUDA_DEVICE_MEMORY_LIMIT", "100m", 1);
+    ensure_initialized();
+
+    int ready[2];
+    char c;
+    if (pipe(ready) != 0)
+        return -1;
+    pid_t other = fork();
+    if (other == 0)
+        _exit(holder(ready[1]));
+    if (read(ready[0], &c, 1) != 1)
+        return -1;
+
+    int failed = 0;
+    int32_t pid = getpid();
+    add_gpu_device_memory_usage(pid, 0, TEST_OWN, 2);
+    if (reserve_gpu_device_memory_usage(pid, 0, TEST_DENIED, 2) == 0) {
+        fprintf(stderr, "%d bytes granted beyond the limit\n", TEST_DENIED);
+        failed++;
+    } else {
+        shrreg_record_oom(0, TEST_DENIED, SHRREG_API_MEM_ALLOC);
+    }
+
+    size_t size;
+    shared_region_t* region = shrreg_map_readonly(&size);
+    shrreg_oom_event_t events[SHRREG_OOM_EVENTS_LEN];
+    int n = shrreg_read_oom_events(region, 0, events, SHRREG_OOM_EVENTS_LEN);
+    if (n != 1) {
+        fprintf(stderr, "%d events recorded for one denial\n", n);
+        failed++;
+    } else {
+        shrreg_oom_event_t* e = &events[0];
+        printf("%s of %lu bytes by %d: usage=%lu limit=%lu top=%d:%lu %d:%lu\n",
+            shrreg_api_name(e->api), e->size, e->pid, e->usage, e->limit,
+            e->top_pid[0], e->top_usage[0], e->top_pid[1], e->top_usage[1]);
+        if (e->pid != pid || e->size != TEST_DENIED || e->api != SHRREG_API_MEM_ALLOC ||
+            e->usage != TEST_OTHER + TEST_OWN || e->limit != TEST_LIMIT ||
+            e->top_pid[0] != other || e->top_usage[0] != TEST_OTHER ||
+            e->top_pid[1] != pid || e->top_usage[1] != TEST_OWN || e->top_pid[2] != 0) {
+            fprintf(stderr, "denial recorded wrong\n");
+            failed++;
+        }
+    }
+
+    int i;
+    for (i = 1; i <= SHRREG_OOM_EVENTS_LEN + 6; i++)
+        shrreg_record_oom(0, i, SHRREG_API_MEM_CREATE);
+    n = shrreg_read_oom_events(region, 0, events, SHRREG_OOM_EVENTS_LEN);
+    for (i = 0; i < n; i++) {
+        if (events[i].size != (uint64_t)i + 7 || events[i].api != SHRREG_API_MEM_CREATE)
+            break;
+    }
+    printf("%d of the latest %d denials kept in order\n", i, SHRREG_OOM_EVENTS_LEN);
+    if (n != SHRREG_OOM_EVENTS_LEN || i != n)
+        failed++;
+
+    kill(other, SIGKILL);
+    while (wait(NULL) > 0);
+    shrreg_test_cleanup();
+    return failed == 0 ? 0 : 1;
+}
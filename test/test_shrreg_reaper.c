@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "multiprocess/multiprocess_memory_limit.h"
+#include "multiprocess/multiprocess_reaper.h"
+#include "test_utils.h"
+
+/*
+ * Kills processes holding memory without letting them run their exit
+ * handler and measures how long the reaper takes to remove their slots
+ * and give back their memory. A slot of a process in another pid
+ * namespace, whose pid means nothing here, must be left alone.
+ * Usage: test_shrreg_reaper [processes]
+ */
+
+#define TEST_CHUNK (1 << 20)
+#define TEST_TIMEOUT_MS 5000
+
+double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+int holder(int ready_fd) {
+    ensure_initialized();
+    add_gpu_device_memory_usage(getpid(), 0, TEST_CHUNK, 2);
+    char c = 1;
+    if (write(ready_fd, &c, 1) != 1)
+        return -1;
+    pause();
+    return 0;
+}
+
+// Register a process of another pid namespace, which has no process here
+int32_t add_foreign_slot() {
+    pid_t pid = fork();
+    if (pid == 0)
+        _exit(0);
+    waitpid(pid, NULL, 0);
+    lock_shrreg();
+    shrreg_proc_slot_t* slot = shrreg_add_proc_slot_nolock(pid);
+    if (slot != NULL)
+        slot->pidns = ~slot->pidns;
+    unlock_shrreg();
+    return slot != NULL ? pid : 0;
+}
+
+int main(int argc, char *argv[]) {
+    int processes = argc > 1 ? atoi(argv[1]) : 8;
+    if (shrreg_test_init("reaper") != 0)
+        return -1;
+    setenv("CUDA_DEVICE_MEMORY_LIMIT", "1g", 1);
+    ensure_initialized();
+    size_t size;
+    shared_region_t* region = shrreg_map_readonly(&size);
+    int32_t foreign = add_foreign_slot();
+    if (foreign == 0)
+        return -1;
+    init_proc_reaper();
+
+    int ready[2];
+    if (pipe(ready) != 0)
+        return -1;
+    pid_t* pids = malloc(processes * sizeof(pid_t));
+    int i;
+    char c;
+    for (i = 0; i < processes; i++) {
+        pids[i] = fork();
+        if (pids[i] == 0)
+            _exit(holder(ready[1]));
+        if (read(ready[0], &c, 1) != 1)
+            return -1;
+    }
+    // Let the reaper pick them up before killing them
+    usleep(1500 * 1000);
+    printf("%d processes registered: slots=%d usage=%luM\n",
+        processes, region->proc_num, get_gpu_memory_usage(0) >> 20);
+
+    double killed = now_ms();
+    for (i = 0; i < processes; i++)
+        kill(pids[i], SIGKILL);
+    while (get_gpu_memory_usage(0) != 0 && now_ms() - killed < TEST_TIMEOUT_MS)
+        usleep(100);
+    double reaped = now_ms() - killed;
+    while (wait(NULL) > 0);
+    usleep(100 * 1000);
+
+    int kept = 0;
+    for (i = 0; i < region->proc_num; i++)
+        kept += shrreg_procs(region)[i].pid == foreign;
+    printf("reaped after %.2f ms: slots=%d usage=%luM, other namespace slot kept=%d\n",
+        reaped, region->proc_num, get_gpu_memory_usage(0) >> 20, kept);
+    free(pids);
+    shrreg_test_cleanup();
+    return get_gpu_memory_usage(0) == 0 && region->proc_num == 2 && kept == 1 ? 0 : 1;
+}
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "multiprocess/multiprocess_memory_limit.h"
+#include "test_utils.h"
+
+/*
+ * Snapshots the region while short-lived processes register, charge it
+ * and exit, which keeps moving the slots. Every snapshot must list each
+ * process once, with whole charges, and hold this process's slot as it
+ * is.
+ * Usage: test_shrreg_snapshot [processes]
+ */
+
+#define TEST_CHUNK 4096
+#define TEST_RUNNING 16
+
+int spawner(int processes) {
+    int i;
+    for (i = 0; i < processes; i++) {
+        if (fork() == 0) {
+            ensure_initialized();
+            add_gpu_device_memory_usage(getpid(), 0, TEST_CHUNK, 2);
+            usleep(rand() % 2000);
+            exit(0);
+        }
+        if (i >= TEST_RUNNING)
+            wait(NULL);
+    }
+    while (wait(NULL) > 0);
+    return 0;
+}
+
+// Count what a consistent copy of the region could not hold
+int check_snapshot(shrreg_snapshot_t* snap) {
+    int bad = 0, own = 0, i, j;
+    if (snap->proc_num < 1 || snap->proc_num > (int)snap->max_procs)
+        return 1;
+    for (i = 0; i < snap->proc_num; i++) {
+        int32_t pid = snap->procs[i].pid;
+        for (j = i + 1; j < snap->proc_num; j++)
+            if (pid != 0 && snap->procs[j].pid == pid)
+                bad++;
+        if (shrreg_snapshot_used(snap, 0, i)->total % TEST_CHUNK != 0)
+            bad++;
+        if (pid == getpid()) {
+            own++;
+            if (shrreg_snapshot_used(snap, 0, i)->total != 2 * TEST_CHUNK)
+                bad++;
+        }
+    }
+    return own == 1 ? bad : bad + 1;
+}
+
+int main(int argc, char *argv[]) {
+    int processes = argc > 1 ? atoi(argv[1]) : 2000;
+    if (shrreg_test_init("snapshot") != 0)
+        return -1;
+    setenv("CUDA_DEVICE_MEMORY_LIMIT", "1g", 1);
+    ensure_initialized();
+    add_gpu_device_memory_usage(getpid(), 0, 2 * TEST_CHUNK, 2);
+    size_t size;
+    shared_region_t* region = shrreg_map_readonly(&size);
+    shrreg_snapshot_t* snap = shrreg_snapshot_alloc(region);
+    if (snap == NULL)
+        return -1;
+
+    pid_t pid = fork();
+    if (pid == 0)
+        _exit(spawner(processes));
+    long snaps = 0, busy = 0, bad = 0, most = 0;
+    while (waitpid(pid, NULL, WNOHANG) == 0) {
+        if (shrreg_snapshot(region, snap) != 0) {
+            busy++;
+            continue;
+        }
+        snaps++;
+        bad += check_snapshot(snap);
+        if (snap->proc_num > most)
+            most = snap->proc_num;
+    }
+    printf("%ld snapshots, %ld given up, %ld inconsistencies, up to %ld processes\n",
+        snaps, busy, bad, most);
+    shrreg_snapshot_free(snap);
+    shrreg_test_cleanup();
+    return bad == 0 && snaps > 0 ? 0 : 1;
+}
@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "multiprocess/multiprocess_memory_limit.h"
+#include "test_utils.h"
+
+/*
+ * Charges and frees allocations of known sizes, then checks the high-water
+ * mark and the size histogram of this process's slot in a snapshot of the
+ * region.
+ * Usage: test_shrreg_stats
+ */
+
+static const size_t held[] = {100, 5000, 1 << 20};
+
+int main() {
+    if (shrreg_test_init("stats") != 0)
+        return -1;
+    setenv("CUDA_DEVICE_MEMORY_LIMIT", "1g", 1);
+    ensure_initialized();
+
+    // Hold all three at once, then free them and charge a smaller one
+    int32_t pid = getpid();
+    uint64_t expected[SHRREG_SIZE_BUCKETS];
+    uint64_t peak = 0;
+    memset(expected, 0, sizeof(expected));
+    size_t i;
+    for (i = 0; i < sizeof(held) / sizeof(held[0]); i++) {
+        add_gpu_device_memory_usage(pid, 0, held[i], 2);
+        expected[shrreg_size_bucket(held[i])]++;
+        peak += held[i];
+    }
+    for (i = 0; i < sizeof(held) / sizeof(held[0]); i++)
+        rm_gpu_device_memory_usage(pid, 0, held[i], 2);
+    add_gpu_device_memory_usage(pid, 0, 2000, 2);
+    expected[shrreg_size_bucket(2000)]++;
+
+    size_t size;
+    shared_region_t* region = shrreg_map_readonly(&size);
+    shrreg_snapshot_t* snap = shrreg_snapshot_alloc(region);
+    if (snap == NULL || shrreg_snapshot(region, snap) != 0)
+        return -1;
+    int failed = 1, slot;
+    for (slot = 0; slot < snap->proc_num; slot++) {
+        if (snap->procs[slot].pid != pid)
+            continue;
+        device_memory_stats_snapshot_t* stats = shrreg_snapshot_stats(snap, 0, slot);
+        printf("peak=%lu, expected %lu; buckets:", stats->peak, peak);
+        failed = stats->peak != peak;
+        int bucket;
+        for (bucket = 0; bucket < SHRREG_SIZE_BUCKETS; bucket++) {
+            if (stats->size_buckets[bucket] != 0 || expected[bucket] != 0)
+                printf(" %d=%lu/%lu", bucket, stats->size_buckets[bucket], expected[bucket]);
+            if (stats->size_buckets[bucket] != expected[bucket])
+                failed = 1;
+        }
+        printf("\n");
+    }
+    shrreg_snapshot_free(snap);
+    shrreg_test_cleanup();
+    return failed;
+}
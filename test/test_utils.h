@@ -5,6 +5,8 @@
 #include <nvml.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 
 #ifndef TEST_DEVICE_ID
@@ -23,6 +25,10 @@
     } }                                       \
 
 
+// Replace those of log_utils.h, included before by tests of the shared region
+#undef CHECK_DRV_API
+#undef CHECK_NVML_API
+
 #define CHECK_DRV_API(f)  {                   \
     CUresult status = (f);                    \
     if (status != CUDA_SUCCESS) {             \
@@ -78,4 +84,64 @@ nvmlReturn_t get_current_memory_usage(size_t* usage) {
 }
 
 
+/*
+ * Shared region tests call into the preloaded libvgpu.so, which they are
+ * not linked against, so its functions are weak here; each test runs
+ * against a region file of its own.
+ */
+#pragma weak ensure_initialized
+#pragma weak shrreg_cache_path
+#pragma weak shrreg_map_readonly
+#pragma weak shrreg_add_proc_slot_nolock
+#pragma weak shrreg_mark_proc_dead
+#pragma weak shrreg_limits_generation
+#pragma weak shrreg_snapshot
+#pragma weak shrreg_snapshot_alloc
+#pragma weak shrreg_snapshot_free
+#pragma weak shrreg_read_history
+#pragma weak shrreg_read_oom_events
+#pragma weak shrreg_record_oom
+#pragma weak lock_shrreg
+#pragma weak unlock_shrreg
+#pragma weak set_host_pid
+#pragma weak find_proc_by_pid
+#pragma weak find_proc_by_hostpid
+#pragma weak add_gpu_device_memory_usage
+#pragma weak rm_gpu_device_memory_usage
+#pragma weak reserve_gpu_device_memory_usage
+#pragma weak reconcile_gpu_device_memory
+#pragma weak reap_dead_proc_slots
+#pragma weak get_gpu_memory_usage
+#pragma weak get_gpu_memory_lease
+#pragma weak reclaim_gpu_memory_leases
+#pragma weak get_current_device_memory_limit
+#pragma weak get_current_group_memory_limit
+#pragma weak get_current_group_memory_usage
+#pragma weak init_proc_reaper
+#pragma weak init_limits_watcher
+
+extern void ensure_initialized();
+extern const char* shrreg_cache_path();
+
+static char shrreg_test_path[64];
+
+// Point the region of this process and its children at a file named
+// after the test. Returns -1 if libvgpu.so is not preloaded.
+static inline int shrreg_test_init(const char* name) {
+	if (ensure_initialized == NULL || shrreg_cache_path == NULL) {
+		fprintf(stderr, "Region functions not found, run with LD_PRELOAD=libvgpu.so\n");
+		return -1;
+	}
+	snprintf(shrreg_test_path, sizeof(shrreg_test_path), "/tmp/shrreg_%s_%d.cache", name, getpid());
+	setenv("CUDA_DEVICE_MEMORY_SHARED_CACHE", shrreg_test_path, 1);
+	return 0;
+}
+
+// Remove the files of the region set up by shrreg_test_init()
+static inline void shrreg_test_cleanup() {
+	unlink(shrreg_cache_path());
+	unlink(shrreg_test_path);
+}
+
+
 #endif